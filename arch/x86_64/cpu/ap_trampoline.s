@@ -0,0 +1,109 @@
+/*
+ * ============================================================================
+ * E-comOS x86_64 - Application processor start-up
+ * ============================================================================
+ *
+ * A SIPI starts an AP in real mode at page:0000.  smp.c copies this code
+ * to AP_TRAMPOLINE_BASE (below 1 MB, identity mapped and executable in
+ * the kernel page tables) and fills in the parameter block at its end,
+ * then the AP walks up to long mode on its own:
+ *
+ *   real mode -> 32-bit protected mode -> long mode on the kernel CR3
+ *             -> entry(cpu) on its own stack
+ *
+ * Addresses are absolute, computed from the copy's base; the GDT here is
+ * only for the climb, entry loads the kernel's.
+ *
+ * Parameter block (struct ap_params in src/kernel/smp.c):
+ *   0x00: cr3    kernel PML4, below 4 GB
+ *   0x08: cr4    boot CPU's CR4 (PCIDE is set once in long mode)
+ *   0x10: efer   boot CPU's EFER
+ *   0x18: stack  top of the AP's boot stack
+ *   0x20: entry  void entry(uint32_t cpu)
+ *   0x28: cpu    logical CPU number
+ */
+
+.set AP_TRAMPOLINE_BASE, 0x8000
+.set CR0_PE,         0x1
+.set CR0_PG,         0x80000000
+.set CR4_PCIDE,      0x20000
+.set EFER_MSR,       0xC0000080
+
+#define ABS(sym) (AP_TRAMPOLINE_BASE + ((sym) - ap_trampoline_start))
+
+.text
+.global ap_trampoline_start
+.global ap_trampoline_params
+.global ap_trampoline_end
+
+.code16
+ap_trampoline_start:
+    cli
+    cld
+    xorw %ax, %ax
+    movw %ax, %ds
+    movw %ax, %es
+    movw %ax, %ss
+    lgdtl AP_TRAMPOLINE_BASE + (ap_gdtr - ap_trampoline_start)
+    movl %cr0, %eax
+    orl $CR0_PE, %eax
+    movl %eax, %cr0
+    ljmpl $0x08, $(AP_TRAMPOLINE_BASE + (ap_pm32 - ap_trampoline_start))
+
+.code32
+ap_pm32:
+    movw $0x10, %ax
+    movw %ax, %ds
+    movw %ax, %es
+    movw %ax, %ss
+
+    /* PAE and the rest of the boot CPU's CR4, except PCIDE (needs LMA) */
+    movl AP_TRAMPOLINE_BASE + (ap_param_cr4 - ap_trampoline_start), %eax
+    andl $~CR4_PCIDE, %eax
+    movl %eax, %cr4
+    movl AP_TRAMPOLINE_BASE + (ap_param_cr3 - ap_trampoline_start), %eax
+    movl %eax, %cr3
+
+    /* EFER.LME (and NXE, SCE as the boot CPU has them) */
+    movl $EFER_MSR, %ecx
+    movl AP_TRAMPOLINE_BASE + (ap_param_efer - ap_trampoline_start), %eax
+    xorl %edx, %edx
+    wrmsr
+
+    movl %cr0, %eax
+    orl $CR0_PG, %eax
+    movl %eax, %cr0
+    ljmpl $0x18, $(AP_TRAMPOLINE_BASE + (ap_lm64 - ap_trampoline_start))
+
+.code64
+ap_lm64:
+    movq AP_TRAMPOLINE_BASE + (ap_param_cr4 - ap_trampoline_start), %rax
+    movq %rax, %cr4
+    movq AP_TRAMPOLINE_BASE + (ap_param_stack - ap_trampoline_start), %rsp
+    movl AP_TRAMPOLINE_BASE + (ap_param_cpu - ap_trampoline_start), %edi
+    movq AP_TRAMPOLINE_BASE + (ap_param_entry - ap_trampoline_start), %rax
+    callq *%rax
+1:
+    cli
+    hlt
+    jmp 1b
+
+.align 8
+ap_gdt:
+    .quad 0x0000000000000000    # null
+    .quad 0x00CF9A000000FFFF    # 0x08: 32-bit code
+    .quad 0x00CF92000000FFFF    # 0x10: data
+    .quad 0x00AF9A000000FFFF    # 0x18: 64-bit code
+ap_gdtr:
+    .word ap_gdtr - ap_gdt - 1
+    .long AP_TRAMPOLINE_BASE + (ap_gdt - ap_trampoline_start)
+
+.align 8
+ap_trampoline_params:
+ap_param_cr3:   .quad 0
+ap_param_cr4:   .quad 0
+ap_param_efer:  .quad 0
+ap_param_stack: .quad 0
+ap_param_entry: .quad 0
+ap_param_cpu:   .quad 0
+ap_trampoline_end:
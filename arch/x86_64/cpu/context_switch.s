@@ -8,6 +8,8 @@
 .text
 .global context_switch
 .type context_switch, @function
+.global context_thread_start
+.type context_thread_start, @function
 
 /*
  * void context_switch(struct cpu_context *old_ctx, struct cpu_context *new_ctx)
@@ -25,7 +27,7 @@
  *   0x28: rbx
  *   0x30: rip
  *   0x38: rsp
- *   (adjust according to your actual struct definition)
+ *   (struct cpu_context in include/kernel/arch/universal.h)
  */
 context_switch:
     /* Save old context */
@@ -63,4 +65,21 @@ context_switch:
     /* Jump to new instruction pointer */
     jmpq *0x30(%rsi)       # jump to saved rip
 
-.size context_switch, . - context_switch
\ No newline at end of file
+.size context_switch, . - context_switch
+
+/*
+ * First code a new thread runs: context_switch jumps here on a fresh
+ * kernel stack with the entry point in rbx.  It finishes the switch as
+ * sched_schedule would have; the switch ran with interrupts off, so
+ * turn them on.  A thread whose entry returns ends in sched_exit.
+ */
+context_thread_start:
+    movabsq $sched_switch_done, %rax
+    callq *%rax
+    sti
+    callq *%rbx
+    movabsq $sched_exit, %rax
+    callq *%rax
+    ud2
+
+.size context_thread_start, . - context_thread_start
@@ -0,0 +1,190 @@
+/*
+    E-com_os Kernel - Lazy FPU/SSE/AVX state
+    Copyright (C) 2025,2026  Saladin5101
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <kernel/arch/fpu.h>
+#include <kernel/sched.h>
+#include <kernel/cpu.h>
+#include <kernel/mm/slab.h>
+#include <kernel/printkit/print.h>
+#include <kernel/internal/types.h>
+#include <stddef.h>
+
+#define CR0_MP          (1ull << 1)
+#define CR0_EM          (1ull << 2)
+#define CR0_TS          (1ull << 3)
+#define CR0_NE          (1ull << 5)
+#define CR4_OSFXSR      (1ull << 9)
+#define CR4_OSXMMEXCPT  (1ull << 10)
+#define CR4_OSXSAVE     (1ull << 18)
+
+#define CPUID1_XSAVE    (1u << 26)        /* ECX */
+#define CPUID_XSTATE    0xDu
+#define XSTATE_XSAVEOPT (1u << 0)         /* leaf 0xD, sub-leaf 1, EAX */
+
+/* x87, SSE, AVX and the three AVX-512 components */
+#define XCR0_WANTED     0xE7ull
+
+#define FPU_AREA_ALIGN  64u
+#define FPU_LEGACY_SIZE 512u
+#define FPU_NO_CPU      0xFFFFFFFFu
+
+/* Initial values the area starts from (legacy region offsets) */
+#define FPU_FCW_OFF     0u
+#define FPU_FCW_INIT    0x037Fu
+#define FPU_MXCSR_OFF   24u
+#define FPU_MXCSR_INIT  0x1F80u
+
+static kmem_cache    *fpu_cache;
+static uint32_t       fpu_size = FPU_LEGACY_SIZE;
+static uint64_t       fpu_xcr0 = 0;           /* 0: no XSAVE, use FXSAVE */
+static int            fpu_has_xsaveopt = 0;
+static struct thread *fpu_owner[MAX_CPUS];    /* whose state the registers hold */
+
+/* ---- Registers ---- */
+
+static inline uint64_t cr0_read(void) {
+    uint64_t cr0;
+    __asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void cr0_write(uint64_t cr0) {
+    __asm__ volatile("movq %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline void cpuid_count(uint32_t leaf, uint32_t sub, uint32_t r[4]) {
+    __asm__ volatile("cpuid" : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3])
+                     : "a"(leaf), "c"(sub));
+}
+
+static void fpu_save(void *area) {
+    uint32_t lo = (uint32_t)fpu_xcr0, hi = (uint32_t)(fpu_xcr0 >> 32);
+    if (fpu_has_xsaveopt)
+        __asm__ volatile("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    else if (fpu_xcr0)
+        __asm__ volatile("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    else
+        __asm__ volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+}
+
+static void fpu_restore(const void *area) {
+    uint32_t lo = (uint32_t)fpu_xcr0, hi = (uint32_t)(fpu_xcr0 >> 32);
+    if (fpu_xcr0)
+        __asm__ volatile("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    else
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+}
+
+/* Reset state: an all-zero XSAVE header puts every component in its init state */
+static void fpu_area_init(void *area) {
+    uint8_t *p = area;
+    for (uint32_t i = 0; i < fpu_size; i++)
+        p[i] = 0;
+    *(uint16_t *)(p + FPU_FCW_OFF)   = FPU_FCW_INIT;
+    *(uint32_t *)(p + FPU_MXCSR_OFF) = FPU_MXCSR_INIT;
+}
+
+/* ---- Setup ---- */
+
+void fpu_cpu_init(void) {
+    uint64_t cr4;
+    __asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_xcr0)
+        cr4 |= CR4_OSXSAVE;
+    __asm__ volatile("movq %0, %%cr4" : : "r"(cr4) : "memory");
+    if (fpu_xcr0)
+        __asm__ volatile("xsetbv" : : "c"(0u), "a"((uint32_t)fpu_xcr0),
+                         "d"((uint32_t)(fpu_xcr0 >> 32)));
+
+    /* Native x87 errors, and the first FPU instruction traps */
+    cr0_write((cr0_read() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+    fpu_owner[cpu_current_id()] = NULL;
+}
+
+void fpu_init(void) {
+    uint32_t r[4];
+    cpuid_count(0, 0, r);
+    uint32_t max_leaf = r[0];
+    cpuid_count(1, 0, r);
+    if ((r[2] & CPUID1_XSAVE) && max_leaf >= CPUID_XSTATE) {
+        cpuid_count(CPUID_XSTATE, 0, r);
+        fpu_xcr0 = (((uint64_t)r[3] << 32) | r[0]) & XCR0_WANTED;
+        cpuid_count(CPUID_XSTATE, 1, r);
+        fpu_has_xsaveopt = (r[0] & XSTATE_XSAVEOPT) != 0;
+    }
+    fpu_cpu_init();
+    if (fpu_xcr0) {
+        /* EBX: size of the standard-format area for what XCR0 now enables */
+        cpuid_count(CPUID_XSTATE, 0, r);
+        fpu_size = r[1];
+    }
+    fpu_cache = kmem_cache_create("fpu", fpu_size, FPU_AREA_ALIGN, NULL);
+
+    print_str(fpu_has_xsaveopt ? "FPU: XSAVEOPT, " : fpu_xcr0 ? "FPU: XSAVE, " : "FPU: FXSAVE, ", 0x0A);
+    print_num(fpu_size, 0x0A);
+    print_str(" bytes per thread on first use\n", 0x0A);
+}
+
+uint32_t fpu_state_size(void) {
+    return fpu_size;
+}
+
+/* ---- Switching ---- */
+
+void fpu_switch(struct thread *prev, struct thread *next) {
+    uint32_t cpu = cpu_current_id();
+    uint64_t cr0 = cr0_read();
+    /* TS clear: prev trapped in (or kept its state loaded) this slice */
+    if (!(cr0 & CR0_TS) && prev->fpu_state)
+        fpu_save(prev->fpu_state);
+    if (fpu_owner[cpu] == next && next->fpu_cpu == cpu) {
+        if (cr0 & CR0_TS)
+            __asm__ volatile("clts" : : : "memory");
+    } else if (!(cr0 & CR0_TS)) {
+        cr0_write(cr0 | CR0_TS);
+    }
+}
+
+int fpu_trap(struct thread *t) {
+    uint32_t cpu = cpu_current_id();
+    if (!t) {
+        fpu_owner[cpu] = NULL;
+        __asm__ volatile("clts" : : : "memory");
+        return 0;
+    }
+    if (!t->fpu_state) {
+        void *area = fpu_cache ? kmem_cache_alloc(fpu_cache) : NULL;
+        if (!area)
+            return -1;
+        fpu_area_init(area);
+        t->fpu_state = area;
+    }
+    __asm__ volatile("clts" : : : "memory");
+    fpu_restore(t->fpu_state);
+    fpu_owner[cpu] = t;
+    t->fpu_cpu     = cpu;
+    return 0;
+}
+
+void fpu_thread_reset(struct thread *t) {
+    /* A stale fpu_owner entry no longer matches once fpu_cpu is cleared */
+    t->fpu_cpu = FPU_NO_CPU;
+    if (t->fpu_state)
+        fpu_area_init(t->fpu_state);
+}
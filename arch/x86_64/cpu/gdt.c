@@ -8,14 +8,18 @@
       0x10  kernel data  (ring 0)
       0x18  user   code  (ring 3, 64-bit)   selector 0x1B (|3)
       0x20  user   data  (ring 3)            selector 0x23 (|3)
-      0x28  TSS low  (16 bytes, two GDT slots)
-      0x30  TSS high
+      0x28  TSS of CPU 0 (16 bytes, two GDT slots)
+      0x38  TSS of CPU 1, and so on up to MAX_CPUS
+
+    Every CPU loads the same table and its own TSS, at 0x28 + 16 * cpu.
 
     64-bit TSS (Intel SDM Vol.3 §7.7):
       rsp0 at offset +4 (used on ring-3 → ring-0 transition)
 */
 
 #include <stdint.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/types.h>
 
 /* ------------------------------------------------------------------ */
 /* GDT entry (8 bytes)                                                */
@@ -69,11 +73,11 @@ typedef struct {
 /* ------------------------------------------------------------------ */
 /* Static storage                                                     */
 /* ------------------------------------------------------------------ */
-/* 5 normal entries + 2 slots for the 64-bit TSS descriptor */
+/* 5 normal entries + 2 slots per CPU for the 64-bit TSS descriptors */
 static gdt_entry    gdt[5];
-static tss_descriptor tss_desc;
+static tss_descriptor tss_desc[MAX_CPUS];
 static gdt_ptr64    gdtp;
-static Tss64       tss;
+static Tss64       tss[MAX_CPUS];
 
 static uint8_t kernel_stack[4096] __attribute__((aligned(16)));
 
@@ -90,15 +94,37 @@ static void gdt_set(int i, uint32_t base, uint32_t limit,
     gdt[i].access      = access;
 }
 
-static void tss_desc_set(uint64_t base, uint32_t limit) {
-    tss_desc.limit_low   = (uint16_t)(limit & 0xFFFFu);
-    tss_desc.base_low    = (uint16_t)(base & 0xFFFFu);
-    tss_desc.base_middle = (uint8_t)((base >> 16) & 0xFFu);
-    tss_desc.access     = 0x89u; /* present, DPL=0, available 64-bit TSS */
-    tss_desc.granularity = (uint8_t)(((limit >> 16) & 0x0Fu));
-    tss_desc.base_high   = (uint8_t)((base >> 24) & 0xFFu);
-    tss_desc.base_upper  = (uint32_t)(base >> 32);
-    tss_desc.reserved   = 0;
+static void tss_desc_set(tss_descriptor *d, uint64_t base, uint32_t limit) {
+    d->limit_low   = (uint16_t)(limit & 0xFFFFu);
+    d->base_low    = (uint16_t)(base & 0xFFFFu);
+    d->base_middle = (uint8_t)((base >> 16) & 0xFFu);
+    d->access     = 0x89u; /* present, DPL=0, available 64-bit TSS */
+    d->granularity = (uint8_t)(((limit >> 16) & 0x0Fu));
+    d->base_high   = (uint8_t)((base >> 24) & 0xFFu);
+    d->base_upper  = (uint32_t)(base >> 32);
+    d->reserved   = 0;
+}
+
+/* Load gdtp and TSS selector sel on the calling CPU */
+static void gdt_load(uint16_t sel) {
+    __asm__ volatile(
+        "lgdt %0\n"
+        /* Far return to reload CS with kernel code selector 0x08 */
+        "pushq $0x08\n"
+        "leaq  1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "movw $0x10, %%ax\n"   /* kernel data selector */
+        "movw %%ax, %%ds\n"
+        "movw %%ax, %%es\n"
+        "movw %%ax, %%ss\n"
+        "xorw %%ax, %%ax\n"    /* FS/GS = null in 64-bit mode */
+        "movw %%ax, %%fs\n"
+        "movw %%ax, %%gs\n"
+        : : "m"(gdtp) : "rax", "memory"
+    );
+    __asm__ volatile("ltr %%ax" : : "a"(sel));
 }
 
 /* ------------------------------------------------------------------ */
@@ -120,61 +146,45 @@ void gdt_init(void) {
     /* User data: ring 3 */
     gdt_set(4, 0, 0xFFFFFu, 0xF2u, 0xC0u);
 
-    /* Build a flat GDT: [gdt entries][tss descriptor] */
-    gdtp.limit = (uint16_t)(sizeof(gdt) + sizeof(tss_desc) - 1u);
-    gdtp.base  = (uint64_t)(uintptr_t)gdt;
-
-    /* TSS */
-    tss.rsp0      = (uint64_t)(uintptr_t)(kernel_stack + sizeof(kernel_stack));
-    tss.iomap_base = (uint16_t)sizeof(Tss64); /* no I/O bitmap */
-
-    tss_desc_set((uint64_t)(uintptr_t)&tss, (uint32_t)(sizeof(Tss64) - 1u));
-
-    /* We need the TSS descriptor contiguous with gdt[] in memory.
-     * Since C doesn't guarantee struct layout across separate arrays,
-     * we embed the TSS descriptor address directly in the GDTR. */
-    gdtp.limit = (uint16_t)(sizeof(gdt) + sizeof(tss_desc) - 1u);
-    /* GDTR base points to gdt[0]; TSS descriptor follows immediately
-     * only if they are adjacent.  Use a packed struct trick: */
+    /* TSS per CPU; the boot CPU starts on kernel_stack, the others
+     * get theirs in gdt_load_cpu */
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        tss[cpu].iomap_base = (uint16_t)sizeof(Tss64); /* no I/O bitmap */
+        tss_desc_set(&tss_desc[cpu], (uint64_t)(uintptr_t)&tss[cpu],
+                     (uint32_t)(sizeof(Tss64) - 1u));
+    }
+    tss[0].rsp0 = (uint64_t)(uintptr_t)(kernel_stack + sizeof(kernel_stack));
 
-    /* Simpler: build a single flat table in a local array */
+    /* The descriptors must sit in one table: build it flat */
     static uint8_t gdt_flat[sizeof(gdt) + sizeof(tss_desc)]
         __attribute__((aligned(8)));
 
     /* Copy normal entries */
     for (uint32_t i = 0; i < sizeof(gdt); i++)
         gdt_flat[i] = ((uint8_t *)gdt)[i];
-    /* Copy TSS descriptor */
+    /* Copy TSS descriptors */
     for (uint32_t i = 0; i < sizeof(tss_desc); i++)
-        gdt_flat[sizeof(gdt) + i] = ((uint8_t *)&tss_desc)[i];
+        gdt_flat[sizeof(gdt) + i] = ((uint8_t *)tss_desc)[i];
 
     gdtp.limit = (uint16_t)(sizeof(gdt_flat) - 1u);
     gdtp.base  = (uint64_t)(uintptr_t)gdt_flat;
 
-    __asm__ volatile(
-        "lgdt %0\n"
-        /* Far return to reload CS with kernel code selector 0x08 */
-        "pushq $0x08\n"
-        "leaq  1f(%%rip), %%rax\n"
-        "pushq %%rax\n"
-        "lretq\n"
-        "1:\n"
-        "movw $0x10, %%ax\n"   /* kernel data selector */
-        "movw %%ax, %%ds\n"
-        "movw %%ax, %%es\n"
-        "movw %%ax, %%ss\n"
-        "xorw %%ax, %%ax\n"    /* FS/GS = null in 64-bit mode */
-        "movw %%ax, %%fs\n"
-        "movw %%ax, %%gs\n"
-        : : "m"(gdtp) : "rax", "memory"
-    );
-
-    /* TSS selector = offset of tss_desc in gdt_flat = sizeof(gdt) = 0x28
+    /* TSS selector = offset of tss_desc[0] in gdt_flat = sizeof(gdt) = 0x28
      * RPL = 0, TI = 0  →  selector = 0x28 */
-    __asm__ volatile("ltr %%ax" : : "a"((uint16_t)0x28u));
+    gdt_load((uint16_t)sizeof(gdt));
+}
+
+/*
+ * Precondition:  gdt_init has run on the boot CPU; cpu < MAX_CPUS.
+ * Postcondition: the calling CPU uses the shared GDT and TSS cpu, with
+ *                rsp0 as its ring-0 stack.  Its GS base is gone.
+ */
+void gdt_load_cpu(uint32_t cpu, uint64_t rsp0) {
+    tss[cpu].rsp0 = rsp0;
+    gdt_load((uint16_t)(sizeof(gdt) + cpu * sizeof(tss_descriptor)));
 }
 
 /* Update kernel stack pointer in TSS (call on each context switch) */
 void tss_set_kernel_stack(uint64_t rsp0) {
-    tss.rsp0 = rsp0;
+    tss[cpu_current_id()].rsp0 = rsp0;
 }
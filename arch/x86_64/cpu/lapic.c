@@ -0,0 +1,159 @@
+/*
+    E-com_os Kernel - Local APIC
+    Copyright (C) 2025,2026  Saladin5101
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <kernel/arch/lapic.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/cpu.h>
+#include <kernel/mm.h>
+#include <kernel/time.h>
+
+#define LAPIC_ID          0x020u
+#define LAPIC_EOI         0x0B0u
+#define LAPIC_SVR         0x0F0u
+#define LAPIC_TPR         0x080u
+#define LAPIC_ICR_LOW     0x300u
+#define LAPIC_ICR_HIGH    0x310u
+#define LAPIC_LVT_TIMER   0x320u
+#define LAPIC_TIMER_INIT  0x380u
+#define LAPIC_TIMER_CUR   0x390u
+#define LAPIC_TIMER_DIV   0x3E0u
+
+#define SVR_ENABLE        (1u << 8)
+#define ICR_PENDING       (1u << 12)
+#define ICR_ASSERT        (1u << 14)
+#define ICR_INIT          (5u << 8)
+#define ICR_STARTUP       (6u << 8)
+#define LVT_MASKED        (1u << 16)
+#define LVT_PERIODIC      (1u << 17)
+#define LVT_TSC_DEADLINE  (2u << 17)
+#define TIMER_DIV_16      0x3u
+#define CALIBRATE_MS      10u
+#define CPUID1_TSC_DEADLINE (1u << 24)    /* ECX */
+#define CPUID1_APIC         (1u << 9)     /* EDX */
+#define MSR_TSC_DEADLINE  0x6E0u
+
+static volatile uint32_t *lapic = 0;
+static uint32_t ticks_per_ms = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4u];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4u] = val;
+}
+
+static void cpuid1(uint32_t *ecx, uint32_t *edx) {
+    uint32_t a, b;
+    __asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(*ecx), "=d"(*edx) : "a"(1u), "c"(0u));
+    (void)a; (void)b;
+}
+
+int lapic_init(uint64_t phys) {
+    uint32_t ecx, edx;
+    cpuid1(&ecx, &edx);
+    if (!(edx & CPUID1_APIC))
+        return -1;
+    if (mm_map_page(phys, phys, MM_FLAG_KERNEL_RW | MM_FLAG_DEVICE) < 0)
+        return -1;
+    lapic = (volatile uint32_t *)(uintptr_t)phys;
+    return 0;
+}
+
+int lapic_present(void) {
+    return lapic != 0;
+}
+
+void lapic_enable(void) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | IRQ_SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void icr_send(uint32_t apic_id, uint32_t low) {
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING)
+        __asm__ volatile("pause");
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, low);   /* the write sends it */
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    icr_send(apic_id, ICR_ASSERT | vector);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    icr_send(apic_id, ICR_ASSERT | ICR_INIT);
+}
+
+void lapic_send_sipi(uint32_t apic_id, uint8_t page) {
+    icr_send(apic_id, ICR_STARTUP | page);
+}
+
+void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    /* Start on a tick edge so the window is whole milliseconds */
+    uint64_t t = time_get_current_ms();
+    while (time_get_current_ms() == t)
+        __asm__ volatile("pause");
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFFu);
+    t = time_get_current_ms();
+    while (time_get_current_ms() - t < CALIBRATE_MS)
+        __asm__ volatile("pause");
+    ticks_per_ms = (0xFFFFFFFFu - lapic_read(LAPIC_TIMER_CUR)) / CALIBRATE_MS;
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+int lapic_timer_start(uint8_t vector) {
+    if (!ticks_per_ms)
+        return -1;
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_PERIODIC | vector);
+    lapic_write(LAPIC_TIMER_INIT, ticks_per_ms);
+    return 0;
+}
+
+int lapic_timer_oneshot(uint8_t vector, uint32_t ms) {
+    if (!ticks_per_ms)
+        return -1;
+    uint64_t count = (uint64_t)ms * ticks_per_ms;
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, vector);
+    lapic_write(LAPIC_TIMER_INIT, count > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)count);
+    return 0;
+}
+
+int lapic_has_tsc_deadline(void) {
+    uint32_t ecx, edx;
+    cpuid1(&ecx, &edx);
+    return (ecx & CPUID1_TSC_DEADLINE) != 0;
+}
+
+void lapic_timer_deadline(uint8_t vector, uint64_t tsc) {
+    lapic_write(LAPIC_LVT_TIMER, LVT_TSC_DEADLINE | vector);
+    /* The MMIO write must land before the MSR write arms the timer */
+    __asm__ volatile("mfence" : : : "memory");
+    cpu_wrmsr(MSR_TSC_DEADLINE, tsc ? tsc : 1u);   /* 0 would disarm it */
+}
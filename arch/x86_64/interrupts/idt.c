@@ -78,9 +78,16 @@ void idt_init(void) {
     GATE(40, irq8);  GATE(41, irq9);  GATE(42, irq10); GATE(43, irq11);
     GATE(44, irq12); GATE(45, irq13); GATE(46, irq14); GATE(47, irq15);
 
+    GATE(48, irq16); GATE(49, irq17); GATE(50, irq18);
+    GATE(IRQ_SPURIOUS_VECTOR, irq_spurious);
+
     UGATE(128, isr128);
 
     idt_pointer.limit = sizeof(idt) - 1;
     idt_pointer.base  = (uint64_t)(uintptr_t)&idt;
+    idt_load();
+}
+
+void idt_load(void) {
     __asm__ volatile("lidt %0" : : "m"(idt_pointer));
 }
@@ -17,13 +17,22 @@
 */
 
 #include <stdint.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/lapic.h>
 #include <kernel/time.h>
+#include <kernel/sched.h>
 
 #define PIC1_CMD  0x20
 #define PIC1_DATA 0x21
 #define PIC2_CMD  0xA0
 #define PIC2_DATA 0xA1
 
+#define PIT_CH0       0x40
+#define PIT_CMD       0x43
+#define PIT_MODE_RATE 0x34      /* channel 0, lo/hi byte, mode 2 */
+#define PIT_INPUT_HZ  1193182u
+#define TIMER_HZ      1000u     /* one tick per millisecond, as time.c counts */
+
 static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
@@ -50,34 +59,57 @@ void irq_remap(void) {
 }
 
 static void irq_ack(uint8_t irq) {
+    if (irq >= 16) {
+        lapic_eoi();
+        return;
+    }
     if (irq >= 8)
         outb(PIC2_CMD, 0x20);
     outb(PIC1_CMD, 0x20);
 }
 
-static void (*irq_handlers[16])(void) = {0};
+static void (*irq_handlers[IRQ_COUNT])(void) = {0};
 
 void irq_install_handler(uint8_t irq, void (*handler)(void)) {
-    if (irq < 16)
+    if (irq < IRQ_COUNT)
         irq_handlers[irq] = handler;
 }
 
 void irq_uninstall_handler(uint8_t irq) {
-    if (irq < 16)
+    if (irq < IRQ_COUNT)
         irq_handlers[irq] = 0;
 }
 
 static void timer_handler(void) {
     time_tick();
+    sched_tick();
 }
 
 void irq_handler_asm_shim(uint64_t vec) {
     uint8_t irq = (uint8_t)(vec - 32);
-    if (irq < 16 && irq_handlers[irq])
+    /* Whatever woke a CPU out of a tickless sleep, it ticks again */
+    time_idle_restart();
+    if (irq < IRQ_COUNT && irq_handlers[irq])
         irq_handlers[irq]();
     irq_ack(irq);
+    /*
+     * Acknowledged, so the next thread gets interrupts.  The preempted
+     * thread's frame stays on its own stack until it is resumed.
+     */
+    if (sched_need_resched())
+        sched_schedule();
 }
 
 void irq_init_timer(void) {
+    uint16_t divisor = (uint16_t)(PIT_INPUT_HZ / TIMER_HZ);
+    outb(PIT_CMD, PIT_MODE_RATE);
+    outb(PIT_CH0, (uint8_t)(divisor & 0xFF));
+    outb(PIT_CH0, (uint8_t)(divisor >> 8));
     irq_install_handler(0, timer_handler);
+    outb(PIC1_DATA, inb(PIC1_DATA) & (uint8_t)~1u);   /* unmask IRQ 0 */
+}
+
+void irq_stop_timer(void) {
+    outb(PIC1_DATA, (uint8_t)(inb(PIC1_DATA) | 1u));   /* mask IRQ 0 */
+    irq_uninstall_handler(0);
 }
@@ -63,28 +63,38 @@ IRQ 12, 44
 IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
+IRQ 16, 48      # local APIC timer
+IRQ 17, 49      # reschedule IPI
+IRQ 18, 50      # TLB shootdown IPI
 
+# Spurious local APIC interrupts take no EOI
+.global irq_spurious
+irq_spurious:
+    iretq
+
+# GS is never reloaded here: its base is the CPU's cpu_local area,
+# swapped with the user's on the way in from and out to ring 3.
 irq_common_stub:
+    testb $3, 24(%rsp)      # CS of the interrupted code
+    jz 1f
+    swapgs
+1:
     SAVE_REGS
 
     movw $0x10, %ax
     movw %ax, %ds
     movw %ax, %es
-    movw %ax, %fs
-    movw %ax, %gs
 
     # irq_handler takes a struct registers by value — pass int_no as arg
     movq 120(%rsp), %rdi    # int_no (after 15 * 8 = 120 bytes of saved regs)
 
     call irq_handler_asm_shim
 
-    movw $0x10, %ax
-    movw %ax, %ds
-    movw %ax, %es
-    movw %ax, %fs
-    movw %ax, %gs
-
     RESTORE_REGS
     addq $16, %rsp
-    sti
+    # IRETQ restores IF; an STI here could let an interrupt in after SWAPGS
+    testb $3, 8(%rsp)
+    jz 2f
+    swapgs
+2:
     iretq
@@ -18,6 +18,11 @@
 
 #include <stdint.h>
 #include <kernel/printkit/print.h>
+#include <kernel/address_space.h>
+#include <kernel/mm.h>
+#include <kernel/arch/fpu.h>
+#include <kernel/sched.h>
+#include <kernel/syscall.h>
 
 static const char *exception_messages[] = {
     "Division By Zero",
@@ -46,8 +51,49 @@ static const char *exception_messages[] = {
     "Reserved", "Reserved", "Reserved"
 };
 
+/*
+ * Report a fault no region accounts for and end the running thread.
+ * Returns only if there is none, for the caller to halt.
+ */
+static void page_fault_fatal(uint64_t addr, uint64_t err_code) {
+    print_str("Page fault at ", 0x4F);
+    print_hex((uint32_t)(addr >> 32), 0x4F);
+    print_str(":", 0x4F);
+    print_hex((uint32_t)addr, 0x4F);
+    print_str(err_code & MM_PF_WRITE ? " (write" : " (read", 0x4F);
+    print_str(err_code & MM_PF_PRESENT ? ", protection" : ", not present", 0x4F);
+    print_str(err_code & MM_PF_USER ? ", user)\n" : ", kernel)\n", 0x4F);
+
+    Thread *t = sched_get_current_thread();
+    if (!t)
+        return;
+    t->last_error = ERR_PAGE_FAULT;
+    t->fault_addr = addr;
+    print_str("Thread ", 0x4F);
+    print_num(t->id, 0x4F);
+    print_str(" ended\n", 0x4F);
+    sched_exit();
+}
+
 void isr_handler(uint64_t int_no, uint64_t err_code) {
-    (void)err_code;
+    if (int_no == 7) {
+        /* CR0.TS: first FPU use since the switch; load (or create) its state */
+        Thread *t = sched_get_current_thread();
+        if (fpu_trap(t) == 0)
+            return;
+        print_str("No memory for FPU state, thread ", 0x4F);
+        print_num(t->id, 0x4F);
+        print_str(" ended\n", 0x4F);
+        sched_exit();
+    }
+    if (int_no == 14) {
+        uint64_t cr2;
+        __asm__ volatile("movq %%cr2, %0" : "=r"(cr2));
+        /* Resolved: returning retries the faulting instruction */
+        if (as_page_fault(cr2, (uint32_t)err_code) == 0)
+            return;
+        page_fault_fatal(cr2, err_code);
+    }
     if (int_no < 32) {
         print_str("Exception: ", 0x4F);
         print_str(exception_messages[int_no], 0x4F);
@@ -89,6 +89,9 @@ ISR_NOERRCODE 29
 ISR_NOERRCODE 30
 ISR_NOERRCODE 31
 
+# GS is never reloaded in the stubs: its base is the CPU's cpu_local
+# area, swapped with the user's on the way in from and out to ring 3.
+
 # int 0x80 syscall entry
 .global isr128
 isr128:
@@ -98,13 +101,15 @@ isr128:
     jmp syscall_stub
 
 syscall_stub:
+    testb $3, 24(%rsp)      # CS of the interrupted code
+    jz 1f
+    swapgs
+1:
     SAVE_REGS
 
     movw $0x10, %ax
     movw %ax, %ds
     movw %ax, %es
-    movw %ax, %fs
-    movw %ax, %gs
 
     # isr frame on stack (from bottom): r15..rax, int_no, err_code, rip, cs, rflags, rsp, ss
     # int_no is at rsp+120 (15 regs * 8), err_code at rsp+128 — but we need
@@ -120,25 +125,24 @@ syscall_stub:
     # store return value back into saved rax slot
     movq %rax, 112(%rsp)
 
-    movw $0x10, %ax
-    movw %ax, %ds
-    movw %ax, %es
-    movw %ax, %fs
-    movw %ax, %gs
-
     RESTORE_REGS
     addq $16, %rsp          # pop err_code + int_no
-    sti
+    testb $3, 8(%rsp)       # IRETQ restores IF, so no STI after SWAPGS
+    jz 2f
+    swapgs
+2:
     iretq
 
 isr_common_stub:
+    testb $3, 24(%rsp)      # CS of the interrupted code
+    jz 1f
+    swapgs
+1:
     SAVE_REGS
 
     movw $0x10, %ax
     movw %ax, %ds
     movw %ax, %es
-    movw %ax, %fs
-    movw %ax, %gs
 
     # isr_handler(int_no, err_code) — pass as two args
     movq 120(%rsp), %rdi    # int_no  (after 15 pushq = 120 bytes)
@@ -146,13 +150,10 @@ isr_common_stub:
 
     call isr_handler
 
-    movw $0x10, %ax
-    movw %ax, %ds
-    movw %ax, %es
-    movw %ax, %fs
-    movw %ax, %gs
-
     RESTORE_REGS
     addq $16, %rsp
-    sti
+    testb $3, 8(%rsp)       # IRETQ restores IF, so no STI after SWAPGS
+    jz 2f
+    swapgs
+2:
     iretq
@@ -63,6 +63,7 @@ my $config = {
         '-Wextra',                     # Enable extra warnings
         '-c',                          # Compile only, do not link
         '-mcmodel=large',              # Large code model for kernel
+        '-mgeneral-regs-only',         # FPU/SSE registers belong to threads
         '-Werror',                     # Treat warnings as errors
         '-pedantic',                   # Strict ISO C compliance
 	'-g',                          # To debug
@@ -109,13 +110,26 @@ my $config = {
             'src/kernel/main.c',         # Kernel entry point and main loop
             'src/kernel/syscall.c',      # System call implementation
             'src/kernel/debug.c',        # Debug and diagnostic utilities
+            'src/kernel/address_space.c', # Per-space page tables and PCIDs
+            'src/kernel/pressure.c',     # Memory-pressure notifications
+            'src/kernel/shm.c',          # Shared memory objects
+            'src/kernel/acpi.c',         # ACPI table lookup
+            'src/kernel/smp.c',          # Application processor bring-up
             'src/ipc/ipc.c',             # Inter-process communication
             'src/mm/mm.c',               # Memory management subsystem
+            'src/mm/buddy.c',            # Buddy page allocator
+            'src/mm/bitmap.c',           # Two-level page bitmap
+            'src/mm/slab.c',             # Slab object caches
+            'src/mm/heap.c',             # Kernel heap (kmalloc/kfree)
+            'src/mm/vmalloc.c',          # Kernel virtual allocator (vmalloc/vfree)
+            'src/mm/numa.c',             # NUMA topology from ACPI SRAT/SLIT
             'src/sched/sched.c',         # Task scheduler implementation
             'src/printkit/print.c',      # Printing and output utilities
             'src/time/time.c',           # Time management and timers
 	    'src/kernel/proc.c',	 # System process management
             'arch/x86_64/cpu/gdt.c',     # Global Descriptor Table management
+            'arch/x86_64/cpu/lapic.c',   # Local APIC, IPIs and per-CPU timer
+            'arch/x86_64/cpu/fpu.c',     # Lazy FPU/SSE/AVX state
             'arch/x86_64/interrupts/idt.c', # Interrupt Descriptor Table
             'arch/x86_64/interrupts/isr.c', # ISR handler implementations
             'arch/x86_64/interrupts/irq.c', # IRQ handler implementations
@@ -124,6 +138,7 @@ my $config = {
         # Assembly source files for low-level operations
         asm => [
             'arch/x86_64/cpu/context_switch.s',  # Context switching assembly
+            'arch/x86_64/cpu/ap_trampoline.s',   # AP real-mode start-up
 	    'boot/multiboot2_start.s',           # New GRUB start up
 	    'boot/long_mode_switch.s',           # Long mode change
         ],
@@ -0,0 +1,38 @@
+/*
+    E-comOS Kernel - ACPI tables
+    Copyright (C) 2025,2026  Saladin5101
+
+    Lookup of the static ACPI tables (SRAT, SLIT, MADT, ...) from the
+    root the firmware hands over.  The tables are read in place, so
+    only while firmware memory is still identity mapped: the callers
+    parse what they need during early boot and keep their own copies.
+
+    Invariant: a table returned by acpi_find_table passed its checksum.
+*/
+
+#ifndef KERNEL_ACPI_H
+#define KERNEL_ACPI_H
+
+#include <stdint.h>
+
+#define ACPI_HEADER_LEN  36u   /* common system description table header */
+
+/*
+ * acpi_init — remember the root reachable from rsdp, an ACPI RSDP (or
+ * directly an RSDT or XSDT).  Returns -1 if there is none.
+ */
+int acpi_init(const void *rsdp);
+
+/* The table with signature sig (4 characters), or NULL */
+const uint8_t *acpi_find_table(const char *sig);
+
+/* Little-endian fields of packed tables, at any alignment */
+static inline uint32_t acpi_rd32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t acpi_rd64(const uint8_t *p) {
+    return (uint64_t)acpi_rd32(p) | (uint64_t)acpi_rd32(p + 4) << 32;
+}
+
+#endif /* KERNEL_ACPI_H */
@@ -1,6 +1,9 @@
 /*
     E-comOS Kernel - Address Space Management
     Copyright (C) 2025,2026  Saladin5101
+
+    Address space 0 is the kernel's own.  Others map user memory in
+    [MM_USER_BASE, MM_USER_END) and share all kernel mappings.
 */
 
 #ifndef KERNEL_ADDRESS_SPACE_H
@@ -8,12 +11,108 @@
 
 #include <stdint.h>
 
-typedef address_space;
+#define MAX_ADDRESS_SPACES 8192u
+
+typedef uint32_t address_space;
+
+/* Precondition: mm_init has run.  Postcondition: as_create can succeed. */
+void         as_init(void);
 
+/* Returns the new space, or 0 if out of memory or ids */
 address_space as_create(void);
+/* Fails while the space is loaded on any CPU */
 int          as_destroy(address_space as);
-int          as_map(address_space as, uint32_t vaddr, uint32_t paddr,
-                   uint32_t size, uint32_t flags);
-int          as_unmap(address_space as, uint32_t vaddr, uint32_t size);
+int          as_map(address_space as, uint64_t vaddr, uint64_t paddr,
+                   uint64_t size, uint32_t flags);
+int          as_unmap(address_space as, uint64_t vaddr, uint64_t size);
+/* as_map, but -1 if any of the range is mapped or meets a region */
+int          as_map_free(address_space as, uint64_t vaddr, uint64_t paddr,
+                        uint64_t size, uint32_t flags);
+/* Change the MM_FLAG_* protection of every page mapped in the range */
+int          as_protect(address_space as, uint64_t vaddr, uint64_t size, uint32_t flags);
+
+/*
+ * Demand-paged regions.  Nothing is allocated up front: the page-fault
+ * handler maps a zeroed frame the first time a page is touched.
+ * as_region_reserve: anonymous memory [start, start + size).
+ * as_stack_reserve:  a stack ending at top, populated on demand over its
+ *                    top size bytes and growing down on faults just below
+ *                    its bottom, to at most max_size bytes.
+ * as_region_release: drop the region holding addr and free its frames.
+ * Reservations must be page aligned, lie in [MM_USER_BASE, MM_USER_END)
+ * and not overlap another region (a stack counts its full max_size) or
+ * anything already mapped.
+ * Explicit as_map mappings are not regions and are never freed here;
+ * shared memory objects mapped into a destroyed space let go of it.
+ */
+#define AS_REGION_ANON   0u
+#define AS_REGION_STACK  1u
+
+int          as_region_reserve(address_space as, uint64_t start, uint64_t size,
+                              uint32_t flags);
+int          as_stack_reserve(address_space as, uint64_t top, uint64_t size,
+                             uint64_t max_size, uint32_t flags);
+int          as_region_release(address_space as, uint64_t addr);
+
+/*
+ * as_clone — new space with the regions of src, their frames shared
+ * copy-on-write; a page is copied on the first write from either side.
+ * Explicit as_map mappings are not inherited.  Returns 0 on failure.
+ * as_destroy_clone — as_destroy for a space cloned from parent; -1 if
+ * it was not.  Clones of a destroyed space pass to its own parent.
+ */
+address_space as_clone(address_space src);
+int          as_destroy_clone(address_space parent, address_space as);
+
+/*
+ * as_page_fault — resolve a fault at addr (err: MM_PF_* bits) in the
+ * current space: a first touch inside a region, or a write to a page
+ * shared by as_clone.  Returns 0 if the access can be retried, -1 if
+ * it is invalid.
+ */
+int          as_page_fault(uint64_t addr, uint32_t err);
+
+/*
+ * as_copy_in — copy size bytes from user address src of as into dst.
+ * as_copy_out — copy size bytes from src to user address dst of as,
+ * first copying pages it still shares with a clone.
+ * Both return -1 unless all of the range is mapped user-accessible,
+ * and writable for as_copy_out.
+ */
+int          as_copy_in(address_space as, void *dst, uint64_t src, uint64_t size);
+int          as_copy_out(address_space as, uint64_t dst, const void *src, uint64_t size);
+
+/*
+ * Accounting.  Every page faulted into a region is charged to its space
+ * until the region is released; a clone starts charged for the pages it
+ * shares.  A fault that would take the charge past the hard limit is
+ * refused; the soft limit only counts how often it is crossed.  Limits
+ * are in pages, 0 = none.  as_charge / as_uncharge hold pages that are
+ * not in a region, such as a shared object's, against the same limits.
+ */
+typedef struct {
+    uint64_t resident;      /* pages mapped in the user range */
+    uint64_t shared;        /* of which shared copy-on-write */
+    uint64_t page_tables;   /* page-table pages, PML4 included */
+    uint64_t charged;       /* pages held against the limits */
+    uint64_t peak;          /* highest charge so far */
+    uint64_t kernel_bytes;  /* descriptors the kernel keeps for the space */
+    uint64_t limit_soft;
+    uint64_t limit_hard;
+    uint32_t soft_crossings;
+    uint32_t hard_denials;  /* charges refused at the hard limit */
+} as_usage;
+
+int          as_usage_get(address_space as, as_usage *u);
+int          as_set_limits(address_space as, uint64_t soft, uint64_t hard);
+int          as_charge(address_space as, uint64_t pages);
+void         as_uncharge(address_space as, uint64_t pages);
+
+/*
+ * as_switch — load the page tables of as on this CPU.
+ * No-op if it is already loaded; with PCIDs the TLB is not flushed.
+ */
+void         as_switch(address_space as);
+address_space as_get_current(void);
 
 #endif
@@ -0,0 +1,67 @@
+/*
+    E-com_os Kernel - Lazy FPU/SSE/AVX state
+    Copyright (C) 2025,2026  Saladin5101
+
+    A thread has no extended-state area until it first touches the FPU.
+    Every switch sets CR0.TS, so that first touch — and the first one
+    after each switch — traps with #NM, which allocates the area if
+    needed and loads it.  A thread that never uses the FPU never traps
+    and costs nothing on a switch.
+
+    A thread that did use it in its slice is saved when switched out,
+    so its state is always in memory when another CPU picks it up.  The
+    registers still hold it afterwards: if it comes back to the same
+    CPU before anyone else used the FPU there, TS is cleared again
+    without a reload.
+
+    The area is XSAVE format sized from CPUID leaf 0xD for the features
+    enabled in XCR0, saved with XSAVEOPT where available, or a 512-byte
+    FXSAVE area on CPUs without XSAVE.
+
+    Invariant: CR0.TS is clear on a CPU only while its current thread's
+               state is in that CPU's registers.
+    The kernel itself is built without FPU/SSE code (-mgeneral-regs-only).
+*/
+
+#ifndef KERNEL_ARCH_FPU_H
+#define KERNEL_ARCH_FPU_H
+
+#include <stdint.h>
+
+struct thread;
+
+/*
+ * fpu_init — detect the extended-state features on the boot CPU, size
+ * the area and set up the calling CPU.  Precondition: the slab
+ * allocator is up.
+ */
+void     fpu_init(void);
+
+/* fpu_cpu_init — enable the same features on an application processor */
+void     fpu_cpu_init(void);
+
+/* Bytes in a thread's area: FXSAVE's 512 or the XSAVE size */
+uint32_t fpu_state_size(void);
+
+/*
+ * fpu_switch — called with interrupts off just before switching from
+ * prev to next on this CPU: saves prev's state if it used the FPU and
+ * arms the trap for next unless its state is still loaded here.
+ */
+void     fpu_switch(struct thread *prev, struct thread *next);
+
+/*
+ * fpu_trap — the #NM handler for the running thread t (NULL for an
+ * idle thread, whose state is not kept).  Returns -1 if t's area
+ * cannot be allocated.
+ */
+int      fpu_trap(struct thread *t);
+
+/*
+ * fpu_thread_reset — a thread slot is reused: its area, if any, goes
+ * back to the initial state and its registers are no longer loaded
+ * anywhere.
+ */
+void     fpu_thread_reset(struct thread *t);
+
+#endif /* KERNEL_ARCH_FPU_H */
@@ -21,15 +21,31 @@
 
 #include <stdint.h>
 
+/*
+ * Vectors 32-47 are the PIC lines, IRQ 0-15.  The local APIC sources
+ * follow as IRQ 16 and up; their handlers are acknowledged at the local
+ * APIC instead of the PIC.
+ */
+#define IRQ_LAPIC_TIMER   16u   /* vector 48 */
+#define IRQ_IPI_RESCHED   17u   /* vector 49 */
+#define IRQ_IPI_TLB       18u   /* vector 50 */
+#define IRQ_COUNT         19u
+#define IRQ_VECTOR(irq)   (32u + (irq))
+#define IRQ_SPURIOUS_VECTOR 0xFFu
+
 void idt_init(void);
+/* idt_load — load the table idt_init built on another CPU */
+void idt_load(void);
 void idt_set_gate(uint8_t num, uint64_t base, uint16_t sel, uint8_t flags);
 void irq_remap(void);
 void irq_init_timer(void);
+void irq_stop_timer(void);      /* mask the PIT once local APIC ticks take over */
 void irq_install_handler(uint8_t irq, void (*handler)(void));
 void irq_uninstall_handler(uint8_t irq);
 void irq_handler_asm_shim(uint64_t vec);
 void isr_handler(uint64_t int_no, uint64_t err_code);
 void gdt_init(void);
+void gdt_load_cpu(uint32_t cpu, uint64_t rsp0);
 void tss_set_kernel_stack(uint64_t rsp0);
 
 extern void isr0(void);  extern void isr1(void);  extern void isr2(void);
@@ -49,6 +65,7 @@ extern void irq3(void);  extern void irq4(void);  extern void irq5(void);
 extern void irq6(void);  extern void irq7(void);  extern void irq8(void);
 extern void irq9(void);  extern void irq10(void); extern void irq11(void);
 extern void irq12(void); extern void irq13(void); extern void irq14(void);
-extern void irq15(void);
+extern void irq15(void); extern void irq16(void); extern void irq17(void);
+extern void irq18(void); extern void irq_spurious(void);
 
 #endif
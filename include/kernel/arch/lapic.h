@@ -0,0 +1,54 @@
+/*
+    E-com_os Kernel - Local APIC
+    Copyright (C) 2025,2026  Saladin5101
+
+    xAPIC register access through the MMIO window every CPU sees at the
+    same physical address.  Only the boot CPU maps it; the others use
+    the mapping once they run on the kernel page tables.
+*/
+
+#ifndef KERNEL_ARCH_LAPIC_H
+#define KERNEL_ARCH_LAPIC_H
+
+#include <stdint.h>
+
+#define LAPIC_DEFAULT_BASE  0xFEE00000ull
+
+/*
+ * lapic_init — map the window at phys.  Returns -1 if the CPU has no
+ * local APIC or it cannot be mapped.  Precondition: paging is enabled.
+ */
+int      lapic_init(uint64_t phys);
+int      lapic_present(void);
+
+/* lapic_enable — software-enable the calling CPU's APIC, accept all priorities */
+void     lapic_enable(void);
+uint32_t lapic_id(void);
+void     lapic_eoi(void);
+
+/* Fixed-delivery interrupt with vector to the CPU with APIC id apic_id */
+void     lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+/* Start-up sequence: INIT, then SIPIs with the real-mode entry page */
+void     lapic_send_init(uint32_t apic_id);
+void     lapic_send_sipi(uint32_t apic_id, uint8_t page);
+
+/*
+ * lapic_timer_calibrate — measure the timer rate against the 1 ms
+ *                         clock.  Needs interrupts on; takes ~10 ms.
+ * lapic_timer_start     — interrupt with vector every ms on the calling
+ *                         CPU.  -1 if not calibrated.
+ * lapic_timer_oneshot   — interrupt once, ms from now; the count is
+ *                         capped, so the interrupt may come earlier
+ *                         for very long waits.  -1 if not calibrated.
+ * lapic_timer_deadline  — interrupt once when the TSC reaches tsc.
+ *                         Only where lapic_has_tsc_deadline().
+ * Each replaces whatever mode the calling CPU's timer was in.
+ */
+void     lapic_timer_calibrate(void);
+int      lapic_timer_start(uint8_t vector);
+int      lapic_timer_oneshot(uint8_t vector, uint32_t ms);
+int      lapic_has_tsc_deadline(void);
+void     lapic_timer_deadline(uint8_t vector, uint64_t tsc);
+
+#endif
@@ -7,11 +7,11 @@
 
 #include <stdint.h>
 
-// CPU registers structure
+// Callee-saved registers, as context_switch saves and loads them
 struct cpu_context {
-    uint32_t eax, ebx, ecx, edx;
-    uint32_t esi, edi, esp, ebp;
-    uint32_t eip, eflags;
+    uint64_t r15, r14, r13, r12;
+    uint64_t rbp, rbx;
+    uint64_t rip, rsp;
 };
 
 
@@ -25,6 +25,14 @@ void arch_enable_interrupts(void);
 void arch_disable_interrupts(void);
 void arch_halt(void);
 void arch_context_switch(struct cpu_context *old, struct cpu_context *new);
+
+/*
+ * context_switch — save the caller's registers into old (if not NULL)
+ * and continue wherever new was saved.  A new thread starts at
+ * context_thread_start with its entry point in rbx.
+ */
+void context_switch(struct cpu_context *old_ctx, struct cpu_context *new_ctx);
+void context_thread_start(void);
 // System call entry
 void syscall_entry(void);
 
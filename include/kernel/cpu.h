@@ -0,0 +1,113 @@
+/*
+    E-comOS Kernel - CPU-local helpers
+    Copyright (C) 2025,2026  Saladin5101
+
+    Every CPU's GS base points at its cpu_local area while it runs
+    kernel code; entry from ring 3 swaps the user base out with SWAPGS.
+    Per-CPU data is indexed by cpu_current_id() and must be touched with
+    interrupts disabled (cpu_irq_save / cpu_irq_restore), which also
+    keeps the thread from moving to another CPU in between.
+*/
+
+#ifndef KERNEL_CPU_H
+#define KERNEL_CPU_H
+
+#include <stdint.h>
+#include <kernel/internal/types.h>
+
+#define RFLAGS_IF (1ull << 9)
+
+#define MSR_GS_BASE         0xC0000101u
+#define MSR_KERNEL_GS_BASE  0xC0000102u   /* swapped in by SWAPGS */
+
+/* Requests other CPUs leave in cpu_local.ipi_pending */
+#define CPU_IPI_TLB         (1u << 0)     /* drop non-global entries */
+#define CPU_IPI_TLB_GLOBAL  (1u << 1)     /* drop every entry */
+
+/* Fields are read through %gs at fixed offsets: keep the order */
+typedef struct cpu_local {
+    struct cpu_local *self;               /* %gs:0 */
+    uint32_t          id;                 /* %gs:8 */
+    uint32_t          apic_id;            /* %gs:12 */
+    volatile uint32_t ipi_pending;        /* %gs:16, CPU_IPI_* */
+} cpu_local;
+
+static inline uint64_t cpu_rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpu_wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32))
+                     : "memory");
+}
+
+/* Make l the calling CPU's area.  Segment loads after this clobber it. */
+static inline void cpu_local_init(cpu_local *l, uint32_t id, uint32_t apic_id) {
+    l->self        = l;
+    l->id          = id;
+    l->apic_id     = apic_id;
+    l->ipi_pending = 0;
+    cpu_wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t)l);
+    cpu_wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+/* volatile: a thread that switched out may resume on another CPU */
+static inline uint32_t cpu_current_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
+
+static inline cpu_local *cpu_local_self(void) {
+    cpu_local *l;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(l));
+    return l;
+}
+
+/*
+ * Act on requests other CPUs are waiting for (kernel/smp.c).  Called
+ * from every busy-wait that may run with interrupts disabled, so a CPU
+ * spinning on a lock still answers a TLB shootdown from its holder.
+ */
+void cpu_ipi_service(void);
+
+static inline void cpu_ipi_poll(void) {
+    uint32_t pending;
+    __asm__ volatile("movl %%gs:16, %0" : "=r"(pending));
+    if (pending)
+        cpu_ipi_service();
+}
+
+/* Initial local APIC id of the calling CPU (CPUID leaf 1, EBX[31:24]). */
+static inline uint32_t cpu_apic_id(void) {
+    uint32_t a, b, c, d;
+    __asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1u));
+    (void)a; (void)c; (void)d;
+    return b >> 24;
+}
+
+/* Disable interrupts and return the previous RFLAGS. */
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq\n"
+                     "popq %0\n"
+                     "cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Re-enable interrupts only if they were enabled before cpu_irq_save. */
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF)
+        __asm__ volatile("sti" : : : "memory");
+}
+
+/* Time-stamp counter, for measuring short intervals in cycles. */
+static inline uint64_t cpu_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#endif /* KERNEL_CPU_H */
@@ -0,0 +1,41 @@
+/*
+    E-com_os Kernel - Spinlock
+    Copyright (C) 2025,2026  Saladin5101
+
+    Test-and-test-and-set lock.  Holders must not sleep and must keep
+    interrupts disabled if the lock is also taken from IRQ context.
+    Waiters keep answering other CPUs' requests (cpu_ipi_poll): the
+    holder may be waiting for this CPU to flush its TLB.
+*/
+
+#ifndef KERNEL_INTERNAL_SPINLOCK_H
+#define KERNEL_INTERNAL_SPINLOCK_H
+
+#include <stdint.h>
+#include <kernel/cpu.h>
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t *lock) {
+    while (__atomic_exchange_n(&lock->locked, 1u, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) {
+            __asm__ volatile("pause");
+            cpu_ipi_poll();
+        }
+    }
+}
+
+/* Take the lock only if it is free; 1 on success */
+static inline int spin_trylock(spinlock_t *lock) {
+    return !lock->locked && !__atomic_exchange_n(&lock->locked, 1u, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0u, __ATOMIC_RELEASE);
+}
+
+#endif
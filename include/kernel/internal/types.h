@@ -25,6 +25,7 @@ typedef uint32_t capability_t;
 #define MAX_THREADS        256
 #define MAX_PROCESSES      64
 #define MAX_CAPABILITIES   1024
+#define MAX_CPUS           8
 
 typedef unsigned char   u8;
 typedef unsigned short  u16;
@@ -41,6 +41,11 @@ typedef struct ipc_message {
     uint8_t  data[IPC_MAX_DATA_SIZE];
 } ipc_message_t;
 
+/* Message buffers come from a slab cache; ipc_init creates it */
+void           ipc_init(void);
+ipc_message_t *ipc_msg_alloc(void);
+void           ipc_msg_free(ipc_message_t *msg);
+
 /* Low-level kernel IPC */
 int ipc_send(thread_id target, ipc_message_t *msg);
 int ipc_receive(ipc_message_t *msg);
@@ -2,8 +2,14 @@
     E-comOS Kernel - Memory Manager Interface
     Copyright (C) 2025,2026  Saladin5101
 
-    Invariant: page_bitmap bit i == 1  ↔  physical page i is allocated.
-    Invariant: next_free_page ≤ MAX_PAGES at all times.
+    Physical memory is split into zones, one per contiguous run of usable
+    RAM in the UEFI map.  Each zone keeps its metadata (buddy nodes and
+    allocation bitmap) in its own first frames, sized at boot.
+
+    Invariant: for initialised frames, zone bitmap bit i == 1  ↔  frame i
+               of the zone is allocated or holds metadata.
+    Invariant: every free, initialised page belongs to exactly one buddy
+               free block of its zone.
 */
 
 #ifndef KERNEL_MM_H
@@ -14,13 +20,17 @@
 #include <kernel/boot.h>
 
 #define PAGE_SIZE       4096u
-#define MAX_PHYS_PAGES  4096u   /* manages 16 MB: [0x100000, 0x1100000) */
-#define MAX_PAGES       MAX_PHYS_PAGES
+#define PAGE_SIZE_2M    0x200000ull
+#define PAGE_SIZE_1G    0x40000000ull
 #define KERNEL_BASE     0x100000u
 
-/* Physical memory window managed */
+/* Lowest physical address handed to the page allocator */
 #define PHYS_BASE      0x100000ULL
-#define PHYS_SIZE      (MAX_PAGES * (uint64_t)PAGE_SIZE)  /* 16 MB */
+
+#define MM_MAX_ZONES       64u
+#define MM_MIN_ZONE_PAGES  16u        /* smaller runs of RAM are ignored */
+#define MM_SECTION_PAGES   32768u     /* 128 MB, unit of deferred init */
+#define MM_FALLBACK_PAGES  4096u      /* 16 MB assumed without a UEFI map */
 
 /* x86 page-table entry flags */
 #define PTE_PRESENT  (1u << 0)
@@ -32,6 +42,7 @@
 #define PTE_DIRTY    (1u << 6)
 #define PTE_PAT      (1u << 7)  /* Page Attribute Table */
 #define PTE_GLOBAL   (1u << 8)
+#define PTE_HUGE     (1u << 7)  /* PS: 2 MB page in a PD entry */
 
 /* Higher-level mapping flags (translated to PTE flags by mmMapPage) */
 #define MM_FLAG_READ    (1u << 0)
@@ -51,7 +62,9 @@
 /* Memory allocation flags */
 #define KMALLOC_NORMAL  0x00
 #define KMALLOC_ZEROED  0x01  /* Clear memory to zeros */
-#define KMALLOC_ALIGNED 0x02  /* Return aligned memory (16-byte) */
+#define KMALLOC_ALIGNED 0x02  /* Return cache-line aligned memory */
+
+#define KMALLOC_ALIGN   64u   /* alignment given by KMALLOC_ALIGNED */
 
 typedef enum {
     MEMORY_SUCCESS              =  0,
@@ -67,44 +80,343 @@ typedef enum {
  *
  * Precondition:  called exactly once, before any mm_alloc_page call.
  * Precondition:  interrupts are disabled.
- * Postcondition: page_bitmap reflects all usable physical pages;
- *                kernel image pages are marked allocated.
- * Postcondition: next_free_page points to the first free page index,
- *                or equals MAX_PAGES if no free pages exist.
+ * Postcondition: one zone exists per run of conventional memory above
+ *                PHYS_BASE, excluding the kernel image.
+ * Postcondition: the first section of every zone is free for allocation;
+ *                the rest is brought in by mm_deferred_init().
+ * Postcondition: all zone memory is covered by the kernel direct map.
  *
  * boot_params may be NULL; in that case a conservative fallback is used.
  */
 memory_status mm_init(boot_params *boot_params);
 
+/*
+ * mm_deferred_init — initialise one more section of zone metadata and
+ * release its pages.  Called from the idle loop, and by the allocator
+ * when the initialised part of memory runs dry.  Boot cost therefore
+ * does not grow with the amount of RAM.
+ * Returns the number of pages still waiting for initialisation.
+ */
+uint32_t mm_deferred_init(void);
+
 /*
  * mm_alloc_page — allocate one physical page (4 KB).
- * Returns physical address, or NULL if OOM.
- * NOT interrupt-safe; caller must disable interrupts if needed.
+ * Served from the calling CPU's page magazine; only an empty magazine
+ * touches the global buddy allocator (one batched refill).
+ * Returns physical address, or NULL if OOM.  Interrupt-safe.
  */
 void *mm_alloc_page(void);
 
-/* mm_free_page — release a page previously returned by mm_alloc_page. */
+/*
+ * mm_alloc_page_flags — mm_alloc_page with MM_ALLOC_* flags.
+ * MM_ALLOC_ZEROED returns a cleared page, taken from the pre-zeroed
+ * pool when it has one (a hit) and cleared on the spot otherwise.
+ * MM_ALLOC_RESERVE may take the last free pages, which every other
+ * allocation leaves alone (see mm_reserve_stats).  Only for kernel
+ * paths that must not fail: page tables, thread stacks and the slabs
+ * of SLAB_RESERVE caches.
+ */
+#define MM_ALLOC_ZEROED  (1u << 0)
+#define MM_ALLOC_RESERVE (1u << 1)
+
+void *mm_alloc_page_flags(uint32_t flags);
+
+/*
+ * mm_free_page — release a page previously returned by mm_alloc_page.
+ * The page goes back to this CPU's magazine; a full magazine drains a
+ * batch of its coldest pages to the buddy allocator.  A page of another
+ * NUMA node goes straight back to the buddy allocator.
+ */
 void mm_free_page(void *page);
 
+/*
+ * Page magazine control.
+ * A magazine is only ever changed by its own CPU: changes asked for
+ * from elsewhere are done by each CPU at its next allocation, free or
+ * mm_magazine_poll.
+ * mm_magazine_tune:    set batch size and watermarks on every CPU
+ *                      (0 < batch ≤ high, low ≤ high ≤ 64); -1 if invalid.
+ * mm_magazine_balance: refill below low / drain above high on this CPU;
+ *                      called from the idle loop to keep the fast path warm.
+ * mm_magazine_poll:    carry out a drain asked of this CPU; idle loops.
+ * mm_magazine_flush:   return every cached page to the buddy allocator,
+ *                      this CPU's at once and the others' as they poll.
+ */
+int  mm_magazine_tune(uint32_t batch, uint32_t low, uint32_t high);
+void mm_magazine_balance(void);
+void mm_magazine_poll(void);
+void mm_magazine_flush(void);
+
+/*
+ * Pre-zeroed page pool.
+ * mm_zero_pool_fill:  clear a few more free pages with non-temporal
+ *                     stores; called from the idle loop.  Returns the
+ *                     number of pages added.
+ * mm_zero_pool_drain: give every pooled page back, under memory pressure.
+ * Pooled pages count as free in mm_get_free_pages().
+ */
+uint32_t mm_zero_pool_fill(void);
+void     mm_zero_pool_drain(void);
+void     mm_zero_pool_stats(uint32_t *pages, uint64_t *hits, uint64_t *misses);
+
 /*
  * mm_alloc_pages — allocate multiple contiguous physical pages.
+ * Served by the buddy allocator in O(log n); count may be any value up
+ * to 2^BUDDY_MAX_ORDER, the rounding slack is returned immediately.
  * Returns physical address, or NULL if OOM.
  */
 void *mm_alloc_pages(uint32_t count);
+/* mm_alloc_pages with MM_ALLOC_ZEROED and MM_ALLOC_RESERVE */
+void *mm_alloc_pages_flags(uint32_t count, uint32_t flags);
 
-/* mm_free_pages — release contiguous pages. */
+/*
+ * mm_free_pages — release contiguous pages.
+ * Any sub-range of an earlier allocation may be freed; freed blocks are
+ * coalesced with their buddies.
+ */
 void mm_free_pages(void *pages, uint32_t count);
 
 /*
  * mm_map_page — insert a vaddr→paddr mapping into the current page tables.
  * flags: combination of MM_FLAG_* constants.
+ * vaddr may be any canonical 48-bit address; missing intermediate tables
+ * are allocated on demand.  A mapping that lands inside a 2 MB or 1 GB
+ * page splits that page into next-level entries with the same
+ * attributes first.
+ * mm_unmap_page — remove a 4 KB mapping; page tables left empty by it
+ * are freed.
+ */
+int mm_map_page(uint64_t vaddr, uint64_t paddr, uint32_t flags);
+int mm_unmap_page(uint64_t vaddr);
+
+/*
+ * mm_map_page_size — map one page of size PAGE_SIZE, PAGE_SIZE_2M or
+ * PAGE_SIZE_1G (the latter only on CPUs with 1 GB page support).
+ * vaddr and paddr must be aligned to size.  Returns -1 on bad size or
+ * alignment, on allocation failure, or if smaller mappings already
+ * exist in the range.
+ * mm_unmap_page_size — remove a mapping of exactly that size.
+ */
+int mm_map_page_size(uint64_t vaddr, uint64_t paddr, uint64_t size, uint32_t flags);
+int mm_unmap_page_size(uint64_t vaddr, uint64_t size);
+
+/*
+ * Page-table root of one address space.  PML4 slot 0 (the identity
+ * direct map) and the upper half are kernel slots shared by every root;
+ * user mappings live in [MM_USER_BASE, MM_USER_END).
+ */
+#define MM_USER_BASE  0x0000008000000000ull   /* PML4 slot 1 */
+#define MM_USER_END   0x0000800000000000ull
+
+typedef struct {
+    uint64_t *pml4;
+    uint32_t  kernel_gen;   /* kernel slots were copied at this generation */
+    uint32_t  owner;        /* address space id recorded in anonymous pages */
+    volatile uint32_t tlb_stale;  /* CPUs whose cached entries of r are stale */
+} mm_pt_root;
+
+/*
+ * mm_pt_create — allocate a PML4 sharing the kernel slots.
+ * mm_pt_destroy — free the root and every user page table under it.
+ * Precondition: r is not loaded on any CPU.  Mapped frames are not freed.
+ */
+int  mm_pt_create(mm_pt_root *r);
+void mm_pt_destroy(mm_pt_root *r);
+
+/*
+ * mm_pt_usage — what the user range of r costs: pages mapped (a 2 MB
+ * page counts 512), those of them shared copy-on-write with another
+ * root, and page-table pages including the PML4.  Walks every table.
+ */
+typedef struct {
+    uint64_t resident;
+    uint64_t shared;
+    uint64_t tables;
+} mm_pt_usage_t;
+
+void mm_pt_usage(mm_pt_root *r, mm_pt_usage_t *u);
+
+/*
+ * mm_pt_map / mm_pt_unmap — 4 KB mapping in the user range of r.
+ * Stale TLB entries are dropped on the CPUs running r before these
+ * return; CPUs that ran r before drop them when they next load it.
+ * mm_pt_map returns 1 if it replaced a present mapping, 0 if not,
+ * -1 on error.  mm_pt_map_new leaves a present mapping as it is and
+ * returns 1 for it, so of two racing faults only one frame is mapped.
+ * mm_pt_present returns 1 if vaddr is mapped in r; it waits for a page
+ * being migrated, which is unmapped only under the page-table lock.
+ * mm_pt_range_empty returns 1 if nothing in [vaddr, vaddr + size) is.
+ */
+int  mm_pt_map(mm_pt_root *r, uint64_t vaddr, uint64_t paddr, uint32_t flags);
+int  mm_pt_map_new(mm_pt_root *r, uint64_t vaddr, uint64_t paddr, uint32_t flags);
+int  mm_pt_unmap(mm_pt_root *r, uint64_t vaddr);
+int  mm_pt_present(mm_pt_root *r, uint64_t vaddr);
+int  mm_pt_range_empty(mm_pt_root *r, uint64_t vaddr, uint64_t size);
+
+/*
+ * mm_pt_copy_in — copy size bytes at vaddr in r into dst, for reading
+ * syscall arguments.  Returns -1, having copied part of it, unless the
+ * whole range is mapped user-accessible; nothing is faulted in.
+ * mm_pt_copy_out — the same the other way, for results; the range must
+ * also be mapped writable, so copy-on-write pages are refused.
+ */
+int  mm_pt_copy_in(mm_pt_root *r, void *dst, uint64_t vaddr, uint64_t size);
+int  mm_pt_copy_out(mm_pt_root *r, uint64_t vaddr, const void *src, uint64_t size);
+
+/*
+ * Range operations on [vaddr, vaddr + size) of root r; r NULL means the
+ * kernel root for kernel addresses and the loaded root otherwise.  The
+ * range must lie wholly in the user range or wholly in kernel slots.
+ * TLB invalidations are batched into one pass at the end, or a single
+ * full flush past MM_FLUSH_BATCH pages; as with mm_pt_map they are only
+ * done if r is live on this CPU.
+ * mm_map_range uses 2 MB pages where vaddr and paddr allow it.  On
+ * failure the range may be left partly mapped.
+ * mm_unmap_range frees page tables it empties; large pages that are
+ * only partly covered are split, by protect as well.
+ * All return -1 on error, otherwise 0 if no present mapping changed.
+ * mm_map_range returns 1 if it replaced one; unmap and protect return
+ * how many 4 KB pages they removed or reprotected.
+ */
+#define MM_FLUSH_BATCH 32u
+
+int  mm_map_range(mm_pt_root *r, uint64_t vaddr, uint64_t paddr, uint64_t size,
+                  uint32_t flags);
+int  mm_unmap_range(mm_pt_root *r, uint64_t vaddr, uint64_t size);
+/*
+ * As mm_unmap_range, and also frees the frames that were mapped there;
+ * a shared frame just loses one owner.
+ */
+int  mm_unmap_range_free(mm_pt_root *r, uint64_t vaddr, uint64_t size);
+int  mm_protect_range(mm_pt_root *r, uint64_t vaddr, uint64_t size, uint32_t flags);
+
+/*
+ * Copy-on-write sharing.  A frame mapped by several owners carries a
+ * count of the extra ones and is only freed when the last lets go.
+ * mm_page_ref — add an owner to a managed frame; -1 if not managed.
+ * mm_page_unref — drop an owner, freeing the frame if it was the last.
+ * mm_page_shared — 1 if the frame currently has more than one owner.
+ */
+int  mm_page_ref(void *page);
+void mm_page_unref(void *page);
+int  mm_page_shared(void *page);
+
+/*
+ * mm_pt_share_cow — map every page present in [vaddr, vaddr + size) of
+ * src at the same address in dst, sharing the frames.  Writable pages
+ * become read-only copy-on-write in both roots.  Large pages in src are
+ * split first, since frames are counted 4 KB at a time.  The range in
+ * dst must be unmapped.  Returns -1 on error (dst may be partly
+ * populated), 1 if src mappings were write-protected, 0 otherwise.
+ * mm_pt_cow_fault — resolve a write to a copy-on-write page of r: copy
+ * the frame if it is still shared, otherwise make it writable in place.
+ * Returns -1 if vaddr is not a copy-on-write page or memory ran out.
+ */
+int  mm_pt_share_cow(mm_pt_root *dst, mm_pt_root *src, uint64_t vaddr, uint64_t size);
+int  mm_pt_cow_fault(mm_pt_root *r, uint64_t vaddr);
+
+/*
+ * Compaction — rebuild free blocks of 2^order pages by moving in-use
+ * anonymous and kernel heap pages out of one aligned block.
+ * mm_compact: budget is in TSC cycles, 0 for none; stops after the
+ *             first block freed.  Returns the pages moved.  Runs by
+ *             itself when mm_alloc_pages finds no contiguous run, with
+ *             exponential back-off for orders it keeps failing on.
+ * mm_compact_idle: a budgeted pass at 2 MB when free memory is badly
+ *             fragmented; called from the idle loop.
+ * mm_compact_set_owner_lookup: how to find the root of the address
+ *             space an anonymous page belongs to (NULL if gone).  Called
+ *             with page-table state locked; must not map or unmap.
+ * mm_compact_stats: runs so far, pages moved and TSC cycles spent.
+ */
+uint32_t mm_compact(uint32_t order, uint64_t budget);
+void     mm_compact_idle(void);
+void     mm_compact_set_owner_lookup(mm_pt_root *(*root_of)(uint32_t owner));
+void     mm_compact_stats(uint64_t *runs, uint64_t *moved, uint64_t *cycles);
+
+/*
+ * Memory pressure, from the free-page count against watermarks set at
+ * mm_init.  A level is entered when free memory falls below its mark
+ * and left only once it is back above the mark by a margin, so levels
+ * do not flap.  CRITICAL starts well before ordinary allocations are
+ * refused at the reserve.
+ * mm_pressure_level: re-evaluate and return the current level; O(1).
+ * mm_pressure_shrink: pages that would have to be freed to get back
+ *             below LOW.
+ * mm_pressure_set_notify: fn is called, from allocation and free
+ *             paths, while the level has yet to be re-evaluated after
+ *             free memory crossed a mark; it must not allocate.
+ * mm_reserve_stats: reserve size in pages, allocations served from it
+ *             and ordinary allocations refused to protect it.
+ */
+#define MM_PRESSURE_NONE      0u
+#define MM_PRESSURE_LOW       1u
+#define MM_PRESSURE_MEDIUM    2u
+#define MM_PRESSURE_CRITICAL  3u
+
+uint32_t mm_pressure_level(void);
+uint32_t mm_pressure_shrink(void);
+void     mm_pressure_set_notify(void (*fn)(void));
+void     mm_reserve_stats(uint32_t *pages, uint64_t *dips, uint64_t *refused);
+
+/*
+ * NUMA placement (topology in kernel/mm/numa.h).  No zone spans two
+ * nodes.  Frames are taken from the nodes in the calling CPU's node's
+ * fallback order, nearest first by SLIT distance unless set otherwise;
+ * this covers mm_alloc_page, mm_alloc_pages and, through the pages it
+ * grows by, kmalloc.
+ * mm_numa_set_cpu: cpu has local APIC id apic_id.  mm_init does this
+ *             for the boot CPU; the others are recorded as they start.
+ * mm_numa_cpu_node: the node cpu was recorded on, 0 by default.
+ * mm_numa_set_fallback: the n nodes, in order, node's CPUs take frames
+ *             from.  Nodes left out are never used by them.  -1 if an
+ *             entry is out of range or repeated.
+ * mm_numa_stats: free pages in node's buddy allocators, and buddy
+ *             allocations for its CPUs served on and off the node.
+ */
+void     mm_numa_set_cpu(uint32_t cpu, uint32_t apic_id);
+uint32_t mm_numa_cpu_node(uint32_t cpu);
+int      mm_numa_set_fallback(uint32_t node, const uint8_t *order, uint32_t n);
+void     mm_numa_stats(uint32_t node, uint32_t *free_pages, uint64_t *local, uint64_t *remote);
+
+/*
+ * Page-fault error code bits (pushed by the CPU for vector 14).
+ */
+#define MM_PF_PRESENT  (1u << 0)   /* 0: not present, 1: protection */
+#define MM_PF_WRITE    (1u << 1)
+#define MM_PF_USER     (1u << 2)
+#define MM_PF_RSVD     (1u << 3)
+#define MM_PF_INSTR    (1u << 4)
+
+/* The kernel's own root, loaded at boot */
+mm_pt_root *mm_pt_kernel(void);
+
+/*
+ * mm_pt_load — switch this CPU to root r (NULL = kernel).
+ * With PCIDs enabled, pcid (0 … 4095) tags r's TLB entries and noflush
+ * keeps the entries already cached under that tag, unless r's mappings
+ * changed since this CPU last ran it; without PCIDs both are ignored
+ * and the load flushes all non-global entries.
+ */
+void mm_pt_load(mm_pt_root *r, uint32_t pcid, int noflush);
+int  mm_pcid_enabled(void);
+
+/* mm_tlb_flush_all — drop every TLB entry on this CPU, for every PCID */
+void mm_tlb_flush_all(void);
+
+/*
+ * mm_tlb_set_shootdown — fn(cpus, global) must make every CPU in the
+ * bitmask cpus drop its non-global TLB entries for the loaded PCID (all
+ * entries if global) and return only once they have.  mm calls it with
+ * IRQs off, often holding pt_lock, whenever a translation other CPUs
+ * may cache changes; without it only this CPU is flushed.
  */
-int mm_map_page(uint32_t vaddr, uint32_t paddr, uint32_t flags);
-int mm_unmap_page(uint32_t vaddr);
+void mm_tlb_set_shootdown(void (*fn)(uint32_t cpus, int global));
 
 /*
- * mm_enable_paging — load CR3 and set CR0.PG.
+ * mm_enable_paging — load CR3 and set CR0.PG, then map the kernel heap.
  * Precondition: page tables built by build_page_tables() (called from mm_init).
+ * Postcondition: kmalloc may be called.
  * Panics if page tables are not ready.
  */
 void mm_enable_paging(void);
@@ -126,7 +438,10 @@ static inline uintptr_t mm_virt_to_phys(void *virt) {
 }
 
 /*
- * Kernel heap allocator (built on top of page allocator)
+ * Kernel heap allocator (built on top of page allocator).
+ * Free blocks are kept in segregated size-class bins; kmalloc is a
+ * bitmap lookup plus at most one split and kfree coalesces with both
+ * neighbours in O(1).  Plain allocations are 16-byte aligned.
  */
 void *kmalloc(size_t size, uint32_t flags);
 void kfree(void *ptr);
@@ -137,13 +452,15 @@ void *krealloc(void *ptr, size_t size);
 uint32_t mm_get_free_pages(void);
 uint32_t mm_get_total_pages(void);
 uint32_t mm_get_used_pages(void);
+uint32_t mm_get_free_blocks(uint32_t order);  /* buddy blocks of 2^order pages */
 
 /* Debug functions */
-void mm_dump_bitmap(uint32_t start, uint32_t count);
+void mm_dump_bitmap(uint32_t start, uint32_t count);  /* start: frame number */
 void mm_dump_stats(void);
+void mm_dump_buddy(void);  /* free blocks and fragmentation per order */
+void mm_dump_magazines(void);
+void mm_dump_zones(void);
 
-extern uint8_t  page_bitmap[MAX_PAGES / 8];
-extern uint32_t next_free_page;
 extern int page_tables_ready;
 
 #endif /* KERNEL_MM_H */
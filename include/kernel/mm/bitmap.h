@@ -0,0 +1,60 @@
+/*
+    E-comOS Kernel - Two-Level Page Bitmap
+    Copyright (C) 2025,2026  Saladin5101
+
+    Leaf words hold one bit per frame (1 = allocated).  One summary bit
+    per leaf word records whether that word still has a clear bit, so a
+    search for a free frame skips 4096 allocated frames per summary word
+    with a single tzcnt.  Single-bit updates are atomic and may run
+    concurrently with each other and with the range operations.
+
+    Invariant: nr_set == number of set bits in initialised ranges.
+    Invariant: summary bit w == 0  →  words[w] == ~0 (no false negatives;
+               a set summary bit is only a hint).
+*/
+
+#ifndef KERNEL_MM_BITMAP_H
+#define KERNEL_MM_BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint64_t *words;
+    uint64_t *summary;
+    uint32_t  nbits;
+    uint32_t  nr_set;
+} mm_bitmap;
+
+/* Bytes of storage (8-byte aligned) needed for nbits bits */
+size_t   mm_bitmap_bytes(uint32_t nbits);
+
+/*
+ * mm_bitmap_attach — point b at storage without touching it.
+ * Every range must pass through mm_bitmap_init_range() before use,
+ * which lets large bitmaps be initialised lazily.
+ */
+void     mm_bitmap_attach(mm_bitmap *b, void *storage, uint32_t nbits);
+void     mm_bitmap_init_range(mm_bitmap *b, uint32_t from, uint32_t to, int value);
+
+/* Single-bit operations; set/clear return the previous value */
+int      mm_bitmap_set(mm_bitmap *b, uint32_t i);
+int      mm_bitmap_clear(mm_bitmap *b, uint32_t i);
+
+static inline int mm_bitmap_test(const mm_bitmap *b, uint32_t i) {
+    return (int)((b->words[i >> 6] >> (i & 63u)) & 1u);
+}
+
+/* Range operations on [from, to), a word at a time; return bits changed */
+uint32_t mm_bitmap_set_range(mm_bitmap *b, uint32_t from, uint32_t to);
+uint32_t mm_bitmap_clear_range(mm_bitmap *b, uint32_t from, uint32_t to);
+
+/* First clear bit in [from, to), or to if there is none */
+uint32_t mm_bitmap_find_next_zero(const mm_bitmap *b, uint32_t from, uint32_t to);
+
+/* Number of set bits, maintained incrementally: O(1) */
+static inline uint32_t mm_bitmap_count_set(const mm_bitmap *b) {
+    return __atomic_load_n(&b->nr_set, __ATOMIC_RELAXED);
+}
+
+#endif /* KERNEL_MM_BITMAP_H */
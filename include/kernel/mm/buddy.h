@@ -0,0 +1,103 @@
+/*
+    E-comOS Kernel - Binary Buddy Page Allocator
+    Copyright (C) 2025,2026  Saladin5101
+
+    A zone manages the frames [base_pfn, base_pfn + nr_pages).  Blocks of
+    order k are 2^k frames long and start on a frame number that is a
+    multiple of 2^k, so a block's buddy is found by flipping bit k.
+
+    Invariant: a frame is on free list k  ↔  nodes[i].free == 1 and
+               nodes[i].order == k  (only block heads carry the free flag).
+    Invariant: free_pages == Σ nr_free[k] · 2^k.
+*/
+
+#ifndef KERNEL_MM_BUDDY_H
+#define KERNEL_MM_BUDDY_H
+
+#include <stdint.h>
+
+#define BUDDY_MAX_ORDER  10u                  /* 2^10 pages = 4 MB */
+#define BUDDY_NR_ORDERS  (BUDDY_MAX_ORDER + 1u)
+#define BUDDY_NONE       0xFFFFFFFFu          /* "no frame" list sentinel */
+
+/*
+ * Per-frame bookkeeping, indexed by zone-relative frame number.  Nodes
+ * may be embedded at the start of larger per-frame records; stride is
+ * the distance between consecutive nodes.
+ */
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t  order;
+    uint8_t  free;
+} buddy_node;
+
+typedef struct {
+    uint64_t    base_pfn;
+    uint32_t    nr_pages;
+    uint32_t    free_pages;
+    uint32_t    order_mask;                   /* bit k set ↔ list k non-empty */
+    uint32_t    free_head[BUDDY_NR_ORDERS];
+    uint32_t    nr_free[BUDDY_NR_ORDERS];
+    uint32_t    stride;                       /* bytes from one node to the next */
+    buddy_node *nodes;
+} buddy_zone;
+
+/*
+ * buddy_zone_init — attach node storage and empty the free lists.
+ * Precondition: nodes has room for nr_pages entries of stride bytes,
+ * stride >= sizeof(buddy_node).
+ * Node contents are left untouched; see buddy_init_nodes().
+ */
+void     buddy_zone_init(buddy_zone *z, uint64_t base_pfn, uint32_t nr_pages,
+                         buddy_node *nodes, uint32_t stride);
+
+/*
+ * buddy_init_nodes — mark frames [idx, idx + count) allocated.
+ * Must run on a range before any of it is freed.  Ranges bounded by
+ * multiples of 2^BUDDY_MAX_ORDER frames (or the zone edges) may be
+ * initialised lazily: no block inside such a range has its buddy outside.
+ */
+void     buddy_init_nodes(buddy_zone *z, uint32_t idx, uint32_t count);
+
+/*
+ * buddy_alloc — take one naturally aligned block of 2^order frames.
+ * Returns the zone-relative index of the first frame, or BUDDY_NONE.
+ * O(BUDDY_MAX_ORDER): at most one split per order.
+ */
+uint32_t buddy_alloc(buddy_zone *z, uint32_t order);
+
+/*
+ * buddy_alloc_range — take count contiguous frames.
+ * The block is rounded up to a power of two and the unused tail is
+ * returned to the free lists immediately, so nothing is wasted.
+ */
+uint32_t buddy_alloc_range(buddy_zone *z, uint32_t count);
+
+/* buddy_free — return a block taken with buddy_alloc(), coalescing upward. */
+void     buddy_free(buddy_zone *z, uint32_t idx, uint32_t order);
+
+/*
+ * buddy_free_range — return an arbitrary run of frames.
+ * The run is split into maximal aligned blocks, each freed with coalescing.
+ */
+void     buddy_free_range(buddy_zone *z, uint32_t idx, uint32_t count);
+
+/*
+ * buddy_take — remove the single free frame idx from whatever free
+ * block holds it; the rest of the block stays free.  Returns -1 if idx
+ * is not on a free list.
+ */
+int      buddy_take(buddy_zone *z, uint32_t idx);
+
+/* Order needed to hold count frames (count > 0). */
+uint32_t buddy_order_for(uint32_t count);
+
+/*
+ * buddy_frag_index — share of free pages (in percent) that cannot serve
+ * an allocation of the given order because they sit in smaller blocks.
+ * 0 = no fragmentation for that order, 100 = none of it is usable.
+ */
+uint32_t buddy_frag_index(const buddy_zone *z, uint32_t order);
+
+#endif /* KERNEL_MM_BUDDY_H */
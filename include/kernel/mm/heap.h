@@ -0,0 +1,29 @@
+/*
+    E-comOS Kernel - Kernel Heap
+    Copyright (C) 2025,2026  Saladin5101
+
+    Internal interface between the memory manager and the kmalloc heap
+    (src/mm/heap.c).  Callers allocate through kmalloc/kfree in mm.h.
+
+    Invariant: no two physically adjacent heap blocks are both free.
+*/
+
+#ifndef KERNEL_MM_HEAP_H
+#define KERNEL_MM_HEAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Start of the kernel heap window.  It lies in the upper half, clear of
+ * the identity direct map, so heap mappings never shadow RAM.
+ */
+#define HEAP_START_VIRT 0xFFFFFF0000000000ull
+
+/* heap_init — map the initial heap.  Precondition: the kernel page tables are loaded. */
+void      heap_init(void);
+
+uintptr_t heap_get_end(void);        /* first byte past the mapped heap */
+size_t    heap_get_free_bytes(void); /* payload bytes in free blocks */
+
+#endif /* KERNEL_MM_HEAP_H */
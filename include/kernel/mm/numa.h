@@ -0,0 +1,47 @@
+/*
+    E-comOS Kernel - NUMA Topology
+    Copyright (C) 2025,2026  Saladin5101
+
+    Node layout from the ACPI SRAT (which memory ranges and which CPUs
+    belong to which proximity domain) and SLIT (relative distances).
+    Proximity domains are renumbered densely from 0 in the order the
+    SRAT lists them.  Without an SRAT everything is node 0.
+
+    Invariant: memory ranges are sorted by base and do not overlap.
+    Invariant: numa_distance(n, n) is the smallest distance from n.
+*/
+
+#ifndef KERNEL_MM_NUMA_H
+#define KERNEL_MM_NUMA_H
+
+#include <stdint.h>
+
+#define NUMA_MAX_NODES    8u    /* further domains fold into node 0 */
+#define NUMA_MAX_RANGES   32u
+#define NUMA_MAX_CPUS     256u
+#define NUMA_LOCAL        10u   /* SLIT distance of a node to itself */
+#define NUMA_REMOTE       20u   /* assumed when there is no SLIT */
+
+/*
+ * numa_init — parse the SRAT and SLIT while firmware memory is still
+ * identity mapped.  Precondition: acpi_init has run.  Returns the node
+ * count, at least 1.
+ */
+uint32_t numa_init(void);
+uint32_t numa_nodes(void);
+
+/* Node of physical address phys; 0 if no range covers it */
+uint32_t numa_node_of_phys(uint64_t phys);
+
+/*
+ * First address above phys at which the node may change: the end of
+ * the range holding phys, or the start of the next one.  ~0 if none.
+ */
+uint64_t numa_range_end(uint64_t phys);
+
+/* Node of the CPU with this local APIC (or x2APIC) id; 0 if unknown */
+uint32_t numa_node_of_apic(uint32_t apic_id);
+
+uint32_t numa_distance(uint32_t from, uint32_t to);
+
+#endif /* KERNEL_MM_NUMA_H */
@@ -0,0 +1,67 @@
+/*
+    E-comOS Kernel - Per-Frame Descriptors
+    Copyright (C) 2025,2026  Saladin5101
+
+    Every managed frame has one 32-byte descriptor, two per cache line,
+    in an array at the head of its zone indexed by zone-relative frame
+    number.  The buddy allocator threads its free lists through the
+    first bytes of the descriptors; the rest describes the frame while
+    it is in use.
+
+    Invariant: a free frame has refs == 0, mapcount == 0 and flags == 0.
+    Invariant: mapcount counts the 4 KB page-table entries mapping the
+               frame; large-page mappings are not counted.
+    Invariant: owner and index are meaningful only for MM_PAGE_ANON
+               frames with mapcount == 1: the address space and the
+               virtual address of that single mapping.  MM_PAGE_HEAP
+               frames keep their kernel heap or vmalloc address in index.
+*/
+
+#ifndef KERNEL_MM_PAGE_H
+#define KERNEL_MM_PAGE_H
+
+#include <stdint.h>
+#include <kernel/mm/buddy.h>
+
+#define MM_PAGE_ANON    (1u << 0)   /* user memory faulted into a region */
+#define MM_PAGE_TABLE   (1u << 1)   /* paging structure */
+#define MM_PAGE_PINNED  (1u << 2)   /* must stay at this physical address */
+#define MM_PAGE_HEAP    (1u << 3)   /* kernel heap or vmalloc, reached only through index */
+
+typedef struct mm_page {
+    buddy_node buddy;      /* free-list linkage while free */
+    uint16_t   mapcount;   /* 4 KB page-table entries mapping the frame */
+    uint8_t    flags;      /* MM_PAGE_* */
+    uint8_t    zone;       /* index of the owning zone */
+    uint32_t   refs;       /* extra owners of a shared frame */
+    uint32_t   owner;      /* address space of an anonymous page */
+    uint64_t   index;      /* its virtual address there */
+} mm_page;
+
+_Static_assert(sizeof(mm_page) == 32, "two descriptors per cache line");
+
+/*
+ * mm_page_of — descriptor of the managed frame at phys, or NULL.
+ * mm_page_phys — physical address of the frame pg describes.
+ * Lookup is a binary search over the zones.
+ */
+mm_page  *mm_page_of(uint64_t phys);
+uint64_t  mm_page_phys(const mm_page *pg);
+
+/*
+ * mm_page_pin / mm_page_unpin — keep a frame at its physical address,
+ * e.g. while a device or an IPC grant refers to it.  The pin is a flag
+ * and does not nest.
+ */
+int       mm_page_pin(void *page);
+void      mm_page_unpin(void *page);
+
+/*
+ * Record the single mapping through which a frame is used, which makes
+ * it movable by compaction: an anonymous user page of space owner, or
+ * a kernel heap or vmalloc page.
+ */
+void      mm_page_set_anon(void *page, uint32_t owner, uint64_t vaddr);
+void      mm_page_set_heap(void *page, uint64_t vaddr);
+
+#endif /* KERNEL_MM_PAGE_H */
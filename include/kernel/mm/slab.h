@@ -0,0 +1,75 @@
+/*
+    E-comOS Kernel - Slab Object Caches
+    Copyright (C) 2025,2026  Saladin5101
+
+    A cache hands out fixed-size objects carved from slabs of 2^order
+    physical pages.  Slabs are naturally aligned buddy blocks, so the slab
+    owning an object is found by masking its address.  Each CPU keeps a
+    small stash of free objects in front of the slab lists; allocation and
+    free are a pointer pop/push unless the stash runs dry or overflows.
+
+    Invariant: objects handed out by a cache with a constructor are always
+               in constructed state; the constructor runs once per object
+               when its slab is created, not on every allocation.
+*/
+
+#ifndef KERNEL_MM_SLAB_H
+#define KERNEL_MM_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SLAB_MAX_CACHES   32u
+#define SLAB_MAX_ORDER     4u   /* largest slab: 16 pages */
+#define SLAB_STASH_SIZE   16u   /* per-CPU free objects */
+#define SLAB_STASH_BATCH   8u   /* objects moved per stash refill / flush */
+
+/* kmem_cache_create_flags */
+#define SLAB_RESERVE      (1u << 0)   /* slabs may come from the kernel reserve */
+
+typedef struct kmem_cache kmem_cache;
+
+typedef struct {
+    const char *name;
+    uint32_t    obj_size;     /* bytes per object, including padding */
+    uint32_t    objs_per_slab;
+    uint32_t    slab_pages;
+    uint32_t    slabs;        /* slabs currently owned */
+    uint32_t    objs_total;   /* objects in all slabs */
+    uint32_t    objs_active;  /* objects held by callers */
+    uint32_t    objs_stashed; /* free objects sitting in CPU stashes */
+    uint64_t    allocs;
+    uint64_t    frees;
+    uint64_t    stash_hits;
+} kmem_cache_info;
+
+/*
+ * kmem_cache_create — create a cache of size-byte objects.
+ * align: 0 for pointer alignment, otherwise a power of two ≤ PAGE_SIZE.
+ * ctor:  optional, run once on every object when its slab is populated.
+ * Returns NULL if the object is too large or the descriptor pool is full.
+ * kmem_cache_create_flags — the same with SLAB_* flags.  SLAB_RESERVE is
+ * for kernel metadata whose loss fails whole operations (threads, kernel
+ * mappings), never for objects user space can make the kernel allocate
+ * in bulk.
+ */
+kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                              void (*ctor)(void *obj));
+kmem_cache *kmem_cache_create_flags(const char *name, size_t size, size_t align,
+                                    void (*ctor)(void *obj), uint32_t flags);
+
+/* kmem_cache_alloc — take one object; NULL if out of memory. */
+void *kmem_cache_alloc(kmem_cache *cache);
+
+/* kmem_cache_free — return an object obtained from the same cache. */
+void  kmem_cache_free(kmem_cache *cache, void *obj);
+
+/* kmem_cache_shrink — flush CPU stashes and release empty slabs. */
+void  kmem_cache_shrink(kmem_cache *cache);
+
+void  kmem_cache_get_info(const kmem_cache *cache, kmem_cache_info *info);
+
+/* Print occupancy of every cache */
+void  kmem_cache_dump_all(void);
+
+#endif /* KERNEL_MM_SLAB_H */
@@ -0,0 +1,41 @@
+/*
+    E-comOS Kernel - Kernel Virtual Allocator
+    Copyright (C) 2025,2026  Saladin5101
+
+    Large kernel allocations backed by single frames from anywhere in
+    RAM, mapped contiguously into a window of their own below the heap.
+    Nothing needs physically contiguous memory, so big tables never
+    depend on how fragmented the zones are.
+
+    Invariant: free ranges of the window never touch each other; a
+               range freed next to a free neighbour is merged with it.
+    Invariant: every allocation is followed by one unmapped guard page.
+*/
+
+#ifndef KERNEL_MM_VMALLOC_H
+#define KERNEL_MM_VMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/mm/heap.h>
+
+#define VMALLOC_START 0xFFFFFE0000000000ull
+#define VMALLOC_END   HEAP_START_VIRT          /* 1 TB window */
+
+/* Precondition: slab caches usable.  Postcondition: vmalloc can succeed. */
+void   vmalloc_init(void);
+
+/*
+ * vmalloc — page-aligned virtual memory of at least size bytes.
+ * flags: MM_ALLOC_ZEROED for cleared memory.  Returns NULL if the
+ * window or RAM is exhausted.  Not for use from IRQ context.
+ */
+void  *vmalloc(size_t size, uint32_t flags);
+
+/* vfree — unmap and free an allocation; NULL is ignored */
+void   vfree(void *addr);
+
+/* Bytes allocated, free bytes in the window and number of free ranges */
+void   vmalloc_stats(uint64_t *used, uint64_t *free, uint32_t *ranges);
+
+#endif /* KERNEL_MM_VMALLOC_H */
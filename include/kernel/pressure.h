@@ -0,0 +1,45 @@
+/*
+    E-comOS Kernel - Memory Pressure Notifications
+    Copyright (C) 2025,2026  Saladin5101
+
+    Services holding memory they could give back (caches, the display
+    service's buffers) subscribe with the lowest MM_PRESSURE_* level
+    they care about.  When the level changes they get an IPC message
+    of type IPC_MSG_MEM_PRESSURE, and again every PRESSURE_RENOTIFY_MS
+    while it stays at or above MEDIUM, until memory is back.
+
+    Invariant: a subscriber told of a level at or above its threshold is
+               also told when the level falls below it again.
+*/
+
+#ifndef KERNEL_PRESSURE_H
+#define KERNEL_PRESSURE_H
+
+#include <stdint.h>
+
+#define IPC_MSG_MEM_PRESSURE   0x4D50u   /* 'MP' */
+#define PRESSURE_MAX_SUBS      32u
+#define PRESSURE_RENOTIFY_MS   250u
+
+/* Payload of an IPC_MSG_MEM_PRESSURE message */
+typedef struct {
+    uint32_t level;         /* MM_PRESSURE_* */
+    uint32_t free_pages;
+    uint32_t total_pages;
+    uint32_t shrink_pages;  /* what all subscribers together should return */
+} pressure_notice;
+
+/* Precondition: slab caches usable. */
+void pressure_init(void);
+
+/*
+ * pressure_subscribe — notify pid from min_level (MM_PRESSURE_LOW …
+ * CRITICAL) upwards; a second call changes the threshold and
+ * MM_PRESSURE_NONE unsubscribes.  Returns -1 if the table is full.
+ */
+int  pressure_subscribe(uint32_t pid, uint32_t min_level);
+
+/* Re-evaluate the level and send due notices; called from the idle loop */
+void pressure_poll(void);
+
+#endif /* KERNEL_PRESSURE_H */
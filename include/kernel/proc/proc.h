@@ -44,8 +44,8 @@ typedef struct {
     uint64_t rsp;       /* Stack pointer */
     uint64_t ss;        /* Stack segment selector */
     
-    /* FPU/SSE state (if needed) */
-    uint8_t fpu_state[512] __attribute__((aligned(16)));
+    /* FPU/SSE/AVX state, allocated on first use (arch/fpu.h) */
+    void* fpu_state;
 } proc_context_t;
 
 /*------------------
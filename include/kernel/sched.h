@@ -20,6 +20,26 @@
 #define KERNEL_SCHED_H
 
 #include <stdint.h>
+#include <kernel/arch/universal.h>
+
+/*
+ * Priorities run from 0 (lowest) to SCHED_PRIO_MAX.  The highest ready
+ * priority always runs; threads of equal priority take turns in FIFO
+ * order.
+ */
+#define SCHED_PRIO_LEVELS   32u
+#define SCHED_PRIO_MAX      (SCHED_PRIO_LEVELS - 1u)
+#define SCHED_PRIO_IDLE     0u
+#define SCHED_PRIO_DEFAULT  8u    /* new threads, bulk work */
+#define SCHED_PRIO_DRIVER   24u   /* latency-sensitive driver threads */
+
+/*
+ * A running thread is preempted by the timer when its quantum, set per
+ * priority, runs out and another thread of the same priority is ready.
+ */
+#define SCHED_QUANTUM_MS      10u
+#define SCHED_QUANTUM_MAX_MS  1000u
+#define SCHED_KSTACK_PAGES    4u    /* 16 KB kernel stack per thread */
 
 typedef enum {
     THREAD_READY,
@@ -31,20 +51,87 @@ typedef enum {
 typedef struct thread {
     uint32_t    id;
     thread_state state;
-    uint32_t    stack_ptr;
     uint32_t    priority;
+    uint32_t    slice_left;     /* ms of its quantum left */
+    uint32_t    space;          /* address space, 0 = kernel */
+    uint8_t     privileged;     /* may change system-wide settings */
     uint8_t     block_reason;
     int32_t     last_error;
+    uint64_t    fault_addr;     /* CR2 of the fault that killed it */
     union {
         uint8_t irq_num;
     } block_data;
+    struct thread *rq_next;     /* run queue links while THREAD_READY */
+    struct thread *rq_prev;
+    uint32_t    cpu;            /* run queue it belongs to */
+    volatile uint8_t on_cpu;    /* a CPU is still on its stack */
+    uint64_t    kstack;         /* base of its SCHED_KSTACK_PAGES stack */
+    void       *fpu_state;      /* extended state, from its first FPU use */
+    uint32_t    fpu_cpu;        /* CPU that last loaded it (arch/fpu.h) */
+    struct cpu_context ctx;     /* saved registers while switched out */
 } Thread;
 
+void    sched_init(void);
+
+/*
+ * sched_cpu_start — the calling CPU's stack becomes its idle thread and
+ * it starts taking threads.  sched_init does this for the boot CPU.
+ */
+void    sched_cpu_start(uint32_t cpu);
 int     sched_create_thread(void (*entry_point)(void));
 void    sched_yield(void);
 void    sched_schedule(void);
+
+/* sched_exit — end the calling thread; its stack is reused with its slot */
+void    sched_exit(void);
+
+/*
+ * sched_switch_done — first thing a thread runs after being switched
+ * to: lets the thread switched away from run on other CPUs again.
+ */
+void    sched_switch_done(void);
+
+/* sched_tick — account one timer tick (1 ms) to this CPU's running thread */
+void    sched_tick(void);
+
+/*
+ * sched_idle — an idle loop's halt, until the next interrupt.  With the
+ * dynamic tick, and no thread waiting on any CPU, the tick stops until
+ * next_ms (TIME_NEVER if the caller has nothing due).  Returns at once
+ * if this CPU should schedule.  Returns with interrupts enabled.
+ */
+void    sched_idle(uint64_t next_ms);
 Thread *sched_get_thread_by_pid(uint32_t pid);
 Thread *sched_get_current_thread(void);
 uint32_t sched_get_current_pid(void);
 
+/*
+ * sched_block  — t stops being runnable until sched_wakeup; reason is
+ *                a BLOCK_REASON_*.  Takes t off its run queue if ready.
+ * sched_wakeup — make a blocked t ready again.  Safe from IRQ context.
+ * A wakeup or priority change that puts a thread above the one running
+ * on its CPU, or the end of a quantum, sets that CPU's flag returned by
+ * sched_need_resched (with an IPI if it is another CPU); interrupt and
+ * syscall exits act on it, and sched_schedule clears it.
+ */
+void    sched_block(Thread *t, uint8_t reason);
+void    sched_wakeup(Thread *t);
+int     sched_need_resched(void);
+
+/* Priority of thread pid; -1 if there is none or prio > SCHED_PRIO_MAX */
+int     sched_get_priority(uint32_t pid);
+int     sched_set_priority(uint32_t pid, uint32_t prio);
+
+/*
+ * sched_set_privileged — let thread pid change system-wide settings
+ * from user space (quantum, timer slack) and raise its own priority
+ * past SCHED_PRIO_DEFAULT.  New threads are not privileged; only the
+ * kernel grants it, to the services it starts.  -1 if pid is gone.
+ */
+int     sched_set_privileged(uint32_t pid, int on);
+
+/* Quantum of priority prio in ms (1 … SCHED_QUANTUM_MAX_MS); -1 if invalid */
+int     sched_get_quantum(uint32_t prio);
+int     sched_set_quantum(uint32_t prio, uint32_t ms);
+
 #endif
@@ -8,7 +8,7 @@
 
 #include <stdint.h>
 
-typedef service_id;
+typedef uint32_t service_id;
 
 #define SERVICE_VGA_DISPLAY    1
 #define SERVICE_KEYBOARD_INPUT 2
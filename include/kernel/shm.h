@@ -0,0 +1,69 @@
+/*
+    E-comOS Kernel - Shared Memory Objects
+    Copyright (C) 2025,2026  Saladin5101
+
+    A shared memory object is a set of frames that several address
+    spaces map at once, so bulk data moves by mapping rather than by
+    copying through IPC payloads.  The frames need not be contiguous.
+
+    The space that creates an object owns it and grants other spaces
+    the rights they may map it with; each mapping picks its own subset.
+    Its frames count against the owner's limits until it is freed.
+    The owner's handle and every mapping hold the object; it is freed
+    when the handle is released and the last mapping is gone.
+
+    Invariant: every frame of a live object carries one frame reference
+               for the object itself and one per mapping of it.
+*/
+
+#ifndef KERNEL_SHM_H
+#define KERNEL_SHM_H
+
+#include <stdint.h>
+#include <kernel/address_space.h>
+#include <kernel/mm.h>
+
+#define SHM_MAX_OBJECTS  256u
+#define SHM_MAX_GRANTS   8u
+#define SHM_RIGHTS       (MM_FLAG_READ | MM_FLAG_WRITE | MM_FLAG_EXEC)
+
+typedef uint32_t shm_id;
+
+/* Precondition: as_init has run. */
+void   shm_init(void);
+
+/*
+ * shm_create — a zeroed object of size bytes (rounded up to pages)
+ * owned by space owner, mappable with at most the SHM_RIGHTS in
+ * rights.  Returns 0 if out of memory or object slots, or if the
+ * pages would take owner past its hard limit.
+ */
+shm_id shm_create(address_space owner, uint64_t size, uint32_t rights);
+
+/*
+ * shm_grant — let space to map the object with rights (a subset of the
+ * object's); owner only.  0 rights withdraws the grant but leaves
+ * mappings already made in place.
+ */
+int    shm_grant(shm_id id, address_space owner, address_space to, uint32_t rights);
+
+/*
+ * shm_map — map the whole object at vaddr in space as with flags
+ * (MM_FLAG_*; the rights among them must be granted).  vaddr must be
+ * page aligned, in the user range, and the object may not meet a
+ * region or anything already mapped there.
+ * shm_unmap — remove the mapping of the object at vaddr in as.
+ */
+int    shm_map(shm_id id, address_space as, uint64_t vaddr, uint32_t flags);
+int    shm_unmap(shm_id id, address_space as, uint64_t vaddr);
+
+/* shm_release — drop the owner's handle; no new mappings can be made */
+int    shm_release(shm_id id, address_space owner);
+
+/*
+ * shm_space_gone — as is being destroyed: forget its mappings, grants
+ * and handles.  Precondition: its page tables are already freed.
+ */
+void   shm_space_gone(address_space as);
+
+#endif /* KERNEL_SHM_H */
@@ -0,0 +1,44 @@
+/*
+    E-comOS Kernel - Multiprocessor bring-up
+    Copyright (C) 2025,2026  Saladin5101
+
+    CPUs come from the ACPI MADT.  The boot CPU is CPU 0; the others are
+    numbered in MADT order, up to MAX_CPUS, and started one at a time
+    with INIT-SIPI-SIPI.  Each gets its own GS-based cpu_local area, TSS,
+    local APIC timer and scheduler run queue, and idles in its own loop.
+
+    Other CPUs are reached with IPIs: a reschedule when work is queued
+    for them, and a TLB shootdown, which the sender waits for, when a
+    translation they may cache changes.
+*/
+
+#ifndef KERNEL_SMP_H
+#define KERNEL_SMP_H
+
+#include <stdint.h>
+
+#define SMP_AP_START_MS  100u   /* how long an AP gets to come up */
+
+/*
+ * smp_init — set up the boot CPU's per-CPU area and enumerate CPUs.
+ * Precondition: gdt_init and acpi_init have run, ACPI tables are still
+ *               identity mapped.
+ */
+void     smp_init(void);
+
+/*
+ * smp_boot_aps — map the local APIC, calibrate its timer (on one CPU
+ * too) and start every other CPU.
+ * Precondition: paging, the IDT and the 1 ms timer are up and
+ *               interrupts are enabled.
+ * Postcondition: the CPUs that answered are scheduling threads.
+ */
+void     smp_boot_aps(void);
+
+uint32_t smp_cpu_count(void);    /* CPUs found, started or not */
+uint32_t smp_online_mask(void);  /* bit n set once CPU n runs */
+
+/* smp_send_resched — make cpu enter the scheduler; no-op if offline */
+void     smp_send_resched(uint32_t cpu);
+
+#endif /* KERNEL_SMP_H */
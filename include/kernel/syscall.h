@@ -28,6 +28,37 @@
 #define SYS_IRQ_WAIT        5
 #define SYS_IRQ_GET_COUNT   6
 #define SYS_IRQ_RESET_COUNT 7
+#define SYS_ADDRESS_MAP_RANGE 8
+#define SYS_ADDRESS_CLONE   9   /* copy-on-write clone of the caller's space; see SYS_ADDRESS_DESTROY */
+#define SYS_MEM_STATS       10  /* arg1 0 or the caller's pid, arg2 as_usage * */
+#define SYS_MEM_LIMIT       11  /* arg1 0 or the caller's pid, arg2 soft, arg3 hard pages */
+#define SYS_MEM_PRESSURE    12  /* arg1 lowest MM_PRESSURE_* to be told of, 0 = stop */
+#define SYS_SHM_CREATE      13  /* arg1 size in bytes, arg2 SHM_RIGHTS; returns the id */
+#define SYS_SHM_GRANT       14  /* arg1 id, arg2 pid, arg3 rights (0 = withdraw) */
+#define SYS_SHM_MAP         15  /* arg1 sys_shm_map_t * */
+#define SYS_SHM_UNMAP       16  /* arg1 sys_shm_map_t *; flags ignored */
+#define SYS_SHM_RELEASE     17  /* arg1 id */
+#define SYS_THREAD_GET_PRIORITY 18  /* arg1 pid (0 = caller) */
+#define SYS_THREAD_SET_PRIORITY 19  /* arg1 0 or the caller's pid, arg2 0 … SCHED_PRIO_MAX (past DEFAULT: privileged) */
+#define SYS_SCHED_QUANTUM   20  /* arg1 priority, arg2 ms (0 = query; set: privileged); returns ms */
+#define SYS_TIMER_SLACK     21  /* arg1 wakeup coalescing ms (0 = query; set: privileged); returns ms */
+#define SYS_ADDRESS_DESTROY 22  /* arg1 space from SYS_ADDRESS_CLONE; fails while it is loaded */
+
+/* SYS_ADDRESS_MAP_RANGE argument, passed by pointer in arg1; the range
+   must lie in the user range and is mapped in the caller's space */
+typedef struct {
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t size;     /* bytes, rounded up to whole pages */
+    uint32_t flags;    /* MM_FLAG_* */
+} sys_map_range_t;
+
+/* SYS_SHM_MAP / SYS_SHM_UNMAP argument, passed by pointer in arg1 */
+typedef struct {
+    uint64_t vaddr;
+    uint32_t id;
+    uint32_t flags;    /* MM_FLAG_* */
+} sys_shm_map_t;
 
 #define BLOCK_REASON_NONE     0
 #define BLOCK_REASON_IRQ_WAIT 1
@@ -35,11 +66,14 @@
 #define IRQ_WAIT_CLEAR  0x01
 #define IRQ_WAIT_NOWAIT 0x02
 
-#define ERR_TIMEOUT -3
+#define ERR_TIMEOUT    -3
+#define ERR_PAGE_FAULT -4
 
 void syscall_irq_init(void);
 void syscall_irq_notify(uint8_t irq_num);
 void syscall_irq_check_timeouts(void);
+/* Earliest time_get_current_ms() at which a waiter times out; TIME_NEVER if none */
+uint64_t syscall_irq_next_timeout(void);
 long syscall_handler(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3);
 
 #endif
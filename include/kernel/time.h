@@ -1,9 +1,70 @@
+/*
+    E-comOS Kernel - Time subsystem
+    Copyright (C) 2025,2026  Saladin5101
+
+    Time is counted in milliseconds since boot.  Until time_nohz_init
+    it is the count of PIT ticks on the boot CPU.  With an invariant
+    TSC and a local APIC it then becomes the TSC, every CPU ticks from
+    its own local APIC timer, and a CPU with nothing to run stops its
+    tick: the timer is programmed once for the next expiry (one-shot,
+    or TSC-deadline where the CPU has it) and the CPU sleeps until then
+    or until another interrupt.
+
+    Wakeups are coalesced: a sleep ends on the first multiple of the
+    slack at or after the expiry asked for, so CPUs with nearby expiries
+    wake together.  Without the dynamic tick every call below except
+    time_get_current_ms and time_tick is a no-op.
+*/
+
 #ifndef KERNEL_TIME_H
 #define KERNEL_TIME_H
 
 #include <stdint.h>
 
+#define TIME_SLACK_DEFAULT_MS  1u
+#define TIME_SLACK_MAX_MS      100u
+#define TIME_IDLE_MAX_MS       1000u   /* longest sleep without a tick */
+#define TIME_NEVER             (~0ull) /* no expiry pending */
+
 uint64_t time_get_current_ms(void);
+
+/* time_tick — one PIT tick on the boot CPU, while the PIT keeps time */
 void     time_tick(void);
 
+/*
+ * time_nohz_init — switch to the TSC clock and per-CPU local APIC
+ * ticks.  Precondition: lapic_timer_calibrate has run and interrupts
+ * are on.  Returns -1, staying periodic on the PIT, if the TSC is not
+ * invariant or there is no local APIC.
+ */
+int      time_nohz_init(void);
+int      time_nohz_enabled(void);
+
+/*
+ * time_idle_stop — the calling CPU is about to halt with nothing due
+ * before next_ms (TIME_NEVER: nothing at all): replace its tick with
+ * one interrupt at the coalesced expiry.  Returns -1 and leaves the
+ * tick running if the expiry is within the next tick.  Interrupts off.
+ * time_idle_restart — put the tick back if it was stopped; called on
+ * every interrupt, so whatever wakes the CPU restarts it.
+ */
+int      time_idle_stop(uint64_t next_ms);
+void     time_idle_restart(void);
+
+/*
+ * time_kick_boot — something the boot CPU's idle loop looks after
+ * (IRQ-wait timeouts, memory pressure) is now due at due_ms: if that
+ * CPU sleeps without a tick past it, wake it with an IPI.  Safe from
+ * any CPU, with interrupts off and under spinlocks.
+ */
+void     time_kick_boot(uint64_t due_ms);
+
+/*
+ * Coalescing slack in ms: 1 … TIME_SLACK_MAX_MS; -1 if out of range.
+ * It applies to every CPU, so SYS_TIMER_SLACK only lets privileged
+ * threads (sched_set_privileged) change it.
+ */
+int      time_set_slack(uint32_t ms);
+uint32_t time_get_slack(void);
+
 #endif
@@ -1,6 +1,31 @@
 #include <kernel/ipc.h>
+#include <kernel/mm/slab.h>
 #include <string.h>
 
+static kmem_cache *ipc_msg_cache;
+
+void ipc_init(void) {
+    ipc_msg_cache = kmem_cache_create("ipc_message", sizeof(ipc_message_t), 0, 0);
+}
+
+/* Header fields are cleared; data is only valid up to msg->size. */
+ipc_message_t *ipc_msg_alloc(void) {
+    ipc_message_t *msg = kmem_cache_alloc(ipc_msg_cache);
+    if (msg) {
+        msg->type      = 0;
+        msg->source    = 0;
+        msg->target    = 0;
+        msg->timestamp = 0;
+        msg->size      = 0;
+        msg->sequence  = 0;
+    }
+    return msg;
+}
+
+void ipc_msg_free(ipc_message_t *msg) {
+    kmem_cache_free(ipc_msg_cache, msg);
+}
+
 // Internal IPC functions
 int ipc_send(thread_id target, ipc_message_t *msg) {
     // Implementation of ipc_send
@@ -19,22 +44,26 @@ int ipc_receive(ipc_message_t *msg) {
 
 int ipc_send_msg(uint32_t type, uint32_t flags, uint32_t receiver_pid,
                uint32_t data_len, const void *data) {
-    ipc_message_t msg = {0};
+    ipc_message_t *msg = ipc_msg_alloc();
+    if (!msg)
+        return ECLIB_IPC_BUFFER_OVERFLOW;
     
-    msg.type = type;
-    msg.target = receiver_pid;
-    msg.size = (uint32_t)data_len;
+    msg->type = type;
+    msg->target = receiver_pid;
+    msg->size = (uint32_t)data_len;
     
     // Store flags in the message (using timestamp field for now)
-    msg.timestamp = (uint32_t)flags;
+    msg->timestamp = (uint32_t)flags;
     
     // Copy data if provided
     if (data && data_len > 0 && data_len <= IPC_MAX_DATA_SIZE) {
-        memcpy(msg.data, data, data_len);
+        memcpy(msg->data, data, data_len);
     }
     
     // Call the low-level send function
-    return ipc_send(receiver_pid, &msg);
+    int rc = ipc_send(receiver_pid, msg);
+    ipc_msg_free(msg);
+    return rc;
 }
 
 int ipc_receive_msg(ipc_message_t *msg, int timeout_ms) {
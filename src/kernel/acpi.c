@@ -0,0 +1,61 @@
+/*
+    E-comOS Kernel - ACPI tables
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+*/
+
+#include <kernel/acpi.h>
+#include <stddef.h>
+
+static const uint8_t *root;       /* RSDT or XSDT */
+static uint32_t       entry_size; /* 4 for the RSDT, 8 for the XSDT */
+
+static int sig_is(const uint8_t *p, const char *sig, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++)
+        if (p[i] != (uint8_t)sig[i])
+            return 0;
+    return 1;
+}
+
+static int checksum_ok(const uint8_t *p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++)
+        sum = (uint8_t)(sum + p[i]);
+    return sum == 0;
+}
+
+int acpi_init(const void *rsdp) {
+    const uint8_t *p = (const uint8_t *)rsdp;
+    root = NULL;
+    entry_size = 4;
+    if (p && sig_is(p, "RSD PTR ", 8) && checksum_ok(p, 20)) {
+        /* Revision 2 and later add the 64-bit XSDT address */
+        if (p[15] >= 2u && acpi_rd64(p + 24) && checksum_ok(p, acpi_rd32(p + 20))) {
+            root = (const uint8_t *)(uintptr_t)acpi_rd64(p + 24);
+            entry_size = 8;
+        } else {
+            root = (const uint8_t *)(uintptr_t)acpi_rd32(p + 16);
+        }
+    } else if (p && sig_is(p, "XSDT", 4)) {
+        root = p;
+        entry_size = 8;
+    } else if (p && sig_is(p, "RSDT", 4)) {
+        root = p;
+    }
+    if (root && !checksum_ok(root, acpi_rd32(root + 4)))
+        root = NULL;
+    return root ? 0 : -1;
+}
+
+const uint8_t *acpi_find_table(const char *sig) {
+    if (!root)
+        return NULL;
+    uint32_t len = acpi_rd32(root + 4);
+    for (uint32_t off = ACPI_HEADER_LEN; off + entry_size <= len; off += entry_size) {
+        uint64_t addr = entry_size == 8u ? acpi_rd64(root + off) : acpi_rd32(root + off);
+        const uint8_t *t = (const uint8_t *)(uintptr_t)addr;
+        if (t && sig_is(t, sig, 4) && checksum_ok(t, acpi_rd32(t + 4)))
+            return t;
+    }
+    return NULL;
+}
@@ -1,50 +1,572 @@
 /*
     E-comOS Kernel - Address Space Management
     Copyright (C) 2025,2026  Saladin5101
+
+    Each address space owns a PML4 whose kernel slots are shared with the
+    kernel root.  Switching spaces loads its root tagged with a per-CPU
+    PCID, so the TLB entries of recently run spaces survive the switch.
+
+    PCIDs are handed out per CPU in generations: a space keeps its PCID
+    while its generation matches the CPU's.  When a CPU runs out of tags
+    it starts a new generation with one full TLB flush, and every space
+    picks up a fresh tag the next time it runs there.
+
+    Invariant: within one generation a PCID names at most one space on
+               that CPU, so a load with NOFLUSH never sees foreign entries.
+
+    Regions describe memory that is reserved but populated on demand:
+    the page-fault handler maps a zeroed frame on first touch.  A stack
+    region also owns the window below it down to its limit and grows
+    into it, one fault at a time, for accesses near its current bottom.
+
+    Invariant: region spans [limit, end) are sorted and do not overlap.
+    Invariant: every frame mapped inside a region was allocated by the
+               fault handler and is freed when the region is released.
+
+    A clone shares every region frame with its parent copy-on-write, so
+    spawning from a warm template costs page-table entries, not copies;
+    the first write on either side copies that one page.
+
+    Region pages are charged to their space as they are faulted in and
+    uncharged when the region goes; the hard limit is checked before the
+    frame is taken, so a space never holds more than its limit.  Shared
+    memory objects charge their owner through as_charge the same way.
 */
 
 #include <kernel/address_space.h>
+#include <kernel/shm.h>
 #include <kernel/mm.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/page.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
+
+#define AS_PCID_COUNT  4096u      /* PCID 0 is the kernel's */
+#define AS_STACK_REACH 0x10000ull /* faults this far below a stack grow it */
+
+typedef struct as_region {
+    struct as_region *next;
+    uint64_t start;   /* bottom of the populated part (stacks move it down) */
+    uint64_t end;
+    uint64_t limit;   /* lowest address the region may cover */
+    uint32_t flags;   /* MM_FLAG_* of pages faulted in */
+    uint32_t kind;    /* AS_REGION_* */
+} as_region;
+
+typedef struct {
+    uint16_t pcid;
+    uint32_t gen;             /* 0 = no PCID on this CPU */
+} as_asid;
+
+typedef struct {
+    mm_pt_root root;
+    as_asid    asid[MAX_CPUS];
+    spinlock_t lock;          /* regions */
+    as_region *regions;       /* sorted by limit */
+    as_region *hint;          /* region of the last fault */
+    address_space parent;     /* space it was cloned from, 0 = none */
+    uint32_t   nregions;
+    uint64_t   charged;       /* pages held against the limits; guarded by lock */
+    uint64_t   charged_held;  /* of which through as_charge, not inherited */
+    uint64_t   peak;
+    uint64_t   limit_soft;    /* pages, 0 = none */
+    uint64_t   limit_hard;
+    uint32_t   soft_crossings;
+    uint32_t   hard_denials;
+} as_desc;
+
+static as_desc      *spaces[MAX_ADDRESS_SPACES];   /* [0] = kernel, NULL */
+static kmem_cache   *as_cache;
+static kmem_cache   *region_cache;
+static uint32_t      as_next = 1;
+static spinlock_t    spaces_lock = SPINLOCK_INIT;  /* slot claims in spaces[] */
+static address_space as_current[MAX_CPUS];
+static uint32_t      pcid_next[MAX_CPUS];
+static uint32_t      pcid_gen[MAX_CPUS];
+
+static as_desc *as_lookup(address_space as) {
+    return as != 0 && as < MAX_ADDRESS_SPACES ? spaces[as] : NULL;
+}
 
-#define MAX_ADDRESS_SPACES 16
+/* Region whose span holds addr, or NULL.  Caller holds d->lock. */
+static as_region *region_find(as_desc *d, uint64_t addr) {
+    as_region *r = d->hint;
+    if (r && addr >= r->limit && addr < r->end)
+        return r;
+    for (r = d->regions; r && r->limit <= addr; r = r->next)
+        if (addr < r->end)
+            return d->hint = r;
+    return NULL;
+}
 
-static uint8_t as_used[MAX_ADDRESS_SPACES] = {0};
+/* Link n in order unless its span overlaps another region */
+static int region_insert(as_desc *d, as_region *n) {
+    as_region **pp = &d->regions;
+    while (*pp && (*pp)->end <= n->limit)
+        pp = &(*pp)->next;
+    if (*pp && (*pp)->limit < n->end)
+        return -1;
+    n->next = *pp;
+    *pp = n;
+    return 0;
+}
+
+/* Unmap the span of r, already unlinked, and free the frames faulted into it */
+static void region_release(as_desc *d, as_region *r) {
+    int pages = mm_unmap_range_free(&d->root, r->limit, r->end - r->limit);
+    if (pages > 0) {
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&d->lock);
+        d->charged = d->charged > (uint64_t)pages ? d->charged - (uint64_t)pages : 0;
+        spin_unlock(&d->lock);
+        cpu_irq_restore(irq);
+    }
+    kmem_cache_free(region_cache, r);
+}
+
+/* Charge n pages to d, or refuse at the hard limit.  Caller holds d->lock. */
+static int charge_pages(as_desc *d, uint64_t n) {
+    if (d->limit_hard && (d->charged >= d->limit_hard || n > d->limit_hard - d->charged)) {
+        d->hard_denials++;
+        return -1;
+    }
+    if (d->limit_soft && d->charged <= d->limit_soft && d->charged + n > d->limit_soft)
+        d->soft_crossings++;
+    d->charged += n;
+    if (d->charged > d->peak)
+        d->peak = d->charged;
+    return 0;
+}
+
+static int region_add(address_space as, uint64_t limit, uint64_t start,
+                      uint64_t end, uint32_t flags, uint32_t kind) {
+    as_desc *d = as_lookup(as);
+    if (!d || (limit | start | end) & (PAGE_SIZE - 1u))
+        return -1;
+    if (limit > start || start >= end || limit < MM_USER_BASE || end > MM_USER_END)
+        return -1;
+    as_region *r = kmem_cache_alloc(region_cache);
+    if (!r)
+        return -1;
+    r->limit = limit;
+    r->start = start;
+    r->end   = end;
+    r->flags = flags;
+    r->kind  = kind;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    /* A region owns the frames in its span, so nothing may be mapped there yet */
+    int rc = mm_pt_range_empty(&d->root, limit, end - limit) ? region_insert(d, r) : -1;
+    if (rc == 0)
+        d->nregions++;
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
+    if (rc != 0)
+        kmem_cache_free(region_cache, r);
+    return rc;
+}
+
+/* Root of an anonymous page's space for compaction; lock-free lookup */
+static mm_pt_root *as_root_of(uint32_t owner) {
+    as_desc *d = as_lookup(owner);
+    return d ? &d->root : NULL;
+}
+
+void as_init(void) {
+    as_cache     = kmem_cache_create("address_space", sizeof(as_desc), 0, 0);
+    region_cache = kmem_cache_create("as_region", sizeof(as_region), 0, 0);
+    mm_compact_set_owner_lookup(as_root_of);
+}
 
 address_space as_create(void) {
-    for (int i = 1; i < MAX_ADDRESS_SPACES; i++) {
-        if (!as_used[i]) {
-            as_used[i] = 1;
-            return (address_space)i;
+    if (!as_cache)
+        return 0;
+    as_desc *d = kmem_cache_alloc(as_cache);
+    if (!d)
+        return 0;
+    if (mm_pt_create(&d->root) != 0) {
+        kmem_cache_free(as_cache, d);
+        return 0;
+    }
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        d->asid[cpu].gen = 0;
+    d->lock.locked = 0;
+    d->regions = d->hint = NULL;
+    d->parent = 0;
+    d->nregions = 0;
+    d->charged = d->charged_held = d->peak = d->limit_soft = d->limit_hard = 0;
+    d->soft_crossings = d->hard_denials = 0;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&spaces_lock);
+    for (uint32_t n = 1; n < MAX_ADDRESS_SPACES; n++) {
+        address_space as = as_next;
+        as_next = as_next + 1u < MAX_ADDRESS_SPACES ? as_next + 1u : 1u;
+        if (!spaces[as]) {
+            spaces[as] = d;
+            d->root.owner = as;
+            spin_unlock(&spaces_lock);
+            cpu_irq_restore(irq);
+            return as;
         }
     }
+    spin_unlock(&spaces_lock);
+    cpu_irq_restore(irq);
+    mm_pt_destroy(&d->root);
+    kmem_cache_free(as_cache, d);
     return 0;
 }
 
 int as_destroy(address_space as) {
-    if (as == 0 || as >= MAX_ADDRESS_SPACES)
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return -1;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        if (as_current[cpu] == as)
+            return -1;
+    /* Free the slot under the lock as_create claims slots with */
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&spaces_lock);
+    int ours = spaces[as] == d;
+    if (ours) {
+        spaces[as] = NULL;
+        /* Its clones can still be destroyed by whoever it came from */
+        for (uint32_t n = 1; n < MAX_ADDRESS_SPACES; n++)
+            if (spaces[n] && spaces[n]->parent == as)
+                spaces[n]->parent = d->parent;
+    }
+    spin_unlock(&spaces_lock);
+    cpu_irq_restore(irq);
+    if (!ours)
+        return -1;   /* destroyed by another CPU meanwhile */
+    while (d->regions) {
+        as_region *r = d->regions;
+        d->regions = r->next;
+        region_release(d, r);
+    }
+    /* Its PCIDs are never handed out again before a generation flush */
+    mm_pt_destroy(&d->root);
+    /* Shared frames only lose this reference once nothing maps them here */
+    shm_space_gone(as);
+    kmem_cache_free(as_cache, d);
+    return 0;
+}
+
+int as_map(address_space as, uint64_t vaddr, uint64_t paddr,
+          uint64_t size, uint32_t flags) {
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return -1;
+    int rc = mm_map_range(&d->root, vaddr, paddr,
+                          (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1), flags);
+    return rc < 0 ? rc : 0;
+}
+
+int as_map_free(address_space as, uint64_t vaddr, uint64_t paddr,
+                uint64_t size, uint32_t flags) {
+    as_desc *d = as_lookup(as);
+    size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (!d || !size || vaddr + size < vaddr)
+        return -1;
+    int rc = -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    const as_region *r = d->regions;
+    while (r && r->end <= vaddr)
+        r = r->next;
+    if ((!r || r->limit >= vaddr + size) && mm_pt_range_empty(&d->root, vaddr, size))
+        rc = mm_map_range(&d->root, vaddr, paddr, size, flags);
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
+    return rc < 0 ? rc : 0;
+}
+
+int as_unmap(address_space as, uint64_t vaddr, uint64_t size) {
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return -1;
+    int rc = mm_unmap_range(&d->root, vaddr,
+                            (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+    return rc < 0 ? rc : 0;
+}
+
+int as_protect(address_space as, uint64_t vaddr, uint64_t size, uint32_t flags) {
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return -1;
+    int rc = mm_protect_range(&d->root, vaddr,
+                              (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1), flags);
+    return rc < 0 ? rc : 0;
+}
+
+int as_region_reserve(address_space as, uint64_t start, uint64_t size, uint32_t flags) {
+    return region_add(as, start, start, start + size, flags, AS_REGION_ANON);
+}
+
+int as_stack_reserve(address_space as, uint64_t top, uint64_t size,
+                     uint64_t max_size, uint32_t flags) {
+    if (size == 0 || max_size < size || max_size > top)
         return -1;
-    as_used[as] = 0;
+    return region_add(as, top - max_size, top - size, top, flags, AS_REGION_STACK);
+}
+
+int as_region_release(address_space as, uint64_t addr) {
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    as_region **pp = &d->regions;
+    while (*pp && !(addr >= (*pp)->limit && addr < (*pp)->end))
+        pp = &(*pp)->next;
+    as_region *r = *pp;
+    if (r) {
+        *pp = r->next;
+        d->nregions--;
+        if (d->hint == r)
+            d->hint = NULL;
+    }
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
+    if (!r)
+        return -1;
+    region_release(d, r);
     return 0;
 }
 
-int as_map(address_space as, uint32_t vaddr, uint32_t paddr,
-          uint32_t size, uint32_t flags) {
-    if (as == 0 || as >= MAX_ADDRESS_SPACES || !as_used[as])
+address_space as_clone(address_space src) {
+    as_desc *s = as_lookup(src);
+    if (!s)
+        return 0;
+    address_space as = as_create();
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return 0;
+
+    int rc = 0;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&s->lock);
+    as_region **tail = &d->regions;
+    for (as_region *r = s->regions; r && rc == 0; r = r->next) {
+        as_region *c = kmem_cache_alloc(region_cache);
+        if (!c) {
+            rc = -1;
+            break;
+        }
+        *c = *r;
+        c->next = NULL;
+        *tail = c;
+        tail  = &c->next;
+        d->nregions++;
+        rc = mm_pt_share_cow(&d->root, &s->root, r->limit, r->end - r->limit);
+        if (rc > 0)
+            rc = 0;   /* shared pages: the parent's stale entries were flushed */
+    }
+    /* Every region page is now mapped on both sides; d is not live yet */
+    d->charged    = d->peak = s->charged - s->charged_held;
+    d->limit_soft = s->limit_soft;
+    d->limit_hard = s->limit_hard;
+    spin_unlock(&s->lock);
+    cpu_irq_restore(irq);
+
+    if (rc != 0) {
+        as_destroy(as);
+        return 0;
+    }
+    d->parent = src;
+    return as;
+}
+
+int as_destroy_clone(address_space parent, address_space as) {
+    as_desc *d = as_lookup(as);
+    if (!d || !parent || d->parent != parent)
         return -1;
-    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint32_t i = 0; i < pages; i++) {
-        int rc = mm_map_page(vaddr + i * PAGE_SIZE,
-                           paddr + i * PAGE_SIZE, flags);
-        if (rc != 0)
-            return rc;
+    return as_destroy(as);
+}
+
+int as_page_fault(uint64_t addr, uint32_t err) {
+    address_space as = as_get_current();
+    as_desc *d = as_lookup(as);
+    if (!d || (err & MM_PF_RSVD))
+        return -1;
+    /* The only protection fault resolved here is a write to a shared page */
+    if (err & MM_PF_PRESENT) {
+        if (!(err & MM_PF_WRITE) || (err & MM_PF_INSTR))
+            return -1;
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&d->lock);
+        as_region *r = region_find(d, addr);
+        int ok = r && (r->flags & MM_FLAG_WRITE)
+              && (!(err & MM_PF_USER) || (r->flags & MM_FLAG_USER))
+              && mm_pt_cow_fault(&d->root, addr) == 0;
+        spin_unlock(&d->lock);
+        cpu_irq_restore(irq);
+        return ok ? 0 : -1;
+    }
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    as_region *r = region_find(d, addr);
+    int ok = r != NULL;
+    if (ok && addr < r->start)
+        ok = r->kind == AS_REGION_STACK && addr + AS_STACK_REACH >= r->start;
+    if (ok && (err & MM_PF_WRITE) && !(r->flags & MM_FLAG_WRITE))
+        ok = 0;
+    if (ok && (err & MM_PF_USER) && !(r->flags & MM_FLAG_USER))
+        ok = 0;
+    if (ok && (err & MM_PF_INSTR) && !(r->flags & MM_FLAG_EXEC))
+        ok = 0;
+    /* Another CPU faulted the page in first, or it is mid-migration */
+    uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1u);
+    if (ok && mm_pt_present(&d->root, page)) {
+        spin_unlock(&d->lock);
+        cpu_irq_restore(irq);
+        return 0;
+    }
+    if (ok && charge_pages(d, 1) != 0)
+        ok = 0;
+    if (ok) {
+        void *frame = mm_alloc_page_flags(MM_ALLOC_ZEROED);
+        int   rc    = frame ? mm_pt_map_new(&d->root, page, (uintptr_t)frame, r->flags) : -1;
+        if (rc != 0) {
+            if (frame)
+                mm_free_page(frame);
+            d->charged--;
+            ok = rc > 0;
+        } else {
+            mm_page_set_anon(frame, as, page);
+            if (page < r->start)
+                r->start = page;
+        }
     }
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
+    return ok ? 0 : -1;
+}
+
+int as_copy_in(address_space as, void *dst, uint64_t src, uint64_t size) {
+    as_desc *d = as_lookup(as);
+    if (!d || !dst)
+        return -1;
+    return mm_pt_copy_in(&d->root, dst, src, size);
+}
+
+int as_copy_out(address_space as, uint64_t dst, const void *src, uint64_t size) {
+    as_desc *d = as_lookup(as);
+    if (!d || !src || dst < MM_USER_BASE || dst >= MM_USER_END || size > MM_USER_END - dst)
+        return -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    /* Pages still shared with a clone get their own copy first */
+    for (uint64_t a = dst & ~(uint64_t)(PAGE_SIZE - 1u); a < dst + size; a += PAGE_SIZE) {
+        as_region *r = region_find(d, a);
+        if (r && (r->flags & MM_FLAG_WRITE))
+            mm_pt_cow_fault(&d->root, a);
+    }
+    int rc = mm_pt_copy_out(&d->root, dst, src, size);
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
+    return rc;
+}
+
+int as_usage_get(address_space as, as_usage *u) {
+    as_desc *d = as_lookup(as);
+    if (!d || !u)
+        return -1;
+    mm_pt_usage_t pt;
+    mm_pt_usage(&d->root, &pt);
+    u->resident    = pt.resident;
+    u->shared      = pt.shared;
+    u->page_tables = pt.tables;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    u->charged        = d->charged;
+    u->peak           = d->peak;
+    u->kernel_bytes   = sizeof(as_desc) + (uint64_t)d->nregions * sizeof(as_region);
+    u->limit_soft     = d->limit_soft;
+    u->limit_hard     = d->limit_hard;
+    u->soft_crossings = d->soft_crossings;
+    u->hard_denials   = d->hard_denials;
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
     return 0;
 }
 
-int as_unmap(address_space as, uint32_t vaddr, uint32_t size) {
-    (void)as;
-    (void)vaddr;
-    (void)size;
-    /* mmUnmapPage not yet wired to page tables — placeholder */
+int as_charge(address_space as, uint64_t pages) {
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    int rc = charge_pages(d, pages);
+    if (rc == 0)
+        d->charged_held += pages;
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
+    return rc;
+}
+
+void as_uncharge(address_space as, uint64_t pages) {
+    as_desc *d = as_lookup(as);
+    if (!d)
+        return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    if (pages > d->charged_held)
+        pages = d->charged_held;
+    d->charged_held -= pages;
+    d->charged      -= pages;
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
+}
+
+int as_set_limits(address_space as, uint64_t soft, uint64_t hard) {
+    as_desc *d = as_lookup(as);
+    if (!d || (hard && soft > hard))
+        return -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&d->lock);
+    d->limit_soft = soft;
+    d->limit_hard = hard;
+    spin_unlock(&d->lock);
+    cpu_irq_restore(irq);
     return 0;
 }
+
+void as_switch(address_space as) {
+    uint64_t irq = cpu_irq_save();
+    uint32_t cpu = cpu_current_id();
+    as_desc *d   = as_lookup(as);
+    if (as_current[cpu] == as || (as != 0 && !d)) {
+        cpu_irq_restore(irq);
+        return;
+    }
+
+    if (!d) {
+        mm_pt_load(NULL, 0, 1);
+    } else if (!mm_pcid_enabled()) {
+        mm_pt_load(&d->root, 0, 0);
+    } else {
+        as_asid *a = &d->asid[cpu];
+        if (a->gen != pcid_gen[cpu] || a->gen == 0) {
+            if (pcid_next[cpu] == 0 || pcid_next[cpu] == AS_PCID_COUNT) {
+                /* Out of tags: new generation, every old tag is void */
+                pcid_gen[cpu]++;
+                pcid_next[cpu] = 1;
+                mm_tlb_flush_all();
+            }
+            a->pcid = (uint16_t)pcid_next[cpu]++;
+            a->gen  = pcid_gen[cpu];
+        }
+        /* A tag is only ever reused for the same space: keep its entries */
+        mm_pt_load(&d->root, a->pcid, 1);
+    }
+    as_current[cpu] = as;
+    cpu_irq_restore(irq);
+}
+
+address_space as_get_current(void) {
+    return as_current[cpu_current_id()];
+}
@@ -8,11 +8,20 @@
 */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <kernel/boot.h>
+#include <kernel/acpi.h>
+#include <kernel/smp.h>
 #include <kernel/arch/interrupts.h>
+#include <kernel/arch/fpu.h>
 #include <kernel/mm.h>
+#include <kernel/mm/vmalloc.h>
 #include <kernel/sched.h>
+#include <kernel/time.h>
+#include <kernel/address_space.h>
+#include <kernel/shm.h>
 #include <kernel/ipc.h>
+#include <kernel/pressure.h>
 #include <kernel/syscall.h>
 #include <kernel/printkit/print.h>
 #include <kernel/debug.h>
@@ -32,6 +41,11 @@ void kernel_main(void* boot_info) {
     print_str("GDT + TSS...\n", 0x1F);
     gdt_init();
 
+    /* Per-CPU area (GS) and CPU list, while ACPI tables are mapped */
+    boot_params *bp = (boot_params *)boot_info;
+    acpi_init(bp ? bp->acpi_rsdt : NULL);
+    smp_init();
+
     /* Phase 2: Memory — must be before any mmAllocPage call */
     print_str("Memory subsystem...\n", 0x1F);
     memory_status mm_status = mm_init(boot_info);
@@ -39,6 +53,11 @@ void kernel_main(void* boot_info) {
         kernel_panic("mmInit failed — no usable memory");
     }
     mm_enable_paging();
+    vmalloc_init();
+    as_init();
+    shm_init();
+    fpu_init();
+    sched_init();
 
     /* Phase 3: Interrupts */
     print_str("Interrupt handling...\n", 0x1F);
@@ -48,7 +67,9 @@ void kernel_main(void* boot_info) {
 
     /* Phase 4: IPC + syscall IRQ subsystem */
     print_str("IPC + syscall...\n", 0x1F);
+    ipc_init();
     syscall_irq_init();
+    pressure_init();
 
     /* Phase 5: Create init service thread */
     print_str("Creating init service...\n", 0x1F);
@@ -64,6 +85,10 @@ void kernel_main(void* boot_info) {
     /* Enable interrupts — from this point shared state must be protected */
     __asm__ volatile("sti");
 
+    /* Other CPUs, timed against the 1 ms tick that is now running */
+    smp_boot_aps();
+    time_nohz_init();
+
     /* Kernel idle loop */
     while (1) {
         sched_schedule();
@@ -73,26 +98,48 @@ void kernel_main(void* boot_info) {
          * data races with IRQ handlers (F-09). */
         __asm__ volatile("cli");
 
-        ipc_message_t msg = {0};   /* zero-initialise to avoid garbage (F-11) */
-        if (ipc_receive_msg(&msg, 0) == ECLIB_OK)
-            ipc_send((thread_id)msg.target, &msg);
+        /* Header comes back zeroed to avoid garbage (F-11) */
+        ipc_message_t *msg = ipc_msg_alloc();
+        if (msg) {
+            if (ipc_receive_msg(msg, 0) == ECLIB_OK)
+                ipc_send((thread_id)msg->target, msg);
+            ipc_msg_free(msg);
+        }
 
         syscall_irq_check_timeouts();
 
-        /* Memory pressure: reset allocator scan hint if >80% used */
-        static uint32_t mm_counter = 0;
-        if (++mm_counter % 100u == 0u) {
-            uint32_t used = 0;
-            for (uint32_t i = 0; i < MAX_PAGES; i++)
-                if (page_bitmap[i >> 3] & (1u << (i & 7u)))
-                    used++;
-            if (used > (MAX_PAGES * 80u / 100u))
-                next_free_page = 0;
+        /* Bring in one more section of RAM while any is still pending */
+        uint32_t deferred = mm_deferred_init();
+
+        /*
+         * Memory pressure (an O(1) watermark check): tell subscribed
+         * services to shrink and return cached and pre-zeroed pages to
+         * the zones.  Otherwise keep this CPU's page magazine between
+         * its watermarks, clear a few more pages for zeroed allocations
+         * and, if free memory has become fragmented, spend a bounded
+         * slice rebuilding 2 MB blocks.
+         */
+        pressure_poll();
+        if (mm_pressure_level() != MM_PRESSURE_NONE) {
+            mm_zero_pool_drain();
+            mm_magazine_flush();
+        } else {
+            mm_magazine_balance();
+            mm_zero_pool_fill();
+            mm_compact_idle();
         }
 
-        __asm__ volatile("sti");
-
-        /* Halt until next interrupt */
-        __asm__ volatile("hlt");
+        /*
+         * Halt until the next interrupt.  With the dynamic tick, sleep
+         * through to the next IRQ-wait timeout, or pressure renotify;
+         * RAM still to bring in keeps the tick.
+         */
+        uint64_t next = deferred ? 0 : syscall_irq_next_timeout();
+        if (mm_pressure_level() != MM_PRESSURE_NONE) {
+            uint64_t renotify = time_get_current_ms() + PRESSURE_RENOTIFY_MS;
+            if (renotify < next)
+                next = renotify;
+        }
+        sched_idle(next);
     }
 }
@@ -0,0 +1,131 @@
+/*
+    E-comOS Kernel - Memory Pressure Notifications
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    mm only computes the level, in O(1), from the free-page count; the
+    messages are sent from the boot CPU's idle loop, never from an
+    allocation path that may be short of memory itself; crossing a mark
+    only wakes that CPU if it sleeps without a tick.  A subscriber whose
+    thread is gone is dropped on the next pass.
+*/
+
+#include <kernel/pressure.h>
+#include <kernel/ipc.h>
+#include <kernel/sched.h>
+#include <kernel/mm.h>
+#include <kernel/mm/slab.h>
+#include <kernel/time.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
+
+typedef struct {
+    uint32_t pid;
+    uint32_t min_level;
+    uint32_t told;        /* level last sent, MM_PRESSURE_NONE at first */
+} pressure_sub;
+
+/* A slot is active while it points at a subscriber taken from the cache */
+static pressure_sub *subs[PRESSURE_MAX_SUBS];
+static kmem_cache   *sub_cache;
+static spinlock_t    subs_lock = SPINLOCK_INIT;
+static uint32_t      level_seen = MM_PRESSURE_NONE;
+static uint64_t      last_notice_ms;
+
+/* A mark was crossed on some CPU: the idle loop should look now */
+static void pressure_kick(void) {
+    time_kick_boot(time_get_current_ms());
+}
+
+void pressure_init(void) {
+    sub_cache = kmem_cache_create("pressure_sub", sizeof(pressure_sub), 0, 0);
+    mm_pressure_set_notify(pressure_kick);
+}
+
+/* Caller holds subs_lock */
+static int find_sub(uint32_t pid) {
+    for (uint32_t i = 0; i < PRESSURE_MAX_SUBS; i++)
+        if (subs[i] && subs[i]->pid == pid)
+            return (int)i;
+    return -1;
+}
+
+static void release_sub(uint32_t idx) {
+    kmem_cache_free(sub_cache, subs[idx]);
+    subs[idx] = 0;
+}
+
+int pressure_subscribe(uint32_t pid, uint32_t min_level) {
+    if (pid == 0 || min_level > MM_PRESSURE_CRITICAL || !sub_cache)
+        return -1;
+    int rc = -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&subs_lock);
+    int idx = find_sub(pid);
+    if (min_level == MM_PRESSURE_NONE) {
+        if (idx >= 0)
+            release_sub((uint32_t)idx);
+        rc = 0;
+    } else if (idx >= 0) {
+        subs[idx]->min_level = min_level;
+        rc = 0;
+    } else {
+        for (uint32_t i = 0; i < PRESSURE_MAX_SUBS; i++) {
+            if (subs[i])
+                continue;
+            pressure_sub *s = kmem_cache_alloc(sub_cache);
+            if (s) {
+                s->pid       = pid;
+                s->min_level = min_level;
+                s->told      = MM_PRESSURE_NONE;
+                subs[i]      = s;
+                rc = 0;
+            }
+            break;
+        }
+    }
+    spin_unlock(&subs_lock);
+    cpu_irq_restore(irq);
+    return rc;
+}
+
+static void notify(pressure_sub *s, uint32_t level) {
+    pressure_notice n;
+    n.level        = level;
+    n.free_pages   = mm_get_free_pages();
+    n.total_pages  = mm_get_total_pages();
+    n.shrink_pages = mm_pressure_shrink();
+    if (ipc_send_msg(IPC_MSG_MEM_PRESSURE, 0, s->pid, sizeof n, &n) == ECLIB_OK)
+        s->told = level;
+}
+
+void pressure_poll(void) {
+    uint32_t level = mm_pressure_level();
+    uint64_t now   = time_get_current_ms();
+    int changed  = level != level_seen;
+    int renotify = !changed && level >= MM_PRESSURE_MEDIUM
+                && now - last_notice_ms >= PRESSURE_RENOTIFY_MS;
+    if (!changed && !renotify)
+        return;
+    level_seen     = level;
+    last_notice_ms = now;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&subs_lock);
+    for (uint32_t i = 0; i < PRESSURE_MAX_SUBS; i++) {
+        pressure_sub *s = subs[i];
+        if (!s)
+            continue;
+        Thread *t = sched_get_thread_by_pid(s->pid);
+        if (!t || t->state == THREAD_TERMINATED) {
+            release_sub(i);
+            continue;
+        }
+        /* At or above the threshold: every change, and reminders; below: the all-clear */
+        if (level >= s->min_level ? level != s->told || renotify
+                                  : s->told >= s->min_level)
+            notify(s, level);
+    }
+    spin_unlock(&subs_lock);
+    cpu_irq_restore(irq);
+}
@@ -4,36 +4,44 @@
 */
 
 #include <kernel/service.h>
+#include <kernel/mm/slab.h>
 
 #define MAX_SERVICES 32
 
-static Service service_table[MAX_SERVICES];
-static int     service_count = 0;
+static Service    *service_table[MAX_SERVICES];
+static kmem_cache *service_cache;
+static int         service_count = 0;
 
 int service_register(service_id id, uint32_t provider_pid, const char *name) {
     if (service_count >= MAX_SERVICES)
         return -1;
     for (int i = 0; i < service_count; i++) {
-        if (service_table[i].id == id)
+        if (service_table[i]->id == id)
             return -2; /* already registered */
     }
-    service_table[service_count].id          = id;
-    service_table[service_count].provider_pid = provider_pid;
-    service_table[service_count].capabilities = 0;
+    if (!service_cache)
+        service_cache = kmem_cache_create("service", sizeof(Service), 0, 0);
+    Service *svc = kmem_cache_alloc(service_cache);
+    if (!svc)
+        return -1;
+    svc->id          = id;
+    svc->provider_pid = provider_pid;
+    svc->capabilities = 0;
     /* copy name */
     int j = 0;
     while (name[j] && j < 31) {
-        service_table[service_count].name[j] = name[j];
+        svc->name[j] = name[j];
         j++;
     }
-    serviceTable[serviceCount].name[j] = '\0';
-    service_count++;
+    svc->name[j] = '\0';
+    service_table[service_count++] = svc;
     return 0;
 }
 
 int service_unregister(service_id id) {
     for (int i = 0; i < service_count; i++) {
-        if (service_table[i].id == id) {
+        if (service_table[i]->id == id) {
+            kmem_cache_free(service_cache, service_table[i]);
             service_table[i] = service_table[--service_count];
             return 0;
         }
@@ -43,8 +51,8 @@ int service_unregister(service_id id) {
 
 uint32_t service_lookup(service_id id) {
     for (int i = 0; i < service_count; i++) {
-        if (service_table[i].id == id)
-            return service_table[i].provider_pid;
+        if (service_table[i]->id == id)
+            return service_table[i]->provider_pid;
     }
     return 0;
 }
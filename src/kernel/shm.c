@@ -0,0 +1,336 @@
+/*
+    E-comOS Kernel - Shared Memory Objects
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    An object keeps its frames in a vmalloc'd array, so a large one
+    needs neither contiguous frames nor a contiguous table.  Mappings
+    go through as_map_free, one call per physically contiguous run, so
+    an object never lands on a region or on anything mapped already.
+    Frame references do the lifetime work: the object holds one on
+    every frame, each mapping another, and whoever drops the last
+    frees it.
+
+    The frames are charged to the creating space until the object is
+    freed, so a space cannot get round its limits through shared memory.
+
+    All object state is guarded by shm_lock, which is taken before any
+    address-space or page-table lock; frames and tables are released
+    after dropping it.
+*/
+
+#include <kernel/shm.h>
+#include <kernel/mm.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/vmalloc.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
+
+typedef struct shm_mapping {
+    struct shm_mapping *next;
+    address_space as;
+    uint32_t      flags;
+    uint64_t      vaddr;
+} shm_mapping;
+
+typedef struct {
+    address_space as;       /* 0 = unused */
+    uint32_t      rights;
+} shm_access;
+
+typedef struct shm_object {
+    shm_id        id;
+    address_space owner;    /* 0 once the handle is released */
+    address_space charged;  /* space the frames are charged to, 0 = none */
+    uint32_t      rights;
+    uint32_t      npages;
+    uint64_t     *frames;   /* physical addresses */
+    shm_mapping  *maps;
+    struct shm_object *next_dead;
+    shm_access    grants[SHM_MAX_GRANTS];
+} shm_object;
+
+/* An object lives in slot id % SHM_MAX_OBJECTS */
+static shm_object *objects[SHM_MAX_OBJECTS];
+static kmem_cache *object_cache;
+static kmem_cache *mapping_cache;
+static spinlock_t  shm_lock = SPINLOCK_INIT;
+static uint32_t    shm_next = 1;
+
+void shm_init(void) {
+    object_cache  = kmem_cache_create("shm_object", sizeof(shm_object), 0, 0);
+    mapping_cache = kmem_cache_create("shm_mapping", sizeof(shm_mapping), 0, 0);
+}
+
+/* Caller holds shm_lock */
+static shm_object *shm_lookup(shm_id id) {
+    shm_object *o = objects[id % SHM_MAX_OBJECTS];
+    return id && o && o->id == id ? o : NULL;
+}
+
+/* Rights space as holds on o.  Caller holds shm_lock. */
+static uint32_t rights_of(const shm_object *o, address_space as) {
+    if (as == o->owner)
+        return o->rights;
+    for (uint32_t i = 0; i < SHM_MAX_GRANTS; i++)
+        if (o->grants[i].as == as)
+            return o->grants[i].rights;
+    return 0;
+}
+
+/* Drop the object's own reference on n frames and free what is left */
+static void frames_release(uint64_t *frames, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++)
+        mm_page_unref((void *)(uintptr_t)frames[i]);
+    vfree(frames);
+}
+
+/* o is unlinked from the table; free it once nothing can reach it */
+static void object_free(shm_object *o) {
+    frames_release(o->frames, o->npages);
+    if (o->charged)
+        as_uncharge(o->charged, o->npages);
+    kmem_cache_free(object_cache, o);
+}
+
+/* Unlink o if its handle and all its mappings are gone.  Caller holds shm_lock. */
+static int object_unused(shm_object *o) {
+    if (o->owner || o->maps)
+        return 0;
+    objects[o->id % SHM_MAX_OBJECTS] = NULL;
+    return 1;
+}
+
+shm_id shm_create(address_space owner, uint64_t size, uint32_t rights) {
+    uint64_t npages = (size + PAGE_SIZE - 1u) / PAGE_SIZE;
+    if (!owner || npages == 0 || npages > UINT32_MAX / sizeof(uint64_t)
+            || (rights & ~SHM_RIGHTS) || !object_cache)
+        return 0;
+    if (as_charge(owner, npages) != 0)
+        return 0;
+    shm_object *o = kmem_cache_alloc(object_cache);
+    if (!o) {
+        as_uncharge(owner, npages);
+        return 0;
+    }
+    o->frames = vmalloc(npages * sizeof(uint64_t), 0);
+    if (!o->frames) {
+        kmem_cache_free(object_cache, o);
+        as_uncharge(owner, npages);
+        return 0;
+    }
+    for (uint32_t i = 0; i < npages; i++) {
+        void *frame = mm_alloc_page_flags(MM_ALLOC_ZEROED);
+        if (!frame) {
+            frames_release(o->frames, i);
+            kmem_cache_free(object_cache, o);
+            as_uncharge(owner, npages);
+            return 0;
+        }
+        o->frames[i] = (uint64_t)(uintptr_t)frame;
+    }
+    o->owner     = owner;
+    o->charged   = owner;
+    o->rights    = rights;
+    o->npages    = (uint32_t)npages;
+    o->maps      = NULL;
+    o->next_dead = NULL;
+    for (uint32_t i = 0; i < SHM_MAX_GRANTS; i++) {
+        o->grants[i].as     = 0;
+        o->grants[i].rights = 0;
+    }
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shm_lock);
+    shm_id id = 0;
+    for (uint32_t n = 0; n < SHM_MAX_OBJECTS && !id; n++) {
+        shm_id cand = shm_next;
+        shm_next = shm_next + 1u ? shm_next + 1u : 1u;
+        if (!objects[cand % SHM_MAX_OBJECTS]) {
+            o->id = id = cand;
+            objects[cand % SHM_MAX_OBJECTS] = o;
+        }
+    }
+    spin_unlock(&shm_lock);
+    cpu_irq_restore(irq);
+    if (!id) {
+        o->id = 0;
+        object_free(o);
+    }
+    return id;
+}
+
+int shm_grant(shm_id id, address_space owner, address_space to, uint32_t rights) {
+    if (!to || to == owner)
+        return -1;
+    int rc = -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shm_lock);
+    shm_object *o = shm_lookup(id);
+    if (o && o->owner && o->owner == owner && !(rights & ~o->rights)) {
+        shm_access *slot = NULL;
+        for (uint32_t i = 0; i < SHM_MAX_GRANTS; i++) {
+            if (o->grants[i].as == to) {
+                slot = &o->grants[i];
+                break;
+            }
+            if (!slot && o->grants[i].as == 0)
+                slot = &o->grants[i];
+        }
+        if (slot) {
+            slot->as     = rights ? to : 0;
+            slot->rights = rights;
+            rc = 0;
+        } else if (!rights) {
+            rc = 0;
+        }
+    }
+    spin_unlock(&shm_lock);
+    cpu_irq_restore(irq);
+    return rc;
+}
+
+int shm_map(shm_id id, address_space as, uint64_t vaddr, uint32_t flags) {
+    if ((vaddr & (PAGE_SIZE - 1u)) || vaddr < MM_USER_BASE || vaddr >= MM_USER_END
+            || !mapping_cache)
+        return -1;
+    shm_mapping *m = kmem_cache_alloc(mapping_cache);
+    if (!m)
+        return -1;
+    flags |= MM_FLAG_USER;
+
+    int rc = -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shm_lock);
+    shm_object *o = shm_lookup(id);
+    uint64_t size = o ? (uint64_t)o->npages * PAGE_SIZE : 0;
+    if (o && o->owner && !(flags & SHM_RIGHTS & ~rights_of(o, as))
+            && size <= MM_USER_END - vaddr) {
+        rc = 0;
+        uint32_t i = 0;
+        while (i < o->npages && rc == 0) {
+            uint32_t run = 1;
+            while (i + run < o->npages
+                   && o->frames[i + run] == o->frames[i] + (uint64_t)run * PAGE_SIZE)
+                run++;
+            rc = as_map_free(as, vaddr + (uint64_t)i * PAGE_SIZE, o->frames[i],
+                             (uint64_t)run * PAGE_SIZE, flags);
+            if (rc == 0)
+                i += run;
+        }
+        if (rc != 0) {
+            as_unmap(as, vaddr, (uint64_t)i * PAGE_SIZE);
+        } else {
+            for (i = 0; i < o->npages; i++)
+                mm_page_ref((void *)(uintptr_t)o->frames[i]);
+            m->as    = as;
+            m->flags = flags;
+            m->vaddr = vaddr;
+            m->next  = o->maps;
+            o->maps  = m;
+            m = NULL;
+        }
+    }
+    spin_unlock(&shm_lock);
+    cpu_irq_restore(irq);
+    if (m)
+        kmem_cache_free(mapping_cache, m);
+    return rc;
+}
+
+int shm_unmap(shm_id id, address_space as, uint64_t vaddr) {
+    shm_mapping *m = NULL;
+    shm_object  *dead = NULL;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shm_lock);
+    shm_object *o = shm_lookup(id);
+    shm_mapping **pp = o ? &o->maps : NULL;
+    while (pp && *pp && !((*pp)->as == as && (*pp)->vaddr == vaddr))
+        pp = &(*pp)->next;
+    if (pp && *pp) {
+        m   = *pp;
+        *pp = m->next;
+        /* Unmapped before the references go, so no TLB can reach a freed frame */
+        as_unmap(as, vaddr, (uint64_t)o->npages * PAGE_SIZE);
+        for (uint32_t i = 0; i < o->npages; i++)
+            mm_page_unref((void *)(uintptr_t)o->frames[i]);
+        if (object_unused(o))
+            dead = o;
+    }
+    spin_unlock(&shm_lock);
+    cpu_irq_restore(irq);
+    if (!m)
+        return -1;
+    kmem_cache_free(mapping_cache, m);
+    if (dead)
+        object_free(dead);
+    return 0;
+}
+
+int shm_release(shm_id id, address_space owner) {
+    shm_object *dead = NULL;
+    int rc = -1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shm_lock);
+    shm_object *o = shm_lookup(id);
+    if (o && o->owner && o->owner == owner) {
+        o->owner = 0;
+        if (object_unused(o))
+            dead = o;
+        rc = 0;
+    }
+    spin_unlock(&shm_lock);
+    cpu_irq_restore(irq);
+    if (dead)
+        object_free(dead);
+    return rc;
+}
+
+void shm_space_gone(address_space as) {
+    shm_object  *dead = NULL;
+    shm_mapping *gone = NULL;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&shm_lock);
+    for (uint32_t s = 0; s < SHM_MAX_OBJECTS; s++) {
+        shm_object *o = objects[s];
+        if (!o)
+            continue;
+        for (uint32_t i = 0; i < SHM_MAX_GRANTS; i++)
+            if (o->grants[i].as == as)
+                o->grants[i].as = 0;
+        if (o->owner == as)
+            o->owner = 0;
+        if (o->charged == as)
+            o->charged = 0;   /* the slot may be reused before o is freed */
+        /* Its page tables are gone: only the references are left */
+        shm_mapping **pp = &o->maps;
+        while (*pp) {
+            shm_mapping *m = *pp;
+            if (m->as != as) {
+                pp = &m->next;
+                continue;
+            }
+            for (uint32_t i = 0; i < o->npages; i++)
+                mm_page_unref((void *)(uintptr_t)o->frames[i]);
+            *pp = m->next;
+            m->next = gone;
+            gone = m;
+        }
+        if (object_unused(o)) {
+            o->next_dead = dead;
+            dead = o;
+        }
+    }
+    spin_unlock(&shm_lock);
+    cpu_irq_restore(irq);
+    while (gone) {
+        shm_mapping *m = gone;
+        gone = m->next;
+        kmem_cache_free(mapping_cache, m);
+    }
+    while (dead) {
+        shm_object *o = dead;
+        dead = o->next_dead;
+        object_free(o);
+    }
+}
@@ -0,0 +1,267 @@
+/*
+    E-comOS Kernel - Multiprocessor bring-up
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    The AP start-up code (arch/x86_64/cpu/ap_trampoline.s) is copied
+    below 1 MB, where a SIPI can point, and takes its CR3, stack and
+    entry from a parameter block at its end.  APs start one at a time,
+    so one block is enough: the next is not written until the previous
+    AP is online, which it becomes only after reading it.
+
+    A TLB shootdown leaves a request in each target's cpu_local and
+    sends an IPI; the sender spins until every target has flushed.  The
+    target may be spinning on a lock the sender holds, so lock waiters
+    answer requests too (cpu_ipi_poll).
+*/
+
+#include <kernel/smp.h>
+#include <kernel/acpi.h>
+#include <kernel/cpu.h>
+#include <kernel/mm.h>
+#include <kernel/sched.h>
+#include <kernel/time.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/fpu.h>
+#include <kernel/arch/lapic.h>
+#include <kernel/printkit/print.h>
+#include <kernel/internal/types.h>
+
+#define AP_TRAMPOLINE_BASE   0x8000u   /* must match ap_trampoline.s */
+#define AP_INIT_DELAY_MS     10u
+#define MADT_LAPIC_ADDR_OFF  36u
+#define MADT_ENTRIES_OFF     44u
+#define MADT_LAPIC           0u
+#define MADT_LAPIC_OVERRIDE  5u
+#define MADT_X2APIC          9u
+#define MADT_ENABLED         1u
+#define XAPIC_MAX_ID         0xFEu     /* 0xFF is the broadcast id */
+#define CR3_ADDR_MASK        0x000FFFFFFFFFF000ull
+
+/* Layout of the block at ap_trampoline_params */
+typedef struct {
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} ap_params;
+
+extern uint8_t ap_trampoline_start[], ap_trampoline_params[], ap_trampoline_end[];
+
+static cpu_local         cpu_locals[MAX_CPUS];
+static uint32_t          cpu_apic[MAX_CPUS];
+static uint64_t          boot_stack_top[MAX_CPUS];
+static uint32_t          nr_cpus = 1;
+static uint64_t          lapic_phys = LAPIC_DEFAULT_BASE;
+static volatile uint32_t online_mask = 1u;
+
+/* ---- Enumeration ---- */
+
+static void cpu_add(uint32_t apic_id) {
+    if (apic_id == cpu_apic[0] || apic_id > XAPIC_MAX_ID || nr_cpus == MAX_CPUS)
+        return;
+    cpu_apic[nr_cpus++] = apic_id;
+}
+
+static void madt_parse(const uint8_t *madt) {
+    uint32_t len = acpi_rd32(madt + 4);
+    lapic_phys = acpi_rd32(madt + MADT_LAPIC_ADDR_OFF);
+    for (uint32_t off = MADT_ENTRIES_OFF; off + 2u <= len; ) {
+        const uint8_t *e = madt + off;
+        uint32_t elen = e[1];
+        if (elen < 2u || off + elen > len)
+            break;
+        switch (e[0]) {
+        case MADT_LAPIC:
+            if (elen >= 8u && (acpi_rd32(e + 4) & MADT_ENABLED))
+                cpu_add(e[3]);
+            break;
+        case MADT_X2APIC:
+            if (elen >= 16u && (acpi_rd32(e + 8) & MADT_ENABLED))
+                cpu_add(acpi_rd32(e + 4));
+            break;
+        case MADT_LAPIC_OVERRIDE:
+            if (elen >= 12u)
+                lapic_phys = acpi_rd64(e + 4);
+            break;
+        default:
+            break;
+        }
+        off += elen;
+    }
+}
+
+void smp_init(void) {
+    cpu_apic[0] = cpu_apic_id();
+    cpu_local_init(&cpu_locals[0], 0, cpu_apic[0]);
+    const uint8_t *madt = acpi_find_table("APIC");
+    if (madt)
+        madt_parse(madt);
+    if (nr_cpus > 1u) {
+        print_str("SMP: ", 0x0A);
+        print_num(nr_cpus, 0x0A);
+        print_str(" CPUs in MADT\n", 0x0A);
+    }
+}
+
+/* ---- IPIs ---- */
+
+void cpu_ipi_service(void) {
+    cpu_local *l = cpu_local_self();
+    uint32_t req = __atomic_load_n(&l->ipi_pending, __ATOMIC_ACQUIRE);
+    if (req & CPU_IPI_TLB_GLOBAL) {
+        mm_tlb_flush_all();
+    } else if (req & CPU_IPI_TLB) {
+        /* Drops the loaded PCID's entries; other PCIDs were made stale */
+        uint64_t cr3;
+        __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+        __asm__ volatile("movq %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+    /* Cleared only now: the sender waits for the flush, not the read */
+    __atomic_and_fetch(&l->ipi_pending, ~req, __ATOMIC_RELEASE);
+}
+
+static void smp_tlb_shootdown(uint32_t cpus, int global) {
+    uint32_t req = global ? CPU_IPI_TLB_GLOBAL : CPU_IPI_TLB;
+    cpus &= online_mask;
+    for (uint32_t cpu = 0; cpu < nr_cpus; cpu++) {
+        if (!(cpus & (1u << cpu)))
+            continue;
+        __atomic_or_fetch(&cpu_locals[cpu].ipi_pending, req, __ATOMIC_RELEASE);
+        lapic_send_ipi(cpu_apic[cpu], (uint8_t)IRQ_VECTOR(IRQ_IPI_TLB));
+    }
+    for (uint32_t cpu = 0; cpu < nr_cpus; cpu++) {
+        if (!(cpus & (1u << cpu)))
+            continue;
+        while (__atomic_load_n(&cpu_locals[cpu].ipi_pending, __ATOMIC_ACQUIRE) & req) {
+            __asm__ volatile("pause");
+            cpu_ipi_poll();   /* it may be waiting on us as well */
+        }
+    }
+}
+
+void smp_send_resched(uint32_t cpu) {
+    if (cpu < nr_cpus && cpu != cpu_current_id() && (online_mask & (1u << cpu)))
+        lapic_send_ipi(cpu_apic[cpu], (uint8_t)IRQ_VECTOR(IRQ_IPI_RESCHED));
+}
+
+uint32_t smp_cpu_count(void) {
+    return nr_cpus;
+}
+
+uint32_t smp_online_mask(void) {
+    return online_mask;
+}
+
+/* ---- AP start-up ---- */
+
+static void delay_ms(uint64_t ms) {
+    uint64_t start = time_get_current_ms();
+    while (time_get_current_ms() - start < ms)
+        __asm__ volatile("pause");
+}
+
+/* Entered from the trampoline on the AP's boot stack, which becomes its idle thread */
+static void ap_main(uint32_t cpu) {
+    gdt_load_cpu(cpu, boot_stack_top[cpu]);
+    cpu_local_init(&cpu_locals[cpu], cpu, cpu_apic[cpu]);
+    idt_load();
+    fpu_cpu_init();
+    mm_pt_load(NULL, 0, 1);
+    lapic_enable();
+    mm_numa_set_cpu(cpu, cpu_apic[cpu]);
+    sched_cpu_start(cpu);
+    lapic_timer_start((uint8_t)IRQ_VECTOR(IRQ_LAPIC_TIMER));
+    __atomic_or_fetch(&online_mask, 1u << cpu, __ATOMIC_RELEASE);
+    __asm__ volatile("sti");
+
+    /* Idle loop: work arrives by IPI, or is stolen on a timer tick */
+    for (;;) {
+        sched_schedule();
+        mm_magazine_poll();
+        sched_idle(TIME_NEVER);
+    }
+}
+
+static int ap_start(uint32_t cpu, uint64_t cr3) {
+    void *stack = mm_alloc_pages(SCHED_KSTACK_PAGES);
+    if (!stack)
+        return -1;
+    ap_params *p = (ap_params *)(uintptr_t)(AP_TRAMPOLINE_BASE
+                   + (uint32_t)(ap_trampoline_params - ap_trampoline_start));
+    uint64_t cr4;
+    __asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+    p->cr3   = cr3;
+    p->cr4   = cr4;
+    p->efer  = cpu_rdmsr(0xC0000080u);
+    boot_stack_top[cpu] = (uint64_t)(uintptr_t)stack + (uint64_t)SCHED_KSTACK_PAGES * PAGE_SIZE;
+    p->stack = boot_stack_top[cpu];
+    p->entry = (uint64_t)(uintptr_t)ap_main;
+    p->cpu   = cpu;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    lapic_send_init(cpu_apic[cpu]);
+    delay_ms(AP_INIT_DELAY_MS);
+    /* The second SIPI is only for CPUs that missed the first */
+    for (uint32_t sipi = 0; sipi < 2u; sipi++) {
+        lapic_send_sipi(cpu_apic[cpu], (uint8_t)(AP_TRAMPOLINE_BASE >> 12));
+        uint64_t start = time_get_current_ms();
+        uint64_t wait  = sipi ? SMP_AP_START_MS : 1u;
+        while (!(online_mask & (1u << cpu)) && time_get_current_ms() - start <= wait)
+            __asm__ volatile("pause");
+        if (online_mask & (1u << cpu))
+            return 0;
+    }
+    /*
+     * The CPU may still come up late and run on this stack, possibly
+     * holding a lock by then: leave the stack to it rather than free it.
+     */
+    return -1;
+}
+
+void smp_boot_aps(void) {
+    /* One CPU still wants its local APIC timer, for the dynamic tick */
+    if (lapic_init(lapic_phys) != 0) {
+        if (nr_cpus > 1u)
+            print_str("SMP: cannot start other CPUs\n", 0x0C);
+        return;
+    }
+    lapic_enable();
+    lapic_timer_calibrate();
+    irq_install_handler(IRQ_LAPIC_TIMER, sched_tick);
+    if (nr_cpus < 2u)
+        return;
+
+    uint64_t cr3;
+    __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+    cr3 &= CR3_ADDR_MASK;
+    /* The trampoline loads CR3 before long mode: 32 bits only */
+    if (cr3 >> 32) {
+        print_str("SMP: cannot start other CPUs\n", 0x0C);
+        return;
+    }
+    irq_install_handler(IRQ_IPI_TLB, cpu_ipi_service);
+    /* The resched IPI needs no handler: the interrupt exit schedules */
+    mm_tlb_set_shootdown(smp_tlb_shootdown);
+
+    uint8_t *dst = (uint8_t *)(uintptr_t)AP_TRAMPOLINE_BASE;
+    for (uint32_t i = 0; i < (uint32_t)(ap_trampoline_end - ap_trampoline_start); i++)
+        dst[i] = ap_trampoline_start[i];
+
+    uint32_t up = 1;
+    for (uint32_t cpu = 1; cpu < nr_cpus; cpu++) {
+        /* A late AP would read the next one's parameters: stop here */
+        if (ap_start(cpu, cr3) != 0) {
+            print_str("SMP: CPU ", 0x0C);
+            print_num(cpu, 0x0C);
+            print_str(" did not start\n", 0x0C);
+            break;
+        }
+        up++;
+    }
+    print_str("SMP: ", 0x0A);
+    print_num(up, 0x0A);
+    print_str(" CPUs online\n", 0x0A);
+}
@@ -20,7 +20,13 @@
 #include <kernel/ipc.h>
 #include <kernel/sched.h>
 #include <kernel/mm.h>
+#include <kernel/address_space.h>
+#include <kernel/pressure.h>
+#include <kernel/shm.h>
+#include <kernel/mm/slab.h>
 #include <kernel/time.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
 #include <stdint.h>
 
 #define MAX_IRQ_WAITERS 16
@@ -32,19 +38,25 @@ typedef struct {
     uint8_t  flags;
     uint32_t timeout_ms;
     uint64_t start_time;
-    uint8_t  is_active;
 } irq_waiter;
 
-static irq_waiter     irq_waiters[MAX_IRQ_WAITERS];
+/*
+ * A slot is active while it points at a waiter taken from the cache.
+ * The table is guarded by waiters_lock, taken before any scheduler
+ * lock: a waiter checks and blocks under it, so a notification from
+ * another CPU cannot slip in between.
+ */
+static spinlock_t     waiters_lock = SPINLOCK_INIT;
+static irq_waiter    *irq_waiters[MAX_IRQ_WAITERS];
+static kmem_cache    *irq_waiter_cache;
 static uint32_t      num_waiters = 0;
 static volatile uint32_t irq_occurred[MAX_IRQS];
 static volatile uint32_t irq_occurrence_count[MAX_IRQS];
 
 void syscall_irq_init(void) {
-    for (int i = 0; i < MAX_IRQ_WAITERS; i++) {
-        irq_waiters[i].pid      = 0;
-        irq_waiters[i].is_active = 0;
-    }
+    irq_waiter_cache = kmem_cache_create("irq_waiter", sizeof(irq_waiter), 0, 0);
+    for (int i = 0; i < MAX_IRQ_WAITERS; i++)
+        irq_waiters[i] = 0;
     for (int i = 0; i < MAX_IRQS; i++) {
         irq_occurred[i]         = 0;
         irq_occurrence_count[i]  = 0;
@@ -52,11 +64,17 @@ void syscall_irq_init(void) {
     num_waiters = 0;
 }
 
+/* Caller holds waiters_lock for these */
+static void release_irq_waiter(uint32_t idx) {
+    kmem_cache_free(irq_waiter_cache, irq_waiters[idx]);
+    irq_waiters[idx] = 0;
+}
+
 static int find_irq_waiter(uint32_t pid, uint8_t irq_num) {
     for (uint32_t i = 0; i < num_waiters; i++) {
-        if (irq_waiters[i].is_active &&
-            irq_waiters[i].pid == pid &&
-            irq_waiters[i].irq_number == irq_num)
+        if (irq_waiters[i] &&
+            irq_waiters[i]->pid == pid &&
+            irq_waiters[i]->irq_number == irq_num)
             return (int)i;
     }
     return -1;
@@ -67,15 +85,21 @@ static int add_irq_waiter(uint32_t pid, uint8_t irq_num,
     if (find_irq_waiter(pid, irq_num) >= 0)
         return -2;
     for (uint32_t i = 0; i < MAX_IRQ_WAITERS; i++) {
-        if (!irq_waiters[i].is_active) {
-            irq_waiters[i].pid       = pid;
-            irq_waiters[i].irq_number = irq_num;
-            irq_waiters[i].flags     = flags;
-            irq_waiters[i].timeout_ms = timeout_ms;
-            irq_waiters[i].start_time = time_get_current_ms();
-            irq_waiters[i].is_active  = 1;
+        if (!irq_waiters[i]) {
+            irq_waiter *w = kmem_cache_alloc(irq_waiter_cache);
+            if (!w)
+                return -1;
+            w->pid        = pid;
+            w->irq_number = irq_num;
+            w->flags      = flags;
+            w->timeout_ms = timeout_ms;
+            w->start_time = time_get_current_ms();
+            irq_waiters[i] = w;
             if (i >= num_waiters)
                 num_waiters = i + 1;
+            /* Timeouts are checked by the boot CPU, which may be asleep */
+            if (timeout_ms)
+                time_kick_boot(w->start_time + timeout_ms);
             return 0;
         }
     }
@@ -85,42 +109,61 @@ static int add_irq_waiter(uint32_t pid, uint8_t irq_num,
 static void remove_irq_waiter(uint32_t pid, uint8_t irq_num) {
     int idx = find_irq_waiter(pid, irq_num);
     if (idx >= 0)
-        irq_waiters[idx].is_active = 0;
+        release_irq_waiter((uint32_t)idx);
 }
 
 void syscall_irq_notify(uint8_t irq_num) {
     if (irq_num >= MAX_IRQS)
         return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&waiters_lock);
     irq_occurred[irq_num] = 1;
     irq_occurrence_count[irq_num]++;
     for (uint32_t i = 0; i < num_waiters; i++) {
-        if (!irq_waiters[i].is_active) continue;
-        if (irq_waiters[i].irq_number != irq_num) continue;
-        irq_waiters[i].is_active = 0;
-        Thread *t = sched_get_thread_by_pid(irq_waiters[i].pid);
-        if (t && t->state == THREAD_BLOCKED) {
-            t->state       = THREAD_READY;
-            t->block_reason = BLOCK_REASON_NONE;
-        }
+        if (!irq_waiters[i]) continue;
+        if (irq_waiters[i]->irq_number != irq_num) continue;
+        uint32_t pid = irq_waiters[i]->pid;
+        release_irq_waiter(i);
+        sched_wakeup(sched_get_thread_by_pid(pid));
     }
+    spin_unlock(&waiters_lock);
+    cpu_irq_restore(irq);
 }
 
 void syscall_irq_check_timeouts(void) {
     uint64_t now = time_get_current_ms();
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&waiters_lock);
     for (uint32_t i = 0; i < num_waiters; i++) {
-        if (!irq_waiters[i].is_active) continue;
-        if (irq_waiters[i].timeout_ms == 0) continue;
-        uint64_t elapsed = now - irq_waiters[i].start_time;
-        if (elapsed < irq_waiters[i].timeout_ms) continue;
-        uint32_t pid = irq_waiters[i].pid;
-        irq_waiters[i].is_active = 0;
+        if (!irq_waiters[i]) continue;
+        if (irq_waiters[i]->timeout_ms == 0) continue;
+        uint64_t elapsed = now - irq_waiters[i]->start_time;
+        if (elapsed < irq_waiters[i]->timeout_ms) continue;
+        uint32_t pid = irq_waiters[i]->pid;
+        release_irq_waiter(i);
         Thread *t = sched_get_thread_by_pid(pid);
         if (t && t->state == THREAD_BLOCKED) {
-            t->state       = THREAD_READY;
-            t->block_reason = BLOCK_REASON_NONE;
-            t->last_error   = ERR_TIMEOUT;
+            t->last_error = ERR_TIMEOUT;
+            sched_wakeup(t);
         }
     }
+    spin_unlock(&waiters_lock);
+    cpu_irq_restore(irq);
+}
+
+uint64_t syscall_irq_next_timeout(void) {
+    uint64_t next = TIME_NEVER;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&waiters_lock);
+    for (uint32_t i = 0; i < num_waiters; i++) {
+        if (!irq_waiters[i] || irq_waiters[i]->timeout_ms == 0) continue;
+        uint64_t due = irq_waiters[i]->start_time + irq_waiters[i]->timeout_ms;
+        if (due < next)
+            next = due;
+    }
+    spin_unlock(&waiters_lock);
+    cpu_irq_restore(irq);
+    return next;
 }
 
 static long irq_wait_syscall(uint8_t irq_num, uint8_t flags, uint32_t timeout_ms) {
@@ -133,25 +176,38 @@ static long irq_wait_syscall(uint8_t irq_num, uint8_t flags, uint32_t timeout_ms
         return 0;
     }
     if (flags & IRQ_WAIT_NOWAIT) return -2;
-    int rc = add_irq_waiter(pid, irq_num, flags, timeout_ms);
-    if (rc < 0) return rc;
     Thread *t = sched_get_current_thread();
-    if (!t) {
-        remove_irq_waiter(pid, irq_num);
+    if (!t)
         return -4;
-    }
-    t->state                = THREAD_BLOCKED;
-    t->block_reason          = BLOCK_REASON_IRQ_WAIT;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&waiters_lock);
+    int rc = add_irq_waiter(pid, irq_num, flags, timeout_ms);
+    spin_unlock(&waiters_lock);
+    cpu_irq_restore(irq);
+    if (rc < 0) return rc;
     t->block_data.irq_num     = irq_num;
-    while (!irq_occurred[irq_num]) {
-        syscall_irq_check_timeouts();
-        if (find_irq_waiter(pid, irq_num) < 0)
+    for (;;) {
+        /* Check and block under the lock, so the IRQ cannot slip in between */
+        irq = cpu_irq_save();
+        spin_lock(&waiters_lock);
+        if (irq_occurred[irq_num] || find_irq_waiter(pid, irq_num) < 0) {
+            spin_unlock(&waiters_lock);
+            cpu_irq_restore(irq);
             break;
-        sched_yield();
+        }
+        sched_block(t, BLOCK_REASON_IRQ_WAIT);
+        spin_unlock(&waiters_lock);
+        sched_schedule();   /* back once notified or timed out */
+        cpu_irq_restore(irq);
+        syscall_irq_check_timeouts();
     }
+    irq = cpu_irq_save();
+    spin_lock(&waiters_lock);
     if (irq_occurred[irq_num] && (flags & IRQ_WAIT_CLEAR))
         irq_occurred[irq_num] = 0;
     remove_irq_waiter(pid, irq_num);
+    spin_unlock(&waiters_lock);
+    cpu_irq_restore(irq);
     if (t->last_error == ERR_TIMEOUT) {
         t->last_error = 0;
         return -3;
@@ -159,7 +215,30 @@ static long irq_wait_syscall(uint8_t irq_num, uint8_t flags, uint32_t timeout_ms
     return 0;
 }
 
-long syscall_handler(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+/* Address space of process pid, 0 for the caller; 0 if it has none */
+static address_space space_of(uint32_t pid) {
+    Thread *t = pid ? sched_get_thread_by_pid(pid) : sched_get_current_thread();
+    return t && t->state != THREAD_TERMINATED ? t->space : 0;
+}
+
+/* Threads the kernel marked with sched_set_privileged */
+static int caller_privileged(void) {
+    Thread *t = sched_get_current_thread();
+    return t && t->privileged;
+}
+
+/* Others may lower their priority, but not raise it past the default */
+static long set_own_priority(uint32_t prio) {
+    uint32_t pid = sched_get_current_pid();
+    int cur = sched_get_priority(pid);
+    if (cur < 0)
+        return -1;
+    if (!caller_privileged() && prio > (uint32_t)cur && prio > SCHED_PRIO_DEFAULT)
+        return -1;
+    return sched_set_priority(pid, prio);
+}
+
+static long syscall_dispatch(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
     switch (num) {
     case SYS_IPC_SEND:
         return ipc_send((thread_id)arg1, (ipc_message_t *)(uintptr_t)arg2);
@@ -170,6 +249,70 @@ long syscall_handler(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3)
         return 0;
     case SYS_ADDRESS_MAP:
         return mm_map_page(arg1, arg2, arg3);
+    case SYS_ADDRESS_MAP_RANGE: {
+        /* Only into the caller's own user range */
+        sys_map_range_t req;
+        address_space as = as_get_current();
+        if (as_copy_in(as, &req, arg1, sizeof req) != 0)
+            return -1;
+        return as_map(as, req.vaddr, req.paddr, req.size, req.flags);
+    }
+    case SYS_ADDRESS_CLONE: {
+        address_space as = as_clone(as_get_current());
+        return as ? (long)as : -1;
+    }
+    case SYS_ADDRESS_DESTROY:
+        return as_destroy_clone(as_get_current(), arg1);
+    /* A process may only look at and limit its own space */
+    case SYS_MEM_STATS: {
+        as_usage u;
+        if (arg1 && arg1 != sched_get_current_pid())
+            return -1;
+        if (as_usage_get(space_of(0), &u) != 0)
+            return -1;
+        return as_copy_out(space_of(0), arg2, &u, sizeof u);
+    }
+    case SYS_MEM_LIMIT:
+        if (arg1 && arg1 != sched_get_current_pid())
+            return -1;
+        return as_set_limits(space_of(0), arg2, arg3);
+    case SYS_MEM_PRESSURE:
+        if (pressure_subscribe(sched_get_current_pid(), arg1) != 0)
+            return -1;
+        return (long)mm_pressure_level();
+    case SYS_SHM_CREATE: {
+        shm_id id = shm_create(as_get_current(), arg1, arg2);
+        return id ? (long)id : -1;
+    }
+    case SYS_SHM_GRANT:
+        return shm_grant(arg1, as_get_current(), space_of(arg2), arg3);
+    case SYS_SHM_MAP:
+    case SYS_SHM_UNMAP: {
+        sys_shm_map_t req;
+        address_space as = as_get_current();
+        if (as_copy_in(as, &req, arg1, sizeof req) != 0)
+            return -1;
+        if (num == SYS_SHM_MAP)
+            return shm_map(req.id, as, req.vaddr, req.flags);
+        return shm_unmap(req.id, as, req.vaddr);
+    }
+    case SYS_SHM_RELEASE:
+        return shm_release(arg1, as_get_current());
+    case SYS_THREAD_GET_PRIORITY:
+        return sched_get_priority(arg1 ? arg1 : sched_get_current_pid());
+    case SYS_THREAD_SET_PRIORITY:
+        /* Only a thread's own priority: no one may starve another */
+        if (arg1 && arg1 != sched_get_current_pid())
+            return -1;
+        return set_own_priority(arg2);
+    case SYS_SCHED_QUANTUM:
+        if (arg2 && (!caller_privileged() || sched_set_quantum(arg1, arg2) != 0))
+            return -1;
+        return sched_get_quantum(arg1);
+    case SYS_TIMER_SLACK:
+        if (arg1 && (!caller_privileged() || time_set_slack(arg1) != 0))
+            return -1;
+        return time_get_slack();
     case SYS_IRQ_WAIT:
         return irq_wait_syscall((uint8_t)arg1, (uint8_t)arg2, arg3);
     case SYS_IRQ_GET_COUNT:
@@ -182,3 +325,11 @@ long syscall_handler(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3)
         return -1;
     }
 }
+
+long syscall_handler(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    long rc = syscall_dispatch(num, arg1, arg2, arg3);
+    /* Leaving the kernel is a preemption point for threads it woke */
+    if (sched_need_resched())
+        sched_schedule();
+    return rc;
+}
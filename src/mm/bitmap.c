@@ -0,0 +1,175 @@
+/*
+    E-comOS Kernel - Two-Level Page Bitmap
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    Storage layout: [leaf words][summary words], both 64-bit.
+    Leaf updates are single locked RMW instructions; the summary bit of a
+    word is refreshed only when the word turns full or stops being full.
+*/
+
+#include <kernel/mm/bitmap.h>
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                             */
+/* ------------------------------------------------------------------ */
+static inline uint32_t popcnt64(uint64_t v) {
+    uint64_t r;
+    __asm__("popcntq %1, %0" : "=r"(r) : "rm"(v));
+    return (uint32_t)r;
+}
+
+/* Bits [lo, hi) of one word, 0 ≤ lo < hi ≤ 64 */
+static inline uint64_t word_mask(uint32_t lo, uint32_t hi) {
+    uint64_t upto = hi == 64u ? ~0ull : (1ull << hi) - 1u;
+    return upto & ~((1ull << lo) - 1u);
+}
+
+/*
+ * Make summary bit w agree with words[w].  Another CPU may flip the
+ * word between our read and our summary write, so re-check afterwards;
+ * whichever CPU writes the summary last also verifies it.
+ */
+static void summary_sync(mm_bitmap *b, uint32_t w) {
+    uint64_t *s  = &b->summary[w >> 6];
+    uint64_t bit = 1ull << (w & 63u);
+    for (;;) {
+        int has_zero = __atomic_load_n(&b->words[w], __ATOMIC_RELAXED) != ~0ull;
+        if (has_zero)
+            __atomic_fetch_or(s, bit, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(s, ~bit, __ATOMIC_RELAXED);
+        if ((__atomic_load_n(&b->words[w], __ATOMIC_RELAXED) != ~0ull) == has_zero)
+            return;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Public interface                                                    */
+/* ------------------------------------------------------------------ */
+size_t mm_bitmap_bytes(uint32_t nbits) {
+    size_t nwords = ((size_t)nbits + 63u) / 64u;
+    return (nwords + (nwords + 63u) / 64u) * sizeof(uint64_t);
+}
+
+void mm_bitmap_attach(mm_bitmap *b, void *storage, uint32_t nbits) {
+    size_t nwords = ((size_t)nbits + 63u) / 64u;
+    b->words   = (uint64_t *)storage;
+    b->summary = b->words + nwords;
+    b->nbits   = nbits;
+    b->nr_set  = 0;
+}
+
+void mm_bitmap_init_range(mm_bitmap *b, uint32_t from, uint32_t to, int value) {
+    if (from >= to)
+        return;
+    for (uint32_t w = from >> 6; w <= (to - 1u) >> 6; w++) {
+        uint32_t lo = w == from >> 6 ? from & 63u : 0u;
+        uint32_t hi = w == (to - 1u) >> 6 ? ((to - 1u) & 63u) + 1u : 64u;
+        /* Padding past nbits reads as allocated so the last word can fill */
+        if (value && to == b->nbits && w == (to - 1u) >> 6)
+            hi = 64u;
+        uint64_t m = word_mask(lo, hi);
+        if (value)
+            __atomic_fetch_or(&b->words[w], m, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(&b->words[w], ~m, __ATOMIC_RELAXED);
+        summary_sync(b, w);
+    }
+    if (value)
+        __atomic_add_fetch(&b->nr_set, to - from, __ATOMIC_RELAXED);
+}
+
+int mm_bitmap_set(mm_bitmap *b, uint32_t i) {
+    uint32_t w   = i >> 6;
+    uint64_t bit = 1ull << (i & 63u);
+    uint64_t old = __atomic_fetch_or(&b->words[w], bit, __ATOMIC_RELAXED);
+    if (old & bit)
+        return 1;
+    __atomic_add_fetch(&b->nr_set, 1u, __ATOMIC_RELAXED);
+    if ((old | bit) == ~0ull)
+        summary_sync(b, w);
+    return 0;
+}
+
+int mm_bitmap_clear(mm_bitmap *b, uint32_t i) {
+    uint32_t w   = i >> 6;
+    uint64_t bit = 1ull << (i & 63u);
+    uint64_t old = __atomic_fetch_and(&b->words[w], ~bit, __ATOMIC_RELAXED);
+    if (!(old & bit))
+        return 0;
+    __atomic_sub_fetch(&b->nr_set, 1u, __ATOMIC_RELAXED);
+    if (old == ~0ull)
+        summary_sync(b, w);
+    return 1;
+}
+
+uint32_t mm_bitmap_set_range(mm_bitmap *b, uint32_t from, uint32_t to) {
+    uint32_t changed = 0;
+    if (from >= to)
+        return 0;
+    for (uint32_t w = from >> 6; w <= (to - 1u) >> 6; w++) {
+        uint32_t lo = w == from >> 6 ? from & 63u : 0u;
+        uint32_t hi = w == (to - 1u) >> 6 ? ((to - 1u) & 63u) + 1u : 64u;
+        uint64_t m   = word_mask(lo, hi);
+        uint64_t old = __atomic_fetch_or(&b->words[w], m, __ATOMIC_RELAXED);
+        uint32_t n   = popcnt64(m & ~old);
+        changed += n;
+        if (n && (old | m) == ~0ull)
+            summary_sync(b, w);
+    }
+    __atomic_add_fetch(&b->nr_set, changed, __ATOMIC_RELAXED);
+    return changed;
+}
+
+uint32_t mm_bitmap_clear_range(mm_bitmap *b, uint32_t from, uint32_t to) {
+    uint32_t changed = 0;
+    if (from >= to)
+        return 0;
+    for (uint32_t w = from >> 6; w <= (to - 1u) >> 6; w++) {
+        uint32_t lo = w == from >> 6 ? from & 63u : 0u;
+        uint32_t hi = w == (to - 1u) >> 6 ? ((to - 1u) & 63u) + 1u : 64u;
+        uint64_t m   = word_mask(lo, hi);
+        uint64_t old = __atomic_fetch_and(&b->words[w], ~m, __ATOMIC_RELAXED);
+        uint32_t n   = popcnt64(m & old);
+        changed += n;
+        if (n && old == ~0ull)
+            summary_sync(b, w);
+    }
+    __atomic_sub_fetch(&b->nr_set, changed, __ATOMIC_RELAXED);
+    return changed;
+}
+
+uint32_t mm_bitmap_find_next_zero(const mm_bitmap *b, uint32_t from, uint32_t to) {
+    if (from >= to)
+        return to;
+
+    /* Partial first word */
+    uint32_t w    = from >> 6;
+    uint32_t last = (to - 1u) >> 6;
+    uint64_t bits = ~b->words[w] & ~((1ull << (from & 63u)) - 1u);
+    if (bits) {
+        uint32_t r = (w << 6) + (uint32_t)__builtin_ctzll(bits);
+        return r < to ? r : to;
+    }
+
+    /* Then let the summary skip full words 64 at a time */
+    w++;
+    while (w <= last) {
+        uint64_t s = b->summary[w >> 6] & (~0ull << (w & 63u));
+        if (!s) {
+            w = (w | 63u) + 1u;
+            continue;
+        }
+        w = (w & ~63u) + (uint32_t)__builtin_ctzll(s);
+        if (w > last)
+            break;
+        bits = ~b->words[w];
+        if (bits) {
+            uint32_t r = (w << 6) + (uint32_t)__builtin_ctzll(bits);
+            return r < to ? r : to;
+        }
+        w++;    /* stale hint: the word filled up after the summary read */
+    }
+    return to;
+}
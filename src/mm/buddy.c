@@ -0,0 +1,190 @@
+/*
+    E-comOS Kernel - Binary Buddy Page Allocator
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    Free lists are doubly linked through the zone's node array rather than
+    through the free frames themselves, so the allocator never touches the
+    memory it hands out.
+*/
+
+#include <kernel/mm/buddy.h>
+
+/* ------------------------------------------------------------------ */
+/* Free-list helpers                                                   */
+/* ------------------------------------------------------------------ */
+static inline buddy_node *node_at(const buddy_zone *z, uint32_t idx) {
+    return (buddy_node *)((uint8_t *)z->nodes + (uint64_t)idx * z->stride);
+}
+
+static void list_push(buddy_zone *z, uint32_t idx, uint32_t order) {
+    buddy_node *n = node_at(z, idx);
+    n->order = (uint8_t)order;
+    n->free  = 1;
+    n->prev  = BUDDY_NONE;
+    n->next  = z->free_head[order];
+    if (n->next != BUDDY_NONE)
+        node_at(z, n->next)->prev = idx;
+    z->free_head[order] = idx;
+    z->nr_free[order]++;
+    z->order_mask |= 1u << order;
+    z->free_pages += 1u << order;
+}
+
+static void list_unlink(buddy_zone *z, uint32_t idx) {
+    buddy_node *n = node_at(z, idx);
+    uint32_t order = n->order;
+    if (n->prev != BUDDY_NONE)
+        node_at(z, n->prev)->next = n->next;
+    else
+        z->free_head[order] = n->next;
+    if (n->next != BUDDY_NONE)
+        node_at(z, n->next)->prev = n->prev;
+    n->free = 0;
+    n->next = n->prev = BUDDY_NONE;
+    if (--z->nr_free[order] == 0)
+        z->order_mask &= ~(1u << order);
+    z->free_pages -= 1u << order;
+}
+
+/* Largest order a block starting at idx may have (alignment + bound). */
+static uint32_t max_order_at(const buddy_zone *z, uint32_t idx, uint32_t count) {
+    uint64_t pfn = z->base_pfn + idx;
+    uint32_t order = 0;
+    while (order < BUDDY_MAX_ORDER
+           && !(pfn & (1ull << order))
+           && (2u << order) <= count)
+        order++;
+    return order;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public interface                                                    */
+/* ------------------------------------------------------------------ */
+void buddy_zone_init(buddy_zone *z, uint64_t base_pfn, uint32_t nr_pages,
+                     buddy_node *nodes, uint32_t stride) {
+    z->base_pfn   = base_pfn;
+    z->nr_pages   = nr_pages;
+    z->free_pages = 0;
+    z->order_mask = 0;
+    z->stride     = stride;
+    z->nodes      = nodes;
+    for (uint32_t k = 0; k < BUDDY_NR_ORDERS; k++) {
+        z->free_head[k] = BUDDY_NONE;
+        z->nr_free[k]   = 0;
+    }
+}
+
+void buddy_init_nodes(buddy_zone *z, uint32_t idx, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        buddy_node *n = node_at(z, idx + i);
+        n->next  = BUDDY_NONE;
+        n->prev  = BUDDY_NONE;
+        n->order = 0;
+        n->free  = 0;
+    }
+}
+
+uint32_t buddy_order_for(uint32_t count) {
+    uint32_t order = 0;
+    while ((1u << order) < count)
+        order++;
+    return order;
+}
+
+uint32_t buddy_alloc(buddy_zone *z, uint32_t order) {
+    if (order > BUDDY_MAX_ORDER)
+        return BUDDY_NONE;
+
+    /* Smallest non-empty list at or above the requested order */
+    uint32_t avail = z->order_mask & ~((1u << order) - 1u);
+    if (!avail)
+        return BUDDY_NONE;
+    uint32_t k = (uint32_t)__builtin_ctz(avail);
+
+    uint32_t idx = z->free_head[k];
+    list_unlink(z, idx);
+
+    /* Split down, returning the upper half of each split */
+    while (k > order) {
+        k--;
+        list_push(z, idx + (1u << k), k);
+    }
+    node_at(z, idx)->order = (uint8_t)order;
+    return idx;
+}
+
+uint32_t buddy_alloc_range(buddy_zone *z, uint32_t count) {
+    if (count == 0)
+        return BUDDY_NONE;
+    uint32_t order = buddy_order_for(count);
+    uint32_t idx = buddy_alloc(z, order);
+    if (idx == BUDDY_NONE)
+        return BUDDY_NONE;
+    if ((1u << order) > count)
+        buddy_free_range(z, idx + count, (1u << order) - count);
+    return idx;
+}
+
+void buddy_free(buddy_zone *z, uint32_t idx, uint32_t order) {
+    while (order < BUDDY_MAX_ORDER) {
+        uint64_t pfn   = z->base_pfn + idx;
+        uint64_t bpfn  = pfn ^ (1ull << order);
+        if (bpfn < z->base_pfn || bpfn - z->base_pfn >= z->nr_pages)
+            break;
+        uint32_t bidx = (uint32_t)(bpfn - z->base_pfn);
+        buddy_node *b = node_at(z, bidx);
+        if (!b->free || b->order != order)
+            break;
+        list_unlink(z, bidx);
+        if (bidx < idx)
+            idx = bidx;
+        order++;
+    }
+    list_push(z, idx, order);
+}
+
+void buddy_free_range(buddy_zone *z, uint32_t idx, uint32_t count) {
+    while (count) {
+        uint32_t order = max_order_at(z, idx, count);
+        buddy_free(z, idx, order);
+        idx   += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+int buddy_take(buddy_zone *z, uint32_t idx) {
+    uint64_t pfn = z->base_pfn + idx;
+    for (uint32_t k = 0; k <= BUDDY_MAX_ORDER; k++) {
+        uint64_t hpfn = pfn & ~((1ull << k) - 1u);
+        if (hpfn < z->base_pfn)
+            break;
+        uint32_t head = (uint32_t)(hpfn - z->base_pfn);
+        buddy_node *n = node_at(z, head);
+        if (!n->free || n->order != k)
+            continue;
+        /* Split the block down to idx, keeping the halves without it */
+        list_unlink(z, head);
+        while (k > 0) {
+            k--;
+            uint32_t half = head + (1u << k);
+            if (idx >= half) {
+                list_push(z, head, k);
+                head = half;
+            } else {
+                list_push(z, half, k);
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+uint32_t buddy_frag_index(const buddy_zone *z, uint32_t order) {
+    if (z->free_pages == 0 || order > BUDDY_MAX_ORDER)
+        return 0;
+    uint32_t usable = 0;
+    for (uint32_t k = order; k < BUDDY_NR_ORDERS; k++)
+        usable += z->nr_free[k] << k;
+    return (uint32_t)(((uint64_t)(z->free_pages - usable) * 100u) / z->free_pages);
+}
@@ -0,0 +1,519 @@
+/*
+    E-comOS Kernel - Kernel Heap (kmalloc/kfree)
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    Segregated-fit allocator over one linear region starting at
+    HEAP_START_VIRT.  Every block carries a boundary tag:
+
+      [prev_size][size|flags][payload ...........]
+                              ^ returned pointer (16-byte aligned)
+
+    prev_size is valid only when HB_PREV_FREE is set, which lets kfree
+    find both physical neighbours in O(1).  Free blocks sit in one of
+    HEAP_NR_BINS size-class bins:
+
+      bins  1..63   exact classes, 16-byte steps below HEAP_SMALL_MAX
+      bins 64..     four sub-classes per power of two (TLSF-style)
+
+    A bitmap of non-empty bins makes finding a fitting bin a ctz.
+    The heap ends in a zero-size in-use epilogue so coalescing never
+    walks off the mapped region.
+*/
+
+#include <kernel/mm.h>
+#include <kernel/mm/heap.h>
+#include <kernel/mm/page.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
+#include <kernel/printkit/print.h>
+#include <stdint.h>
+
+/* ------------------------------------------------------------------ */
+/* Constants                                                           */
+/* ------------------------------------------------------------------ */
+#define HEAP_INITIAL_PAGES 16u      /* Initial 64KB heap */
+#define HEAP_LARGE_PAGES   (uint32_t)(PAGE_SIZE_2M / PAGE_SIZE)
+#define HEAP_BLOCK_SIZE    16u      /* Minimum payload (holds bin links) */
+#define HEAP_ALIGNMENT     16u
+
+#define HB_USED       0x1u          /* block is allocated */
+#define HB_PREV_FREE  0x2u          /* physically previous block is free */
+#define HB_FLAGS      0xFu
+
+#define HEAP_SMALL_MAX    1024u
+#define HEAP_SMALL_BINS   (HEAP_SMALL_MAX / HEAP_ALIGNMENT)   /* 64 */
+#define HEAP_SMALL_SHIFT  10u                                  /* log2(SMALL_MAX) */
+#define HEAP_SUB_SHIFT    2u
+#define HEAP_SUB_BINS     (1u << HEAP_SUB_SHIFT)
+#define HEAP_MAX_SHIFT    31u                                  /* blocks < 2 GB */
+#define HEAP_NR_BINS      (HEAP_SMALL_BINS + \
+                           (HEAP_MAX_SHIFT - HEAP_SMALL_SHIFT + 1u) * HEAP_SUB_BINS)
+#define HEAP_MAP_WORDS    ((HEAP_NR_BINS + 63u) / 64u)
+
+/* ------------------------------------------------------------------ */
+/* Block layout                                                        */
+/* ------------------------------------------------------------------ */
+typedef struct heap_block {
+    size_t prev_size;     /* payload size of the previous block if free */
+    size_t size;          /* payload size | HB_* flags */
+} heap_block_t;
+
+typedef struct heap_free {
+    heap_block_t      hdr;
+    struct heap_free *next;
+    struct heap_free *prev;
+} heap_free_t;
+
+#define HDR_SIZE  sizeof(heap_block_t)
+
+/* ------------------------------------------------------------------ */
+/* State                                                               */
+/* ------------------------------------------------------------------ */
+static heap_free_t *heap_bins[HEAP_NR_BINS];
+static uint64_t     heap_bin_map[HEAP_MAP_WORDS];
+static uintptr_t    heap_end = HEAP_START_VIRT;
+static heap_block_t *heap_epilogue = NULL;
+static spinlock_t   heap_lock = SPINLOCK_INIT;
+static size_t       heap_free_bytes = 0;
+
+/* ------------------------------------------------------------------ */
+/* Block helpers                                                       */
+/* ------------------------------------------------------------------ */
+static inline size_t block_size(const heap_block_t *b) {
+    return b->size & ~(size_t)HB_FLAGS;
+}
+
+static inline heap_block_t *block_next(heap_block_t *b) {
+    return (heap_block_t *)((uintptr_t)b + HDR_SIZE + block_size(b));
+}
+
+static inline heap_block_t *block_prev(heap_block_t *b) {
+    return (heap_block_t *)((uintptr_t)b - HDR_SIZE - b->prev_size);
+}
+
+static inline void *block_payload(heap_block_t *b) {
+    return (void *)(b + 1);
+}
+
+/* Set size keeping flags, and refresh the next block's boundary tag */
+static void block_set_free(heap_block_t *b, size_t size) {
+    b->size = size | (b->size & HB_PREV_FREE);
+    heap_block_t *n = block_next(b);
+    n->prev_size = size;
+    n->size |= HB_PREV_FREE;
+}
+
+static void block_set_used(heap_block_t *b, size_t size) {
+    b->size = size | HB_USED | (b->size & HB_PREV_FREE);
+    block_next(b)->size &= ~(size_t)HB_PREV_FREE;
+}
+
+/* ------------------------------------------------------------------ */
+/* Size-class bins                                                     */
+/* ------------------------------------------------------------------ */
+static inline uint32_t fls64(uint64_t v) {
+    return 63u - (uint32_t)__builtin_clzll(v);
+}
+
+static uint32_t bin_index(size_t size) {
+    if (size < HEAP_SMALL_MAX)
+        return (uint32_t)(size / HEAP_ALIGNMENT);
+    uint32_t fl = fls64(size);
+    if (fl > HEAP_MAX_SHIFT)
+        fl = HEAP_MAX_SHIFT;
+    uint32_t sl = (uint32_t)(size >> (fl - HEAP_SUB_SHIFT)) & (HEAP_SUB_BINS - 1u);
+    return HEAP_SMALL_BINS + (fl - HEAP_SMALL_SHIFT) * HEAP_SUB_BINS + sl;
+}
+
+/* First bin whose every block is guaranteed to hold size bytes */
+static uint32_t bin_index_fit(size_t size) {
+    if (size >= HEAP_SMALL_MAX) {
+        uint32_t fl = fls64(size);
+        size += ((size_t)1 << (fl - HEAP_SUB_SHIFT)) - 1u;
+    }
+    return bin_index(size);
+}
+
+static void bin_insert(heap_block_t *b) {
+    heap_free_t *f = (heap_free_t *)b;
+    uint32_t idx = bin_index(block_size(b));
+    f->prev = NULL;
+    f->next = heap_bins[idx];
+    if (f->next)
+        f->next->prev = f;
+    heap_bins[idx] = f;
+    heap_bin_map[idx / 64u] |= 1ull << (idx % 64u);
+    heap_free_bytes += block_size(b);
+}
+
+static void bin_remove(heap_block_t *b) {
+    heap_free_t *f = (heap_free_t *)b;
+    uint32_t idx = bin_index(block_size(b));
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        heap_bins[idx] = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    if (!heap_bins[idx])
+        heap_bin_map[idx / 64u] &= ~(1ull << (idx % 64u));
+    heap_free_bytes -= block_size(b);
+}
+
+static heap_block_t *bin_find(size_t size) {
+    uint32_t idx = bin_index_fit(size);
+    if (idx >= HEAP_NR_BINS)
+        return NULL;
+    uint32_t w = idx / 64u;
+    uint64_t bits = heap_bin_map[w] & (~0ull << (idx % 64u));
+    while (!bits) {
+        if (++w >= HEAP_MAP_WORDS)
+            return NULL;
+        bits = heap_bin_map[w];
+    }
+    return &heap_bins[w * 64u + (uint32_t)__builtin_ctzll(bits)]->hdr;
+}
+
+/* Merge b with free neighbours, mark it free and bin it */
+static void block_release(heap_block_t *b, size_t size) {
+    heap_block_t *n = (heap_block_t *)((uintptr_t)b + HDR_SIZE + size);
+    if (!(n->size & HB_USED)) {
+        bin_remove(n);
+        size += HDR_SIZE + block_size(n);
+    }
+    if (b->size & HB_PREV_FREE) {
+        heap_block_t *p = block_prev(b);
+        bin_remove(p);
+        size += HDR_SIZE + block_size(p);
+        b = p;
+    }
+    b->size &= HB_PREV_FREE;
+    block_set_free(b, size);
+    bin_insert(b);
+}
+
+/* Trim a used block to size, releasing the tail if it is big enough */
+static void block_trim(heap_block_t *b, size_t size) {
+    size_t have = block_size(b);
+    if (have < size + HDR_SIZE + HEAP_BLOCK_SIZE) {
+        block_set_used(b, have);
+        return;
+    }
+    block_set_used(b, size);
+    heap_block_t *tail = block_next(b);
+    tail->size = 0;
+    block_release(tail, have - size - HDR_SIZE);
+}
+
+/* ------------------------------------------------------------------ */
+/* Heap growth                                                         */
+/* ------------------------------------------------------------------ */
+
+/* Expand kernel heap by allocating more pages */
+static int heap_expand(size_t size) {
+    /*
+     * While the heap end is 2 MB aligned, grow by whole 2 MB pages: one
+     * TLB entry instead of 512.  Buddy blocks of 512 frames are
+     * naturally aligned, so they can back a large page directly.
+     */
+    while (size && !(heap_end & (PAGE_SIZE_2M - 1u))) {
+        void *block = mm_alloc_pages(HEAP_LARGE_PAGES);
+        if (!block)
+            break;
+        if (((uintptr_t)block & (PAGE_SIZE_2M - 1u))
+                || mm_map_page_size(heap_end, (uintptr_t)block, PAGE_SIZE_2M,
+                                    MM_FLAG_KERNEL_RW) != 0) {
+            mm_free_pages(block, HEAP_LARGE_PAGES);
+            break;
+        }
+        heap_end += PAGE_SIZE_2M;
+        size = size > PAGE_SIZE_2M ? size - PAGE_SIZE_2M : 0;
+    }
+    if (!size)
+        return 1;
+
+    size_t pages_needed = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    /* Try to allocate contiguous pages */
+    void *new_pages = mm_alloc_pages(pages_needed);
+    if (!new_pages) {
+        /*
+         * Try allocating individual pages.  On failure the pages already
+         * mapped stay in the heap: heap_grow adds them as a free block.
+         */
+        for (size_t i = 0; i < pages_needed; i++) {
+            void *page = mm_alloc_page();
+            if (!page) {
+                heap_end += i * PAGE_SIZE;
+                return 0;
+            }
+
+            /* Map the page into kernel heap space */
+            if (mm_map_page_size(heap_end + i * PAGE_SIZE, (uintptr_t)page,
+                                 PAGE_SIZE, MM_FLAG_KERNEL_RW) != 0) {
+                mm_free_page(page);
+                heap_end += i * PAGE_SIZE;
+                return 0;
+            }
+            mm_page_set_heap(page, heap_end + i * PAGE_SIZE);
+        }
+    } else {
+        /* Map contiguous pages */
+        for (size_t i = 0; i < pages_needed; i++) {
+            if (mm_map_page_size(heap_end + i * PAGE_SIZE,
+                                 (uintptr_t)new_pages + i * PAGE_SIZE,
+                                 PAGE_SIZE, MM_FLAG_KERNEL_RW) != 0) {
+                /* Cleanup on failure */
+                for (size_t j = 0; j < i; j++) {
+                    mm_unmap_page_size(heap_end + j * PAGE_SIZE, PAGE_SIZE);
+                }
+                mm_free_pages(new_pages, pages_needed);
+                return 0;
+            }
+        }
+        /* Reached only through the heap window, so compaction may move them */
+        for (size_t i = 0; i < pages_needed; i++)
+            mm_page_set_heap((void *)((uintptr_t)new_pages + i * PAGE_SIZE),
+                             heap_end + i * PAGE_SIZE);
+    }
+
+    heap_end += pages_needed * PAGE_SIZE;
+    return 1;
+}
+
+/*
+ * Turn [old_end, heap_end) into a free block.  The old epilogue header
+ * becomes the new block's header, so a free block just before it
+ * coalesces with the new space.
+ */
+static void heap_add_region(uintptr_t old_end) {
+    heap_block_t *b;
+    if (heap_epilogue) {
+        b = heap_epilogue;
+    } else {
+        b = (heap_block_t *)old_end;
+        b->size = 0;
+    }
+    heap_epilogue = (heap_block_t *)(heap_end - HDR_SIZE);
+    heap_epilogue->size = HB_USED;
+    block_release(b, (uintptr_t)heap_epilogue - (uintptr_t)b - HDR_SIZE);
+}
+
+static int heap_grow(size_t size) {
+    uintptr_t old_end = heap_end;
+    /* Room for the block header plus a new epilogue on a fresh heap */
+    int ok = heap_expand(size + 2u * HDR_SIZE);
+    /* Large pages mapped before a failed 4K tail are still usable */
+    if (heap_end > old_end)
+        heap_add_region(old_end);
+    return ok;
+}
+
+void heap_init(void) {
+    heap_end = HEAP_START_VIRT;
+
+    /* The heap start is 2 MB aligned, so this maps a large page if it can */
+    if (!heap_grow(HEAP_INITIAL_PAGES * PAGE_SIZE - 2u * HDR_SIZE)
+            && heap_end == HEAP_START_VIRT)
+        print_str("MM: failed to map initial heap\n", 0x0C);
+}
+
+uintptr_t heap_get_end(void) {
+    return heap_end;
+}
+
+size_t heap_get_free_bytes(void) {
+    return heap_free_bytes;
+}
+
+/* ------------------------------------------------------------------ */
+/* kmalloc / kfree                                                     */
+/* ------------------------------------------------------------------ */
+/* Free block just below the epilogue, if it holds size bytes */
+static heap_block_t *heap_tail_fit(size_t size) {
+    if (!heap_epilogue || !(heap_epilogue->size & HB_PREV_FREE))
+        return NULL;
+    heap_block_t *t = block_prev(heap_epilogue);
+    return block_size(t) >= size ? t : NULL;
+}
+
+static heap_block_t *heap_take(size_t size) {
+    heap_block_t *b = bin_find(size);
+    if (!b) {
+        /*
+         * bin_find skips the request's own sub-class, so freshly grown
+         * space may sit there; it is always the tail block.
+         */
+        if (!(b = heap_tail_fit(size))) {
+            if (!heap_grow(size) || !(b = heap_tail_fit(size)))
+                return NULL;
+        }
+    }
+    bin_remove(b);
+    return b;
+}
+
+/*
+ * Cache-line aligned allocation: over-allocate, then give the leading
+ * gap back as its own free block.
+ */
+static heap_block_t *heap_take_aligned(size_t size) {
+    size_t slack = KMALLOC_ALIGN + HDR_SIZE + HEAP_BLOCK_SIZE;
+    heap_block_t *b = heap_take(size + slack);
+    if (!b)
+        return NULL;
+
+    uintptr_t payload = (uintptr_t)block_payload(b);
+    uintptr_t aligned = (payload + KMALLOC_ALIGN - 1u) & ~(uintptr_t)(KMALLOC_ALIGN - 1u);
+    if (aligned == payload)
+        return b;
+    /* The gap must itself be a valid free block */
+    while (aligned - payload < HDR_SIZE + HEAP_BLOCK_SIZE)
+        aligned += KMALLOC_ALIGN;
+
+    size_t total = block_size(b);
+    size_t lead  = aligned - payload - HDR_SIZE;
+    heap_block_t *a = (heap_block_t *)(aligned - HDR_SIZE);
+    a->size = 0;
+    block_set_used(a, total - lead - HDR_SIZE);
+    b->size &= HB_PREV_FREE;
+    block_release(b, lead);
+    return a;
+}
+
+void *kmalloc(size_t size, uint32_t flags) {
+    if (size == 0 || size >= ((size_t)1 << HEAP_MAX_SHIFT)) return NULL;
+
+    /* Align size to HEAP_BLOCK_SIZE */
+    size = (size + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1);
+    if (size < HEAP_BLOCK_SIZE) {
+        size = HEAP_BLOCK_SIZE;
+    }
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&heap_lock);
+    heap_block_t *block = (flags & KMALLOC_ALIGNED) ? heap_take_aligned(size)
+                                                    : heap_take(size);
+    if (block)
+        block_trim(block, size);
+    spin_unlock(&heap_lock);
+    cpu_irq_restore(irq);
+    if (!block)
+        return NULL;
+
+    /* Zero memory if requested (sizes are multiples of 16 bytes) */
+    if (flags & KMALLOC_ZEROED) {
+        uint64_t *ptr = (uint64_t *)block_payload(block);
+        for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+            ptr[i] = 0;
+        }
+    }
+
+    return block_payload(block);
+}
+
+static int heap_check_ptr(const char *who, void *ptr) {
+    heap_block_t *block = (heap_block_t *)ptr - 1;
+    uintptr_t addr = (uintptr_t)block;
+    if (addr < HEAP_START_VIRT || addr >= heap_end || (addr & (HEAP_ALIGNMENT - 1u))) {
+        print_str(who, 0x0C);
+        print_str(": invalid pointer 0x", 0x0C);
+        print_hex((uint32_t)addr, 0x0C);
+        print_str("\n", 0x0C);
+        return -1;
+    }
+    if (!(block->size & HB_USED)) {
+        print_str(who, 0x0C);
+        print_str(": double free at 0x", 0x0C);
+        print_hex((uint32_t)addr, 0x0C);
+        print_str("\n", 0x0C);
+        return -1;
+    }
+    return 0;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) return;
+    if (heap_check_ptr("kfree", ptr) != 0)
+        return;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&heap_lock);
+    heap_block_t *block = (heap_block_t *)ptr - 1;
+    block_release(block, block_size(block));
+    spin_unlock(&heap_lock);
+    cpu_irq_restore(irq);
+}
+
+void *kcalloc(size_t num, size_t size) {
+    size_t total = num * size;
+    if (total == 0) return NULL;
+
+    /* Check for overflow */
+    if (size != 0 && total / size != num) {
+        return NULL;
+    }
+
+    void *ptr = kmalloc(total, KMALLOC_ZEROED);
+    return ptr;
+}
+
+void *krealloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return kmalloc(size, 0);
+    }
+
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+    if (heap_check_ptr("krealloc", ptr) != 0)
+        return NULL;
+    if (size >= ((size_t)1 << HEAP_MAX_SHIFT))
+        return NULL;
+    size = (size + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1);
+
+    heap_block_t *block = (heap_block_t *)ptr - 1;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&heap_lock);
+    size_t have = block_size(block);
+    if (have >= size) {
+        /* Shrink in place */
+        block_trim(block, size);
+        spin_unlock(&heap_lock);
+        cpu_irq_restore(irq);
+        return ptr;
+    }
+
+    /* Grow in place by absorbing a free successor */
+    heap_block_t *next = block_next(block);
+    if (!(next->size & HB_USED) && have + HDR_SIZE + block_size(next) >= size) {
+        bin_remove(next);
+        block_set_used(block, have + HDR_SIZE + block_size(next));
+        block_trim(block, size);
+        spin_unlock(&heap_lock);
+        cpu_irq_restore(irq);
+        return ptr;
+    }
+    spin_unlock(&heap_lock);
+    cpu_irq_restore(irq);
+
+    /* Allocate new block */
+    void *new_ptr = kmalloc(size, 0);
+    if (!new_ptr) {
+        return NULL;
+    }
+
+    /* Copy data; payloads are 16-byte aligned multiples of 16 */
+    uint64_t *src = (uint64_t *)ptr;
+    uint64_t *dst = (uint64_t *)new_ptr;
+    for (size_t i = 0; i < have / sizeof(uint64_t); i++) {
+        dst[i] = src[i];
+    }
+
+    /* Free old block */
+    kfree(ptr);
+
+    return new_ptr;
+}
@@ -3,14 +3,49 @@
     Copyright (C) 2025,2026  Saladin5101
     Licensed under AGPL Version 3.
     
-    Physical memory window managed: [PHYS_BASE, PHYS_BASE + PHYS_SIZE)
-    = [0x100000, 0x1100000)  (1 MB … 17 MB, 4096 × 4 KB pages)
+    Physical memory: one zone per run of conventional RAM above PHYS_BASE,
+    as reported by the UEFI memory map.  Zone layout:
+
+      [mm_page × nr_pages][bitmap][usable frames .................]
+      '------ meta_pages ------'
+
+    The mm_page descriptors (kernel/mm/page.h) embed the buddy nodes and
+    carry the share count, map count and use of each frame.
+
+    Metadata is initialised one MM_SECTION_PAGES section at a time: the
+    first section of each zone at boot, the rest from the idle loop (or
+    on demand when allocation runs dry).
 
     Page table layout (64-bit, 4-level, identity-mapped):
-      PML4[0] → PDPT[0] → PD[0..3] → PT[0..1023]  (covers 0 … 16 MB)
+      PML4[0] → PDPT[0] → PD[0..7]   2 MB pages, 0 … 16 MB (kernel image)
+      PML4[n] → PDPT    → 1 GB pages, or PD → 2 MB pages (direct map)
+    A 4 KB mapping that lands inside a large page splits it on demand.
+    Every address space has its own PML4; the kernel slots (slot 0 and
+    the upper half) point at the same PDPTs in all of them.
+
+    Free pages are owned by a per-zone binary buddy allocator
+    (src/mm/buddy.c); the zone bitmap (src/mm/bitmap.c) mirrors the set
+    of pages held by callers.  Single pages are served from per-CPU
+    magazines that refill from and drain to the buddy in batches, so
+    the common path never takes phys_lock.
+
+    On NUMA machines zones are also split at node boundaries from the
+    SRAT (src/mm/numa.c), so every zone belongs to one node.  The free
+    lists are then per node in effect: zone_alloc walks the nodes in the
+    calling CPU's fallback order and only falls back to a farther node
+    when the nearer ones are empty.
 */
 
 #include <kernel/mm.h>
+#include <kernel/mm/buddy.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/heap.h>
+#include <kernel/mm/vmalloc.h>
+#include <kernel/mm/bitmap.h>
+#include <kernel/mm/page.h>
+#include <kernel/mm/numa.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
 #include <kernel/boot.h>
 #include <kernel/printkit/print.h>
 #include <stdint.h>
@@ -25,31 +60,89 @@
  * upper bound used before mm_init has run (should never be needed). */
 #define KERNEL_RESERVED_PAGES_FALLBACK 64u  /* 256 KB conservative bound */
 
-/* Kernel heap constants */
-#define HEAP_START_VIRT 0x2000000u  /* 32 MB - start of kernel heap */
-#define HEAP_INITIAL_PAGES 16u      /* Initial 64KB heap */
-#define HEAP_BLOCK_SIZE 16u         /* Minimum allocation size */
-#define HEAP_ALIGNMENT 16u
-
-/* Kernel heap block header */
-typedef struct heap_block {
-    size_t size;           /* Block size (excluding header) */
-    int free;             /* 1 = free, 0 = allocated */
-    struct heap_block *next;
-    struct heap_block *prev;
-} heap_block_t;
+/* Per-CPU page magazine tuning (pages) */
+#define MAG_CAPACITY    64u  /* hard size of each magazine               */
+#define MAG_BATCH       16u  /* pages moved per refill or drain          */
+#define MAG_LOW_WATER    8u  /* idle balancing refills below this level  */
+#define MAG_HIGH_WATER  48u  /* frees drain a batch at or above this     */
+
+/* Pre-zeroed page pool (pages) */
+#define ZERO_POOL_SIZE  256u  /* 1 MB of cleared pages kept ready        */
+#define ZERO_FILL_BATCH   8u  /* pages cleared per idle-loop pass        */
+
+/* Compaction */
+#define COMPACT_IDLE_ORDER   9u        /* rebuild 2 MB blocks when idle     */
+#define COMPACT_IDLE_FRAG   50u        /* ... once half the free pages can't */
+#define COMPACT_IDLE_CYCLES 500000ull  /* time budget per idle pass         */
+#define COMPACT_DEFER_MAX    6u        /* skip up to 2^6 failed-order tries */
+
+/* Reserve and pressure watermarks, as shifts of the total page count */
+#define RESERVE_SHIFT        7u    /* reserve 1/128 of RAM ...             */
+#define RESERVE_MIN        128u    /* ... but at least 512 KB ...          */
+#define RESERVE_MAX       8192u    /* ... and at most 32 MB                */
+#define PRESSURE_LOW_SHIFT   3u    /* LOW below 1/8 free above the reserve */
+#define PRESSURE_MED_SHIFT   4u    /* MEDIUM below 1/16                    */
+#define PRESSURE_CRIT_SHIFT  5u    /* CRITICAL below 1/32                  */
+#define PRESSURE_HYST_SHIFT  6u    /* a level is left 1/64 above its mark  */
 
 /* ------------------------------------------------------------------ */
 /* Global allocator state                                              */
 /* ------------------------------------------------------------------ */
-uint8_t  page_bitmap[MAX_PAGES / 8] = {0};
-uint32_t next_free_page = 0;
 int page_tables_ready = 0;
 
-/* Kernel heap state */
-static heap_block_t *heap_free_list = NULL;
-static uintptr_t heap_current = 0;
-static uintptr_t heap_end = 0;
+typedef struct {
+    uint64_t   base_pfn;
+    uint32_t   nr_pages;
+    uint32_t   meta_pages;   /* frames [0, meta_pages) hold the metadata */
+    uint32_t   init_pages;   /* frames [0, init_pages) are initialised */
+    mm_bitmap  map;          /* bit i == 1 ↔ frame i allocated */
+    mm_page   *pages;        /* descriptor of frame i */
+    uint32_t   compact_next; /* next block idle compaction looks at */
+    uint32_t   node;         /* NUMA node the frames belong to */
+    buddy_zone buddy;
+} mm_zone;
+
+/* Sorted by base_pfn, non-overlapping */
+static mm_zone    zones[MM_MAX_ZONES];
+static uint32_t   nr_zones = 0;
+static uint64_t   zone_free_mask = 0;   /* bit z set ↔ zones[z] has free blocks */
+static uint32_t   total_pages = 0;
+static uint32_t   used_pages = 0;       /* set bits across all zone bitmaps */
+static uint32_t   deferred_pages = 0;   /* free frames not yet initialised */
+static uint32_t   deferred_zone = 0;    /* first zone with pending sections */
+static spinlock_t phys_lock = SPINLOCK_INIT;
+static spinlock_t deferred_lock = SPINLOCK_INIT;
+
+/* NUMA placement; a single node 0 holding every zone without an SRAT */
+static uint32_t   nr_nodes = 1;
+static uint64_t   node_zones[NUMA_MAX_NODES];     /* bit z ↔ zones[z] on the node */
+static uint8_t    node_order[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint32_t   node_order_len[NUMA_MAX_NODES];
+static uint64_t   node_local[NUMA_MAX_NODES];     /* buddy allocations for the */
+static uint64_t   node_remote[NUMA_MAX_NODES];    /* node's CPUs, by where served */
+static uint8_t    cpu_node[MAX_CPUS];
+
+/*
+ * Per-CPU stack of free single pages (physical addresses).  Only the
+ * owning CPU touches it, with IRQs off; other CPUs may only post a
+ * drain request, which the owner acts on at its next allocation, free
+ * or idle pass.
+ */
+#define MAG_DRAIN_TRIM   1u   /* give back what is above the high mark */
+#define MAG_DRAIN_ALL    2u   /* give back everything */
+
+typedef struct {
+    uint32_t count;
+    volatile uint32_t drain_req;   /* MAG_DRAIN_* bits */
+    uint64_t hits;
+    uint64_t misses;      /* allocations that had to refill first */
+    uint64_t refills;
+    uint64_t drains;
+    void    *pages[MAG_CAPACITY];
+} page_magazine;
+
+static page_magazine page_mags[MAX_CPUS];
+static volatile uint32_t mag_batch, mag_low, mag_high;   /* mm_magazine_tune */
 
 /* ------------------------------------------------------------------ */
 /* 64-bit page table structures (4-level paging, identity map)        */
@@ -59,13 +152,57 @@ static uintptr_t heap_end = 0;
 #define PDPT_ENTRIES 512u
 #define PML4_ENTRIES 512u
 
-/* Each PT covers 512 × 4 KB = 2 MB.  We need 8 PTs for 16 MB. */
-#define NUM_PTS 8u
+/* Levels counted from the leaf: a level-n entry maps 4 KB << 9n */
+#define PT_LEVEL_4K   0u
+#define PT_LEVEL_2M   1u
+#define PT_LEVEL_1G   2u
+#define PT_LEVEL_PML4 3u
+
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ull
+#define PTE_NX        (1ull << 63)
+#define PTE_COW       (1ull << 9)    /* software: read-only until copied */
+
+/*
+ * An entry that points at a table keeps the number of present entries
+ * in that table in its software-available bits 52..61, so unmap can
+ * tell in O(1) when a table has become empty.
+ */
+#define PTE_COUNT_SHIFT 52u
+#define PTE_COUNT_MASK  (0x3FFull << PTE_COUNT_SHIFT)
+
+#define LOW_MAP_END   0x1000000ull   /* 0 … 16 MB always identity mapped */
+
+/*
+ * Page-table page pool.  A map needs at most one new table per level
+ * below the PML4, whether created or split off a large page; reserving
+ * that many up front means a walk never fails half way and leaves no
+ * orphaned tables.
+ */
+#define PT_WALK_MAX   3u
+#define PT_POOL_SIZE 32u   /* zeroed table pages kept for reuse */
+
+#define CR4_PGE      (1ull << 7)
+#define CR4_PCIDE    (1ull << 17)
+#define CR3_NOFLUSH  (1ull << 63)
 
 static uint64_t pml4[PML4_ENTRIES]  __attribute__((aligned(PAGE_SIZE)));
-static uint64_t pdpt[PDPT_ENTRIES]  __attribute__((aligned(PAGE_SIZE)));
-static uint64_t pd[PD_ENTRIES]      __attribute__((aligned(PAGE_SIZE)));
-static uint64_t pt[NUM_PTS][PT_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static spinlock_t pt_lock = SPINLOCK_INIT;
+static int pt_has_1g = 0;            /* CPU supports 1 GB pages */
+static int pt_has_pcid = 0;          /* CR4.PCIDE is set */
+
+/*
+ * The kernel space.  Kernel-slot PML4 entries are created only here;
+ * pt_kernel_gen counts changes to them so other roots can re-copy
+ * the slots lazily when they are next loaded.
+ */
+static mm_pt_root  kernel_root = { pml4, 0, 0, 0 };
+static mm_pt_root *pt_current[MAX_CPUS];  /* loaded root, NULL = kernel */
+static uint32_t    pt_kernel_gen = 1;
+static void      (*tlb_shootdown)(uint32_t cpus, int global);
+
+static uint64_t *pt_pool[PT_POOL_SIZE];   /* every page here is all zero */
+static uint32_t  pt_pool_count = 0;
+static uint32_t  pt_tables     = 0;       /* table pages in use below the PML4 */
 
 /* ------------------------------------------------------------------ */
 /* Panic helper (no dependency on heap)                               */
@@ -80,453 +217,2230 @@ static void __attribute__((noreturn)) mm_panic(const char *msg) {
 /* ------------------------------------------------------------------ */
 /* Bitmap helpers                                                      */
 /* ------------------------------------------------------------------ */
-static inline void bitmap_set(uint32_t idx) {
-    page_bitmap[idx >> 3] |= (uint8_t)(1u << (idx & 7u));
+/*
+ * Bitmap updates also keep used_pages current, so free-page counts and
+ * watermark checks never scan.  Atomic because magazine paths update
+ * bits without holding phys_lock.
+ */
+static void (*pressure_notify)(void) = NULL;
+static void pressure_watch(void);
+
+static inline void used_add(int32_t n) {
+    __atomic_add_fetch(&used_pages, (uint32_t)n, __ATOMIC_RELAXED);
+    if (pressure_notify)
+        pressure_watch();
+}
+
+static inline void bitmap_set(mm_zone *z, uint32_t idx) {
+    if (!mm_bitmap_set(&z->map, idx))
+        used_add(1);
+}
+
+/* Returns 0 if the frame was already free */
+static inline int bitmap_clear(mm_zone *z, uint32_t idx) {
+    if (!mm_bitmap_clear(&z->map, idx))
+        return 0;
+    used_add(-1);
+    return 1;
+}
+
+static inline int bitmap_test(const mm_zone *z, uint32_t idx) {
+    return mm_bitmap_test(&z->map, idx);
+}
+
+/* ------------------------------------------------------------------ */
+/* Zone helpers                                                        */
+/* ------------------------------------------------------------------ */
+static inline void *zone_page(const mm_zone *z, uint32_t idx) {
+    return (void *)(uintptr_t)((z->base_pfn + idx) * PAGE_SIZE);
+}
+
+/* Zone holding the frame at phys, or NULL.  Binary search. */
+static mm_zone *zone_of(uint64_t phys) {
+    uint64_t pfn = phys / PAGE_SIZE;
+    uint32_t lo = 0, hi = nr_zones;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2u;
+        mm_zone *z = &zones[mid];
+        if (pfn < z->base_pfn)
+            hi = mid;
+        else if (pfn - z->base_pfn >= z->nr_pages)
+            lo = mid + 1u;
+        else
+            return z;
+    }
+    return NULL;
+}
+
+/* Validate a page handed back by a caller; returns its frame index or -1 */
+static int64_t zone_page_idx(uint64_t phys, mm_zone **out) {
+    if (phys & (PAGE_SIZE - 1u))
+        return -1;
+    mm_zone *z = zone_of(phys);
+    if (!z)
+        return -1;
+    uint32_t idx = (uint32_t)(phys / PAGE_SIZE - z->base_pfn);
+    if (idx < z->meta_pages || idx >= z->init_pages)
+        return -1;
+    *out = z;
+    return idx;
+}
+
+/* Refresh z's bit in zone_free_mask.  Caller holds phys_lock. */
+static inline void zone_update_mask(const mm_zone *z) {
+    uint64_t bit = 1ull << (uint32_t)(z - zones);
+    if (z->buddy.free_pages)
+        zone_free_mask |= bit;
+    else
+        zone_free_mask &= ~bit;
+}
+
+/* ---- Frame descriptors ---- */
+
+mm_page *mm_page_of(uint64_t phys) {
+    mm_zone *z;
+    int64_t idx = zone_page_idx(phys & ~(uint64_t)(PAGE_SIZE - 1u), &z);
+    return idx < 0 ? NULL : &z->pages[idx];
+}
+
+uint64_t mm_page_phys(const mm_page *pg) {
+    const mm_zone *z = &zones[pg->zone];
+    return (z->base_pfn + (uint64_t)(pg - z->pages)) * PAGE_SIZE;
+}
+
+/*
+ * Drop one owner of a frame.  Returns 1 if the caller was the last one
+ * and must free it (or may write it without copying), 0 otherwise.
+ */
+static int frame_release(uint64_t phys) {
+    mm_page *pg = mm_page_of(phys);
+    if (!pg)
+        return 1;
+    uint32_t n = __atomic_load_n(&pg->refs, __ATOMIC_ACQUIRE);
+    while (n != 0)
+        if (__atomic_compare_exchange_n(&pg->refs, &n, n - 1u, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 0;
+    return 1;
+}
+
+/*
+ * A 4 KB leaf changed from old to new: keep the map counts of the
+ * frames involved in step.  Caller holds pt_lock, which guards every
+ * mapcount.
+ */
+static void frame_map_count(uint64_t old, uint64_t new) {
+    if (!((old ^ new) & (PTE_PRESENT | PTE_ADDR_MASK)))
+        return;
+    mm_page *pg;
+    if ((old & PTE_PRESENT) && (pg = mm_page_of(old & PTE_ADDR_MASK)) && pg->mapcount)
+        pg->mapcount--;
+    if ((new & PTE_PRESENT) && (pg = mm_page_of(new & PTE_ADDR_MASK)))
+        pg->mapcount++;
+}
+
+/*
+ * Take count contiguous frames for the calling CPU: from its node's
+ * nodes in fallback order, and within a node from the lowest zone that
+ * can supply them.  Caller holds phys_lock.  Only zones with free
+ * blocks are visited, so a full zone or node costs nothing.
+ */
+static void *zone_alloc(uint32_t count, mm_zone **out) {
+    uint32_t order = buddy_order_for(count);
+    uint32_t home  = cpu_node[cpu_current_id()];
+    for (uint32_t n = 0; n < node_order_len[home]; n++) {
+        uint64_t mask = zone_free_mask & node_zones[node_order[home][n]];
+        while (mask) {
+            mm_zone *z = &zones[__builtin_ctzll(mask)];
+            mask &= mask - 1u;
+            if (!(z->buddy.order_mask >> order))
+                continue;
+            uint32_t idx = buddy_alloc_range(&z->buddy, count);
+            zone_update_mask(z);
+            if (idx != BUDDY_NONE) {
+                if (z->node == home)
+                    node_local[home]++;
+                else
+                    node_remote[home]++;
+                *out = z;
+                return zone_page(z, idx);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add usable RAM [start, end) (page frame numbers) on node, merging
+ * neighbours on the same node
+ */
+static void zone_add_range(uint64_t start, uint64_t end, uint32_t node) {
+    if (start < PHYS_BASE / PAGE_SIZE)
+        start = PHYS_BASE / PAGE_SIZE;
+    if (end <= start)
+        return;
+
+    uint32_t i = 0;
+    while (i < nr_zones && zones[i].base_pfn + zones[i].nr_pages < start)
+        i++;
+    /* A zone of another node ending right at start stays separate */
+    if (i < nr_zones && zones[i].node != node
+            && zones[i].base_pfn + zones[i].nr_pages == start)
+        i++;
+
+    if (i < nr_zones && zones[i].base_pfn <= end && zones[i].node == node) {
+        /* Overlaps or touches zones[i]; absorb it and any followers */
+        uint64_t s = zones[i].base_pfn < start ? zones[i].base_pfn : start;
+        uint64_t e = end;
+        uint32_t j = i;
+        while (j < nr_zones && zones[j].base_pfn <= e && zones[j].node == node) {
+            uint64_t ze = zones[j].base_pfn + zones[j].nr_pages;
+            if (ze > e)
+                e = ze;
+            j++;
+        }
+        if (e - s > 0xFFFFFFFFu)
+            e = s + 0xFFFFFFFFu;
+        zones[i].base_pfn = s;
+        zones[i].nr_pages = (uint32_t)(e - s);
+        for (uint32_t k = j; k < nr_zones; k++)
+            zones[i + 1u + k - j] = zones[k];
+        nr_zones -= j - i - 1u;
+        return;
+    }
+
+    if (nr_zones == MM_MAX_ZONES) {
+        print_str("MM: too many memory zones, ignoring RAM at pfn ", 0x0E);
+        print_num((uint32_t)start, 0x0E);
+        print_str("\n", 0x0E);
+        return;
+    }
+    for (uint32_t k = nr_zones; k > i; k--)
+        zones[k] = zones[k - 1u];
+    if (end - start > 0xFFFFFFFFu)
+        end = start + 0xFFFFFFFFu;
+    zones[i].base_pfn = start;
+    zones[i].nr_pages = (uint32_t)(end - start);
+    zones[i].node     = node;
+    nr_zones++;
+}
+
+/* zone_add_range, one piece per NUMA node [start, end) touches */
+static void zone_add_split(uint64_t start, uint64_t end) {
+    while (start < end) {
+        uint64_t cut = numa_range_end(start * PAGE_SIZE);
+        cut = cut == ~0ull ? end : (cut + PAGE_SIZE - 1u) / PAGE_SIZE;
+        if (cut > end)
+            cut = end;
+        zone_add_range(start, cut, numa_node_of_phys(start * PAGE_SIZE));
+        start = cut;
+    }
+}
+
+/* zone_add_split with the kernel image [kstart, kend) cut out */
+static void zone_add_usable(uint64_t start, uint64_t end,
+                            uint64_t kstart, uint64_t kend) {
+    if (kend <= start || kstart >= end) {
+        zone_add_split(start, end);
+        return;
+    }
+    zone_add_split(start, kstart);
+    zone_add_split(kend, end);
+}
+
+/*
+ * Carve the metadata out of the head of every zone.  Only the bitmap
+ * bits for the metadata frames are written here; everything else is
+ * done per section.
+ */
+static void zone_setup_all(void) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        mm_zone z = zones[i];
+        uint64_t node_bytes = (uint64_t)z.nr_pages * sizeof(mm_page);
+        uint64_t map_bytes  = mm_bitmap_bytes(z.nr_pages);
+        uint64_t meta = (node_bytes + map_bytes + PAGE_SIZE - 1u) / PAGE_SIZE;
+        if (z.nr_pages < MM_MIN_ZONE_PAGES || meta >= z.nr_pages)
+            continue;
+
+        uint8_t *base = (uint8_t *)mm_phys_to_virt((uintptr_t)(z.base_pfn * PAGE_SIZE));
+        z.meta_pages = (uint32_t)meta;
+        z.pages = (mm_page *)base;
+        z.compact_next = 0;
+        buddy_zone_init(&z.buddy, z.base_pfn, z.nr_pages, &z.pages[0].buddy, sizeof(mm_page));
+
+        /*
+         * Frames below the last 2^BUDDY_MAX_ORDER boundary inside the
+         * metadata can never be a buddy of a free block; skip them.
+         */
+        uint64_t first = (z.base_pfn + z.meta_pages) & ~(uint64_t)((1u << BUDDY_MAX_ORDER) - 1u);
+        z.init_pages = first > z.base_pfn ? (uint32_t)(first - z.base_pfn) : 0;
+
+        deferred_pages += z.nr_pages - z.meta_pages;
+        total_pages    += z.nr_pages;
+        used_pages     += z.meta_pages;
+        node_zones[z.node] |= 1ull << kept;
+        zones[kept] = z;
+
+        /* Attach after the copy: the bitmap lives at its final address */
+        mm_zone *zp = &zones[kept++];
+        mm_bitmap_attach(&zp->map, base + node_bytes, zp->nr_pages);
+        mm_bitmap_init_range(&zp->map, 0, zp->meta_pages, 1);
+    }
+    nr_zones = kept;
+}
+
+/*
+ * Initialise the next section of z and give its free frames to the
+ * buddy.  Sections end on MM_SECTION_PAGES frame boundaries, so buddy
+ * merges never reach into uninitialised metadata.  Caller holds
+ * deferred_lock.
+ */
+static void zone_init_section(mm_zone *z) {
+    uint32_t from = z->init_pages;
+    uint64_t next = ((z->base_pfn + from) | (MM_SECTION_PAGES - 1u)) + 1u;
+    uint32_t to = next - z->base_pfn > z->nr_pages
+                ? z->nr_pages : (uint32_t)(next - z->base_pfn);
+
+    buddy_init_nodes(&z->buddy, from, to - from);
+    for (uint32_t i = from; i < to; i++) {
+        mm_page *pg  = &z->pages[i];
+        pg->mapcount = 0;
+        pg->flags    = 0;
+        pg->zone     = (uint8_t)(z - zones);
+        pg->refs     = 0;
+        pg->owner    = 0;
+        pg->index    = 0;
+    }
+    uint32_t first_free = from > z->meta_pages ? from : z->meta_pages;
+    mm_bitmap_init_range(&z->map, first_free, to, 0);
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&phys_lock);
+    if (to > first_free) {
+        buddy_free_range(&z->buddy, first_free, to - first_free);
+        deferred_pages -= to - first_free;
+    }
+    z->init_pages = to;
+    zone_update_mask(z);
+    spin_unlock(&phys_lock);
+    cpu_irq_restore(irq);
+}
+
+uint32_t mm_deferred_init(void) {
+    if (!deferred_pages)
+        return 0;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&deferred_lock);
+    while (deferred_zone < nr_zones
+           && zones[deferred_zone].init_pages == zones[deferred_zone].nr_pages)
+        deferred_zone++;
+    if (deferred_zone < nr_zones)
+        zone_init_section(&zones[deferred_zone]);
+    spin_unlock(&deferred_lock);
+    cpu_irq_restore(irq);
+    return deferred_pages;
+}
+
+/* ------------------------------------------------------------------ */
+/* 64-bit identity page table setup                                   */
+/* ------------------------------------------------------------------ */
+
+/* ---- Page-table page pool (caller holds pt_lock) ---- */
+
+/* Top the pool up to n pages; 0 if it now holds at least n */
+static int pt_pool_reserve(uint32_t n) {
+    while (pt_pool_count < n) {
+        uint64_t *t = (uint64_t *)mm_phys_to_virt(
+            (uintptr_t)mm_alloc_page_flags(MM_ALLOC_ZEROED | MM_ALLOC_RESERVE));
+        if (!t)
+            return -1;
+        mm_page *pg = mm_page_of(mm_virt_to_phys(t));
+        if (pg)
+            pg->flags |= MM_PAGE_TABLE;
+        pt_pool[pt_pool_count++] = t;
+    }
+    return 0;
+}
+
+/* Zeroed page for a new paging structure */
+static uint64_t *table_alloc(void) {
+    if (pt_pool_reserve(1u) != 0)
+        return NULL;
+    pt_tables++;
+    return pt_pool[--pt_pool_count];
+}
+
+/* t must be all zero again, which every emptied table is */
+static void table_free(uint64_t *t) {
+    pt_tables--;
+    if (pt_pool_count < PT_POOL_SIZE)
+        pt_pool[pt_pool_count++] = t;
+    else
+        mm_free_page((void *)mm_virt_to_phys(t));
+}
+
+static inline uint32_t pt_index(uint64_t vaddr, uint32_t level) {
+    return (uint32_t)(vaddr >> (12u + 9u * level)) & 0x1FFu;
+}
+
+static inline uint64_t level_size(uint32_t level) {
+    return (uint64_t)PAGE_SIZE << (9u * level);
+}
+
+static inline uint64_t *pte_table(uint64_t e) {
+    return (uint64_t *)mm_phys_to_virt((uintptr_t)(e & PTE_ADDR_MASK));
+}
+
+static inline uint32_t pte_count(uint64_t e) {
+    return (uint32_t)((e & PTE_COUNT_MASK) >> PTE_COUNT_SHIFT);
+}
+
+static inline void pte_count_add(uint64_t *e, int32_t delta) {
+    *e = (*e & ~PTE_COUNT_MASK)
+       | ((uint64_t)(pte_count(*e) + (uint32_t)delta) << PTE_COUNT_SHIFT);
+}
+
+static inline int canonical(uint64_t vaddr) {
+    return (uint64_t)((int64_t)(vaddr << 16) >> 16) == vaddr;
+}
+
+/* Slots below MM_USER_BASE and in the upper half belong to the kernel */
+static inline int pt_kernel_slot(uint32_t slot) {
+    return slot < pt_index(MM_USER_BASE, PT_LEVEL_PML4) || slot >= PML4_ENTRIES / 2u;
+}
+
+/* Caller has IRQs off */
+static inline mm_pt_root *pt_root_current(void) {
+    mm_pt_root *r = pt_current[cpu_current_id()];
+    return r ? r : &kernel_root;
+}
+
+/*
+ * Other CPUs to interrupt for r's stale entries: every one for the
+ * kernel root, whose slots all roots share, else those with r loaded.
+ * Caller has IRQs off.
+ */
+static uint32_t pt_remote_cpus(const mm_pt_root *r) {
+    uint32_t self = cpu_current_id(), mask = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        if (cpu != self && (r == &kernel_root
+                            || __atomic_load_n(&pt_current[cpu], __ATOMIC_SEQ_CST) == r))
+            mask |= 1u << cpu;
+    return mask;
+}
+
+/*
+ * Make every other CPU drop r's stale entries; returns once those
+ * running r have.  A CPU that ran r before may still hold entries
+ * under r's PCID: it is marked in r->tlb_stale and reloads r without
+ * NOFLUSH next time.  Marking comes first and mm_pt_load publishes
+ * pt_current before reading the mark, so a CPU loading r meanwhile
+ * is either interrupted or sees the mark.  This CPU is marked too
+ * unless r is loaded here, where the caller used INVLPG.
+ */
+static void pt_flush_remote(mm_pt_root *r, int global) {
+    if (r != &kernel_root) {
+        uint32_t stale = (1u << MAX_CPUS) - 1u;
+        if (r == pt_root_current())
+            stale &= ~(1u << cpu_current_id());
+        __atomic_or_fetch(&r->tlb_stale, stale, __ATOMIC_SEQ_CST);
+    }
+    uint32_t cpus = pt_remote_cpus(r);
+    if (cpus && tlb_shootdown)
+        tlb_shootdown(cpus, global || r == &kernel_root);
+}
+
+void mm_tlb_set_shootdown(void (*fn)(uint32_t cpus, int global)) {
+    tlb_shootdown = fn;
+}
+
+/*
+ * Kernel-slot entry changed in the kernel PML4.  Roots that are loaded
+ * right now get the entry immediately, since kernel code running on
+ * them may touch the new mapping before the next switch; the rest
+ * catch up in mm_pt_load().  Caller holds pt_lock.
+ */
+static void pt_kernel_changed(uint32_t slot) {
+    pt_kernel_gen++;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        if (pt_current[cpu] && pt_current[cpu] != &kernel_root)
+            pt_current[cpu]->pml4[slot] = pml4[slot];
+}
+
+static uint64_t pte_flags(uint32_t flags) {
+    uint64_t entry = PTE_PRESENT;
+    if (flags & MM_FLAG_WRITE) entry |= PTE_WRITABLE;
+    if (flags & MM_FLAG_USER)  entry |= PTE_USER;
+    if (flags & MM_FLAG_DEVICE) {
+        entry |= PTE_PCD;  /* Cache disable for device memory */
+    } else if (flags & MM_FLAG_CACHED) {
+        /* Normal cached memory - no special flags needed */
+    }
+    if (flags & MM_FLAG_GLOBAL) entry |= PTE_GLOBAL;
+    return entry;
+}
+
+/*
+ * Replace the large-page entry *e with a table of next-level entries
+ * mapping the same memory with the same attributes, so that part of it
+ * can be changed.  The translation is unchanged, so no flush is needed
+ * here.  Caller holds pt_lock.
+ */
+static int pt_split(uint64_t *e, uint32_t level) {
+    uint64_t *t = table_alloc();
+    if (!t)
+        return -1;
+    uint64_t base  = *e & PTE_ADDR_MASK & ~(level_size(level) - 1u);
+    uint64_t attrs = *e & (0xFFFull | PTE_NX);
+    if (level == PT_LEVEL_2M)
+        attrs &= ~(uint64_t)PTE_HUGE;   /* bit 7 means PAT in a 4 KB PTE */
+    uint64_t step = level_size(level - 1u);
+    for (uint32_t i = 0; i < PT_ENTRIES; i++) {
+        t[i] = (base + i * step) | attrs;
+        if (level == PT_LEVEL_2M)
+            frame_map_count(0, t[i]);
+    }
+    *e = (uint64_t)mm_virt_to_phys(t) | PTE_PRESENT | PTE_WRITABLE | (*e & PTE_USER)
+       | ((uint64_t)PT_ENTRIES << PTE_COUNT_SHIFT);
+    return 0;
+}
+
+/*
+ * Walk to the entry that maps vaddr at the given level, filling
+ * path[l] with the entry used at each level l on the way (path[3] is in
+ * the PML4).  Large pages above that level are split; missing tables
+ * are created only when alloc is set.  user (0 or PTE_USER) is or-ed
+ * into every table entry on the path so the leaf alone decides user
+ * access.  Caller holds pt_lock.
+ */
+static uint64_t *pt_walk(uint64_t *root, uint64_t vaddr, uint32_t level, int alloc,
+                         uint64_t user, uint64_t *path[PT_LEVEL_PML4 + 1u]) {
+    uint64_t *table = root;
+    for (uint32_t l = PT_LEVEL_PML4; l > level; l--) {
+        uint64_t *e = &table[pt_index(vaddr, l)];
+        uint64_t old = *e;
+        path[l] = e;
+        if (!(*e & PTE_PRESENT)) {
+            uint64_t *t;
+            if (!alloc || !(t = table_alloc()))
+                return NULL;
+            *e = (uint64_t)mm_virt_to_phys(t) | PTE_PRESENT | PTE_WRITABLE;
+            if (l < PT_LEVEL_PML4)
+                pte_count_add(path[l + 1u], 1);
+        } else if (*e & PTE_HUGE) {
+            if (pt_split(e, l) != 0)
+                return NULL;
+        }
+        *e |= user;
+        if (l == PT_LEVEL_PML4 && root == pml4 && pt_kernel_slot(pt_index(vaddr, l))
+                && ((old ^ *e) & ~PTE_COUNT_MASK))
+            pt_kernel_changed(pt_index(vaddr, l));
+        table = pte_table(*e);
+    }
+    path[level] = &table[pt_index(vaddr, level)];
+    return path[level];
+}
+
+/* Store a leaf through path[level], keeping the parent's count in step */
+static void pt_set(uint64_t *path[PT_LEVEL_PML4 + 1u], uint32_t level, uint64_t entry) {
+    uint64_t *e = path[level];
+    int was = (*e & PTE_PRESENT) != 0, is = (entry & PTE_PRESENT) != 0;
+    if (level == PT_LEVEL_4K)
+        frame_map_count(*e, entry);
+    *e = entry;
+    if (level < PT_LEVEL_PML4 && was != is)
+        pte_count_add(path[level + 1u], is ? 1 : -1);
+}
+
+/* ---- Deferred TLB invalidation ---- */
+
+/*
+ * Pages whose translation changed during one range operation.  They are
+ * invalidated together once the operation is done; past MM_FLUSH_BATCH
+ * pages a single CR3 reload is cheaper than that many INVLPGs.  Tables
+ * emptied on the way, and frames unmapped to be freed, are held back
+ * until after the flush, chained through their first words, so nothing
+ * can reach a page once it is reused.
+ */
+typedef struct {
+    uint64_t  va[MM_FLUSH_BATCH];
+    uint32_t  count;
+    int       all;       /* too many pages: flush everything */
+    int       global;    /* a global entry changed */
+    uint64_t *freed;     /* tables to release after the flush */
+    uint64_t *frames;    /* frames to free: [0] next, [1] page count */
+} pt_flush;
+
+#define PT_PROTECT      0
+#define PT_UNMAP        1
+#define PT_UNMAP_FREE   2   /* unmap and free the frames */
+
+static void flush_add(pt_flush *f, uint64_t vaddr, uint64_t old) {
+    f->global |= (old & PTE_GLOBAL) != 0;
+    if (f->all)
+        return;
+    if (f->count == MM_FLUSH_BATCH)
+        f->all = 1;
+    else
+        f->va[f->count++] = vaddr;
+}
+
+/*
+ * Invalidate r's changed pages on this CPU if r is live here, and on
+ * any other CPU that may cache them, then release held tables.  Other
+ * CPUs drop their entries wholesale.  Caller holds pt_lock.
+ */
+static void flush_run(pt_flush *f, mm_pt_root *r) {
+    int live = r == &kernel_root || r == pt_root_current();
+    if (live && f->all) {
+        if (f->global) {
+            mm_tlb_flush_all();
+        } else {
+            /* Without NOFLUSH, a CR3 write drops the current PCID's entries */
+            uint64_t cr3;
+            __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+            __asm__ volatile("movq %0, %%cr3" : : "r"(cr3) : "memory");
+        }
+    } else if (live) {
+        for (uint32_t i = 0; i < f->count; i++)
+            __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)f->va[i]) : "memory");
+    }
+    if (f->all || f->count)
+        pt_flush_remote(r, f->global);
+    while (f->freed) {
+        uint64_t *t = f->freed;
+        f->freed = (uint64_t *)(uintptr_t)t[0];
+        t[0] = 0;
+        table_free(t);
+    }
+    while (f->frames) {
+        uint64_t *fr = f->frames;
+        f->frames = (uint64_t *)(uintptr_t)fr[0];
+        if (fr[1] == 1u)
+            mm_free_page((void *)mm_virt_to_phys(fr));
+        else
+            mm_free_pages((void *)mm_virt_to_phys(fr), (uint32_t)fr[1]);
+    }
+}
+
+/*
+ * After path[level] was cleared, free every table on the path that is
+ * now empty, bottom up.  The PML4 itself is never freed, nor are the
+ * kernel-slot PDPTs every address space shares.  Without a flush batch
+ * the caller must have invalidated vaddr first: INVLPG also drops the
+ * cached paging-structure entries that still point at these tables.
+ */
+static void pt_prune(uint64_t *path[PT_LEVEL_PML4 + 1u], uint32_t level, uint64_t vaddr,
+                     pt_flush *f) {
+    for (uint32_t l = level + 1u; l <= PT_LEVEL_PML4; l++) {
+        if (pte_count(*path[l]) != 0)
+            return;
+        if (l == PT_LEVEL_PML4 && pt_kernel_slot(pt_index(vaddr, l)))
+            return;
+        uint64_t *t = pte_table(*path[l]);
+        pt_set(path, l, 0);
+        if (f) {
+            t[0] = (uint64_t)(uintptr_t)f->freed;
+            f->freed = t;
+        } else {
+            table_free(t);
+        }
+    }
+}
+
+/*
+ * Descend without splitting or allocating.  Returns the entry at which
+ * the walk stopped: a leaf at *level, or a non-present entry whose
+ * level_size(*level) bytes are all unmapped.  Caller holds pt_lock.
+ */
+static uint64_t *pt_find(uint64_t *root, uint64_t vaddr, uint32_t *level,
+                         uint64_t *path[PT_LEVEL_PML4 + 1u]) {
+    uint64_t *table = root;
+    for (uint32_t l = PT_LEVEL_PML4; ; l--) {
+        uint64_t *e = &table[pt_index(vaddr, l)];
+        path[l] = e;
+        if (l == PT_LEVEL_4K || !(*e & PTE_PRESENT) || (*e & PTE_HUGE)) {
+            *level = l;
+            return e;
+        }
+        table = pte_table(*e);
+    }
+}
+
+static int cpu_supports_1g_pages(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                             : "a"(0x80000000u), "c"(0));
+    if (eax < 0x80000001u)
+        return 0;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                             : "a"(0x80000001u), "c"(0));
+    return (edx >> 26) & 1u;   /* Page1GB */
+}
+
+/*
+ * Identity map [start, end) with the largest pages that fit: 1 GB where
+ * an aligned gigabyte is wholly inside the range, 2 MB elsewhere.
+ */
+static int direct_map_range(uint64_t start, uint64_t end, uint64_t global) {
+    const uint64_t big = level_size(PT_LEVEL_2M), huge = level_size(PT_LEVEL_1G);
+    uint64_t *path[PT_LEVEL_PML4 + 1u];
+    for (uint64_t a = start & ~(big - 1u); a < end; ) {
+        if (pt_has_1g && !(a & (huge - 1u)) && a + huge <= end) {
+            uint64_t *e = pt_walk(pml4, a, PT_LEVEL_1G, 1, 0, path);
+            if (!e)
+                return -1;
+            if (!(*e & PTE_PRESENT)) {
+                pt_set(path, PT_LEVEL_1G, a | PTE_PRESENT | PTE_WRITABLE | PTE_HUGE | global);
+                a += huge;
+                continue;
+            }
+        }
+        uint64_t *e = pt_walk(pml4, a, PT_LEVEL_2M, 1, 0, path);
+        if (!e)
+            return -1;
+        if (!(*e & PTE_PRESENT))
+            pt_set(path, PT_LEVEL_2M, a | PTE_PRESENT | PTE_WRITABLE | PTE_HUGE | global);
+        a += big;
+    }
+    return 0;
+}
+
+static void build_page_tables(uint64_t kern_start, uint64_t kern_end) {
+    for (uint32_t i = 0; i < PML4_ENTRIES; i++) pml4[i] = 0;
+
+    pt_has_1g = cpu_supports_1g_pages();
+
+    /* 0 … 2 MB holds firmware leftovers: mapped, but not global */
+    int rc = direct_map_range(0, level_size(PT_LEVEL_2M), 0);
+    if (rc == 0)
+        rc = direct_map_range(level_size(PT_LEVEL_2M), LOW_MAP_END, PTE_GLOBAL);
+
+    /* Kernel image, in case it was loaded above the low window */
+    if (rc == 0 && kern_end > LOW_MAP_END)
+        rc = direct_map_range(kern_start, kern_end, PTE_GLOBAL);
+
+    /* Every zone */
+    for (uint32_t zi = 0; zi < nr_zones && rc == 0; zi++)
+        rc = direct_map_range(zones[zi].base_pfn * PAGE_SIZE,
+                              (zones[zi].base_pfn + zones[zi].nr_pages) * PAGE_SIZE,
+                              PTE_GLOBAL);
+    if (rc != 0)
+        print_str("MM: out of memory for direct map\n", 0x0C);
+
+    page_tables_ready = 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* mm_init                                                            */
+/* ------------------------------------------------------------------ */
+static void watermarks_init(void);
+static void numa_order_init(void);
+
+memory_status mm_init(boot_params *boot_params) {
+    /* Step 1: determine kernel image extent from linker symbols */
+    extern uint8_t _kernelStart[], _kernelEnd[];
+    uint64_t kern_start = (uint64_t)(uintptr_t)_kernelStart;
+    uint64_t kern_end   = (uint64_t)(uintptr_t)_kernelEnd;
+    uint64_t k_first, k_last;   /* frame numbers excluded from every zone */
+
+    if (kern_start >= PHYS_BASE && kern_end > kern_start) {
+        k_first = kern_start / PAGE_SIZE;
+        k_last  = (kern_end + PAGE_SIZE - 1u) / PAGE_SIZE;
+    } else {
+        /* Linker symbols unavailable — use conservative bound */
+        k_first = PHYS_BASE / PAGE_SIZE;
+        k_last  = k_first + KERNEL_RESERVED_PAGES_FALLBACK;
+    }
+
+    /* Step 2: collect zones from the UEFI memory map or use fallback,
+     * split by NUMA node while the ACPI tables are still mapped */
+    numa_init();
+    numa_order_init();
+    nr_zones = 0;
+    if (!boot_params
+            || !boot_params->memory_map
+            || boot_params->memory_map_size == 0
+            || boot_params->memory_map_descriptor_size < sizeof(efi_memory_descriptor)) {
+        /* Fallback: assume 16 MB of conventional RAM above PHYS_BASE */
+        zone_add_usable(PHYS_BASE / PAGE_SIZE,
+                        PHYS_BASE / PAGE_SIZE + MM_FALLBACK_PAGES,
+                        k_first, k_last);
+        print_str("MM: fallback map (no UEFI params)\n", 0x0E);
+    } else {
+        const uint8_t *base     = (const uint8_t *)boot_params->memory_map;
+        uint64_t       stride   = boot_params->memory_map_descriptor_size;
+        uint64_t       num_descs = boot_params->memory_map_size / stride;
+
+        for (uint64_t d = 0; d < num_descs; d++) {
+            const efi_memory_descriptor *desc =
+                (const efi_memory_descriptor *)(base + d * stride);
+
+            if (desc->type != EFI_CONVENTIONAL_MEMORY)
+                continue;
+
+            /* Overflow guard: ignore descriptors running past 2^52 */
+            uint64_t first = (desc->physical_start + PAGE_SIZE - 1u) / PAGE_SIZE;
+            if (first >= (1ull << 40) || desc->number_of_pages >= (1ull << 40))
+                continue;
+            zone_add_usable(first, desc->physical_start / PAGE_SIZE
+                                   + desc->number_of_pages,
+                            k_first, k_last);
+        }
+    }
+
+    /* Step 3: place metadata and bring up the first section of each zone */
+    for (uint32_t n = 0; n < NUMA_MAX_NODES; n++)
+        node_zones[n] = 0;
+    zone_setup_all();
+    mm_numa_set_cpu(cpu_current_id(), cpu_apic_id());
+    for (uint32_t i = 0; i < nr_zones; i++)
+        zone_init_section(&zones[i]);
+    mm_magazine_tune(MAG_BATCH, MAG_LOW_WATER, MAG_HIGH_WATER);
+    watermarks_init();
+
+    /* Step 4: build page tables; the heap follows once they are loaded */
+    build_page_tables(kern_start, kern_end);
+
+    /* Step 5: report */
+    uint32_t free_count = mm_get_free_pages();
+
+    print_str("MM: ", 0x0A);
+    print_num(nr_zones, 0x0A);
+    print_str(" zones, free pages: ", 0x0A);
+    print_num(free_count, 0x0A);
+    print_str(" / ", 0x0A);
+    print_num(total_pages, 0x0A);
+    print_str(" (", 0x0A);
+    print_num(deferred_pages, 0x0A);
+    print_str(" deferred)\n", 0x0A);
+
+    if (free_count == 0)
+        return MEMORY_ERROR_NOMEM;
+
+    return MEMORY_SUCCESS;
+}
+
+/* ------------------------------------------------------------------ */
+/* Per-CPU page magazines                                              */
+/* ------------------------------------------------------------------ */
+/* Move up to n pages from the zones into mag.  Caller has IRQs off. */
+static void magazine_refill(page_magazine *mag, uint32_t n) {
+    if (n > MAG_CAPACITY - mag->count)
+        n = MAG_CAPACITY - mag->count;
+    if (n == 0)
+        return;
+
+    mm_zone *z;
+    spin_lock(&phys_lock);
+    /* One contiguous run costs a single buddy operation */
+    uint8_t *run = (uint8_t *)zone_alloc(n, &z);
+    if (run) {
+        /* Push highest first so the lowest address is handed out next */
+        for (uint32_t i = n; i-- > 0; )
+            mag->pages[mag->count++] = run + (size_t)i * PAGE_SIZE;
+    } else {
+        while (n--) {
+            void *page = zone_alloc(1, &z);
+            if (!page)
+                break;
+            mag->pages[mag->count++] = page;
+        }
+    }
+    spin_unlock(&phys_lock);
+    mag->refills++;
+}
+
+/* Return the n coldest pages (bottom of the stack) to their zones. */
+static void magazine_drain(page_magazine *mag, uint32_t n) {
+    if (n > mag->count)
+        n = mag->count;
+    if (n == 0)
+        return;
+
+    spin_lock(&phys_lock);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t phys = (uint64_t)(uintptr_t)mag->pages[i];
+        mm_zone *z = zone_of(phys);
+        buddy_free(&z->buddy, (uint32_t)(phys / PAGE_SIZE - z->base_pfn), 0);
+        zone_update_mask(z);
+    }
+    spin_unlock(&phys_lock);
+
+    for (uint32_t i = n; i < mag->count; i++)
+        mag->pages[i - n] = mag->pages[i];
+    mag->count -= n;
+    mag->drains++;
 }
 
-static inline void bitmap_clear(uint32_t idx) {
-    page_bitmap[idx >> 3] &= (uint8_t)~(1u << (idx & 7u));
+/* Act on a drain request posted to this CPU's magazine.  IRQs are off. */
+static void magazine_poll(page_magazine *mag) {
+    if (!mag->drain_req)
+        return;
+    uint32_t req = __atomic_exchange_n(&mag->drain_req, 0u, __ATOMIC_ACQUIRE);
+    if (req & MAG_DRAIN_ALL)
+        magazine_drain(mag, mag->count);
+    else if ((req & MAG_DRAIN_TRIM) && mag->count > mag_high)
+        magazine_drain(mag, mag->count - mag_high);
+}
+
+/* Drain this CPU's magazine now and ask every other CPU to drain its own */
+static void magazine_request(uint32_t req) {
+    uint64_t irq = cpu_irq_save();
+    uint32_t self = cpu_current_id();
+    for (uint32_t c = 0; c < MAX_CPUS; c++)
+        if (c != self)
+            __atomic_or_fetch(&page_mags[c].drain_req, req, __ATOMIC_RELEASE);
+    __atomic_or_fetch(&page_mags[self].drain_req, req, __ATOMIC_RELAXED);
+    magazine_poll(&page_mags[self]);
+    cpu_irq_restore(irq);
+}
+
+int mm_magazine_tune(uint32_t batch, uint32_t low, uint32_t high) {
+    if (batch == 0 || low > high || high > MAG_CAPACITY || batch > high)
+        return -1;
+    mag_batch = batch;
+    mag_low   = low;
+    mag_high  = high;
+    magazine_request(MAG_DRAIN_TRIM);
+    return 0;
+}
+
+void mm_magazine_balance(void) {
+    uint64_t irq = cpu_irq_save();
+    page_magazine *mag = &page_mags[cpu_current_id()];
+    magazine_poll(mag);
+    if (mag->count < mag_low)
+        magazine_refill(mag, mag_batch);
+    else if (mag->count > mag_high)
+        magazine_drain(mag, mag->count - mag_high);
+    cpu_irq_restore(irq);
+}
+
+void mm_magazine_poll(void) {
+    uint64_t irq = cpu_irq_save();
+    magazine_poll(&page_mags[cpu_current_id()]);
+    cpu_irq_restore(irq);
+}
+
+void mm_magazine_flush(void) {
+    magazine_request(MAG_DRAIN_ALL);
+}
+
+/* ------------------------------------------------------------------ */
+/* Reserve and memory pressure                                         */
+/* ------------------------------------------------------------------ */
+static uint32_t reserve_pages = 0;   /* 0 until mm_init sizes it */
+static uint64_t reserve_dips = 0;
+static uint64_t reserve_refused = 0;
+static uint32_t pressure_mark[MM_PRESSURE_CRITICAL + 1u];  /* [NONE] unused */
+static uint32_t pressure_hyst = 0;
+static uint32_t pressure_cur = MM_PRESSURE_NONE;
+
+static void watermarks_init(void) {
+    uint32_t r = total_pages >> RESERVE_SHIFT;
+    r = r < RESERVE_MIN ? RESERVE_MIN : r > RESERVE_MAX ? RESERVE_MAX : r;
+    reserve_pages = r < total_pages / 4u ? r : total_pages / 4u;
+    pressure_mark[MM_PRESSURE_LOW]      = reserve_pages + (total_pages >> PRESSURE_LOW_SHIFT);
+    pressure_mark[MM_PRESSURE_MEDIUM]   = reserve_pages + (total_pages >> PRESSURE_MED_SHIFT);
+    pressure_mark[MM_PRESSURE_CRITICAL] = reserve_pages + (total_pages >> PRESSURE_CRIT_SHIFT);
+    pressure_hyst = total_pages >> PRESSURE_HYST_SHIFT;
+}
+
+/*
+ * The reserve is the last reserve_pages free pages.  An ordinary
+ * allocation of count pages that would dig into it is refused; one
+ * with MM_ALLOC_RESERVE goes ahead and is counted.
+ */
+static int reserve_check(uint32_t count, uint32_t flags) {
+    if (mm_get_free_pages() >= reserve_pages + count)
+        return 0;
+    if (flags & MM_ALLOC_RESERVE) {
+        __atomic_add_fetch(&reserve_dips, 1u, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_add_fetch(&reserve_refused, 1u, __ATOMIC_RELAXED);
+    return -1;
+}
+
+uint32_t mm_pressure_level(void) {
+    uint32_t free = mm_get_free_pages();
+    uint32_t cur  = __atomic_load_n(&pressure_cur, __ATOMIC_RELAXED);
+    uint32_t lvl  = MM_PRESSURE_NONE;
+    while (lvl < MM_PRESSURE_CRITICAL && free < pressure_mark[lvl + 1u])
+        lvl++;
+    /* Step down one level at a time, each only past the margin above its mark */
+    while (cur > lvl && free >= pressure_mark[cur] + pressure_hyst)
+        cur--;
+    if (cur > lvl)
+        lvl = cur;
+    __atomic_store_n(&pressure_cur, lvl, __ATOMIC_RELAXED);
+    return lvl;
+}
+
+/* Free memory crossed a mark the last evaluated level does not reflect */
+static void pressure_watch(void) {
+    uint32_t free = mm_get_free_pages();
+    uint32_t cur  = __atomic_load_n(&pressure_cur, __ATOMIC_RELAXED);
+    if ((cur < MM_PRESSURE_CRITICAL && free < pressure_mark[cur + 1u])
+            || (cur > MM_PRESSURE_NONE && free >= pressure_mark[cur] + pressure_hyst))
+        pressure_notify();
+}
+
+void mm_pressure_set_notify(void (*fn)(void)) {
+    pressure_notify = fn;
+}
+
+uint32_t mm_pressure_shrink(void) {
+    uint32_t free   = mm_get_free_pages();
+    uint32_t target = pressure_mark[MM_PRESSURE_LOW] + pressure_hyst;
+    return free < target ? target - free : 0;
+}
+
+void mm_reserve_stats(uint32_t *pages, uint64_t *dips, uint64_t *refused) {
+    *pages   = reserve_pages;
+    *dips    = __atomic_load_n(&reserve_dips, __ATOMIC_RELAXED);
+    *refused = __atomic_load_n(&reserve_refused, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------ */
+/* Pre-zeroed page pool                                                */
+/* ------------------------------------------------------------------ */
+/*
+ * Pages in the pool are allocated in their zone bitmap but reported as
+ * free.  The idle loop clears them with non-temporal stores, so zeroing
+ * does not evict the working set from the cache; the page is usually
+ * written again much later by whoever takes it.
+ */
+static void    *zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_count  = 0;
+static uint64_t zero_hits   = 0;
+static uint64_t zero_misses = 0;
+static spinlock_t zero_lock = SPINLOCK_INIT;
+
+static void page_clear_nt(void *page) {
+    uint64_t *p = (uint64_t *)page;
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 8u)
+        __asm__ volatile("movnti %1, 0(%0)\n"  "movnti %1, 8(%0)\n"
+                         "movnti %1, 16(%0)\n" "movnti %1, 24(%0)\n"
+                         "movnti %1, 32(%0)\n" "movnti %1, 40(%0)\n"
+                         "movnti %1, 48(%0)\n" "movnti %1, 56(%0)"
+                         : : "r"(p + i), "r"(0ull) : "memory");
+    /* Streaming stores are weakly ordered: drain them before publishing */
+    __asm__ volatile("sfence" : : : "memory");
+}
+
+/* Pop a cleared page, or NULL.  Caller has IRQs off. */
+static void *zero_pool_take(void) {
+    void *page = NULL;
+    spin_lock(&zero_lock);
+    if (zero_count)
+        page = zero_pool[--zero_count];
+    spin_unlock(&zero_lock);
+    return page;
+}
+
+uint32_t mm_zero_pool_fill(void) {
+    uint32_t added = 0;
+    while (added < ZERO_FILL_BATCH
+           && __atomic_load_n(&zero_count, __ATOMIC_RELAXED) < ZERO_POOL_SIZE) {
+        void *page = mm_alloc_page();
+        if (!page)
+            break;
+        page_clear_nt(mm_phys_to_virt((uintptr_t)page));
+
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&zero_lock);
+        int kept = zero_count < ZERO_POOL_SIZE;
+        if (kept)
+            zero_pool[zero_count++] = page;
+        spin_unlock(&zero_lock);
+        cpu_irq_restore(irq);
+        if (!kept) {
+            mm_free_page(page);
+            break;
+        }
+        added++;
+    }
+    return added;
+}
+
+void mm_zero_pool_drain(void) {
+    void *page;
+    for (;;) {
+        uint64_t irq = cpu_irq_save();
+        page = zero_pool_take();
+        cpu_irq_restore(irq);
+        if (!page)
+            break;
+        mm_free_page(page);
+    }
+}
+
+static void *page_take(void);
+
+void *mm_alloc_page_flags(uint32_t flags) {
+    if (reserve_check(1u, flags) != 0)
+        return NULL;
+    if (!(flags & MM_ALLOC_ZEROED))
+        return page_take();
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&zero_lock);
+    void *page = NULL;
+    if (zero_count) {
+        page = zero_pool[--zero_count];
+        zero_hits++;
+    } else {
+        zero_misses++;
+    }
+    spin_unlock(&zero_lock);
+    cpu_irq_restore(irq);
+
+    /* Miss: clear it here, with ordinary stores since the caller is about to use it */
+    if (!page && (page = page_take())) {
+        uint64_t *p = (uint64_t *)mm_phys_to_virt((uintptr_t)page);
+        for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+            p[i] = 0;
+    }
+    return page;
+}
+
+void mm_zero_pool_stats(uint32_t *pages, uint64_t *hits, uint64_t *misses) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&zero_lock);
+    *pages  = zero_count;
+    *hits   = zero_hits;
+    *misses = zero_misses;
+    spin_unlock(&zero_lock);
+    cpu_irq_restore(irq);
+}
+
+/* ------------------------------------------------------------------ */
+/* NUMA placement                                                     */
+/* ------------------------------------------------------------------ */
+
+/* Every node falls back to the others nearest first, ties to the lower id */
+static void numa_order_init(void) {
+    nr_nodes = numa_nodes();
+    for (uint32_t h = 0; h < nr_nodes; h++) {
+        for (uint32_t n = 0; n < nr_nodes; n++) {
+            uint32_t i = n;
+            while (i > 0 && numa_distance(h, node_order[h][i - 1u]) > numa_distance(h, n)) {
+                node_order[h][i] = node_order[h][i - 1u];
+                i--;
+            }
+            node_order[h][i] = (uint8_t)n;
+        }
+        node_order_len[h] = nr_nodes;
+    }
+}
+
+void mm_numa_set_cpu(uint32_t cpu, uint32_t apic_id) {
+    if (cpu < MAX_CPUS)
+        cpu_node[cpu] = (uint8_t)numa_node_of_apic(apic_id);
+}
+
+uint32_t mm_numa_cpu_node(uint32_t cpu) {
+    return cpu < MAX_CPUS ? cpu_node[cpu] : 0;
+}
+
+int mm_numa_set_fallback(uint32_t node, const uint8_t *order, uint32_t n) {
+    if (node >= nr_nodes || !order || n == 0 || n > nr_nodes)
+        return -1;
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (order[i] >= nr_nodes || (seen & (1u << order[i])))
+            return -1;
+        seen |= 1u << order[i];
+    }
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&phys_lock);
+    for (uint32_t i = 0; i < n; i++)
+        node_order[node][i] = order[i];
+    node_order_len[node] = n;
+    spin_unlock(&phys_lock);
+    cpu_irq_restore(irq);
+    return 0;
+}
+
+void mm_numa_stats(uint32_t node, uint32_t *free_pages, uint64_t *local, uint64_t *remote) {
+    *free_pages = 0;
+    *local  = 0;
+    *remote = 0;
+    if (node >= nr_nodes)
+        return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&phys_lock);
+    for (uint32_t i = 0; i < nr_zones; i++)
+        if (zones[i].node == node)
+            *free_pages += zones[i].buddy.free_pages;
+    *local  = node_local[node];
+    *remote = node_remote[node];
+    spin_unlock(&phys_lock);
+    cpu_irq_restore(irq);
+}
+
+/* ------------------------------------------------------------------ */
+/* mm_alloc_page                                                      */
+/* ------------------------------------------------------------------ */
+static void *page_take(void) {
+    uint64_t irq = cpu_irq_save();
+    page_magazine *mag = &page_mags[cpu_current_id()];
+    magazine_poll(mag);
+    if (mag->count == 0) {
+        mag->misses++;
+        magazine_refill(mag, mag_batch);
+        /* Initialised memory ran dry: pull in deferred sections */
+        while (mag->count == 0 && deferred_pages) {
+            mm_deferred_init();
+            magazine_refill(mag, mag_batch);
+        }
+        if (mag->count == 0) {
+            /* Last resort: cleared pages are still pages */
+            void *page = zero_pool_take();
+            cpu_irq_restore(irq);
+            return page;
+        }
+    } else {
+        mag->hits++;
+    }
+    void *page = mag->pages[--mag->count];
+    mm_zone *z = zone_of((uint64_t)(uintptr_t)page);
+    bitmap_set(z, (uint32_t)((uintptr_t)page / PAGE_SIZE - z->base_pfn));
+    cpu_irq_restore(irq);
+    return page;
+}
+
+void *mm_alloc_page(void) {
+    return mm_alloc_page_flags(0);
+}
+
+/* ------------------------------------------------------------------ */
+/* mm_free_page                                                       */
+/* ------------------------------------------------------------------ */
+void mm_free_page(void *page) {
+    mm_zone *z;
+    int64_t idx = zone_page_idx((uint64_t)(uintptr_t)page, &z);
+    if (idx < 0)
+        return; /* not a managed, page-aligned frame — refuse silently */
+
+    /* Still shared: the owners let go through mm_page_unref */
+    mm_page *pg = &z->pages[idx];
+    if (__atomic_load_n(&pg->refs, __ATOMIC_ACQUIRE) != 0)
+        return;
+
+    uint64_t irq = cpu_irq_save();
+    if (!bitmap_clear(z, (uint32_t)idx)) {
+        cpu_irq_restore(irq);
+        return; /* double free — refuse silently */
+    }
+    pg->flags = 0;
+    if (z->node != cpu_node[cpu_current_id()]) {
+        /* Another node's frame goes home, so magazines only cache local ones */
+        spin_lock(&phys_lock);
+        buddy_free(&z->buddy, (uint32_t)idx, 0);
+        zone_update_mask(z);
+        spin_unlock(&phys_lock);
+        cpu_irq_restore(irq);
+        return;
+    }
+    page_magazine *mag = &page_mags[cpu_current_id()];
+    magazine_poll(mag);
+    if (mag->count >= mag_high)
+        magazine_drain(mag, mag_batch);
+    mag->pages[mag->count++] = page;
+    cpu_irq_restore(irq);
+}
+
+static int compact_worth(uint32_t order);
+
+/* ------------------------------------------------------------------ */
+/* mm_alloc_pages                                                      */
+/* ------------------------------------------------------------------ */
+void *mm_alloc_pages(uint32_t count) {
+    return mm_alloc_pages_flags(count, 0);
+}
+
+void *mm_alloc_pages_flags(uint32_t count, uint32_t flags) {
+    if (count == 0) return NULL;
+    if (count == 1) return mm_alloc_page_flags(flags & (MM_ALLOC_ZEROED | MM_ALLOC_RESERVE));
+    if (count > (1u << BUDDY_MAX_ORDER)) return NULL;
+    if (reserve_check(count, flags) != 0) return NULL;
+
+    mm_zone *z;
+    void *pages;
+    int compacted = 0;
+    for (;;) {
+        uint64_t irq = cpu_irq_save();
+        spin_lock(&phys_lock);
+        pages = zone_alloc(count, &z);
+        if (pages) {
+            uint32_t idx = (uint32_t)((uintptr_t)pages / PAGE_SIZE - z->base_pfn);
+            used_add((int32_t)mm_bitmap_set_range(&z->map, idx, idx + count));
+        }
+        spin_unlock(&phys_lock);
+        cpu_irq_restore(irq);
+        if (pages) {
+            if (flags & MM_ALLOC_ZEROED) {
+                uint64_t *p = (uint64_t *)mm_phys_to_virt((uintptr_t)pages);
+                for (uint64_t i = 0; i < (uint64_t)count * (PAGE_SIZE / sizeof(uint64_t)); i++)
+                    p[i] = 0;
+            }
+            return pages;
+        }
+        if (deferred_pages) {
+            mm_deferred_init();
+            continue;
+        }
+        /* Enough memory may be free, just not in one piece */
+        if (compacted || !compact_worth(buddy_order_for(count)))
+            return NULL;
+        compacted = 1;
+        mm_zero_pool_drain();
+        mm_compact(buddy_order_for(count), 0);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* mm_free_pages                                                       */
+/* ------------------------------------------------------------------ */
+void mm_free_pages(void *pages, uint32_t count) {
+    mm_zone *z;
+    int64_t first = zone_page_idx((uint64_t)(uintptr_t)pages, &z);
+    if (first < 0)
+        return;
+    if (count > z->init_pages - (uint32_t)first)
+        return;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&phys_lock);
+    uint32_t end = (uint32_t)first + count;
+    if (mm_bitmap_find_next_zero(&z->map, (uint32_t)first, end) != end) {
+        /* part of the range is already free — refuse */
+        spin_unlock(&phys_lock);
+        cpu_irq_restore(irq);
+        return;
+    }
+    used_add(-(int32_t)mm_bitmap_clear_range(&z->map, (uint32_t)first, end));
+    for (uint32_t i = (uint32_t)first; i < end; i++)
+        z->pages[i].flags = 0;
+    buddy_free_range(&z->buddy, (uint32_t)first, count);
+    zone_update_mask(z);
+    spin_unlock(&phys_lock);
+    cpu_irq_restore(irq);
+}
+
+/* ------------------------------------------------------------------ */
+/* mm_map_page                                                         */
+/* ------------------------------------------------------------------ */
+static int size_to_level(uint64_t size, uint32_t *level) {
+    if (size == PAGE_SIZE)
+        *level = PT_LEVEL_4K;
+    else if (size == PAGE_SIZE_2M)
+        *level = PT_LEVEL_2M;
+    else if (size == PAGE_SIZE_1G && pt_has_1g)
+        *level = PT_LEVEL_1G;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * Map one page into root r, or into the root that owns vaddr when r is
+ * NULL.  Returns -1 on failure, 0 for a new mapping and 1 if a present
+ * mapping was replaced, or left alone when keep is set.
+ */
+static int pt_map(mm_pt_root *r, uint64_t vaddr, uint64_t paddr, uint64_t size,
+                  uint32_t flags, int keep) {
+    uint32_t level;
+    if (!page_tables_ready || size_to_level(size, &level) != 0)
+        return -1;
+    if (((vaddr | paddr) & (size - 1u)) || (paddr & ~PTE_ADDR_MASK) || !canonical(vaddr))
+        return -1;
+
+    uint64_t entry = paddr | pte_flags(flags);
+    if (level != PT_LEVEL_4K)
+        entry |= PTE_HUGE;
+
+    uint64_t irq = cpu_irq_save();
+    mm_pt_root *cur = pt_root_current();
+    if (!r)
+        r = pt_kernel_slot(pt_index(vaddr, PT_LEVEL_PML4)) ? &kernel_root : cur;
+    spin_lock(&pt_lock);
+    uint64_t *path[PT_LEVEL_PML4 + 1u];
+    uint64_t *e = NULL;
+    if (pt_pool_reserve(PT_WALK_MAX) == 0)
+        e = pt_walk(r->pml4, vaddr, level, 1, entry & PTE_USER, path);
+    /* Refuse to drop a table of smaller mappings under a large page */
+    if (!e || (level != PT_LEVEL_4K && (*e & PTE_PRESENT) && !(*e & PTE_HUGE))) {
+        spin_unlock(&pt_lock);
+        cpu_irq_restore(irq);
+        return -1;
+    }
+    int replaced = (*e & PTE_PRESENT) != 0;
+    if (replaced && keep) {
+        spin_unlock(&pt_lock);
+        cpu_irq_restore(irq);
+        return 1;
+    }
+    pt_set(path, level, entry);
+    spin_unlock(&pt_lock);
+
+    /* Kernel slots are live in every root; others only where loaded */
+    if (r == cur || r == &kernel_root)
+        __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)vaddr) : "memory");
+    if (replaced)
+        pt_flush_remote(r, 0);
+    cpu_irq_restore(irq);
+    return replaced;
+}
+
+static int pt_unmap(mm_pt_root *r, uint64_t vaddr, uint64_t size) {
+    uint32_t level;
+    if (!page_tables_ready || size_to_level(size, &level) != 0)
+        return -1;
+    if ((vaddr & (size - 1u)) || !canonical(vaddr))
+        return -1;
+
+    uint64_t irq = cpu_irq_save();
+    mm_pt_root *cur = pt_root_current();
+    if (!r)
+        r = pt_kernel_slot(pt_index(vaddr, PT_LEVEL_PML4)) ? &kernel_root : cur;
+    spin_lock(&pt_lock);
+    uint64_t *path[PT_LEVEL_PML4 + 1u];
+    uint64_t *e = pt_walk(r->pml4, vaddr, level, 0, 0, path);
+    int rc = -1;
+    if (e && (*e & PTE_PRESENT) && (level == PT_LEVEL_4K || (*e & PTE_HUGE))) {
+        pt_set(path, level, 0);
+        if (r == cur || r == &kernel_root)
+            __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)vaddr) : "memory");
+        pt_flush_remote(r, 0);
+        pt_prune(path, level, vaddr, NULL);
+        rc = 0;
+    }
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return rc;
+}
+
+/* ---- Range operations ---- */
+
+/*
+ * Resolve the root for [vaddr, end): a user root only covers the user
+ * range, and a NULL root picks the owner of vaddr, which must then own
+ * the whole range.  Caller has IRQs off.
+ */
+static mm_pt_root *range_root(mm_pt_root *r, uint64_t vaddr, uint64_t end) {
+    if (end <= vaddr || (vaddr & (PAGE_SIZE - 1u)) || (end & (PAGE_SIZE - 1u))
+            || !canonical(vaddr) || !canonical(end - 1u))
+        return NULL;
+    int user = vaddr >= MM_USER_BASE && end <= MM_USER_END;
+    int low  = end <= MM_USER_BASE;
+    int high = vaddr >= (0xFFFFull << 48);
+    if (r && r != &kernel_root)
+        return user ? r : NULL;
+    if (low || high)
+        return &kernel_root;
+    return user && !r ? pt_root_current() : NULL;
+}
+
+int mm_map_range(mm_pt_root *r, uint64_t vaddr, uint64_t paddr, uint64_t size,
+                 uint32_t flags) {
+    uint64_t end = vaddr + size;
+    if (!page_tables_ready || ((vaddr ^ paddr) & (PAGE_SIZE - 1u))
+            || ((paddr + size - 1u) & ~PTE_ADDR_MASK & ~0xFFFull))
+        return -1;
+
+    uint64_t irq = cpu_irq_save();
+    r = range_root(r, vaddr, end);
+    if (!r) {
+        cpu_irq_restore(irq);
+        return -1;
+    }
+    uint64_t base = pte_flags(flags);
+    pt_flush f;
+    f.count = 0; f.all = 0; f.global = 0; f.freed = NULL; f.frames = NULL;
+    int rc = 0, replaced = 0;
+
+    spin_lock(&pt_lock);
+    for (uint64_t a = vaddr, p = paddr; a < end; ) {
+        uint64_t *path[PT_LEVEL_PML4 + 1u];
+        uint32_t level = PT_LEVEL_4K;
+        uint64_t *e = NULL;
+        if (pt_pool_reserve(PT_WALK_MAX) != 0) {
+            rc = -1;
+            break;
+        }
+        /* 2 MB pages where both sides are aligned and no 4 KB table exists */
+        if (!((a | p) & (PAGE_SIZE_2M - 1u)) && end - a >= PAGE_SIZE_2M) {
+            e = pt_walk(r->pml4, a, PT_LEVEL_2M, 1, base & PTE_USER, path);
+            if (e && (!(*e & PTE_PRESENT) || (*e & PTE_HUGE)))
+                level = PT_LEVEL_2M;
+        }
+        if (level == PT_LEVEL_4K)
+            e = pt_walk(r->pml4, a, PT_LEVEL_4K, 1, base & PTE_USER, path);
+        if (!e) {
+            rc = -1;
+            break;
+        }
+        if (*e & PTE_PRESENT) {
+            replaced = 1;
+            flush_add(&f, a, *e);
+        }
+        pt_set(path, level, p | base | (level != PT_LEVEL_4K ? PTE_HUGE : 0));
+        a += level_size(level);
+        p += level_size(level);
+    }
+    flush_run(&f, r);
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return rc < 0 ? rc : replaced;
+}
+
+/*
+ * Shared loop of unmap and protect (mode PT_*).  A large page only
+ * partly inside the range is split first; holes are skipped a whole
+ * table at a time.
+ */
+static int pt_change_range(mm_pt_root *r, uint64_t vaddr, uint64_t size,
+                           int mode, uint32_t flags) {
+    uint64_t end = vaddr + size;
+    if (!page_tables_ready)
+        return -1;
+
+    uint64_t irq = cpu_irq_save();
+    r = range_root(r, vaddr, end);
+    if (!r) {
+        cpu_irq_restore(irq);
+        return -1;
+    }
+    uint64_t base = pte_flags(flags);
+    pt_flush f;
+    f.count = 0; f.all = 0; f.global = 0; f.freed = NULL; f.frames = NULL;
+    int rc = 0, changed = 0;
+
+    spin_lock(&pt_lock);
+    for (uint64_t a = vaddr; a < end; ) {
+        uint64_t *path[PT_LEVEL_PML4 + 1u];
+        uint32_t level;
+        uint64_t *e  = pt_find(r->pml4, a, &level, path);
+        uint64_t sz  = level_size(level);
+        uint64_t next = (a & ~(sz - 1u)) + sz;
+        if (!(*e & PTE_PRESENT)) {
+            a = next;
+            continue;
+        }
+        if (level != PT_LEVEL_4K && ((a & (sz - 1u)) || next > end)) {
+            if (pt_pool_reserve(PT_WALK_MAX) != 0
+                    || !(e = pt_walk(r->pml4, a, PT_LEVEL_4K, 0, 0, path))) {
+                rc = -1;
+                break;
+            }
+            level = PT_LEVEL_4K;
+            next  = a + PAGE_SIZE;
+        }
+        flush_add(&f, a, *e);
+        changed += (int)(level_size(level) / PAGE_SIZE);
+        if (mode == PT_UNMAP_FREE) {
+            uint64_t frame = *e & PTE_ADDR_MASK & ~(level_size(level) - 1u);
+            /* A shared frame only loses an owner; never write into it */
+            if (level != PT_LEVEL_4K || frame_release(frame)) {
+                uint64_t *fr = (uint64_t *)mm_phys_to_virt((uintptr_t)frame);
+                fr[0] = (uint64_t)(uintptr_t)f.frames;
+                fr[1] = level_size(level) / PAGE_SIZE;
+                f.frames = fr;
+            }
+        }
+        if (mode != PT_PROTECT) {
+            pt_set(path, level, 0);
+            pt_prune(path, level, a, &f);
+        } else {
+            uint64_t keep = *e & (PTE_ADDR_MASK | PTE_COW
+                                  | (level != PT_LEVEL_4K ? PTE_HUGE : 0));
+            /* A copy-on-write page stays read-only until it is copied */
+            *e = keep | (keep & PTE_COW ? base & ~(uint64_t)PTE_WRITABLE : base);
+            /* Upper entries must allow what the leaf now allows */
+            for (uint32_t l = level + 1u; l <= PT_LEVEL_PML4 && (base & PTE_USER); l++)
+                if (!(*path[l] & PTE_USER)) {
+                    *path[l] |= PTE_USER;
+                    if (l == PT_LEVEL_PML4 && r == &kernel_root
+                            && pt_kernel_slot(pt_index(a, l)))
+                        pt_kernel_changed(pt_index(a, l));
+                }
+        }
+        a = next;
+    }
+    flush_run(&f, r);
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return rc < 0 ? rc : changed;
+}
+
+int mm_unmap_range(mm_pt_root *r, uint64_t vaddr, uint64_t size) {
+    return pt_change_range(r, vaddr, size, PT_UNMAP, 0);
+}
+
+int mm_unmap_range_free(mm_pt_root *r, uint64_t vaddr, uint64_t size) {
+    return pt_change_range(r, vaddr, size, PT_UNMAP_FREE, 0);
+}
+
+int mm_protect_range(mm_pt_root *r, uint64_t vaddr, uint64_t size, uint32_t flags) {
+    return pt_change_range(r, vaddr, size, PT_PROTECT, flags);
+}
+
+int mm_map_page_size(uint64_t vaddr, uint64_t paddr, uint64_t size, uint32_t flags) {
+    return pt_map(NULL, vaddr, paddr, size, flags, 0) < 0 ? -1 : 0;
+}
+
+int mm_unmap_page_size(uint64_t vaddr, uint64_t size) {
+    return pt_unmap(NULL, vaddr, size);
+}
+
+int mm_map_page(uint64_t vaddr, uint64_t paddr, uint32_t flags) {
+    return mm_map_page_size(vaddr, paddr, PAGE_SIZE, flags);
+}
+
+/* ------------------------------------------------------------------ */
+/* mm_unmap_page                                                       */
+/* ------------------------------------------------------------------ */
+int mm_unmap_page(uint64_t vaddr) {
+    return mm_unmap_page_size(vaddr, PAGE_SIZE);
+}
+
+/* ------------------------------------------------------------------ */
+/* Address-space roots                                                 */
+/* ------------------------------------------------------------------ */
+static inline int user_range(uint64_t vaddr) {
+    return vaddr >= MM_USER_BASE && vaddr < MM_USER_END;
+}
+
+/* Copy the kernel slots of the kernel PML4 into t.  Caller holds pt_lock. */
+static void pt_copy_kernel_slots(uint64_t *t) {
+    for (uint32_t i = 0; i < PML4_ENTRIES; i++)
+        if (pt_kernel_slot(i))
+            t[i] = pml4[i];
+}
+
+/* Free every table below t, a table at the given level, and zero t */
+static void pt_free_tables(uint64_t *t, uint32_t level) {
+    for (uint32_t i = 0; i < PT_ENTRIES; i++) {
+        if (level > PT_LEVEL_4K && (t[i] & PTE_PRESENT) && !(t[i] & PTE_HUGE)) {
+            uint64_t *child = pte_table(t[i]);
+            pt_free_tables(child, level - 1u);
+            table_free(child);
+        } else if (level == PT_LEVEL_4K) {
+            frame_map_count(t[i], 0);
+        }
+        t[i] = 0;
+    }
+}
+
+int mm_pt_create(mm_pt_root *r) {
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    uint64_t *t = table_alloc();
+    if (t) {
+        pt_copy_kernel_slots(t);
+        r->pml4       = t;
+        r->kernel_gen = pt_kernel_gen;
+        r->owner      = 0;
+        r->tlb_stale  = 0;
+    }
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return t ? 0 : -1;
+}
+
+void mm_pt_destroy(mm_pt_root *r) {
+    if (!r->pml4 || r == &kernel_root)
+        return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    for (uint32_t i = 0; i < PML4_ENTRIES; i++) {
+        if (!pt_kernel_slot(i) && (r->pml4[i] & PTE_PRESENT)) {
+            uint64_t *pdpt = pte_table(r->pml4[i]);
+            pt_free_tables(pdpt, PT_LEVEL_1G);
+            table_free(pdpt);
+        }
+        r->pml4[i] = 0;
+    }
+    table_free(r->pml4);
+    r->pml4 = NULL;
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+}
+
+/* Add the mappings below t, a table at the given level, to u */
+static void pt_usage_walk(const uint64_t *t, uint32_t level, mm_pt_usage_t *u) {
+    u->tables++;
+    for (uint32_t i = 0; i < PT_ENTRIES; i++) {
+        if (!(t[i] & PTE_PRESENT))
+            continue;
+        if (level > PT_LEVEL_4K && !(t[i] & PTE_HUGE)) {
+            pt_usage_walk(pte_table(t[i]), level - 1u, u);
+        } else if (level == PT_LEVEL_4K) {
+            const mm_page *pg = mm_page_of(t[i] & PTE_ADDR_MASK);
+            u->resident++;
+            if (pg && __atomic_load_n(&pg->refs, __ATOMIC_ACQUIRE))
+                u->shared++;
+        } else {
+            u->resident += level_size(level) / PAGE_SIZE;
+        }
+    }
+}
+
+void mm_pt_usage(mm_pt_root *r, mm_pt_usage_t *u) {
+    u->resident = u->shared = u->tables = 0;
+    if (!r || !r->pml4 || r == &kernel_root)
+        return;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    u->tables = 1;
+    for (uint32_t i = 0; i < PML4_ENTRIES; i++)
+        if (!pt_kernel_slot(i) && (r->pml4[i] & PTE_PRESENT))
+            pt_usage_walk(pte_table(r->pml4[i]), PT_LEVEL_1G, u);
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+}
+
+int mm_pt_map(mm_pt_root *r, uint64_t vaddr, uint64_t paddr, uint32_t flags) {
+    if (!user_range(vaddr))
+        return -1;
+    return pt_map(r, vaddr, paddr, PAGE_SIZE, flags, 0);
+}
+
+int mm_pt_map_new(mm_pt_root *r, uint64_t vaddr, uint64_t paddr, uint32_t flags) {
+    if (!user_range(vaddr))
+        return -1;
+    return pt_map(r, vaddr, paddr, PAGE_SIZE, flags, 1);
+}
+
+int mm_pt_unmap(mm_pt_root *r, uint64_t vaddr) {
+    if (!user_range(vaddr))
+        return -1;
+    return pt_unmap(r, vaddr, PAGE_SIZE);
+}
+
+int mm_pt_present(mm_pt_root *r, uint64_t vaddr) {
+    if (!r || !user_range(vaddr))
+        return 0;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    uint64_t *path[PT_LEVEL_PML4 + 1u];
+    uint32_t level;
+    int present = (*pt_find(r->pml4, vaddr, &level, path) & PTE_PRESENT) != 0;
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return present;
+}
+
+int mm_pt_range_empty(mm_pt_root *r, uint64_t vaddr, uint64_t size) {
+    if (!r || !size || !user_range(vaddr) || size > MM_USER_END - vaddr)
+        return 0;
+    uint64_t end = vaddr + size;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    uint64_t *path[PT_LEVEL_PML4 + 1u];
+    uint32_t level;
+    int empty = 1;
+    /* A hole is skipped a whole table at a time */
+    for (uint64_t a = vaddr; a < end && empty; ) {
+        if (*pt_find(r->pml4, a, &level, path) & PTE_PRESENT)
+            empty = 0;
+        else
+            a = (a & ~(level_size(level) - 1u)) + level_size(level);
+    }
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return empty;
+}
+
+/*
+ * Go through the frames rather than vaddr, under pt_lock: a page seen
+ * mapped cannot be unmapped and freed until the copy is done.  Writes
+ * need a writable mapping, so they never land in a copy-on-write frame.
+ */
+static int pt_copy_user(mm_pt_root *r, uint8_t *buf, uint64_t vaddr, uint64_t size,
+                        int write) {
+    if (!r || r == &kernel_root || size > MM_USER_END - vaddr || !user_range(vaddr))
+        return -1;
+    uint64_t need = PTE_PRESENT | PTE_USER | (write ? PTE_WRITABLE : 0u);
+    int rc = 0;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    while (size) {
+        uint64_t *path[PT_LEVEL_PML4 + 1u];
+        uint32_t level;
+        uint64_t e = *pt_find(r->pml4, vaddr, &level, path);
+        if ((e & need) != need) {
+            rc = -1;
+            break;
+        }
+        uint64_t off = vaddr & (level_size(level) - 1u);
+        uint64_t n   = level_size(level) - off;
+        if (n > size)
+            n = size;
+        uint8_t *frame = (uint8_t *)mm_phys_to_virt(
+            (uintptr_t)((e & PTE_ADDR_MASK & ~(level_size(level) - 1u)) + off));
+        for (uint64_t i = 0; i < n; i++) {
+            if (write)
+                frame[i] = buf[i];
+            else
+                buf[i] = frame[i];
+        }
+        buf   += n;
+        vaddr += n;
+        size  -= n;
+    }
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return rc;
+}
+
+int mm_pt_copy_in(mm_pt_root *r, void *dst, uint64_t vaddr, uint64_t size) {
+    return pt_copy_user(r, dst, vaddr, size, 0);
+}
+
+int mm_pt_copy_out(mm_pt_root *r, uint64_t vaddr, const void *src, uint64_t size) {
+    return pt_copy_user(r, (uint8_t *)(uintptr_t)src, vaddr, size, 1);
+}
+
+/* ---- Copy-on-write sharing ---- */
+
+int mm_page_ref(void *page) {
+    mm_page *pg = mm_page_of((uint64_t)(uintptr_t)page);
+    if (!pg)
+        return -1;
+    __atomic_add_fetch(&pg->refs, 1u, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
+void mm_page_unref(void *page) {
+    if (frame_release((uint64_t)(uintptr_t)page))
+        mm_free_page(page);
+}
+
+int mm_page_shared(void *page) {
+    mm_page *pg = mm_page_of((uint64_t)(uintptr_t)page);
+    return pg && __atomic_load_n(&pg->refs, __ATOMIC_ACQUIRE) != 0;
+}
+
+int mm_page_pin(void *page) {
+    mm_page *pg = mm_page_of((uint64_t)(uintptr_t)page);
+    if (!pg)
+        return -1;
+    __atomic_or_fetch(&pg->flags, (uint8_t)MM_PAGE_PINNED, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void mm_page_unpin(void *page) {
+    mm_page *pg = mm_page_of((uint64_t)(uintptr_t)page);
+    if (pg)
+        __atomic_and_fetch(&pg->flags, (uint8_t)~MM_PAGE_PINNED, __ATOMIC_RELEASE);
+}
+
+void mm_page_set_heap(void *page, uint64_t vaddr) {
+    mm_page *pg = mm_page_of((uint64_t)(uintptr_t)page);
+    if (!pg)
+        return;
+    pg->owner = 0;
+    pg->index = vaddr;
+    __atomic_or_fetch(&pg->flags, (uint8_t)MM_PAGE_HEAP, __ATOMIC_RELEASE);
 }
 
-static inline int bitmap_test(uint32_t idx) {
-    return (page_bitmap[idx >> 3] >> (idx & 7u)) & 1u;
+void mm_page_set_anon(void *page, uint32_t owner, uint64_t vaddr) {
+    mm_page *pg = mm_page_of((uint64_t)(uintptr_t)page);
+    if (!pg)
+        return;
+    pg->owner = owner;
+    pg->index = vaddr;
+    __atomic_or_fetch(&pg->flags, (uint8_t)MM_PAGE_ANON, __ATOMIC_RELEASE);
 }
 
-/* ------------------------------------------------------------------ */
-/* Kernel heap management                                              */
-/* ------------------------------------------------------------------ */
+int mm_pt_share_cow(mm_pt_root *dst, mm_pt_root *src, uint64_t vaddr, uint64_t size) {
+    uint64_t end = vaddr + size;
+    if (!page_tables_ready || !dst || !src || dst == src
+            || dst == &kernel_root || src == &kernel_root)
+        return -1;
 
-/* Expand kernel heap by allocating more pages */
-static int heap_expand(size_t size) {
-    size_t pages_needed = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    
-    /* Try to allocate contiguous pages */
-    void *new_pages = mm_alloc_pages(pages_needed);
-    if (!new_pages) {
-        /* Try allocating individual pages */
-        for (size_t i = 0; i < pages_needed; i++) {
-            void *page = mm_alloc_page();
-            if (!page) {
-                /* Free previously allocated pages */
-                for (size_t j = 0; j < i; j++) {
-                    mm_free_page((void *)((uintptr_t)new_pages + j * PAGE_SIZE));
-                }
-                return 0;
-            }
-            
-            /* Map the page into kernel heap space */
-            if (mm_map_page(HEAP_START_VIRT + (heap_end - HEAP_START_VIRT) + i * PAGE_SIZE,
-                          (uint32_t)(uintptr_t)page,
-                          MM_FLAG_KERNEL_RW) != 0) {
-                mm_free_page(page);
-                for (size_t j = 0; j < i; j++) {
-                    mm_free_page((void *)((uintptr_t)new_pages + j * PAGE_SIZE));
-                }
-                return 0;
-            }
+    uint64_t irq = cpu_irq_save();
+    if (!range_root(src, vaddr, end)) {
+        cpu_irq_restore(irq);
+        return -1;
+    }
+    pt_flush f;
+    f.count = 0; f.all = 0; f.global = 0; f.freed = NULL; f.frames = NULL;
+    int rc = 0, changed = 0;
+
+    spin_lock(&pt_lock);
+    for (uint64_t a = vaddr; a < end; ) {
+        uint64_t *path[PT_LEVEL_PML4 + 1u], *dpath[PT_LEVEL_PML4 + 1u];
+        uint32_t level;
+        uint64_t *e = pt_find(src->pml4, a, &level, path);
+        if (!(*e & PTE_PRESENT)) {
+            a = (a & ~(level_size(level) - 1u)) + level_size(level);
+            continue;
         }
-    } else {
-        /* Map contiguous pages */
-        for (size_t i = 0; i < pages_needed; i++) {
-            if (mm_map_page(HEAP_START_VIRT + (heap_end - HEAP_START_VIRT) + i * PAGE_SIZE,
-                          (uint32_t)(uintptr_t)new_pages + i * PAGE_SIZE,
-                          MM_FLAG_KERNEL_RW) != 0) {
-                /* Cleanup on failure */
-                for (size_t j = 0; j < i; j++) {
-                    mm_unmap_page(HEAP_START_VIRT + (heap_end - HEAP_START_VIRT) + j * PAGE_SIZE);
-                }
-                mm_free_pages(new_pages, pages_needed);
-                return 0;
-            }
+        /* Frames are shared, and counted, 4 KB at a time */
+        uint64_t *d = NULL;
+        if (pt_pool_reserve(2u * PT_WALK_MAX) == 0
+                && (level == PT_LEVEL_4K || (e = pt_walk(src->pml4, a, PT_LEVEL_4K, 0, 0, path))))
+            d = pt_walk(dst->pml4, a, PT_LEVEL_4K, 1, *e & PTE_USER, dpath);
+        if (!d || (*d & PTE_PRESENT)) {
+            rc = -1;
+            break;
         }
-    }
-    
-    heap_end += pages_needed * PAGE_SIZE;
-    return 1;
-}
-
-/* Find best fit free block in heap */
-static heap_block_t *heap_find_best_fit(size_t size) {
-    heap_block_t *best = NULL;
-    heap_block_t *current = heap_free_list;
-    
-    while (current) {
-        if (current->free && current->size >= size) {
-            if (!best || current->size < best->size) {
-                best = current;
-            }
+        /* Frames the allocator does not own (device memory) stay shared as is */
+        if (mm_page_ref((void *)(uintptr_t)(*e & PTE_ADDR_MASK)) == 0 && (*e & PTE_WRITABLE)) {
+            flush_add(&f, a, *e);
+            *e = (*e & ~(uint64_t)PTE_WRITABLE) | PTE_COW;
+            changed = 1;
         }
-        current = current->next;
-    }
-    
-    return best;
-}
-
-/* Split a heap block if it's too large */
-static void heap_split_block(heap_block_t *block, size_t size) {
-    if (block->size <= size + sizeof(heap_block_t) + HEAP_BLOCK_SIZE) {
-        return;
-    }
-    
-    heap_block_t *new_block = (heap_block_t *)((uintptr_t)block + sizeof(heap_block_t) + size);
-    new_block->size = block->size - size - sizeof(heap_block_t);
-    new_block->free = 1;
-    new_block->prev = block;
-    new_block->next = block->next;
-    
-    if (block->next) {
-        block->next->prev = new_block;
+        pt_set(dpath, PT_LEVEL_4K, *e);
+        a += PAGE_SIZE;
     }
-    
-    block->size = size;
-    block->next = new_block;
+    flush_run(&f, src);
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    return rc < 0 ? rc : changed;
 }
 
-/* Merge adjacent free heap blocks */
-static void heap_merge_blocks(void) {
-    heap_block_t *current = heap_free_list;
-    
-    while (current && current->next) {
-        uintptr_t current_end = (uintptr_t)current + sizeof(heap_block_t) + current->size;
-        uintptr_t next_start = (uintptr_t)current->next;
-        
-        if (current_end == next_start && current->free && current->next->free) {
-            /* Merge current with next */
-            current->size += sizeof(heap_block_t) + current->next->size;
-            current->next = current->next->next;
-            
-            if (current->next) {
-                current->next->prev = current;
+int mm_pt_cow_fault(mm_pt_root *r, uint64_t vaddr) {
+    if (!r || r == &kernel_root || !user_range(vaddr))
+        return -1;
+    vaddr &= ~(uint64_t)(PAGE_SIZE - 1u);
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    uint64_t *path[PT_LEVEL_PML4 + 1u];
+    uint32_t level;
+    uint64_t *e = pt_find(r->pml4, vaddr, &level, path);
+    uint64_t frame = *e & PTE_ADDR_MASK;
+    int rc = -1, copied = 0;
+    if (level == PT_LEVEL_4K && (*e & PTE_PRESENT) && (*e & PTE_COW)) {
+        uint64_t attrs = (*e & ~(PTE_ADDR_MASK | PTE_COW)) | PTE_WRITABLE;
+        /* Owners are only added under pt_lock: an unshared frame stays ours */
+        mm_page *old = mm_page_of(frame);
+        if (!mm_page_shared((void *)(uintptr_t)frame)) {
+            *e = frame | attrs;
+            if (old && old->mapcount == 1u) {
+                old->owner = r->owner;
+                old->index = vaddr;
             }
+            rc = 0;
         } else {
-            current = current->next;
+            uint64_t *to = (uint64_t *)mm_phys_to_virt((uintptr_t)mm_alloc_page());
+            if (to) {
+                const uint64_t *from = (const uint64_t *)mm_phys_to_virt((uintptr_t)frame);
+                for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+                    to[i] = from[i];
+                frame_map_count(*e, (uint64_t)mm_virt_to_phys(to) | attrs);
+                *e = (uint64_t)mm_virt_to_phys(to) | attrs;
+                if (old && (old->flags & MM_PAGE_ANON))
+                    mm_page_set_anon(to, r->owner, vaddr);
+                rc = 0;
+                copied = 1;
+            }
         }
+        if (rc == 0 && r == pt_root_current())
+            __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)vaddr) : "memory");
+        if (rc == 0)
+            pt_flush_remote(r, 0);
     }
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+    if (copied)
+        mm_page_unref((void *)(uintptr_t)frame);
+    return rc;
 }
 
 /* ------------------------------------------------------------------ */
-/* 64-bit identity page table setup                                   */
+/* Compaction                                                          */
 /* ------------------------------------------------------------------ */
-static void build_page_tables(void) {
-    /* Clear page tables */
-    for (uint32_t i = 0; i < PML4_ENTRIES; i++) pml4[i] = 0;
-    for (uint32_t i = 0; i < PDPT_ENTRIES; i++) pdpt[i] = 0;
-    for (uint32_t i = 0; i < PD_ENTRIES; i++) pd[i] = 0;
-    for (uint32_t i = 0; i < NUM_PTS; i++) {
-        for (uint32_t j = 0; j < PT_ENTRIES; j++) {
-            pt[i][j] = 0;
-        }
-    }
-    
-    /* PML4[0] → pdpt */
-    pml4[0] = (uint64_t)(uintptr_t)pdpt | PTE_PRESENT | PTE_WRITABLE;
-
-    /* PDPT[0] → pd */
-    pdpt[0] = (uint64_t)(uintptr_t)pd | PTE_PRESENT | PTE_WRITABLE;
-
-    /* PD[i] → pt[i]  (each covers 2 MB) */
-    for (uint32_t i = 0; i < NUM_PTS; i++) {
-        pd[i] = (uint64_t)(uintptr_t)pt[i] | PTE_PRESENT | PTE_WRITABLE;
-
-        /* Fill PT: identity-map 512 × 4 KB pages (0-16MB) */
-        for (uint32_t j = 0; j < PT_ENTRIES; j++) {
-            uint64_t phys = (uint64_t)i * PT_ENTRIES * PAGE_SIZE
-                          + (uint64_t)j * PAGE_SIZE;
-            /* Mark kernel pages as supervisor-only */
-            uint64_t flags = PTE_PRESENT | PTE_WRITABLE;
-            if (phys >= 0x200000) {  /* Above 2MB mark for kernel */
-                flags |= PTE_GLOBAL;  /* Global pages for kernel */
-            }
-            pt[i][j] = phys | flags;
-        }
-    }
 
-    page_tables_ready = 1;
+/*
+ * Rebuild free blocks of a given order by moving the in-use frames of
+ * one aligned block elsewhere.  Only frames reached through a single
+ * known 4 KB mapping can move: anonymous user pages (owner, index) and
+ * kernel heap pages (index in the kernel root).  Everything else pins
+ * its block.  The block's free frames are taken off the free lists
+ * first so the destinations are always outside it.
+ *
+ * A frame is unmapped and shot down on every CPU before it is copied,
+ * so no write can land in it meanwhile; a thread touching it faults
+ * and waits on pt_lock for the new mapping.  Kernel code has no such
+ * retry, so heap pages move only while no other CPU runs.  Only the
+ * frames compaction took or emptied itself are freed: another CPU may
+ * allocate in the block at any time.
+ */
+#define MM_PAGE_MOVABLE (MM_PAGE_ANON | MM_PAGE_HEAP)
+
+static mm_pt_root *(*compact_root_of)(uint32_t owner);
+static uint64_t compact_runs   = 0;
+static uint64_t compact_moved  = 0;
+static uint64_t compact_cycles = 0;
+static uint32_t compact_defer_shift[BUDDY_NR_ORDERS];
+static uint32_t compact_considered[BUDDY_NR_ORDERS];
+
+void mm_compact_set_owner_lookup(mm_pt_root *(*root_of)(uint32_t owner)) {
+    compact_root_of = root_of;
 }
 
-/* ------------------------------------------------------------------ */
-/* mm_init                                                            */
-/* ------------------------------------------------------------------ */
-memory_status mm_init(boot_params *boot_params) {
-    /* Step 1: mark everything allocated (deny-by-default) */
-    for (uint32_t i = 0; i < MAX_PAGES / 8u; i++)
-        page_bitmap[i] = 0xFFu;
-    next_free_page = MAX_PAGES; /* sentinel: no free pages yet */
-
-    /* Step 2: determine kernel image extent from linker symbols */
-    extern uint8_t _kernelStart[], _kernelEnd[];
-    uint64_t kern_start = (uint64_t)(uintptr_t)_kernelStart;
-    uint64_t kern_end   = (uint64_t)(uintptr_t)_kernelEnd;
+/* Back off exponentially from orders compaction recently failed for */
+static int compact_worth(uint32_t order) {
+    if (order > BUDDY_MAX_ORDER)
+        return 0;
+    if (++compact_considered[order] < (1u << compact_defer_shift[order]))
+        return 0;
+    compact_considered[order] = 0;
+    return 1;
+}
 
-    /* Step 3: parse UEFI memory map or use fallback */
-    if (!boot_params
-            || !boot_params->memory_map
-            || boot_params->memory_map_size == 0
-            || boot_params->memory_map_descriptor_size < sizeof(efi_memory_descriptor)) {
-        /* Fallback: assume the entire managed window is conventional RAM
-         * except the kernel image pages. */
-        for (uint32_t i = 0; i < MAX_PAGES; i++)
-            bitmap_clear(i);
-
-        /* Re-mark kernel pages as used */
-        if (kern_start >= PHYS_BASE && kern_end > kern_start) {
-            uint32_t k_first = (uint32_t)((kern_start - PHYS_BASE) / PAGE_SIZE);
-            uint32_t k_last  = (uint32_t)((kern_end   - PHYS_BASE + PAGE_SIZE - 1u)
-                                          / PAGE_SIZE);
-            if (k_last > MAX_PAGES) k_last = MAX_PAGES;
-            for (uint32_t i = k_first; i < k_last; i++)
-                bitmap_set(i);
-        } else {
-            /* Linker symbols unavailable — use conservative bound */
-            for (uint32_t i = 0; i < KERNEL_RESERVED_PAGES_FALLBACK; i++)
-                bitmap_set(i);
-        }
+static inline int page_movable(const mm_page *pg) {
+    if ((pg->flags & MM_PAGE_HEAP) && tlb_shootdown)
+        return 0;
+    return (pg->flags & MM_PAGE_MOVABLE) && !(pg->flags & (MM_PAGE_PINNED | MM_PAGE_TABLE))
+        && pg->mapcount == 1u && __atomic_load_n(&pg->refs, __ATOMIC_ACQUIRE) == 0;
+}
 
-        print_str("MM: fallback map (no UEFI params)\n", 0x0E);
-        goto find_first;
+/* In-use frames of [idx, idx + count) if all of them can move, else -1 */
+static int32_t block_movable(const mm_zone *z, uint32_t idx, uint32_t count) {
+    int32_t used = 0;
+    for (uint32_t i = idx; i < idx + count; i++) {
+        if (!bitmap_test(z, i))
+            continue;
+        if (!page_movable(&z->pages[i]))
+            return -1;
+        used++;
     }
+    return used;
+}
 
-    /* Step 4: walk UEFI memory map */
-    {
-        const uint8_t *base     = (const uint8_t *)boot_params->memory_map;
-        uint64_t       stride   = boot_params->memory_map_descriptor_size;
-        uint64_t       num_descs = boot_params->memory_map_size / stride;
-
-        for (uint64_t d = 0; d < num_descs; d++) {
-            const efi_memory_descriptor *desc =
-                (const efi_memory_descriptor *)(base + d * stride);
-
-            if (desc->type != EFI_CONVENTIONAL_MEMORY)
-                continue;
+/*
+ * Move one frame to a new one and repoint its mapping.  Caller holds
+ * pt_lock with IRQs off, so the mapping cannot change meanwhile, and
+ * its entry is clear while the frame is copied.
+ */
+static int migrate_page(mm_zone *z, uint32_t idx) {
+    mm_page *pg = &z->pages[idx];
+    if (!page_movable(pg))
+        return -1;
+    mm_pt_root *r = pg->flags & MM_PAGE_HEAP ? &kernel_root
+                  : compact_root_of ? compact_root_of(pg->owner) : NULL;
+    if (!r || !r->pml4)
+        return -1;
+    uint64_t frame = (z->base_pfn + idx) * PAGE_SIZE;
+    uint64_t *path[PT_LEVEL_PML4 + 1u];
+    uint32_t level;
+    uint64_t *e = pt_find(r->pml4, pg->index, &level, path);
+    if (level != PT_LEVEL_4K || !(*e & PTE_PRESENT) || (*e & PTE_ADDR_MASK) != frame)
+        return -1;
 
-            uint64_t region_start = desc->physical_start;
-            uint64_t region_pages = desc->number_of_pages;
+    /* The old frame is freed right after: moving costs no memory */
+    uint64_t *to = (uint64_t *)mm_phys_to_virt((uintptr_t)mm_alloc_page_flags(MM_ALLOC_RESERVE));
+    if (!to)
+        return -1;
 
-            /* Overflow guard */
-            if (region_pages > (PHYS_SIZE / PAGE_SIZE))
-                region_pages = PHYS_SIZE / PAGE_SIZE;
+    /* No CPU may write the old frame from here on */
+    uint64_t old = *e;
+    *e = 0;
+    if (r == &kernel_root || r == pt_root_current())
+        __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)pg->index) : "memory");
+    pt_flush_remote(r, 0);
+
+    const uint64_t *from = (const uint64_t *)mm_phys_to_virt((uintptr_t)frame);
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+        to[i] = from[i];
+
+    mm_page *npg = mm_page_of(mm_virt_to_phys(to));
+    npg->owner    = pg->owner;
+    npg->index    = pg->index;
+    npg->flags    = pg->flags;
+    npg->mapcount = 1;
+    *e = (uint64_t)mm_virt_to_phys(to) | (old & ~PTE_ADDR_MASK);
+    pg->flags    = 0;
+    pg->mapcount = 0;
+    return 0;
+}
 
-            for (uint64_t p = 0; p < region_pages; p++) {
-                uint64_t phys = region_start + p * (uint64_t)PAGE_SIZE;
+static inline int mine_test(const uint64_t *mine, uint32_t bit) {
+    return (mine[bit / 64u] >> (bit % 64u)) & 1u;
+}
 
-                if (phys < PHYS_BASE)
-                    continue;
-                if (phys >= PHYS_BASE + PHYS_SIZE)
-                    break;
+static inline void mine_set(uint64_t *mine, uint32_t bit) {
+    mine[bit / 64u] |= 1ull << (bit % 64u);
+}
 
-                uint32_t idx = (uint32_t)((phys - PHYS_BASE) / PAGE_SIZE);
-                bitmap_clear(idx);
-            }
+/*
+ * Empty the block [idx, idx + count) of z as far as the budget allows
+ * and free what it no longer uses.  Returns the pages moved.  Caller
+ * holds pt_lock with IRQs off.
+ */
+static uint32_t compact_block(mm_zone *z, uint32_t idx, uint32_t count,
+                              uint64_t start, uint64_t budget) {
+    /* Frames of the block this call holds and may free: bit i - idx */
+    uint64_t mine[(1u << BUDDY_MAX_ORDER) / 64u] = {0};
+
+    spin_lock(&phys_lock);
+    for (uint32_t i = idx; i < idx + count; i++) {
+        if (!bitmap_test(z, i) && buddy_take(&z->buddy, i) == 0) {
+            bitmap_set(z, i);
+            mine_set(mine, i - idx);
         }
     }
+    zone_update_mask(z);
+    spin_unlock(&phys_lock);
 
-    /* Step 5: re-mark kernel image pages as used */
-    if (kern_start >= PHYS_BASE && kern_end > kern_start) {
-        uint32_t k_first = (uint32_t)((kern_start - PHYS_BASE) / PAGE_SIZE);
-        uint32_t k_last  = (uint32_t)((kern_end - PHYS_BASE + PAGE_SIZE - 1u)
-                                      / PAGE_SIZE);
-        if (k_last > MAX_PAGES) k_last = MAX_PAGES;
-        for (uint32_t i = k_first; i < k_last; i++)
-            bitmap_set(i);
-    } else {
-        for (uint32_t i = 0; i < KERNEL_RESERVED_PAGES_FALLBACK; i++)
-            bitmap_set(i);
-    }
-
-find_first:
-    /* Step 6: find first free page */
-    next_free_page = MAX_PAGES;
-    for (uint32_t i = 0; i < MAX_PAGES; i++) {
-        if (!bitmap_test(i)) {
-            next_free_page = i;
+    uint32_t moved = 0;
+    for (uint32_t i = idx; i < idx + count; i++) {
+        if (budget && cpu_rdtsc() - start > budget)
             break;
+        if (!mine_test(mine, i - idx) && (z->pages[i].flags & MM_PAGE_MOVABLE)
+                && migrate_page(z, i) == 0) {
+            mine_set(mine, i - idx);
+            moved++;
         }
     }
 
-    /* Step 7: build page tables */
-    build_page_tables();
-
-    /* Step 8: initialize kernel heap */
-    heap_current = HEAP_START_VIRT;
-    heap_end = HEAP_START_VIRT;
-    
-    /* Allocate initial heap pages */
-    for (uint32_t i = 0; i < HEAP_INITIAL_PAGES; i++) {
-        void *page = mm_alloc_page();
-        if (!page) {
-            print_str("MM: failed to allocate initial heap page ", 0x0C);
-            print_num(i, 0x0C);
-            print_str("\n", 0x0C);
-            break;
-        }
-        
-        /* Map the page into kernel heap space */
-        if (mm_map_page(HEAP_START_VIRT + i * PAGE_SIZE,
-                       (uint32_t)(uintptr_t)page,
-                       MM_FLAG_KERNEL_RW) != 0) {
-            mm_free_page(page);
-            print_str("MM: failed to map heap page ", 0x0C);
-            print_num(i, 0x0C);
-            print_str("\n", 0x0C);
-            break;
-        }
-        
-        heap_end += PAGE_SIZE;
+    /* Old translations may be cached under any PCID here: drop them all */
+    if (moved)
+        mm_tlb_flush_all();
+
+    /* Return runs of frames taken or emptied above */
+    for (uint32_t i = idx; i < idx + count; ) {
+        uint32_t j = i;
+        while (j < idx + count && mine_test(mine, j - idx))
+            j++;
+        if (j > i)
+            mm_free_pages(zone_page(z, i), j - i);
+        i = j + (j == i);
     }
-    
-    /* Initialize heap free list */
-    if (heap_end > heap_current) {
-        heap_free_list = (heap_block_t *)heap_current;
-        heap_free_list->size = heap_end - heap_current - sizeof(heap_block_t);
-        heap_free_list->free = 1;
-        heap_free_list->next = NULL;
-        heap_free_list->prev = NULL;
-    }
-
-    /* Step 9: report */
-    uint32_t free_count = 0;
-    for (uint32_t i = 0; i < MAX_PAGES; i++)
-        if (!bitmap_test(i)) free_count++;
-
-    print_str("MM: free pages: ", 0x0A);
-    print_num(free_count, 0x0A);
-    print_str(" / ", 0x0A);
-    print_num(MAX_PAGES, 0x0A);
-    print_str("  first free: ", 0x0A);
-    print_num(next_free_page, 0x0A);
-    print_str("  heap: 0x", 0x0A);
-    print_hex(HEAP_START_VIRT, 0x0A);
-    print_str("-0x", 0x0A);
-    print_hex(heap_end, 0x0A);
-    print_str("\n", 0x0A);
-
-    if (free_count == 0)
-        return MEMORY_ERROR_NOMEM;
-
-    return MEMORY_SUCCESS;
+    return moved;
 }
 
-/* ------------------------------------------------------------------ */
-/* mm_alloc_page                                                      */
-/* ------------------------------------------------------------------ */
-void *mm_alloc_page(void) {
-    for (uint32_t i = next_free_page; i < MAX_PAGES; i++) {
-        if (!bitmap_test(i)) {
-            bitmap_set(i);
-            next_free_page = i + 1u;
-            return (void *)(uintptr_t)(PHYS_BASE + (uint64_t)i * PAGE_SIZE);
+uint32_t mm_compact(uint32_t order, uint64_t budget) {
+    if (order == 0 || order > BUDDY_MAX_ORDER || !page_tables_ready)
+        return 0;
+    uint64_t start = cpu_rdtsc();
+    uint32_t count = 1u << order, moved = 0;
+    int done = 0;
+
+    /* Cached free frames are invisible to buddy_take; other CPUs follow */
+    mm_magazine_flush();
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&pt_lock);
+    for (uint32_t zi = 0; zi < nr_zones && !done; zi++) {
+        mm_zone *z = &zones[zi];
+        uint64_t first = (z->base_pfn + z->meta_pages + count - 1u) & ~(uint64_t)(count - 1u);
+        uint32_t lo = (uint32_t)(first - z->base_pfn);
+        if (first - z->base_pfn >= z->init_pages || z->init_pages - lo < count)
+            continue;
+        uint32_t nblocks = (z->init_pages - lo) / count;
+        uint32_t b = budget ? z->compact_next % nblocks : 0;
+
+        for (uint32_t n = 0; n < nblocks; n++, b = b + 1u == nblocks ? 0 : b + 1u) {
+            if (budget && cpu_rdtsc() - start > budget) {
+                z->compact_next = b;
+                done = 1;
+                break;
+            }
+            uint32_t idx = lo + b * count;
+            int32_t used = block_movable(z, idx, count);
+            /* Needs moving and the zone can take what it holds */
+            if (used <= 0 || (uint32_t)used > z->buddy.free_pages)
+                continue;
+            moved += compact_block(z, idx, count, start, budget);
+            if (block_movable(z, idx, count) == 0) {
+                done = 1;
+                z->compact_next = b + 1u;
+                break;
+            }
         }
     }
-    return NULL;
-}
-
-/* ------------------------------------------------------------------ */
-/* mm_free_page                                                       */
-/* ------------------------------------------------------------------ */
-void mm_free_page(void *page) {
-    uint64_t addr = (uint64_t)(uintptr_t)page;
-    if (addr < PHYS_BASE || addr >= PHYS_BASE + PHYS_SIZE)
-        return;
-    if (addr & (PAGE_SIZE - 1u))
-        return; /* not page-aligned — refuse silently */
-    uint32_t idx = (uint32_t)((addr - PHYS_BASE) / PAGE_SIZE);
-    bitmap_clear(idx);
-    if (idx < next_free_page)
-        next_free_page = idx;
+    spin_unlock(&pt_lock);
+    cpu_irq_restore(irq);
+
+    if (done && !budget)
+        compact_defer_shift[order] = 0;
+    else if (!budget && compact_defer_shift[order] < COMPACT_DEFER_MAX)
+        compact_defer_shift[order]++;
+
+    uint64_t cycles = cpu_rdtsc() - start;
+    compact_runs++;
+    compact_moved  += moved;
+    compact_cycles += cycles;
+    return moved;
 }
 
-/* ------------------------------------------------------------------ */
-/* mm_alloc_pages                                                      */
-/* ------------------------------------------------------------------ */
-void *mm_alloc_pages(uint32_t count) {
-    if (count == 0) return NULL;
-    if (count == 1) return mm_alloc_page();
-    
-    /* Find contiguous free pages */
-    for (uint32_t i = 0; i <= MAX_PAGES - count; i++) {
-        uint32_t j;
-        for (j = 0; j < count; j++) {
-            if (bitmap_test(i + j)) break;
-        }
-        if (j == count) {
-            /* Found contiguous free pages */
-            for (j = 0; j < count; j++) {
-                bitmap_set(i + j);
-            }
-            if (i < next_free_page) {
-                next_free_page = i + count;
-            }
-            return (void *)(uintptr_t)(PHYS_BASE + (uint64_t)i * PAGE_SIZE);
+void mm_compact_idle(void) {
+    for (uint32_t zi = 0; zi < nr_zones; zi++) {
+        const buddy_zone *b = &zones[zi].buddy;
+        if (b->free_pages >= 2u << COMPACT_IDLE_ORDER
+                && buddy_frag_index(b, COMPACT_IDLE_ORDER) >= COMPACT_IDLE_FRAG) {
+            mm_compact(COMPACT_IDLE_ORDER, COMPACT_IDLE_CYCLES);
+            return;
         }
     }
-    return NULL; /* No contiguous block found */
 }
 
-/* ------------------------------------------------------------------ */
-/* mm_free_pages                                                       */
-/* ------------------------------------------------------------------ */
-void mm_free_pages(void *pages, uint32_t count) {
-    uint64_t addr = (uint64_t)(uintptr_t)pages;
-    if (addr < PHYS_BASE || addr >= PHYS_BASE + PHYS_SIZE)
-        return;
-    if (addr & (PAGE_SIZE - 1u))
-        return;
-    
-    uint32_t first = (uint32_t)((addr - PHYS_BASE) / PAGE_SIZE);
-    for (uint32_t i = 0; i < count; i++) {
-        bitmap_clear(first + i);
-    }
-    
-    if (first < next_free_page) {
-        next_free_page = first;
-    }
+void mm_compact_stats(uint64_t *runs, uint64_t *moved, uint64_t *cycles) {
+    *runs   = compact_runs;
+    *moved  = compact_moved;
+    *cycles = compact_cycles;
 }
 
-/* ------------------------------------------------------------------ */
-/* mm_map_page                                                         */
-/* ------------------------------------------------------------------ */
-int mm_map_page(uint32_t vaddr, uint32_t paddr, uint32_t flags) {
-    if (!page_tables_ready)
-        return -1;
+mm_pt_root *mm_pt_kernel(void) {
+    return &kernel_root;
+}
 
-    uint32_t pd_idx  = (vaddr >> 21) & 0x1FFu; /* PD index (2 MB granule) */
-    uint32_t pt_idx  = (vaddr >> 12) & 0x1FFu; /* PT index */
+int mm_pcid_enabled(void) {
+    return pt_has_pcid;
+}
 
-    if (pd_idx >= NUM_PTS) {
-        /* Need to expand page tables - for now, fail */
-        return -1;
+void mm_pt_load(mm_pt_root *r, uint32_t pcid, int noflush) {
+    if (!r)
+        r = &kernel_root;
+    uint64_t irq = cpu_irq_save();
+    if (r != &kernel_root && r->kernel_gen != pt_kernel_gen) {
+        spin_lock(&pt_lock);
+        pt_copy_kernel_slots(r->pml4);
+        r->kernel_gen = pt_kernel_gen;
+        spin_unlock(&pt_lock);
     }
-
-    uint64_t entry = (uint64_t)paddr | PTE_PRESENT;
-    if (flags & MM_FLAG_WRITE) entry |= PTE_WRITABLE;
-    if (flags & MM_FLAG_USER)  entry |= PTE_USER;
-    if (flags & MM_FLAG_DEVICE) {
-        entry |= PTE_PCD;  /* Cache disable for device memory */
-    } else if (flags & MM_FLAG_CACHED) {
-        /* Normal cached memory - no special flags needed */
+    uint32_t cpu = cpu_current_id();
+    __atomic_store_n(&pt_current[cpu], r, __ATOMIC_SEQ_CST);
+    /* Entries cached under pcid may predate a change: see pt_flush_remote */
+    if (r != &kernel_root
+            && (__atomic_fetch_and(&r->tlb_stale, ~(1u << cpu), __ATOMIC_SEQ_CST) & (1u << cpu)))
+        noflush = 0;
+    uint64_t cr3 = (uint64_t)mm_virt_to_phys(r->pml4);
+    if (pt_has_pcid) {
+        cr3 |= pcid & 0xFFFu;
+        if (noflush)
+            cr3 |= CR3_NOFLUSH;
     }
-    if (flags & MM_FLAG_GLOBAL) entry |= PTE_GLOBAL;
-
-    pt[pd_idx][pt_idx] = entry;
+    __asm__ volatile("movq %0, %%cr3" : : "r"(cr3) : "memory");
+    cpu_irq_restore(irq);
+}
 
-    /* Invalidate TLB entry */
-    __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)vaddr) : "memory");
-    return 0;
+/* Toggling CR4.PGE drops every TLB entry, global ones and all PCIDs included */
+void mm_tlb_flush_all(void) {
+    uint64_t irq = cpu_irq_save();
+    uint64_t cr4;
+    __asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("movq %0, %%cr4" : : "r"(cr4 ^ CR4_PGE) : "memory");
+    __asm__ volatile("movq %0, %%cr4" : : "r"(cr4) : "memory");
+    cpu_irq_restore(irq);
 }
 
-/* ------------------------------------------------------------------ */
-/* mm_unmap_page                                                       */
-/* ------------------------------------------------------------------ */
-int mm_unmap_page(uint32_t vaddr) {
-    if (!page_tables_ready)
-        return -1;
-    uint32_t pd_idx = (vaddr >> 21) & 0x1FFu;
-    uint32_t pt_idx = (vaddr >> 12) & 0x1FFu;
-    if (pd_idx >= NUM_PTS)
-        return -1;
-    pt[pd_idx][pt_idx] = 0;
-    __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)vaddr) : "memory");
-    return 0;
+static int cpu_supports_pcid(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                             : "a"(1u), "c"(0));
+    return (ecx >> 17) & 1u;   /* PCID */
 }
 
 /* ------------------------------------------------------------------ */
@@ -543,7 +2457,15 @@ void mm_enable_paging(void) {
     uint64_t cr4;
     __asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
     cr4 |= (1 << 5);  /* Set PAE bit */
+    cr4 |= CR4_PGE;   /* Kernel mappings survive CR3 switches */
     __asm__ volatile("movq %0, %%cr4" : : "r"(cr4));
+
+    /* PCIDE may only be set while CR3[11:0] == 0, which holds for PCID 0 */
+    if (cpu_supports_pcid()) {
+        cr4 |= CR4_PCIDE;
+        __asm__ volatile("movq %0, %%cr4" : : "r"(cr4));
+        pt_has_pcid = 1;
+    }
     
     /* Enable paging */
     uint64_t cr0;
@@ -556,193 +2478,46 @@ void mm_enable_paging(void) {
                      "movq %%rax, %%cr3" : : : "rax");
     
     print_str("MM: paging enabled\n", 0x0A);
-}
-
-/* ------------------------------------------------------------------ */
-/* Kernel heap allocator (kmalloc/kfree)                               */
-/* ------------------------------------------------------------------ */
-
-void *kmalloc(size_t size, uint32_t flags) {
-    if (size == 0) return NULL;
-    
-    /* Align size to HEAP_BLOCK_SIZE */
-    size = (size + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
-    if (size < HEAP_BLOCK_SIZE) {
-        size = HEAP_BLOCK_SIZE;
-    }
-    
-    /* Add header size */
-    size_t total_size = size + sizeof(heap_block_t);
-    
-    /* Find best fit block */
-    heap_block_t *block = heap_find_best_fit(size);
-    
-    /* If no suitable block found, expand heap */
-    if (!block) {
-        if (!heap_expand(total_size)) {
-            return NULL;
-        }
-        /* Try again after expansion */
-        block = heap_find_best_fit(size);
-        if (!block) {
-            return NULL;
-        }
-    }
-    
-    /* Remove from free list */
-    if (block->prev) {
-        block->prev->next = block->next;
-    } else {
-        heap_free_list = block->next;
-    }
-    
-    if (block->next) {
-        block->next->prev = block->prev;
-    }
-    
-    /* Split block if it's too large */
-    heap_split_block(block, size);
-    
-    /* Mark as allocated */
-    block->free = 0;
-    
-    /* Zero memory if requested */
-    if (flags & KMALLOC_ZEROED) {
-        uint8_t *ptr = (uint8_t *)(block + 1);
-        for (size_t i = 0; i < size; i++) {
-            ptr[i] = 0;
-        }
-    }
-    
-    /* Return pointer to data area */
-    return (void *)(block + 1);
-}
-
-void kfree(void *ptr) {
-    if (!ptr) return;
-    
-    /* Get block header */
-    heap_block_t *block = (heap_block_t *)ptr - 1;
-    
-    /* Validate pointer */
-    uintptr_t addr = (uintptr_t)block;
-    if (addr < HEAP_START_VIRT || addr >= heap_end) {
-        print_str("kfree: invalid pointer 0x", 0x0C);
-        print_hex(addr, 0x0C);
-        print_str("\n", 0x0C);
-        return;
-    }
-    
-    if (block->free) {
-        print_str("kfree: double free at 0x", 0x0C);
-        print_hex(addr, 0x0C);
-        print_str("\n", 0x0C);
-        return;
-    }
-    
-    /* Mark as free */
-    block->free = 1;
-    
-    /* Add to free list (sorted by address) */
-    heap_block_t *current = heap_free_list;
-    heap_block_t *prev = NULL;
-    
-    while (current && (uintptr_t)current < (uintptr_t)block) {
-        prev = current;
-        current = current->next;
-    }
-    
-    block->prev = prev;
-    block->next = current;
-    
-    if (prev) {
-        prev->next = block;
-    } else {
-        heap_free_list = block;
-    }
-    
-    if (current) {
-        current->prev = block;
-    }
-    
-    /* Merge with adjacent free blocks */
-    heap_merge_blocks();
-}
-
-void *kcalloc(size_t num, size_t size) {
-    size_t total = num * size;
-    if (total == 0) return NULL;
-    
-    /* Check for overflow */
-    if (size != 0 && total / size != num) {
-        return NULL;
-    }
-    
-    void *ptr = kmalloc(total, KMALLOC_ZEROED);
-    return ptr;
-}
 
-void *krealloc(void *ptr, size_t size) {
-    if (!ptr) {
-        return kmalloc(size, 0);
-    }
-    
-    if (size == 0) {
-        kfree(ptr);
-        return NULL;
-    }
-    
-    heap_block_t *block = (heap_block_t *)ptr - 1;
-    if (block->size >= size) {
-        /* Block is already large enough */
-        return ptr;
-    }
-    
-    /* Allocate new block */
-    void *new_ptr = kmalloc(size, 0);
-    if (!new_ptr) {
-        return NULL;
-    }
-    
-    /* Copy data */
-    uint8_t *src = (uint8_t *)ptr;
-    uint8_t *dst = (uint8_t *)new_ptr;
-    for (size_t i = 0; i < block->size && i < size; i++) {
-        dst[i] = src[i];
-    }
-    
-    /* Free old block */
-    kfree(ptr);
-    
-    return new_ptr;
+    /* HEAP_START_VIRT is only mapped by the tables just loaded */
+    heap_init();
+    print_str("MM: heap ", 0x0A);
+    print_num((uint32_t)((heap_get_end() - HEAP_START_VIRT) / 1024u), 0x0A);
+    print_str(" KB\n", 0x0A);
 }
 
 /* ------------------------------------------------------------------ */
 /* Memory statistics                                                   */
 /* ------------------------------------------------------------------ */
+/* Free = buddy + magazines + not yet initialised; all O(1) via used_pages */
 uint32_t mm_get_free_pages(void) {
+    return total_pages - mm_get_used_pages();
+}
+
+uint32_t mm_get_free_blocks(uint32_t order) {
+    if (order > BUDDY_MAX_ORDER) return 0;
     uint32_t count = 0;
-    for (uint32_t i = 0; i < MAX_PAGES; i++) {
-        if (!bitmap_test(i)) count++;
-    }
+    for (uint32_t i = 0; i < nr_zones; i++)
+        count += zones[i].buddy.nr_free[order];
     return count;
 }
 
 uint32_t mm_get_total_pages(void) {
-    return MAX_PAGES;
+    return total_pages;
 }
 
+/* Pages waiting in the zero pool are set in the bitmap but free */
 uint32_t mm_get_used_pages(void) {
-    return MAX_PAGES - mm_get_free_pages();
+    return __atomic_load_n(&used_pages, __ATOMIC_RELAXED)
+         - __atomic_load_n(&zero_count, __ATOMIC_RELAXED);
 }
 
 /* ------------------------------------------------------------------ */
 /* Debug functions                                                     */
 /* ------------------------------------------------------------------ */
 void mm_dump_bitmap(uint32_t start, uint32_t count) {
-    if (start >= MAX_PAGES) return;
-    if (start + count > MAX_PAGES) count = MAX_PAGES - start;
-    
+    if (count == 0) return;
+
     print_str("Page bitmap [", 0x0E);
     print_num(start, 0x0E);
     print_str("-", 0x0E);
@@ -753,7 +2528,18 @@ void mm_dump_bitmap(uint32_t start, uint32_t count) {
         if (i > 0 && i % 64 == 0) {
             print_str("\n", 0x0E);
         }
-        print_char(bitmap_test(start + i) ? 'X' : '.', 0x0E);
+        /* '-' = not RAM, '?' = not yet initialised */
+        uint64_t pfn = (uint64_t)start + i;
+        mm_zone *z = zone_of(pfn * PAGE_SIZE);
+        char c = '-';
+        if (z) {
+            uint32_t idx = (uint32_t)(pfn - z->base_pfn);
+            if (idx >= z->init_pages && idx >= z->meta_pages)
+                c = '?';
+            else
+                c = bitmap_test(z, idx) ? 'X' : '.';
+        }
+        print_char(c, 0x0E);
     }
     print_str("\n", 0x0E);
 }
@@ -782,11 +2568,146 @@ void mm_dump_stats(void) {
     print_num(free_pages * 4, 0x0E);
     print_str(" KB)\n", 0x0E);
     
-    print_str("  Heap:         0x", 0x0E);
-    print_hex(HEAP_START_VIRT, 0x0E);
-    print_str(" - 0x", 0x0E);
-    print_hex(heap_end, 0x0E);
-    print_str(" (", 0x0E);
-    print_num((heap_end - HEAP_START_VIRT) / 1024, 0x0E);
-    print_str(" KB)\n", 0x0E);
+    print_str("  Heap:         ", 0x0E);
+    print_num((uint32_t)((heap_get_end() - HEAP_START_VIRT) / 1024u), 0x0E);
+    print_str(" KB (", 0x0E);
+    print_num(heap_get_free_bytes() / 1024, 0x0E);
+    print_str(" KB free)\n", 0x0E);
+
+    uint64_t vm_used, vm_free;
+    uint32_t vm_ranges;
+    vmalloc_stats(&vm_used, &vm_free, &vm_ranges);
+    print_str("  Vmalloc:      ", 0x0E);
+    print_num((uint32_t)(vm_used / 1024u), 0x0E);
+    print_str(" KB (", 0x0E);
+    print_num(vm_ranges, 0x0E);
+    print_str(" free ranges)\n", 0x0E);
+
+    print_str("  Page tables:  ", 0x0E);
+    print_num(pt_tables, 0x0E);
+    print_str(" pages (", 0x0E);
+    print_num(pt_pool_count, 0x0E);
+    print_str(" pooled)\n", 0x0E);
+
+    uint32_t zero_pages;
+    uint64_t hits, misses;
+    mm_zero_pool_stats(&zero_pages, &hits, &misses);
+    print_str("  Zero pool:    ", 0x0E);
+    print_num(zero_pages, 0x0E);
+    print_str(" pages, ", 0x0E);
+    print_num((uint32_t)hits, 0x0E);
+    print_str(" hits / ", 0x0E);
+    print_num((uint32_t)misses, 0x0E);
+    print_str(" misses\n", 0x0E);
+
+    uint64_t runs, moved, cycles;
+    mm_compact_stats(&runs, &moved, &cycles);
+    print_str("  Compaction:   ", 0x0E);
+    print_num((uint32_t)runs, 0x0E);
+    print_str(" runs, ", 0x0E);
+    print_num((uint32_t)moved, 0x0E);
+    print_str(" pages moved, ", 0x0E);
+    print_num((uint32_t)(cycles / 1000u), 0x0E);
+    print_str(" K cycles\n", 0x0E);
+
+    uint32_t reserve;
+    uint64_t dips, refused;
+    mm_reserve_stats(&reserve, &dips, &refused);
+    print_str("  Pressure:     level ", 0x0E);
+    print_num(mm_pressure_level(), 0x0E);
+    print_str(", reserve ", 0x0E);
+    print_num(reserve, 0x0E);
+    print_str(" pages (", 0x0E);
+    print_num((uint32_t)dips, 0x0E);
+    print_str(" used, ", 0x0E);
+    print_num((uint32_t)refused, 0x0E);
+    print_str(" refused)\n", 0x0E);
+
+    mm_dump_zones();
+    mm_dump_buddy();
+    mm_dump_magazines();
+    kmem_cache_dump_all();
+}
+
+void mm_dump_magazines(void) {
+    print_str("Page magazines (cpu: cached, hits, misses, refills, drains):\n", 0x0E);
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        page_magazine *mag = &page_mags[c];
+        if (mag->hits == 0 && mag->misses == 0 && mag->count == 0)
+            continue;
+        print_str("  ", 0x0E);
+        print_num(c, 0x0E);
+        print_str(": ", 0x0E);
+        print_num(mag->count, 0x0E);
+        print_str(", ", 0x0E);
+        print_num((uint32_t)mag->hits, 0x0E);
+        print_str(", ", 0x0E);
+        print_num((uint32_t)mag->misses, 0x0E);
+        print_str(", ", 0x0E);
+        print_num((uint32_t)mag->refills, 0x0E);
+        print_str(", ", 0x0E);
+        print_num((uint32_t)mag->drains, 0x0E);
+        print_str("\n", 0x0E);
+    }
+}
+
+void mm_dump_zones(void) {
+    print_str("Zones (base pfn: node, pages, metadata, initialised, used, free):\n", 0x0E);
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        mm_zone *z = &zones[i];
+        print_str("  ", 0x0E);
+        print_num((uint32_t)z->base_pfn, 0x0E);
+        print_str(": ", 0x0E);
+        print_num(z->node, 0x0E);
+        print_str(", ", 0x0E);
+        print_num(z->nr_pages, 0x0E);
+        print_str(", ", 0x0E);
+        print_num(z->meta_pages, 0x0E);
+        print_str(", ", 0x0E);
+        print_num(z->init_pages, 0x0E);
+        print_str(", ", 0x0E);
+        print_num(mm_bitmap_count_set(&z->map), 0x0E);
+        print_str(", ", 0x0E);
+        print_num(z->buddy.free_pages, 0x0E);
+        print_str("\n", 0x0E);
+    }
+    if (nr_nodes < 2u)
+        return;
+    print_str("Nodes (node: free, local allocations, remote allocations):\n", 0x0E);
+    for (uint32_t n = 0; n < nr_nodes; n++) {
+        uint32_t free_pages;
+        uint64_t local, remote;
+        mm_numa_stats(n, &free_pages, &local, &remote);
+        print_str("  ", 0x0E);
+        print_num(n, 0x0E);
+        print_str(": ", 0x0E);
+        print_num(free_pages, 0x0E);
+        print_str(", ", 0x0E);
+        print_num((uint32_t)local, 0x0E);
+        print_str(", ", 0x0E);
+        print_num((uint32_t)remote, 0x0E);
+        print_str("\n", 0x0E);
+    }
+}
+
+void mm_dump_buddy(void) {
+    /* Totals across zones; frag% as in buddy_frag_index() */
+    uint32_t free_pages = 0;
+    for (uint32_t i = 0; i < nr_zones; i++)
+        free_pages += zones[i].buddy.free_pages;
+
+    print_str("Buddy free lists (order: blocks, frag%):\n", 0x0E);
+    for (uint32_t k = 0; k <= BUDDY_MAX_ORDER; k++) {
+        uint64_t usable = 0;
+        for (uint32_t i = 0; i < nr_zones; i++)
+            for (uint32_t j = k; j <= BUDDY_MAX_ORDER; j++)
+                usable += (uint64_t)zones[i].buddy.nr_free[j] << j;
+        print_str("  ", 0x0E);
+        print_num(k, 0x0E);
+        print_str(": ", 0x0E);
+        print_num(mm_get_free_blocks(k), 0x0E);
+        print_str(", ", 0x0E);
+        print_num(free_pages ? (uint32_t)((free_pages - usable) * 100u / free_pages) : 0, 0x0E);
+        print_str("%\n", 0x0E);
+    }
 }
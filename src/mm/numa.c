@@ -0,0 +1,176 @@
+/*
+    E-comOS Kernel - NUMA Topology
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    Runs from mm_init before any allocator exists, so everything lives
+    in fixed tables.  ACPI structures are packed, so fields are read
+    byte-wise through the acpi_rd helpers.
+*/
+
+#include <kernel/mm/numa.h>
+#include <kernel/acpi.h>
+#include <kernel/printkit/print.h>
+#include <stddef.h>
+
+#define SRAT_CPU_AFFINITY     0u
+#define SRAT_MEM_AFFINITY     1u
+#define SRAT_X2APIC_AFFINITY  2u
+#define SRAT_ENABLED          1u
+#define SRAT_ENTRIES_OFF      48u   /* header + 12 reserved bytes */
+#define SLIT_ENTRIES_OFF      44u   /* header + 64-bit locality count */
+
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+    uint32_t node;
+} numa_range;
+
+typedef struct {
+    uint32_t apic_id;
+    uint32_t node;
+} numa_cpu;
+
+static numa_range ranges[NUMA_MAX_RANGES];
+static uint32_t   nr_ranges = 0;
+static numa_cpu   cpus[NUMA_MAX_CPUS];
+static uint32_t   nr_cpus = 0;
+static uint32_t   domains[NUMA_MAX_NODES];   /* proximity domain of node i */
+static uint32_t   nr_nodes = 1;
+static uint8_t    distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+/* ---- SRAT / SLIT ---- */
+
+/* Dense node number of a proximity domain, allocating one on first sight */
+static uint32_t node_of_domain(uint32_t domain) {
+    static int seen_first = 0;
+    if (!seen_first) {
+        seen_first = 1;
+        domains[0] = domain;
+        return 0;
+    }
+    for (uint32_t n = 0; n < nr_nodes; n++)
+        if (domains[n] == domain)
+            return n;
+    if (nr_nodes == NUMA_MAX_NODES)
+        return 0;
+    domains[nr_nodes] = domain;
+    return nr_nodes++;
+}
+
+static void range_add(uint64_t base, uint64_t len, uint32_t node) {
+    if (len == 0 || nr_ranges == NUMA_MAX_RANGES)
+        return;
+    uint32_t i = nr_ranges;
+    while (i > 0 && ranges[i - 1u].base > base) {
+        ranges[i] = ranges[i - 1u];
+        i--;
+    }
+    ranges[i].base = base;
+    ranges[i].end  = base + len;
+    ranges[i].node = node;
+    nr_ranges++;
+}
+
+static void cpu_add(uint32_t apic_id, uint32_t node) {
+    if (nr_cpus < NUMA_MAX_CPUS) {
+        cpus[nr_cpus].apic_id = apic_id;
+        cpus[nr_cpus].node    = node;
+        nr_cpus++;
+    }
+}
+
+static void srat_parse(const uint8_t *srat) {
+    uint32_t len = acpi_rd32(srat + 4);
+    for (uint32_t off = SRAT_ENTRIES_OFF; off + 2u <= len; ) {
+        const uint8_t *e = srat + off;
+        uint32_t elen = e[1];
+        if (elen < 2u || off + elen > len)
+            break;
+        switch (e[0]) {
+        case SRAT_CPU_AFFINITY:
+            if (elen >= 16u && (acpi_rd32(e + 4) & SRAT_ENABLED))
+                cpu_add(e[3], node_of_domain(e[2] | (acpi_rd32(e + 8) & 0xFFFFFF00u)));
+            break;
+        case SRAT_MEM_AFFINITY:
+            if (elen >= 40u && (acpi_rd32(e + 28) & SRAT_ENABLED))
+                range_add(acpi_rd64(e + 8), acpi_rd64(e + 16), node_of_domain(acpi_rd32(e + 2)));
+            break;
+        case SRAT_X2APIC_AFFINITY:
+            if (elen >= 24u && (acpi_rd32(e + 12) & SRAT_ENABLED))
+                cpu_add(acpi_rd32(e + 8), node_of_domain(acpi_rd32(e + 4)));
+            break;
+        default:
+            break;
+        }
+        off += elen;
+    }
+}
+
+static void slit_parse(const uint8_t *slit) {
+    uint64_t count = acpi_rd64(slit + ACPI_HEADER_LEN);
+    if (count == 0 || count > 256u || SLIT_ENTRIES_OFF + count * count > acpi_rd32(slit + 4))
+        return;
+    for (uint32_t a = 0; a < nr_nodes; a++)
+        for (uint32_t b = 0; b < nr_nodes; b++)
+            if (domains[a] < count && domains[b] < count)
+                distance[a][b] = slit[SLIT_ENTRIES_OFF + domains[a] * count + domains[b]];
+}
+
+uint32_t numa_init(void) {
+    for (uint32_t a = 0; a < NUMA_MAX_NODES; a++)
+        for (uint32_t b = 0; b < NUMA_MAX_NODES; b++)
+            distance[a][b] = (uint8_t)(a == b ? NUMA_LOCAL : NUMA_REMOTE);
+
+    const uint8_t *srat = acpi_find_table("SRAT");
+    if (!srat)
+        return nr_nodes;
+    srat_parse(srat);
+    const uint8_t *slit = acpi_find_table("SLIT");
+    if (slit)
+        slit_parse(slit);
+
+    if (nr_nodes > 1u) {
+        print_str("NUMA: ", 0x0A);
+        print_num(nr_nodes, 0x0A);
+        print_str(" nodes, ", 0x0A);
+        print_num(nr_ranges, 0x0A);
+        print_str(" memory ranges", 0x0A);
+        print_str(slit ? ", SLIT\n" : "\n", 0x0A);
+    }
+    return nr_nodes;
+}
+
+uint32_t numa_nodes(void) {
+    return nr_nodes;
+}
+
+uint32_t numa_node_of_phys(uint64_t phys) {
+    for (uint32_t i = 0; i < nr_ranges && ranges[i].base <= phys; i++)
+        if (phys < ranges[i].end)
+            return ranges[i].node;
+    return 0;
+}
+
+uint64_t numa_range_end(uint64_t phys) {
+    for (uint32_t i = 0; i < nr_ranges; i++) {
+        if (phys < ranges[i].base)
+            return ranges[i].base;
+        if (phys < ranges[i].end)
+            return ranges[i].end;
+    }
+    return ~0ull;
+}
+
+uint32_t numa_node_of_apic(uint32_t apic_id) {
+    for (uint32_t i = 0; i < nr_cpus; i++)
+        if (cpus[i].apic_id == apic_id)
+            return cpus[i].node;
+    return 0;
+}
+
+uint32_t numa_distance(uint32_t from, uint32_t to) {
+    if (from >= NUMA_MAX_NODES || to >= NUMA_MAX_NODES)
+        return NUMA_REMOTE;
+    return distance[from][to];
+}
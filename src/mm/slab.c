@@ -0,0 +1,356 @@
+/*
+    E-comOS Kernel - Slab Object Caches
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    Slab layout (2^order pages, naturally aligned):
+      [slab_t header][pad to align][obj 0][obj 1] ... [obj n-1][waste]
+
+    Free objects inside a slab are chained through a pointer stored at
+    cache->free_off.  Caches without a constructor keep it in the first
+    word of the object; caches with one keep it just past the object so
+    the constructed state is never overwritten.
+*/
+
+#include <kernel/mm/slab.h>
+#include <kernel/mm.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
+#include <kernel/printkit/print.h>
+
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    kmem_cache  *cache;
+    void        *free;     /* first free object in this slab */
+    uint32_t     inuse;    /* objects out of the slab (stashed or active) */
+} slab_t;
+
+typedef struct {
+    uint32_t count;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;
+    void    *objs[SLAB_STASH_SIZE];
+} slab_stash;
+
+struct kmem_cache {
+    const char *name;
+    uint32_t    obj_size;      /* stride between objects */
+    uint32_t    free_off;      /* offset of the free-list link */
+    uint32_t    first_off;     /* offset of object 0 from the slab base */
+    uint32_t    order;
+    uint32_t    objs_per_slab;
+    void      (*ctor)(void *obj);
+    uint32_t    flags;         /* SLAB_* */
+    spinlock_t  lock;
+    slab_t     *partial;
+    slab_t     *full;
+    slab_t     *empty;
+    uint32_t    nr_slabs;
+    uint32_t    nr_empty;
+    uint8_t     in_use;
+    slab_stash  stash[MAX_CPUS];
+};
+
+static kmem_cache cache_pool[SLAB_MAX_CACHES];
+static spinlock_t cache_pool_lock = SPINLOCK_INIT;
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                             */
+/* ------------------------------------------------------------------ */
+static inline size_t align_up(size_t v, size_t a) {
+    return (v + a - 1u) & ~(a - 1u);
+}
+
+static inline void **free_link(const kmem_cache *c, void *obj) {
+    return (void **)((uint8_t *)obj + c->free_off);
+}
+
+static inline slab_t *obj_to_slab(const kmem_cache *c, void *obj) {
+    uintptr_t slab_bytes = (uintptr_t)PAGE_SIZE << c->order;
+    return (slab_t *)((uintptr_t)obj & ~(slab_bytes - 1u));
+}
+
+static void slab_list_add(slab_t **head, slab_t *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+}
+
+static void slab_list_del(slab_t **head, slab_t *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static slab_t **slab_list_for(kmem_cache *c, const slab_t *s) {
+    if (s->inuse == 0)
+        return &c->empty;
+    if (s->inuse == c->objs_per_slab)
+        return &c->full;
+    return &c->partial;
+}
+
+/* Allocate and populate a new slab.  Called with c->lock held. */
+static slab_t *slab_grow(kmem_cache *c) {
+    void *pages = mm_alloc_pages_flags(1u << c->order,
+                                       (c->flags & SLAB_RESERVE) ? MM_ALLOC_RESERVE : 0u);
+    if (!pages)
+        return NULL;
+
+    slab_t *s = (slab_t *)mm_phys_to_virt((uintptr_t)pages);
+    s->cache = c;
+    s->inuse = 0;
+    s->free  = NULL;
+
+    /* Chain objects in address order so allocation walks forward */
+    uint8_t *base = (uint8_t *)s + c->first_off;
+    for (uint32_t i = c->objs_per_slab; i-- > 0; ) {
+        void *obj = base + (size_t)i * c->obj_size;
+        if (c->ctor)
+            c->ctor(obj);
+        *free_link(c, obj) = s->free;
+        s->free = obj;
+    }
+
+    slab_list_add(&c->empty, s);
+    c->nr_slabs++;
+    c->nr_empty++;
+    return s;
+}
+
+static void slab_release(kmem_cache *c, slab_t *s) {
+    slab_list_del(&c->empty, s);
+    c->nr_slabs--;
+    c->nr_empty--;
+    mm_free_pages((void *)mm_virt_to_phys(s), 1u << c->order);
+}
+
+/* Move up to n objects from the slab lists into st.  IRQs are off. */
+static void stash_refill(kmem_cache *c, slab_stash *st, uint32_t n) {
+    spin_lock(&c->lock);
+    while (n--) {
+        slab_t *s = c->partial ? c->partial : c->empty;
+        if (!s && !(s = slab_grow(c)))
+            break;
+
+        slab_t **from = slab_list_for(c, s);
+        if (s->inuse == 0)
+            c->nr_empty--;
+        void *obj = s->free;
+        s->free = *free_link(c, obj);
+        s->inuse++;
+        slab_t **to = slab_list_for(c, s);
+        if (to != from) {
+            slab_list_del(from, s);
+            slab_list_add(to, s);
+        }
+        st->objs[st->count++] = obj;
+    }
+    spin_unlock(&c->lock);
+}
+
+/* Return the n oldest stashed objects to their slabs.  IRQs are off. */
+static void stash_flush(kmem_cache *c, slab_stash *st, uint32_t n) {
+    if (n > st->count)
+        n = st->count;
+    spin_lock(&c->lock);
+    for (uint32_t i = 0; i < n; i++) {
+        void   *obj = st->objs[i];
+        slab_t *s   = obj_to_slab(c, obj);
+        slab_t **from = slab_list_for(c, s);
+        *free_link(c, obj) = s->free;
+        s->free = obj;
+        s->inuse--;
+        slab_t **to = slab_list_for(c, s);
+        if (to != from) {
+            slab_list_del(from, s);
+            slab_list_add(to, s);
+        }
+        if (s->inuse == 0) {
+            c->nr_empty++;
+            /* Keep one empty slab around to absorb alloc/free churn */
+            if (c->nr_empty > 1)
+                slab_release(c, s);
+        }
+    }
+    spin_unlock(&c->lock);
+
+    for (uint32_t i = n; i < st->count; i++)
+        st->objs[i - n] = st->objs[i];
+    st->count -= n;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public interface                                                    */
+/* ------------------------------------------------------------------ */
+kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                              void (*ctor)(void *obj)) {
+    return kmem_cache_create_flags(name, size, align, ctor, 0);
+}
+
+kmem_cache *kmem_cache_create_flags(const char *name, size_t size, size_t align,
+                                    void (*ctor)(void *obj), uint32_t flags) {
+    if (size == 0 || size > (PAGE_SIZE << SLAB_MAX_ORDER))
+        return NULL;
+    if (align == 0)
+        align = sizeof(void *);
+    if ((align & (align - 1u)) || align > PAGE_SIZE)
+        return NULL;
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    /* Object stride, leaving room for an out-of-line link if needed */
+    size_t free_off = ctor ? align_up(size, sizeof(void *)) : 0;
+    size_t stride   = align_up(ctor ? free_off + sizeof(void *) : size, align);
+    size_t first    = align_up(sizeof(slab_t), align);
+
+    /* Smallest slab holding 8 objects or wasting at most 1/8 of itself */
+    uint32_t order = 0, objs = 0;
+    for (uint32_t k = 0; k <= SLAB_MAX_ORDER; k++) {
+        size_t bytes = (size_t)PAGE_SIZE << k;
+        if (bytes <= first)
+            continue;
+        size_t n = (bytes - first) / stride;
+        if (n == 0)
+            continue;
+        order = k;
+        objs  = (uint32_t)n;
+        size_t waste = bytes - first - n * stride;
+        if (n >= 8u || waste * 8u <= bytes)
+            break;
+    }
+    if (objs == 0)
+        return NULL;
+
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&cache_pool_lock);
+    kmem_cache *c = NULL;
+    for (uint32_t i = 0; i < SLAB_MAX_CACHES; i++) {
+        if (!cache_pool[i].in_use) {
+            c = &cache_pool[i];
+            c->in_use = 1;
+            break;
+        }
+    }
+    spin_unlock(&cache_pool_lock);
+    cpu_irq_restore(irq);
+    if (!c)
+        return NULL;
+
+    c->name          = name;
+    c->obj_size      = (uint32_t)stride;
+    c->free_off      = (uint32_t)free_off;
+    c->first_off     = (uint32_t)first;
+    c->order         = order;
+    c->objs_per_slab = objs;
+    c->ctor          = ctor;
+    c->flags         = flags;
+    c->lock.locked   = 0;
+    c->partial = c->full = c->empty = NULL;
+    c->nr_slabs = c->nr_empty = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        c->stash[cpu].count  = 0;
+        c->stash[cpu].allocs = 0;
+        c->stash[cpu].frees  = 0;
+        c->stash[cpu].hits   = 0;
+    }
+    return c;
+}
+
+void *kmem_cache_alloc(kmem_cache *cache) {
+    if (!cache)
+        return NULL;
+    uint64_t irq = cpu_irq_save();
+    slab_stash *st = &cache->stash[cpu_current_id()];
+    if (st->count == 0) {
+        stash_refill(cache, st, SLAB_STASH_BATCH);
+        if (st->count == 0) {
+            cpu_irq_restore(irq);
+            return NULL;
+        }
+    } else {
+        st->hits++;
+    }
+    void *obj = st->objs[--st->count];
+    st->allocs++;
+    cpu_irq_restore(irq);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache *cache, void *obj) {
+    if (!cache || !obj)
+        return;
+    if (obj_to_slab(cache, obj)->cache != cache) {
+        print_str("kmem_cache_free: object not from cache ", 0x0C);
+        print_str(cache->name, 0x0C);
+        print_str("\n", 0x0C);
+        return;
+    }
+    uint64_t irq = cpu_irq_save();
+    slab_stash *st = &cache->stash[cpu_current_id()];
+    if (st->count == SLAB_STASH_SIZE)
+        stash_flush(cache, st, SLAB_STASH_BATCH);
+    st->objs[st->count++] = obj;
+    st->frees++;
+    cpu_irq_restore(irq);
+}
+
+void kmem_cache_shrink(kmem_cache *cache) {
+    if (!cache)
+        return;
+    uint64_t irq = cpu_irq_save();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        stash_flush(cache, &cache->stash[cpu], cache->stash[cpu].count);
+    spin_lock(&cache->lock);
+    while (cache->empty)
+        slab_release(cache, cache->empty);
+    spin_unlock(&cache->lock);
+    cpu_irq_restore(irq);
+}
+
+void kmem_cache_get_info(const kmem_cache *cache, kmem_cache_info *info) {
+    info->name          = cache->name;
+    info->obj_size      = cache->obj_size;
+    info->objs_per_slab = cache->objs_per_slab;
+    info->slab_pages    = 1u << cache->order;
+    info->slabs         = cache->nr_slabs;
+    info->objs_total    = cache->nr_slabs * cache->objs_per_slab;
+    info->objs_stashed  = 0;
+    info->allocs = info->frees = info->stash_hits = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        info->objs_stashed += cache->stash[cpu].count;
+        info->allocs       += cache->stash[cpu].allocs;
+        info->frees        += cache->stash[cpu].frees;
+        info->stash_hits   += cache->stash[cpu].hits;
+    }
+    info->objs_active = (uint32_t)(info->allocs - info->frees);
+}
+
+void kmem_cache_dump_all(void) {
+    print_str("Slab caches (name: active/total objs, slabs x pages):\n", 0x0E);
+    for (uint32_t i = 0; i < SLAB_MAX_CACHES; i++) {
+        if (!cache_pool[i].in_use)
+            continue;
+        kmem_cache_info info;
+        kmem_cache_get_info(&cache_pool[i], &info);
+        print_str("  ", 0x0E);
+        print_str(info.name, 0x0E);
+        print_str(": ", 0x0E);
+        print_num(info.objs_active, 0x0E);
+        print_str("/", 0x0E);
+        print_num(info.objs_total, 0x0E);
+        print_str(", ", 0x0E);
+        print_num(info.slabs, 0x0E);
+        print_str(" x ", 0x0E);
+        print_num(info.slab_pages, 0x0E);
+        print_str("\n", 0x0E);
+    }
+}
@@ -0,0 +1,296 @@
+/*
+    E-comOS Kernel - Kernel Virtual Allocator
+    Copyright (C) 2025,2026  Saladin5101
+    Licensed under AGPL Version 3.
+
+    The window is tracked as ranges in two AVL trees keyed by start
+    address: free ranges, and allocated ones (so vfree knows the size).
+    Each node also records the largest range in its subtree, which
+    makes the lowest-address fit an O(log n) descent.  Tree updates run
+    under vmap_lock; mapping and unmapping happen outside it, on ranges
+    the caller owns alone.
+*/
+
+#include <kernel/mm/vmalloc.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/page.h>
+#include <kernel/mm.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
+
+typedef struct vmap_range {
+    struct vmap_range *left;
+    struct vmap_range *right;
+    uint64_t start;
+    uint64_t size;        /* bytes, a multiple of PAGE_SIZE */
+    uint64_t max_size;    /* largest size in this subtree */
+    int32_t  height;
+} vmap_range;
+
+static kmem_cache *vmap_cache;
+static vmap_range *free_root;
+static vmap_range *busy_root;
+static spinlock_t  vmap_lock = SPINLOCK_INIT;
+static uint64_t    vmap_used;     /* bytes allocated, guards excluded */
+static uint64_t    vmap_free;     /* bytes in free ranges */
+static uint32_t    vmap_ranges;   /* free ranges */
+
+/* ------------------------------------------------------------------ */
+/* AVL tree                                                            */
+/* ------------------------------------------------------------------ */
+static inline int32_t height(const vmap_range *n) {
+    return n ? n->height : 0;
+}
+
+static inline uint64_t max_size(const vmap_range *n) {
+    return n ? n->max_size : 0;
+}
+
+static void update(vmap_range *n) {
+    int32_t hl = height(n->left), hr = height(n->right);
+    uint64_t m = n->size;
+    if (max_size(n->left) > m)
+        m = max_size(n->left);
+    if (max_size(n->right) > m)
+        m = max_size(n->right);
+    n->height   = (hl > hr ? hl : hr) + 1;
+    n->max_size = m;
+}
+
+static vmap_range *rotate_right(vmap_range *n) {
+    vmap_range *l = n->left;
+    n->left  = l->right;
+    l->right = n;
+    update(n);
+    update(l);
+    return l;
+}
+
+static vmap_range *rotate_left(vmap_range *n) {
+    vmap_range *r = n->right;
+    n->right = r->left;
+    r->left  = n;
+    update(n);
+    update(r);
+    return r;
+}
+
+static vmap_range *rebalance(vmap_range *n) {
+    update(n);
+    int32_t bal = height(n->left) - height(n->right);
+    if (bal > 1) {
+        if (height(n->left->left) < height(n->left->right))
+            n->left = rotate_left(n->left);
+        return rotate_right(n);
+    }
+    if (bal < -1) {
+        if (height(n->right->right) < height(n->right->left))
+            n->right = rotate_right(n->right);
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static vmap_range *tree_insert(vmap_range *root, vmap_range *n) {
+    if (!root) {
+        n->left = n->right = NULL;
+        update(n);
+        return n;
+    }
+    if (n->start < root->start)
+        root->left = tree_insert(root->left, n);
+    else
+        root->right = tree_insert(root->right, n);
+    return rebalance(root);
+}
+
+static vmap_range *tree_remove_min(vmap_range *root, vmap_range **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = tree_remove_min(root->left, min);
+    return rebalance(root);
+}
+
+/* Unlink the node starting at start into *out (NULL if there is none) */
+static vmap_range *tree_remove(vmap_range *root, uint64_t start, vmap_range **out) {
+    if (!root) {
+        *out = NULL;
+        return NULL;
+    }
+    if (start < root->start) {
+        root->left = tree_remove(root->left, start, out);
+    } else if (start > root->start) {
+        root->right = tree_remove(root->right, start, out);
+    } else {
+        *out = root;
+        if (!root->left || !root->right)
+            return root->left ? root->left : root->right;
+        vmap_range *succ;
+        vmap_range *right = tree_remove_min(root->right, &succ);
+        succ->left  = root->left;
+        succ->right = right;
+        return rebalance(succ);
+    }
+    return rebalance(root);
+}
+
+/* Lowest-address range of at least size bytes */
+static vmap_range *tree_first_fit(vmap_range *n, uint64_t size) {
+    while (n && n->max_size >= size) {
+        if (max_size(n->left) >= size)
+            n = n->left;
+        else if (n->size >= size)
+            return n;
+        else
+            n = n->right;
+    }
+    return NULL;
+}
+
+/* Closest ranges below and above start */
+static void tree_neighbours(vmap_range *n, uint64_t start,
+                            vmap_range **pred, vmap_range **succ) {
+    *pred = *succ = NULL;
+    while (n) {
+        if (n->start < start) {
+            *pred = n;
+            n = n->right;
+        } else {
+            *succ = n;
+            n = n->left;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Window ranges                                                       */
+/* ------------------------------------------------------------------ */
+
+/* Take size bytes, guard included, from the lowest free range that fits; 0 if none */
+static uint64_t range_take(uint64_t size, vmap_range *busy) {
+    vmap_range *spent = NULL;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmap_lock);
+    vmap_range *f = tree_first_fit(free_root, size);
+    uint64_t start = 0;
+    if (f) {
+        start = f->start;
+        free_root = tree_remove(free_root, start, &f);
+        if (f->size > size) {
+            f->start += size;
+            f->size  -= size;
+            free_root = tree_insert(free_root, f);
+        } else {
+            spent = f;
+            vmap_ranges--;
+        }
+        vmap_free -= size;
+        vmap_used += size - PAGE_SIZE;
+        busy->start = start;
+        busy->size  = size;
+        busy_root = tree_insert(busy_root, busy);
+    }
+    spin_unlock(&vmap_lock);
+    cpu_irq_restore(irq);
+    if (spent)
+        kmem_cache_free(vmap_cache, spent);
+    return start;
+}
+
+/* Return the allocated range n to the free tree, merging neighbours */
+static void range_put(vmap_range *n) {
+    vmap_range *pred, *succ, *gone[2] = { NULL, NULL };
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmap_lock);
+    vmap_free += n->size;
+    vmap_used -= n->size - PAGE_SIZE;
+    tree_neighbours(free_root, n->start, &pred, &succ);
+    if (pred && pred->start + pred->size == n->start) {
+        free_root = tree_remove(free_root, pred->start, &gone[0]);
+        n->start = pred->start;
+        n->size += pred->size;
+        vmap_ranges--;
+    }
+    if (succ && n->start + n->size == succ->start) {
+        free_root = tree_remove(free_root, succ->start, &gone[1]);
+        n->size += succ->size;
+        vmap_ranges--;
+    }
+    free_root = tree_insert(free_root, n);
+    vmap_ranges++;
+    spin_unlock(&vmap_lock);
+    cpu_irq_restore(irq);
+    for (uint32_t i = 0; i < 2u; i++)
+        if (gone[i])
+            kmem_cache_free(vmap_cache, gone[i]);
+}
+
+/* ------------------------------------------------------------------ */
+/* Public interface                                                    */
+/* ------------------------------------------------------------------ */
+void vmalloc_init(void) {
+    vmap_cache = kmem_cache_create_flags("vmap_range", sizeof(vmap_range), 0, 0, SLAB_RESERVE);
+    vmap_range *all = vmap_cache ? kmem_cache_alloc(vmap_cache) : NULL;
+    if (!all)
+        return;
+    all->start  = VMALLOC_START;
+    all->size   = VMALLOC_END - VMALLOC_START;
+    free_root   = tree_insert(NULL, all);
+    vmap_free   = all->size;
+    vmap_ranges = 1;
+}
+
+void *vmalloc(size_t size, uint32_t flags) {
+    if (size == 0 || !vmap_cache || size > VMALLOC_END - VMALLOC_START)
+        return NULL;
+    uint64_t pages = (size + PAGE_SIZE - 1u) / PAGE_SIZE;
+    vmap_range *busy = kmem_cache_alloc(vmap_cache);
+    if (!busy)
+        return NULL;
+    /* One extra page stays unmapped behind the allocation as a guard */
+    uint64_t start = range_take((pages + 1u) * PAGE_SIZE, busy);
+    if (!start) {
+        kmem_cache_free(vmap_cache, busy);
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < pages; i++) {
+        uint64_t va = start + i * PAGE_SIZE;
+        void *frame = mm_alloc_page_flags(flags & MM_ALLOC_ZEROED);
+        /* Global: the window is shared by every PCID, INVLPG reaches them all */
+        if (!frame || mm_map_page(va, (uintptr_t)frame, MM_FLAG_KERNEL_RW | MM_FLAG_GLOBAL) != 0) {
+            if (frame)
+                mm_free_page(frame);
+            vfree((void *)(uintptr_t)start);
+            return NULL;
+        }
+        /* Reached only through the window, so compaction may move it */
+        mm_page_set_heap(frame, va);
+    }
+    return (void *)(uintptr_t)start;
+}
+
+void vfree(void *addr) {
+    if (!addr)
+        return;
+    vmap_range *n;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&vmap_lock);
+    busy_root = tree_remove(busy_root, (uint64_t)(uintptr_t)addr, &n);
+    spin_unlock(&vmap_lock);
+    cpu_irq_restore(irq);
+    if (!n)
+        return;   /* not an allocation — refuse silently */
+
+    /* Frames mapped so far; a failed vmalloc may have mapped only some */
+    mm_unmap_range_free(NULL, n->start, n->size);
+    range_put(n);
+}
+
+void vmalloc_stats(uint64_t *used, uint64_t *free, uint32_t *ranges) {
+    *used   = vmap_used;
+    *free   = vmap_free;
+    *ranges = vmap_ranges;
+}
@@ -2,90 +2,594 @@
     E-comOS Kernel - Scheduler
     Copyright (C) 2025,2026  Saladin5101
 
-    Invariant: threads[current_thread].state == THREAD_RUNNING
-               at all times after the first sched_schedule() call.
+    Every CPU has its own run queue: one FIFO per priority, and bit p of
+    its ready mask set while queue p is non-empty, so picking the next
+    thread is a bit scan and a dequeue however many threads exist.  A
+    thread with id n lives in slot n % MAX_THREADS, which makes lookup
+    by pid O(1) as well.
+
+    Every thread has its own kernel stack, and switching is a real
+    context_switch: a thread preempted from the timer interrupt keeps
+    its interrupt frame on its own stack and resumes through it; FPU
+    state follows lazily (arch/fpu.h).  Each CPU's boot stack is its
+    idle thread (id 0), run when nothing else is ready there and, so
+    its housekeeping is never starved, at least every
+    SCHED_IDLE_PERIOD_MS.
+
+    A thread belongs to the queue of t->cpu, whose lock guards its
+    state.  New threads go to the least loaded CPU; woken threads go
+    back to the CPU they last ran on, which keeps caches and the NUMA
+    node warm.  Load is balanced by the idle: a CPU with nothing to run
+    steals the best waiting thread from another, trying CPUs on its own
+    node first.  An idle CPU that stopped its tick (time.h) cannot look,
+    so work queued behind a busy CPU wakes one such CPU with an IPI.
+    t->on_cpu stays set until the CPU switching away from t is off its
+    stack, and no other CPU may run t before that.
+
+    Invariant: a thread is on a run queue iff its state is THREAD_READY.
+    Invariant: bit p of rq->ready is set iff rq->head[p] != NULL.
+    Invariant: rq->current->state == THREAD_RUNNING outside rq->lock,
+               except for a thread on its way out through sched_schedule.
+    Lock order: a CPU's own queue, then (trylock only) another's.
 */
 
 #include <kernel/sched.h>
+#include <kernel/smp.h>
 #include <kernel/mm.h>
+#include <kernel/mm/slab.h>
+#include <kernel/address_space.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/fpu.h>
+#include <kernel/time.h>
+#include <kernel/cpu.h>
+#include <kernel/internal/spinlock.h>
 #include <kernel/internal/types.h>
 
-static Thread   threads[MAX_THREADS];
-static uint32_t current_thread = 0;
-static uint32_t next_thread_id  = 1;
+#define SCHED_IDLE_PERIOD_MS  100u
+#define KSTACK_SIZE           ((uint64_t)SCHED_KSTACK_PAGES * PAGE_SIZE)
+
+typedef struct {
+    spinlock_t   lock;
+    Thread      *head[SCHED_PRIO_LEVELS];
+    Thread      *tail[SCHED_PRIO_LEVELS];
+    uint32_t     ready;
+    volatile uint32_t nr_ready;  /* queued threads; read unlocked to balance */
+    Thread      *current;
+    Thread      *prev;           /* switched away from, on_cpu until done */
+    Thread       idle;
+    volatile int need_resched;
+    volatile int tickless;       /* idle with its tick stopped */
+    int          idle_due;
+    uint64_t     idle_ran_ms;
+} sched_rq;
+
+static sched_rq    rqs[MAX_CPUS];
+static volatile uint32_t rq_online = 0;    /* bit n: CPU n schedules */
+static Thread     *threads[MAX_THREADS];
+static kmem_cache *thread_cache;
+static uint32_t    next_thread_id  = 1;
+static spinlock_t  threads_lock = SPINLOCK_INIT;   /* slot claims */
+static uint32_t    quantum[SCHED_PRIO_LEVELS];
+
+/* ---- Run queues (caller holds rq->lock) ---- */
+
+/* A thread preempted inside its quantum goes back to the front */
+static void rq_push(sched_rq *rq, Thread *t, int front) {
+    uint32_t p = t->priority;
+    rq->nr_ready++;
+    if (front && rq->head[p]) {
+        t->rq_prev = 0;
+        t->rq_next = rq->head[p];
+        rq->head[p]->rq_prev = t;
+        rq->head[p] = t;
+        return;
+    }
+    t->rq_next = 0;
+    t->rq_prev = rq->tail[p];
+    if (rq->tail[p])
+        rq->tail[p]->rq_next = t;
+    else
+        rq->head[p] = t;
+    rq->tail[p] = t;
+    rq->ready |= 1u << p;
+}
+
+static void rq_remove(sched_rq *rq, Thread *t) {
+    uint32_t p = t->priority;
+    rq->nr_ready--;
+    if (t->rq_prev)
+        t->rq_prev->rq_next = t->rq_next;
+    else
+        rq->head[p] = t->rq_next;
+    if (t->rq_next)
+        t->rq_next->rq_prev = t->rq_prev;
+    else
+        rq->tail[p] = t->rq_prev;
+    t->rq_next = t->rq_prev = 0;
+    if (!rq->head[p])
+        rq->ready &= ~(1u << p);
+}
+
+/* Highest priority with a ready thread; rq->ready must be non-zero */
+static inline uint32_t rq_top(const sched_rq *rq) {
+    return 31u - (uint32_t)__builtin_clz(rq->ready);
+}
+
+/* Lock the queue t belongs to; t->cpu only changes under that lock.  IRQs off. */
+static sched_rq *rq_lock_thread(Thread *t) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE);
+        sched_rq *rq = &rqs[cpu];
+        spin_lock(&rq->lock);
+        if (t->cpu == cpu)
+            return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+/* cpu should enter the scheduler: at the next exit if it is this one, else by IPI */
+static void resched_cpu(uint32_t cpu) {
+    rqs[cpu].need_resched = 1;
+    smp_send_resched(cpu);
+}
+
+/*
+ * Work is waiting behind busy CPU busy: wake one CPU sleeping without a
+ * tick to steal it.  Idle CPUs that still tick find it on their own.
+ * The fence pairs with the flag store in sched_idle: either the
+ * sleeper sees the queued thread or this sees its tickless flag.
+ */
+static void kick_tickless(uint32_t busy) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu != busy && (rq_online & (1u << cpu)) && rqs[cpu].tickless
+                && !rqs[cpu].need_resched) {
+            resched_cpu(cpu);
+            return;
+        }
+    }
+}
+
+/* t just became ready on cpu: should it take that CPU from its thread? */
+static void check_preempt(uint32_t cpu, const Thread *t) {
+    const sched_rq *rq = &rqs[cpu];
+    if (rq->current == &rq->idle || t->priority > rq->current->priority)
+        resched_cpu(cpu);
+    else
+        kick_tickless(cpu);
+}
+
+/* ---- Balancing ---- */
+
+static uint32_t cpu_load(uint32_t cpu) {
+    const sched_rq *rq = &rqs[cpu];
+    return rq->nr_ready + (rq->current != &rq->idle);
+}
+
+/* Where a new thread goes: the least loaded CPU, this one on a tie */
+static uint32_t cpu_least_loaded(void) {
+    uint32_t best = cpu_current_id(), best_load = cpu_load(best);
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(rq_online & (1u << cpu)))
+            continue;
+        uint32_t load = cpu_load(cpu);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/* Is a thread waiting on some other CPU's queue? */
+static int work_elsewhere(uint32_t self) {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+        if (cpu != self && (rq_online & (1u << cpu)) && rqs[cpu].nr_ready)
+            return 1;
+    return 0;
+}
+
+/* Highest-priority queued thread of v that no CPU is still switching away from */
+static Thread *steal_candidate(const sched_rq *v) {
+    for (uint32_t mask = v->ready; mask; ) {
+        uint32_t p = 31u - (uint32_t)__builtin_clz(mask);
+        for (Thread *t = v->head[p]; t; t = t->rq_next)
+            if (!__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE))
+                return t;
+        mask &= ~(1u << p);
+    }
+    return 0;
+}
+
+/*
+ * Move one waiting thread from another CPU to self's empty queue, from
+ * a CPU on the same node if any has one.  A busy victim is skipped, not
+ * waited for.  Caller holds rq->lock; returns 1 if a thread came over.
+ */
+static int steal(sched_rq *rq, uint32_t self) {
+    uint32_t node = mm_numa_cpu_node(self);
+    for (uint32_t pass = 0; pass < 2u; pass++) {
+        for (uint32_t i = 1; i < MAX_CPUS; i++) {
+            uint32_t cpu = (self + i) % MAX_CPUS;
+            sched_rq *v = &rqs[cpu];
+            if (!(rq_online & (1u << cpu)) || !v->nr_ready
+                    || (mm_numa_cpu_node(cpu) == node) != (pass == 0))
+                continue;
+            if (!spin_trylock(&v->lock))
+                continue;
+            Thread *t = steal_candidate(v);
+            if (t) {
+                rq_remove(v, t);
+                __atomic_store_n(&t->cpu, self, __ATOMIC_RELEASE);
+            }
+            spin_unlock(&v->lock);
+            if (t) {
+                rq_push(rq, t, 0);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * The thread to run after prev: the highest ready priority, unless
+ * prev is still running above it, or at it with quantum left.  A CPU
+ * that would otherwise go idle steals first.
+ */
+static Thread *pick_next(sched_rq *rq, uint32_t self, Thread *prev) {
+    int runs = prev != &rq->idle && prev->state == THREAD_RUNNING;
+    if (rq->idle_due && prev != &rq->idle)
+        return &rq->idle;
+    if (!rq->ready && !runs)
+        steal(rq, self);
+    if (!rq->ready)
+        return runs ? prev : &rq->idle;
+    uint32_t top = rq_top(rq);
+    if (runs && (prev->priority > top || (prev->priority == top && prev->slice_left)))
+        return prev;
+    return rq->head[top];
+}
+
+/*
+ * sched_init
+ *
+ * Precondition:  mm_init has run; called on the boot stack, which
+ *                becomes the boot CPU's idle thread.
+ * Postcondition: Thread objects can be allocated.
+ */
+void sched_init(void) {
+    thread_cache = kmem_cache_create_flags("thread", sizeof(Thread), 0, 0, SLAB_RESERVE);
+    for (uint32_t p = 0; p < SCHED_PRIO_LEVELS; p++)
+        quantum[p] = SCHED_QUANTUM_MS;
+    sched_cpu_start(cpu_current_id());
+}
+
+void sched_cpu_start(uint32_t cpu) {
+    sched_rq *rq = &rqs[cpu];
+    rq->idle.id       = 0;
+    rq->idle.state    = THREAD_RUNNING;
+    rq->idle.priority = SCHED_PRIO_IDLE;
+    rq->idle.cpu      = cpu;
+    rq->idle.on_cpu   = 1;
+    fpu_thread_reset(&rq->idle);
+    rq->current       = &rq->idle;
+    rq->idle_ran_ms   = time_get_current_ms();
+    __atomic_or_fetch(&rq_online, 1u << cpu, __ATOMIC_RELEASE);
+}
 
 /*
  * sched_create_thread
  *
  * Precondition:  entry_point != NULL.
- * Postcondition: new thread is in THREAD_READY state with a valid stack.
+ * Postcondition: new thread is in THREAD_READY state with its own
+ *                kernel stack, queued at SCHED_PRIO_DEFAULT on the
+ *                least loaded CPU; it starts in context_thread_start
+ *                with interrupts enabled.
  * Returns thread ID (> 0) on success, -1 on failure.
  */
 int sched_create_thread(void (*entry_point)(void)) {
     if (!entry_point)
         return -1;
 
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (threads[i].state == THREAD_TERMINATED || threads[i].id == 0) {
-            /* Zero all fields first to avoid uninitialised reads (F-13) */
-            threads[i].id          = 0;
-            threads[i].state       = THREAD_TERMINATED;
-            threads[i].stack_ptr    = 0;
-            threads[i].priority    = 0;
-            threads[i].block_reason = 0;
-            threads[i].last_error   = 0;
-            threads[i].block_data.irq_num = 0;
-
-            void *stack = mm_alloc_page();
-            if (!stack)
-                return -1;
-
-            /* Stack grows downward; place return address at top - 8.
-             * Use uintptr_t throughout to avoid 32-bit truncation (F-06). */
-            uintptr_t stack_top = (uintptr_t)stack + PAGE_SIZE - 8u;
-            *(uint64_t *)stack_top = (uint64_t)(uintptr_t)entry_point;
-
-            threads[i].stack_ptr = (uint32_t)stack_top; /* stored as hint only */
-            threads[i].id       = next_thread_id++;
-            threads[i].state    = THREAD_READY;
-            threads[i].priority = 1;
-
-            return (int)threads[i].id;
+    /* Ids are handed out in order, skipping those whose slot is busy */
+    Thread *t = 0;
+    uint32_t id = 0;
+    uint64_t irq = cpu_irq_save();
+    spin_lock(&threads_lock);
+    for (int n = 0; n < MAX_THREADS && !t; n++) {
+        id = next_thread_id;
+        next_thread_id = next_thread_id + 1u ? next_thread_id + 1u : 1u;
+        uint32_t i = id % MAX_THREADS;
+        Thread *s = threads[i];
+        if (s && !(s->state == THREAD_TERMINATED && !s->on_cpu))
+            continue;
+        if (!s) {
+            if (!(s = kmem_cache_alloc(thread_cache)))
+                break;
+            s->kstack    = 0;   /* a slot keeps its stack and FPU area from then on */
+            s->fpu_state = 0;
+            s->cpu    = 0;
+            s->on_cpu = 0;
+            threads[i] = s;
+        }
+        /* Claimed: id 0 keeps lookups and wakeups away until it is set up */
+        s->id    = 0;
+        s->state = THREAD_BLOCKED;
+        t = s;
+    }
+    spin_unlock(&threads_lock);
+    cpu_irq_restore(irq);
+    if (!t)
+        return -1;
+
+    /* Zero all fields first to avoid uninitialised reads (F-13) */
+    t->priority    = 0;
+    t->slice_left   = 0;
+    t->space       = 0;
+    t->privileged  = 0;
+    t->block_reason = 0;
+    t->last_error   = 0;
+    t->fault_addr   = 0;
+    t->block_data.irq_num = 0;
+    t->rq_next      = 0;
+    t->rq_prev      = 0;
+    fpu_thread_reset(t);
+
+    if (!t->kstack) {
+        void *stack = mm_alloc_pages_flags(SCHED_KSTACK_PAGES, MM_ALLOC_RESERVE);
+        if (!stack) {
+            t->state = THREAD_TERMINATED;
+            return -1;
         }
+        t->kstack = (uint64_t)(uintptr_t)stack;
     }
-    return -1;
+
+    /* First switch to it "returns" into context_thread_start */
+    t->ctx.r15 = t->ctx.r14 = t->ctx.r13 = t->ctx.r12 = 0;
+    t->ctx.rbp = 0;
+    t->ctx.rbx = (uint64_t)(uintptr_t)entry_point;
+    t->ctx.rip = (uint64_t)(uintptr_t)context_thread_start;
+    t->ctx.rsp = t->kstack + KSTACK_SIZE;
+
+    t->priority = SCHED_PRIO_DEFAULT;
+
+    irq = cpu_irq_save();
+    uint32_t cpu = cpu_least_loaded();
+    sched_rq *rq = &rqs[cpu];
+    spin_lock(&rq->lock);
+    t->cpu   = cpu;
+    t->id    = id;
+    t->state = THREAD_READY;
+    rq_push(rq, t, 0);
+    check_preempt(cpu, t);
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(irq);
+    return (int)id;
 }
 
+/* Give up the rest of the quantum to threads of the same priority */
 void sched_yield(void) {
+    uint64_t irq = cpu_irq_save();
+    rqs[cpu_current_id()].current->slice_left = 0;
+    cpu_irq_restore(irq);
     sched_schedule();
 }
 
+/*
+ * Switch to pick_next(current).  The outgoing thread, if still running,
+ * goes back on its queue.  Returns when the caller is next scheduled,
+ * possibly on another CPU.
+ */
 void sched_schedule(void) {
-    static uint32_t last_scheduled = 0;
-    uint32_t next = (last_scheduled + 1u) % MAX_THREADS;
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (threads[next].state == THREAD_READY && threads[next].id != 0) {
-            if (current_thread < MAX_THREADS && threads[current_thread].id != 0)
-                threads[current_thread].state = THREAD_READY;
-            threads[next].state = THREAD_RUNNING;
-            last_scheduled = current_thread = next;
-            return;
+    uint64_t irq = cpu_irq_save();
+    uint32_t self = cpu_current_id();
+    sched_rq *rq = &rqs[self];
+    spin_lock(&rq->lock);
+    rq->need_resched = 0;
+    rq->tickless     = 0;
+    Thread *prev = rq->current;
+    Thread *next = pick_next(rq, self, prev);
+    /* Queued even if it is prev, woken again before it got here */
+    if (next != &rq->idle && next->state == THREAD_READY)
+        rq_remove(rq, next);
+    if (next != prev) {
+        if (prev->state == THREAD_RUNNING) {
+            prev->state = THREAD_READY;
+            if (prev != &rq->idle)
+                rq_push(rq, prev, prev->slice_left != 0);
+        }
+        if (next == &rq->idle) {
+            rq->idle_due    = 0;
+            rq->idle_ran_ms = time_get_current_ms();
         }
-        next = (next + 1u) % MAX_THREADS;
+        next->on_cpu = 1;
+        rq->current  = next;
+        rq->prev     = prev;
     }
+    next->state = THREAD_RUNNING;
+    if (next != &rq->idle && next->slice_left == 0)
+        next->slice_left = quantum[next->priority];
+    spin_unlock(&rq->lock);
+
+    if (next != prev) {
+        as_switch(next->space);
+        if (next->kstack)
+            tss_set_kernel_stack(next->kstack + KSTACK_SIZE);
+        fpu_switch(prev, next);
+        context_switch(&prev->ctx, &next->ctx);
+        sched_switch_done();
+    }
+    cpu_irq_restore(irq);
 }
 
-Thread *sched_get_thread_by_pid(uint32_t pid) {
-    for (int i = 0; i < MAX_THREADS; i++)
-        if (threads[i].id == pid)
-            return &threads[i];
+void sched_switch_done(void) {
+    sched_rq *rq = &rqs[cpu_current_id()];
+    Thread *prev = rq->prev;
+    rq->prev = 0;
+    if (prev)
+        __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+}
+
+void sched_exit(void) {
+    uint64_t irq = cpu_irq_save();
+    sched_rq *rq = &rqs[cpu_current_id()];
+    spin_lock(&rq->lock);
+    if (rq->current != &rq->idle)
+        rq->current->state = THREAD_TERMINATED;
+    spin_unlock(&rq->lock);
+    sched_schedule();
+    /* Only an idle thread gets here */
+    cpu_irq_restore(irq);
+}
+
+/*
+ * Called from the timer interrupt of every CPU.  The switch itself
+ * happens when the interrupt returns, once it has been acknowledged.
+ * An idle CPU looks for work to steal on every tick.
+ */
+void sched_tick(void) {
+    uint64_t irq = cpu_irq_save();
+    uint32_t self = cpu_current_id();
+    sched_rq *rq = &rqs[self];
+    spin_lock(&rq->lock);
+    uint64_t now = time_get_current_ms();
+    if (rq->current == &rq->idle) {
+        rq->idle_ran_ms = now;
+        if (!rq->ready && work_elsewhere(self))
+            rq->need_resched = 1;
+    } else {
+        if (rq->current->slice_left && --rq->current->slice_left == 0)
+            rq->need_resched = 1;
+        if (now - rq->idle_ran_ms >= SCHED_IDLE_PERIOD_MS) {
+            rq->idle_due     = 1;
+            rq->need_resched = 1;
+        }
+        if (rq->nr_ready)
+            kick_tickless(self);
+    }
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(irq);
+}
+
+void sched_idle(uint64_t next_ms) {
+    __asm__ volatile("cli");
+    uint32_t self = cpu_current_id();
+    sched_rq *rq = &rqs[self];
+    if (rq->need_resched) {
+        __asm__ volatile("sti");
+        return;
+    }
+    if (time_nohz_enabled()) {
+        /* Flag the sleep before looking for work; see kick_tickless */
+        __atomic_store_n(&rq->tickless, 1, __ATOMIC_SEQ_CST);
+        if (rq->ready || work_elsewhere(self) || time_idle_stop(next_ms) != 0)
+            rq->tickless = 0;
+    }
+    __asm__ volatile("sti\n hlt");   /* STI holds off interrupts until HLT */
+}
+
+void sched_block(Thread *t, uint8_t reason) {
+    if (!t)
+        return;
+    uint64_t irq = cpu_irq_save();
+    sched_rq *rq = rq_lock_thread(t);
+    if (t->state == THREAD_READY)
+        rq_remove(rq, t);
+    if (t->state != THREAD_TERMINATED) {
+        if (t == rq->current)
+            resched_cpu(t->cpu);
+        t->state        = THREAD_BLOCKED;
+        t->block_reason = reason;
+    }
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(irq);
+}
+
+void sched_wakeup(Thread *t) {
+    if (!t)
+        return;
+    uint64_t irq = cpu_irq_save();
+    sched_rq *rq = rq_lock_thread(t);
+    if (t->state == THREAD_BLOCKED && t->id) {
+        t->state        = THREAD_READY;
+        t->block_reason = 0;
+        rq_push(rq, t, 0);
+        check_preempt(t->cpu, t);
+    }
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(irq);
+}
+
+int sched_need_resched(void) {
+    return rqs[cpu_current_id()].need_resched;
+}
+
+int sched_get_priority(uint32_t pid) {
+    Thread *t = sched_get_thread_by_pid(pid);
+    return t && t->state != THREAD_TERMINATED ? (int)t->priority : -1;
+}
+
+int sched_set_priority(uint32_t pid, uint32_t prio) {
+    Thread *t = sched_get_thread_by_pid(pid);
+    if (!t || prio > SCHED_PRIO_MAX)
+        return -1;
+    int rc = -1;
+    uint64_t irq = cpu_irq_save();
+    sched_rq *rq = rq_lock_thread(t);
+    if (t->state == THREAD_READY) {
+        rq_remove(rq, t);
+        t->priority = prio;
+        rq_push(rq, t, 0);
+        check_preempt(t->cpu, t);
+        rc = 0;
+    } else if (t->state != THREAD_TERMINATED) {
+        t->priority = prio;
+        /* The running thread dropped below a ready one */
+        if (t == rq->current && rq->ready && rq_top(rq) > prio)
+            resched_cpu(t->cpu);
+        rc = 0;
+    }
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(irq);
+    return rc;
+}
+
+int sched_set_privileged(uint32_t pid, int on) {
+    Thread *t = sched_get_thread_by_pid(pid);
+    if (!t || t->state == THREAD_TERMINATED)
+        return -1;
+    t->privileged = on != 0;
+    return 0;
+}
+
+int sched_get_quantum(uint32_t prio) {
+    return prio > SCHED_PRIO_MAX ? -1 : (int)quantum[prio];
+}
+
+int sched_set_quantum(uint32_t prio, uint32_t ms) {
+    if (prio > SCHED_PRIO_MAX || ms == 0 || ms > SCHED_QUANTUM_MAX_MS)
+        return -1;
+    quantum[prio] = ms;
     return 0;
 }
 
+Thread *sched_get_thread_by_pid(uint32_t pid) {
+    Thread *t = threads[pid % MAX_THREADS];
+    return pid && t && t->id == pid ? t : 0;
+}
+
 uint32_t sched_get_current_pid(void) {
-    return threads[current_thread].id;
+    uint64_t irq = cpu_irq_save();
+    uint32_t pid = rqs[cpu_current_id()].current->id;
+    cpu_irq_restore(irq);
+    return pid;
 }
 
 Thread *sched_get_current_thread(void) {
-    return &threads[current_thread];
+    uint64_t irq = cpu_irq_save();
+    sched_rq *rq = &rqs[cpu_current_id()];
+    Thread *t = rq->current == &rq->idle ? 0 : rq->current;
+    cpu_irq_restore(irq);
+    return t;
 }
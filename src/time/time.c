@@ -17,13 +17,144 @@
 */
 
 #include <kernel/time.h>
+#include <kernel/cpu.h>
+#include <kernel/arch/interrupts.h>
+#include <kernel/arch/lapic.h>
+#include <kernel/smp.h>
+#include <kernel/printkit/print.h>
+#include <kernel/internal/types.h>
+
+#define TSC_CALIBRATE_MS     10u
+#define CPUID_EXT_MAX        0x80000000u
+#define CPUID_EXT_POWER      0x80000007u
+#define CPUID_INVARIANT_TSC  (1u << 8)    /* leaf 0x80000007, EDX */
 
 static volatile uint64_t system_ticks = 0;
+static uint64_t tsc_per_ms = 0;           /* non-zero once the TSC keeps time */
+static uint64_t tsc_base;                 /* TSC at ms_base */
+static uint64_t ms_base;
+static int      use_tsc_deadline = 0;
+static volatile uint32_t slack_ms = TIME_SLACK_DEFAULT_MS;
+static volatile uint64_t idle_until[MAX_CPUS];   /* armed expiry; 0 while ticking */
+static volatile uint64_t boot_due = TIME_NEVER;   /* earliest time_kick_boot since */
 
 uint64_t time_get_current_ms(void) {
-    return system_ticks;
+    uint64_t rate = __atomic_load_n(&tsc_per_ms, __ATOMIC_ACQUIRE);
+    if (!rate)
+        return system_ticks;
+    return ms_base + (cpu_rdtsc() - tsc_base) / rate;
 }
 
 void time_tick(void) {
     system_ticks++;
 }
+
+/* ---- Dynamic tick ---- */
+
+static int tsc_invariant(void) {
+    uint32_t a, b, c, d;
+    __asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(CPUID_EXT_MAX), "c"(0u));
+    if (a < CPUID_EXT_POWER)
+        return 0;
+    __asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(CPUID_EXT_POWER), "c"(0u));
+    return (d & CPUID_INVARIANT_TSC) != 0;
+}
+
+int time_nohz_init(void) {
+    if (!lapic_present() || !tsc_invariant())
+        return -1;
+
+    /* Count TSC cycles over whole PIT milliseconds */
+    uint64_t t = system_ticks;
+    while (system_ticks == t)
+        __asm__ volatile("pause");
+    uint64_t start = cpu_rdtsc();
+    t = system_ticks;
+    while (system_ticks - t < TSC_CALIBRATE_MS)
+        __asm__ volatile("pause");
+    uint64_t rate = (cpu_rdtsc() - start) / TSC_CALIBRATE_MS;
+    if (!rate)
+        return -1;
+    use_tsc_deadline = lapic_has_tsc_deadline();
+
+    /* Hand the clock to the TSC and this CPU's tick to its local APIC */
+    uint64_t irq = cpu_irq_save();
+    tsc_base = cpu_rdtsc();
+    ms_base  = system_ticks;
+    __atomic_store_n(&tsc_per_ms, rate, __ATOMIC_RELEASE);
+    irq_stop_timer();
+    lapic_timer_start((uint8_t)IRQ_VECTOR(IRQ_LAPIC_TIMER));
+    cpu_irq_restore(irq);
+
+    print_str(use_tsc_deadline ? "Time: dynamic tick, TSC deadline\n"
+                               : "Time: dynamic tick, APIC one-shot\n", 0x0A);
+    return 0;
+}
+
+int time_nohz_enabled(void) {
+    return __atomic_load_n(&tsc_per_ms, __ATOMIC_ACQUIRE) != 0;
+}
+
+int time_idle_stop(uint64_t next_ms) {
+    uint64_t rate = __atomic_load_n(&tsc_per_ms, __ATOMIC_ACQUIRE);
+    if (!rate)
+        return -1;
+    uint64_t now = time_get_current_ms();
+    if (next_ms <= now + 1u)
+        return -1;
+    if (next_ms - now > TIME_IDLE_MAX_MS)
+        next_ms = now + TIME_IDLE_MAX_MS;
+    uint32_t slack = slack_ms;
+    next_ms = (next_ms + slack - 1u) / slack * slack;
+
+    /*
+     * Publish the sleep before taking what was kicked since the boot
+     * CPU found next_ms: either this sees the kick or the kicker sees
+     * the sleep and sends an IPI.
+     */
+    uint32_t cpu = cpu_current_id();
+    __atomic_store_n(&idle_until[cpu], next_ms, __ATOMIC_SEQ_CST);
+    if (cpu == 0 && __atomic_exchange_n(&boot_due, TIME_NEVER, __ATOMIC_SEQ_CST) < next_ms) {
+        idle_until[cpu] = 0;
+        return -1;
+    }
+
+    uint8_t vector = (uint8_t)IRQ_VECTOR(IRQ_LAPIC_TIMER);
+    if (use_tsc_deadline)
+        lapic_timer_deadline(vector, tsc_base + (next_ms - ms_base) * rate);
+    else
+        lapic_timer_oneshot(vector, (uint32_t)(next_ms - now));
+    return 0;
+}
+
+void time_idle_restart(void) {
+    uint32_t cpu = cpu_current_id();
+    if (!idle_until[cpu])
+        return;
+    __atomic_store_n(&idle_until[cpu], 0, __ATOMIC_RELAXED);
+    lapic_timer_start((uint8_t)IRQ_VECTOR(IRQ_LAPIC_TIMER));
+}
+
+void time_kick_boot(uint64_t due_ms) {
+    if (!time_nohz_enabled())
+        return;
+    uint64_t seen = __atomic_load_n(&boot_due, __ATOMIC_RELAXED);
+    while (due_ms < seen && !__atomic_compare_exchange_n(&boot_due, &seen, due_ms, 0,
+                                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t until = __atomic_load_n(&idle_until[0], __ATOMIC_SEQ_CST);
+    if (until && due_ms < until)
+        smp_send_resched(0);
+}
+
+int time_set_slack(uint32_t ms) {
+    if (ms == 0 || ms > TIME_SLACK_MAX_MS)
+        return -1;
+    slack_ms = ms;
+    return 0;
+}
+
+uint32_t time_get_slack(void) {
+    return slack_ms;
+}